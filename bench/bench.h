@@ -0,0 +1,413 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench.h
+ *
+ *    Description:  timing, latency histograms and JSON results for the benchmarks
+ *
+ *          Usage:  every bench_*.c that writes machine-readable results includes
+ *                  this; results go to stdout or to the file given with -o, so
+ *                  runs of two builds can be diffed or compared by a script.
+ *
+ * =====================================================================================
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+
+/* Histogram: 64 sub-buckets per power of two, at most 1.6% error */
+#define BENCH_SUB_BITS     6
+#define BENCH_SUB          (1 << BENCH_SUB_BITS)
+#define BENCH_BUCKETS      ((64 - BENCH_SUB_BITS + 1) * BENCH_SUB)
+
+/* Each micro-benchmark runs this many rounds of at least this long */
+#define BENCH_ROUNDS       5
+#define BENCH_ROUND_NS     100000000ull
+
+
+typedef struct bench_hist
+{
+	uint64_t counts[BENCH_BUCKETS];
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double   sum;
+} bench_hist;
+
+
+typedef struct bench_json
+{
+	FILE* f;
+	int   depth;
+	int   first[16];                           /* no comma before next item */
+} bench_json;
+
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+
+
+/* ========================== HISTOGRAM ============================= */
+
+
+static inline void bench_hist_init(bench_hist* h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+
+static inline int bench_hist_index(uint64_t v)
+{
+	int msb;
+
+	if(v < BENCH_SUB)
+	{
+		return (int)v;
+	}
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - BENCH_SUB_BITS + 1) * BENCH_SUB + (int)((v >> (msb - BENCH_SUB_BITS)) & (BENCH_SUB - 1));
+}
+
+
+/* Lowest value of a bucket */
+static inline uint64_t bench_hist_value(int index)
+{
+	int shift = index / BENCH_SUB - 1;
+
+	if(index < BENCH_SUB)
+	{
+		return (uint64_t)index;
+	}
+
+	return (uint64_t)(BENCH_SUB + index % BENCH_SUB) << shift;
+}
+
+
+static inline void bench_hist_record(bench_hist* h, uint64_t v)
+{
+	h->counts[bench_hist_index(v)]++;
+	h->count++;
+	h->sum += (double)v;
+	h->min = v < h->min ? v : h->min;
+	h->max = v > h->max ? v : h->max;
+}
+
+
+/* Coordinated omission correction, as HdrHistogram's recordValueWithExpectedInterval:
+ * a sample that took longer than the expected interval between samples hid
+ * the samples that would have been taken meanwhile, so they are added back.
+ */
+static inline void bench_hist_record_corrected(bench_hist* h, uint64_t v, uint64_t interval)
+{
+	uint64_t missing;
+
+	bench_hist_record(h, v);
+
+	if(interval == 0)
+	{
+		return;
+	}
+
+	for(missing = v > interval ? v - interval : 0; missing >= interval; missing -= interval)
+	{
+		bench_hist_record(h, missing);
+	}
+}
+
+
+static inline void bench_hist_merge(bench_hist* to, const bench_hist* from)
+{
+	int i;
+
+	for(i = 0; i < BENCH_BUCKETS; i++)
+	{
+		to->counts[i] += from->counts[i];
+	}
+
+	to->count += from->count;
+	to->sum   += from->sum;
+	to->min    = from->min < to->min ? from->min : to->min;
+	to->max    = from->max > to->max ? from->max : to->max;
+}
+
+
+/* Value at percentile p (0-100) */
+static inline uint64_t bench_hist_percentile(const bench_hist* h, double p)
+{
+	uint64_t want, seen = 0;
+	int i;
+
+	if(h->count == 0)
+	{
+		return 0;
+	}
+
+	want = (uint64_t)(p / 100.0 * (double)h->count + 0.5);
+	want = want < 1 ? 1 : want;
+
+	for(i = 0; i < BENCH_BUCKETS; i++)
+	{
+		if((seen += h->counts[i]) >= want)
+		{
+			return bench_hist_value(i) < h->max ? bench_hist_value(i) : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+
+
+
+/* ============================= JSON =============================== */
+
+
+static inline void bench_json_sep(bench_json* j, const char* key)
+{
+	if(!j->first[j->depth])
+	{
+		fputc(',', j->f);
+	}
+
+	j->first[j->depth] = 0;
+	fprintf(j->f, "\n%*s", j->depth * 2, "");
+
+	if(key != NULL)
+	{
+		fprintf(j->f, "\"%s\": ", key);
+	}
+}
+
+
+static inline void bench_json_open(bench_json* j, const char* key, char brace)
+{
+	if(j->depth > 0)
+	{
+		bench_json_sep(j, key);
+	}
+
+	fputc(brace, j->f);
+	j->first[++j->depth] = 1;
+}
+
+
+static inline void bench_json_close(bench_json* j, char brace)
+{
+	fprintf(j->f, "\n%*s%c", (j->depth - 1) * 2, "", brace);
+
+	if(--j->depth == 0)
+	{
+		fputc('\n', j->f);
+	}
+}
+
+
+static inline void bench_json_num(bench_json* j, const char* key, double v)
+{
+	bench_json_sep(j, key);
+	fprintf(j->f, "%.6g", v);
+}
+
+
+static inline void bench_json_int(bench_json* j, const char* key, uint64_t v)
+{
+	bench_json_sep(j, key);
+	fprintf(j->f, "%llu", (unsigned long long)v);
+}
+
+
+static inline void bench_json_str(bench_json* j, const char* key, const char* v)
+{
+	bench_json_sep(j, key);
+	fputc('"', j->f);
+
+	for(; *v; v++)
+	{
+		if(*v == '"' || *v == '\\')
+		{
+			fputc('\\', j->f);
+		}
+
+		fputc(*v, j->f);
+	}
+
+	fputc('"', j->f);
+}
+
+
+/* Percentiles of a histogram, scaled (e.g. 1e-3 for ns to us) */
+static inline void bench_json_hist(bench_json* j, const char* key, const bench_hist* h, double scale)
+{
+	bench_json_open(j, key, '{');
+	bench_json_int(j, "count", h->count);
+	bench_json_num(j, "min", h->count ? (double)h->min * scale : 0);
+	bench_json_num(j, "mean", h->count ? h->sum / (double)h->count * scale : 0);
+	bench_json_num(j, "p50", (double)bench_hist_percentile(h, 50) * scale);
+	bench_json_num(j, "p90", (double)bench_hist_percentile(h, 90) * scale);
+	bench_json_num(j, "p99", (double)bench_hist_percentile(h, 99) * scale);
+	bench_json_num(j, "p999", (double)bench_hist_percentile(h, 99.9) * scale);
+	bench_json_num(j, "p9999", (double)bench_hist_percentile(h, 99.99) * scale);
+	bench_json_num(j, "max", (double)h->max * scale);
+	bench_json_close(j, '}');
+}
+
+
+/* Start the report: { "suite": .., "host": .., "time": .., */
+static inline int bench_json_begin(bench_json* j, const char* path, const char* suite)
+{
+	struct utsname un;
+	char stamp[32];
+	time_t now = time(NULL);
+
+	memset(j, 0, sizeof(*j));
+	j->f = path != NULL ? fopen(path, "w") : stdout;
+
+	if(j->f == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	uname(&un);
+
+	bench_json_open(j, NULL, '{');
+	bench_json_str(j, "suite", suite);
+	bench_json_str(j, "time", stamp);
+	bench_json_str(j, "host", un.nodename);
+	bench_json_str(j, "kernel", un.release);
+	bench_json_int(j, "cpus", (uint64_t)sysconf(_SC_NPROCESSORS_ONLN));
+#ifdef __OPTIMIZE__
+	bench_json_str(j, "build", "optimized");
+#else
+	bench_json_str(j, "build", "debug");
+#endif
+	return 0;
+}
+
+
+static inline void bench_json_end(bench_json* j)
+{
+	bench_json_close(j, '}');
+
+	if(j->f != stdout)
+	{
+		fclose(j->f);
+	}
+}
+
+
+
+
+/* ========================= MICRO-BENCHMARKS ======================= */
+
+
+/* Page faults of the process so far, every thread included */
+static inline void bench_faults(uint64_t* minor, uint64_t* major)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	*minor = (uint64_t)ru.ru_minflt;
+	*major = (uint64_t)ru.ru_majflt;
+}
+
+
+/* Body of a micro-benchmark: do iters operations, return anything
+ * derived from the work so it is not optimized away.
+ */
+typedef uint64_t (*bench_fn)(void* arg, uint64_t iters);
+
+static volatile uint64_t bench_sink;
+
+
+/* Run fn in rounds, report the median ns per operation
+ *
+ * Iterations double until a round lasts BENCH_ROUND_NS; the median of
+ * BENCH_ROUNDS such rounds is kept, which hides one-off preemptions.
+ */
+static inline double bench_run(bench_json* j, const char* name, bench_fn fn, void* arg)
+{
+	double   rounds[BENCH_ROUNDS], t;
+	uint64_t iters = 1, start, took;
+	uint64_t minor, major, minor_end, major_end;
+	int      i, k;
+
+	for(;;)
+	{
+		start = bench_now_ns();
+		bench_sink += fn(arg, iters);
+
+		if((took = bench_now_ns() - start) >= BENCH_ROUND_NS / 4 || iters >= (1ull << 40))
+		{
+			break;
+		}
+
+		iters *= 2;
+	}
+
+	iters = (uint64_t)((double)iters * BENCH_ROUND_NS / (double)(took ? took : 1)) + 1;
+
+	/* Faults of the timed rounds only, the warm-up has touched its memory */
+	bench_faults(&minor, &major);
+
+	for(i = 0; i < BENCH_ROUNDS; i++)
+	{
+		start = bench_now_ns();
+		bench_sink += fn(arg, iters);
+		rounds[i] = (double)(bench_now_ns() - start) / (double)iters;
+	}
+
+	bench_faults(&minor_end, &major_end);
+
+	for(i = 1; i < BENCH_ROUNDS; i++)
+	{
+		for(t = rounds[i], k = i; k > 0 && rounds[k - 1] > t; k--)
+		{
+			rounds[k] = rounds[k - 1];
+		}
+
+		rounds[k] = t;
+	}
+
+	if(j != NULL)
+	{
+		bench_json_open(j, NULL, '{');
+		bench_json_str(j, "name", name);
+		bench_json_num(j, "ns_per_op", rounds[BENCH_ROUNDS / 2]);
+		bench_json_num(j, "ns_min", rounds[0]);
+		bench_json_num(j, "ns_max", rounds[BENCH_ROUNDS - 1]);
+		bench_json_num(j, "ops_per_sec", 1e9 / rounds[BENCH_ROUNDS / 2]);
+		bench_json_int(j, "iterations", iters);
+		bench_json_int(j, "minor_faults", minor_end - minor);
+		bench_json_int(j, "major_faults", major_end - major);
+		bench_json_num(j, "faults_per_op", (double)(minor_end - minor + major_end - major) /
+		                                   (double)(iters * BENCH_ROUNDS));
+		bench_json_close(j, '}');
+	}
+
+	fprintf(stderr, "%-36s %12.1f ns/op %10" PRIu64 " faults\n", name, rounds[BENCH_ROUNDS / 2],
+	        minor_end - minor + major_end - major);
+	return rounds[BENCH_ROUNDS / 2];
+}
+
+#endif /* BENCH_H_ */
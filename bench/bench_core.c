@@ -0,0 +1,710 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench_core.c
+ *
+ *    Description:  micro-benchmarks of the hot paths: thpool_add_work dispatch
+ *                  (shared and keyed, jobs from malloc and from huge pages),
+ *                  strkvm_parse / strkvm_get_string / strkvm_get_atom,
+ *                  config snapshot reads, number parsing and formatting
+ *                  against the libc calls,
+ *                  uri_decode / uri_encode and strutils_split (per piece,
+ *                  one block, iterator), results as JSON
+ *
+ *          Build:  gcc -O2 -Isrc -Iinclude bench/bench_core.c src/threadpool.c src/trace.c \
+ *                      src/hugemem.c src/strkvm.c src/strutils.c src/uri.c src/config.c src/rcu.c \
+ *                      src/atom.c -o bin/bench_core -lpthread -lm
+ *
+ *          Usage:  bin/bench_core [-o results.json] [-t threads] [filter]
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "bench.h"
+#include "threadpool.h"
+#include "strkvm.h"
+#include "strutils.h"
+#include "uri.h"
+#include "config.h"
+#include "atom.h"
+
+
+typedef struct bench_pool
+{
+	threadpool      pool;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	uint64_t        done;
+} bench_pool;
+
+
+static void* job_empty(void* arg, int index)
+{
+	(void)arg;
+	(void)index;
+	return NULL;
+}
+
+
+static void* job_signal(void* arg, int index)
+{
+	bench_pool* b = arg;
+	(void)index;
+
+	pthread_mutex_lock(&b->lock);
+	b->done++;
+	pthread_cond_signal(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+
+/* Throughput: queue iters empty jobs, then wait for the pool to drain */
+static uint64_t bench_dispatch(void* arg, uint64_t iters)
+{
+	bench_pool* b = arg;
+	uint64_t i;
+
+	for(i = 0; i < iters; i++)
+	{
+		thpool_add_work(b->pool, job_empty, NULL, -1);
+	}
+
+	thpool_wait(b->pool);
+	return iters;
+}
+
+
+/* Throughput with affinity: 64 connections, each one pinned to a worker */
+static uint64_t bench_dispatch_keyed(void* arg, uint64_t iters)
+{
+	bench_pool* b = arg;
+	uint64_t i;
+
+	for(i = 0; i < iters; i++)
+	{
+		thpool_add_work_keyed(b->pool, i & 63, job_empty, NULL, -1);
+	}
+
+	thpool_wait(b->pool);
+	return iters;
+}
+
+
+/* Latency: one job at a time, from thpool_add_work until it has run */
+static uint64_t bench_round_trip(void* arg, uint64_t iters)
+{
+	bench_pool* b = arg;
+	uint64_t i;
+
+	for(i = 0; i < iters; i++)
+	{
+		pthread_mutex_lock(&b->lock);
+		b->done = 0;
+		pthread_mutex_unlock(&b->lock);
+
+		thpool_add_work(b->pool, job_signal, b, -1);
+
+		pthread_mutex_lock(&b->lock);
+		while(b->done == 0)
+		{
+			pthread_cond_wait(&b->cond, &b->lock);
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	return iters;
+}
+
+
+
+
+/* ============================= STRINGS ============================ */
+
+
+typedef struct bench_text
+{
+	char*  text;
+	size_t len;
+	char   split;
+} bench_text;
+
+
+/* "name=value" pairs like a form body or a query */
+static void make_pairs(bench_text* t, int pairs)
+{
+	size_t len = 0;
+	int i;
+
+	t->text = malloc((size_t)pairs * 48 + 1);
+
+	for(i = 0; i < pairs; i++)
+	{
+		len += sprintf(t->text + len, "field_%d=value+number+%d&", i, i * 7919);
+	}
+
+	t->text[--len] = 0;
+	t->len = len;
+	t->split = '&';
+}
+
+
+static uint64_t bench_strkvm_parse(void* arg, uint64_t iters)
+{
+	bench_text* t = arg;
+	st_strkvm kvm;
+	uint64_t i, n = 0;
+
+	for(i = 0; i < iters; i++)
+	{
+		strkvm_init(&kvm);
+		strkvm_parse(&kvm, t->text, t->len, t->split);
+		n += strkvm_count(&kvm);
+		strkvm_free(&kvm);
+	}
+
+	return n;
+}
+
+
+typedef struct bench_kvm
+{
+	st_strkvm   kvm;
+	const char* key;
+} bench_kvm;
+
+
+static uint64_t bench_strkvm_get(void* arg, uint64_t iters)
+{
+	bench_kvm* k = arg;
+	uint64_t i, n = 0;
+	char* value;
+
+	for(i = 0; i < iters; i++)
+	{
+		if(strkvm_get_string(&k->kvm, k->key, &value) == 0)
+		{
+			n += value[0];
+			free(value);
+		}
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_strkvm_get_atom(void* arg, uint64_t iters)
+{
+	bench_kvm* k = arg;
+	uint32_t atom = atom_find(k->key, strlen(k->key));
+	uint64_t i, n = 0;
+	st_strkv* kv;
+
+	for(i = 0; i < iters; i++)
+	{
+		if((kv = strkvm_get_atom(&k->kvm, atom)) != NULL)
+		{
+			n += strkvm_value(&k->kvm, kv)[0];
+		}
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_strkvm_get_int(void* arg, uint64_t iters)
+{
+	bench_kvm* k = arg;
+	uint64_t i, n = 0;
+	int value;
+
+	for(i = 0; i < iters; i++)
+	{
+		if(strkvm_get_int(&k->kvm, k->key, &value) == 0)
+		{
+			n += (uint64_t)value;
+		}
+	}
+
+	return n;
+}
+
+
+typedef struct bench_config
+{
+	st_config config;
+	int       key;
+} bench_config;
+
+
+static uint64_t bench_config_int(void* arg, uint64_t iters)
+{
+	bench_config* c = arg;
+	const st_config_snap* snap;
+	uint64_t i, n = 0;
+
+	for(i = 0; i < iters; i++)
+	{
+		snap = config_acquire(&c->config);
+		n += (uint64_t)config_int(snap, c->key);
+		config_release(snap);
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_uri_decode(void* arg, uint64_t iters)
+{
+	bench_text* t = arg;
+	uint64_t i, n = 0;
+	char* s;
+
+	for(i = 0; i < iters; i++)
+	{
+		s = uri_decode(t->text);
+		n += s[0];
+		free(s);
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_uri_encode(void* arg, uint64_t iters)
+{
+	bench_text* t = arg;
+	uint64_t i, n = 0;
+	char* s;
+
+	for(i = 0; i < iters; i++)
+	{
+		s = uri_encode(t->text);
+		n += s[0];
+		free(s);
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_split(void* arg, uint64_t iters)
+{
+	bench_text* t = arg;
+	uint64_t i, n = 0;
+	uint32_t count, k;
+	char** pieces;
+
+	for(i = 0; i < iters; i++)
+	{
+		if(strutils_split(t->text, t->split, &pieces, &count) != 0)
+		{
+			continue;
+		}
+
+		for(k = 0; k < count; k++)
+		{
+			free(pieces[k]);
+		}
+
+		free(pieces);
+		n += count;
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_split_block(void* arg, uint64_t iters)
+{
+	bench_text* t = arg;
+	uint64_t i, n = 0;
+	uint32_t count;
+	char** pieces;
+
+	for(i = 0; i < iters; i++)
+	{
+		if(strutils_split_block(t->text, t->split, &pieces, &count) != 0)
+		{
+			continue;
+		}
+
+		free(pieces);
+		n += count;
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_split_iter(void* arg, uint64_t iters)
+{
+	bench_text* t = arg;
+	st_strutils_iter it;
+	const char* piece;
+	uint64_t i, n = 0;
+	size_t len;
+
+	for(i = 0; i < iters; i++)
+	{
+		strutils_split_init(&it, t->text, t->len, t->split, 0);
+
+		while(strutils_split_next(&it, &piece, &len))
+		{
+			n += len;
+		}
+	}
+
+	return n;
+}
+
+
+
+
+/* ============================= NUMBERS ============================ */
+
+
+#define NUMBERS 256
+
+typedef struct bench_numbers
+{
+	char    ints[NUMBERS][24];
+	char    doubles[NUMBERS][32];              /* shortest form              */
+	char    doubles17[NUMBERS][32];            /* %.17g, past the fast path  */
+	int64_t int_values[NUMBERS];
+	double  double_values[NUMBERS];
+} bench_numbers;
+
+
+/* Mixed magnitudes, as in headers, queries and config */
+static void make_numbers(bench_numbers* b)
+{
+	uint64_t x = 88172645463325252ull;
+	int i;
+
+	for(i = 0; i < NUMBERS; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+
+		b->int_values[i]    = (int64_t)(x >> (x % 60));
+		b->double_values[i] = (double)(x % 100000000) / 1000.0 * ((i & 1) ? 1.0 : 1e-3);
+		sprintf(b->ints[i], "%" PRId64, b->int_values[i]);
+		strutils_format_double(b->double_values[i], b->doubles[i]);
+		sprintf(b->doubles17[i], "%.17g", b->double_values[i]);
+	}
+}
+
+
+static uint64_t bench_atoll(void* arg, uint64_t iters)
+{
+	bench_numbers* b = arg;
+	uint64_t i, n = 0;
+
+	for(i = 0; i < iters; i++)
+	{
+		n += (uint64_t)atoll(b->ints[i % NUMBERS]);
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_parse_int(void* arg, uint64_t iters)
+{
+	bench_numbers* b = arg;
+	uint64_t i, n = 0;
+	int64_t v;
+	const char* s;
+
+	for(i = 0; i < iters; i++)
+	{
+		s = b->ints[i % NUMBERS];
+		strutils_parse_int(s, strlen(s), &v, NULL);
+		n += (uint64_t)v;
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_strtod(void* arg, uint64_t iters)
+{
+	char (*doubles)[32] = arg;
+	uint64_t i;
+	double n = 0;
+
+	for(i = 0; i < iters; i++)
+	{
+		n += strtod(doubles[i % NUMBERS], NULL);
+	}
+
+	return (uint64_t)n;
+}
+
+
+static uint64_t bench_parse_double(void* arg, uint64_t iters)
+{
+	char (*doubles)[32] = arg;
+	uint64_t i;
+	double n = 0, v;
+	const char* s;
+
+	for(i = 0; i < iters; i++)
+	{
+		s = doubles[i % NUMBERS];
+		strutils_parse_double(s, strlen(s), &v, NULL);
+		n += v;
+	}
+
+	return (uint64_t)n;
+}
+
+
+static uint64_t bench_snprintf_int(void* arg, uint64_t iters)
+{
+	bench_numbers* b = arg;
+	uint64_t i, n = 0;
+	char buf[32];
+
+	for(i = 0; i < iters; i++)
+	{
+		n += (uint64_t)snprintf(buf, sizeof(buf), "%" PRId64, b->int_values[i % NUMBERS]);
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_format_int(void* arg, uint64_t iters)
+{
+	bench_numbers* b = arg;
+	uint64_t i, n = 0;
+	char buf[STRUTILS_INT_LEN];
+
+	for(i = 0; i < iters; i++)
+	{
+		n += strutils_format_int(b->int_values[i % NUMBERS], buf);
+	}
+
+	return n;
+}
+
+
+/* %.17g always reads back but is rarely the shortest */
+static uint64_t bench_snprintf_double(void* arg, uint64_t iters)
+{
+	bench_numbers* b = arg;
+	uint64_t i, n = 0;
+	char buf[32];
+
+	for(i = 0; i < iters; i++)
+	{
+		n += (uint64_t)snprintf(buf, sizeof(buf), "%.17g", b->double_values[i % NUMBERS]);
+	}
+
+	return n;
+}
+
+
+static uint64_t bench_format_double(void* arg, uint64_t iters)
+{
+	bench_numbers* b = arg;
+	uint64_t i, n = 0;
+	char buf[STRUTILS_DOUBLE_LEN];
+
+	for(i = 0; i < iters; i++)
+	{
+		n += strutils_format_double(b->double_values[i % NUMBERS], buf);
+	}
+
+	return n;
+}
+
+
+
+
+/* =============================== MAIN ============================= */
+
+
+static const char* filter;
+
+#define HEADERS "host=example.com\nuser-agent=curl/8.5.0\naccept=*/*\n" \
+                "accept-encoding=gzip, br\naccept-language=en-US,en;q=0.9\n" \
+                "cookie=session=0123456789abcdef\nreferer=https://example.com/\n" \
+                "cache-control=no-cache\nx-forwarded-for=10.0.0.1\nx-request-id=42\n" \
+                "if-none-match=\"abc\"\nconnection=keep-alive"
+
+
+static void run(bench_json* j, const char* name, bench_fn fn, void* arg)
+{
+	if(filter == NULL || strstr(name, filter) != NULL)
+	{
+		bench_run(j, name, fn, arg);
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	thpool_options hugepages = { THPOOL_QUEUE_LIST, 0, THPOOL_HUGEPAGES, 0 };
+	const char* out = NULL;
+	int threads = 4, opt;
+	bench_json json;
+	bench_pool b;
+	bench_text small, large, path;
+	bench_kvm first, last;
+	bench_config conf;
+	bench_numbers* numbers;
+	char name[32];
+	int i;
+
+	while((opt = getopt(argc, argv, "o:t:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'o':
+			out = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o results.json] [-t threads] [filter]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	filter = optind < argc ? argv[optind] : NULL;
+
+	if(bench_json_begin(&json, out, "core") != 0)
+	{
+		return 1;
+	}
+
+	bench_json_int(&json, "threads", (uint64_t)threads);
+	bench_json_open(&json, "results", '[');
+
+	/* threadpool */
+	b.pool = thpool_init(threads);
+	b.done = 0;
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.cond, NULL);
+
+	run(&json, "thpool_add_work/throughput", bench_dispatch, &b);
+	run(&json, "thpool_add_work_keyed/throughput", bench_dispatch_keyed, &b);
+	run(&json, "thpool_add_work/round_trip", bench_round_trip, &b);
+
+	thpool_destroy(b.pool);
+
+	/* threadpool, jobs on pre-faulted huge pages */
+	b.pool = thpool_init_ex(threads, &hugepages);
+
+	run(&json, "thpool_add_work/throughput/hugepages", bench_dispatch, &b);
+	run(&json, "thpool_add_work_keyed/throughput/hugepages", bench_dispatch_keyed, &b);
+
+	thpool_destroy(b.pool);
+
+	/* strkvm */
+	make_pairs(&small, 8);
+	make_pairs(&large, 128);
+
+	run(&json, "strkvm_parse/8", bench_strkvm_parse, &small);
+	run(&json, "strkvm_parse/128", bench_strkvm_parse, &large);
+
+	strkvm_init(&first.kvm);
+	strkvm_parse(&first.kvm, large.text, large.len, large.split);
+	first.key = "field_127";                   /* lookups scan newest first */
+	last.kvm = first.kvm;
+	last.key = "field_0";
+
+	run(&json, "strkvm_get_string/128/newest", bench_strkvm_get, &first);
+	run(&json, "strkvm_get_string/128/oldest", bench_strkvm_get, &last);
+
+	/* request headers: names are atoms */
+	strkvm_free(&first.kvm);
+	strkvm_init(&first.kvm);
+	strkvm_parse(&first.kvm, HEADERS, strlen(HEADERS), '\n');
+	first.key = "host";                        /* oldest of them */
+
+	run(&json, "strkvm_get_string/headers", bench_strkvm_get, &first);
+	run(&json, "strkvm_get_atom/headers", bench_strkvm_get_atom, &first);
+
+	/* config: a scan plus atoi, against a typed read by key id */
+	strkvm_free(&first.kvm);
+	strkvm_init(&first.kvm);
+	strkvm_parse(&first.kvm, small.text, small.len, small.split);
+	first.key = "field_0";
+
+	run(&json, "strkvm_get_int/8/oldest", bench_strkvm_get_int, &first);
+
+	strkvm_free(&first.kvm);
+
+	config_init(&conf.config);
+
+	for(i = 0; i < 128; i++)
+	{
+		sprintf(name, "field_%d", i);
+		conf.key = config_key(&conf.config, name, CONFIG_STRING, NULL);
+	}
+
+	conf.key = config_key(&conf.config, "port", CONFIG_INT, "8080");
+	config_load(&conf.config, large.text, large.len, large.split);
+
+	run(&json, "config_int/128", bench_config_int, &conf);
+
+	config_free(&conf.config);
+
+	/* uri */
+	path.text = "/api/v1/search?q=caf%C3%A9%20au%20lait&tag=%E2%9C%93&page=2&sort=-date%2Cname";
+	path.len = strlen(path.text);
+	path.split = '/';
+
+	run(&json, "uri_decode/escaped", bench_uri_decode, &path);
+	run(&json, "uri_encode/escaped", bench_uri_encode, &path);
+	run(&json, "uri_decode/pairs_128", bench_uri_decode, &large);
+
+	/* strutils */
+	run(&json, "strutils_split/8", bench_split, &small);
+	run(&json, "strutils_split/128", bench_split, &large);
+	run(&json, "strutils_split/path", bench_split, &path);
+	run(&json, "strutils_split_block/8", bench_split_block, &small);
+	run(&json, "strutils_split_block/128", bench_split_block, &large);
+	run(&json, "strutils_split_block/path", bench_split_block, &path);
+	run(&json, "strutils_split_iter/8", bench_split_iter, &small);
+	run(&json, "strutils_split_iter/128", bench_split_iter, &large);
+	run(&json, "strutils_split_iter/path", bench_split_iter, &path);
+
+	free(small.text);
+	free(large.text);
+
+	/* numbers */
+	numbers = malloc(sizeof(bench_numbers));
+	make_numbers(numbers);
+
+	run(&json, "atoll", bench_atoll, numbers);
+	run(&json, "strutils_parse_int", bench_parse_int, numbers);
+	run(&json, "strtod/shortest", bench_strtod, numbers->doubles);
+	run(&json, "strutils_parse_double/shortest", bench_parse_double, numbers->doubles);
+	run(&json, "strtod/17_digits", bench_strtod, numbers->doubles17);
+	run(&json, "strutils_parse_double/17_digits", bench_parse_double, numbers->doubles17);
+	run(&json, "snprintf/int", bench_snprintf_int, numbers);
+	run(&json, "strutils_format_int", bench_format_int, numbers);
+	run(&json, "snprintf/double", bench_snprintf_double, numbers);
+	run(&json, "strutils_format_double", bench_format_double, numbers);
+
+	free(numbers);
+
+	bench_json_close(&json, ']');
+	bench_json_end(&json);
+	return 0;
+}
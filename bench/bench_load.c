@@ -0,0 +1,546 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench_load.c
+ *
+ *    Description:  HTTP/1.1 keep-alive load generator, closed or open loop, with
+ *                  coordinated omission corrected latency percentiles as JSON
+ *
+ *          Build:  gcc -O2 -Isrc -Iinclude bench/bench_load.c src/threadpool.c src/trace.c \
+ *                      src/hugemem.c -o bin/bench_load -lpthread
+ *
+ *          Usage:  bin/bench_load [-s | -a addr -p port] [-c conns] [-d secs]
+ *                                 [-w warmup] [-r rate] [-u path] [-o results.json]
+ *
+ *                  -s runs a minimal server on a threadpool in the same process,
+ *                  so the dispatch path can be measured without anything else.
+ *                  -r 0 (the default) is closed loop: each connection sends the
+ *                  next request when the last answer is in. -r N is open loop:
+ *                  N requests a second over all connections, sent on schedule
+ *                  whether or not the server keeps up.
+ *
+ *  A closed loop that waits on a slow answer stops sending, so it does not
+ *  measure the requests that would have queued up behind it (coordinated
+ *  omission). In open loop the latency is taken from the time the request
+ *  should have been sent; in closed loop the missing samples are added back
+ *  with the mean latency as the expected interval. Both the raw and the
+ *  corrected percentiles are reported.
+ *
+ * =====================================================================================
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+
+#include "bench.h"
+#include "threadpool.h"
+
+
+#define LOAD_BUF_SIZE      65536
+#define LOAD_TIMEOUT_S     5
+
+
+typedef struct load_conf
+{
+	const char* addr;
+	int         port;
+	int         conns;
+	double      duration;                      /* seconds measured          */
+	double      warmup;                        /* seconds not measured      */
+	double      rate;                          /* requests/s, 0 closed loop */
+	const char* path;
+} load_conf;
+
+
+typedef struct load_conn
+{
+	pthread_t   thread;
+	const load_conf* conf;
+	int         index;
+	uint64_t    start;                         /* ns, after the warmup      */
+	uint64_t    end;
+	bench_hist  raw;                           /* send to last byte         */
+	bench_hist  intended;                      /* schedule to last byte     */
+	uint64_t    requests;
+	uint64_t    bytes;
+	uint64_t    non2xx;
+	uint64_t    errors;
+	uint64_t    late;                          /* sent after its slot       */
+} load_conn;
+
+
+
+
+/* ============================== CLIENT ============================ */
+
+
+static int load_connect(const load_conf* conf)
+{
+	struct sockaddr_in sin;
+	struct timeval tv = { LOAD_TIMEOUT_S, 0 };
+	int fd, one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons((uint16_t)conf->port);
+
+	if(inet_pton(AF_INET, conf->addr, &sin.sin_addr) != 1)
+	{
+		return -1;
+	}
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		return -1;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if(connect(fd, (struct sockaddr*)&sin, sizeof(sin)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static int load_send(int fd, const char* buf, size_t len)
+{
+	ssize_t n;
+
+	while(len > 0)
+	{
+		if((n = send(fd, buf, len, MSG_NOSIGNAL)) <= 0)
+		{
+			if(n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			return -1;
+		}
+
+		buf += n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+
+/* Read one response with a Content-Length body, return the status or -1 */
+static int load_response(int fd, char* buf, uint64_t* bytes)
+{
+	size_t have = 0, head, body;
+	char *end, *cl;
+	ssize_t n;
+	int status;
+
+	for(;;)
+	{
+		if(have == LOAD_BUF_SIZE - 1 || (n = recv(fd, buf + have, LOAD_BUF_SIZE - 1 - have, 0)) <= 0)
+		{
+			return -1;
+		}
+
+		have += (size_t)n;
+		buf[have] = 0;
+
+		if((end = strstr(buf, "\r\n\r\n")) != NULL)
+		{
+			break;
+		}
+	}
+
+	head = (size_t)(end + 4 - buf);
+	*end = 0;
+
+	if(sscanf(buf, "HTTP/1.%*d %d", &status) != 1
+	   || (cl = strcasestr(buf, "\r\nContent-Length:")) == NULL)
+	{
+		return -1;
+	}
+
+	body = strtoul(cl + 17, NULL, 10);
+	*bytes += head + body;
+
+	/* The generator sends one request at a time, anything extra is an error */
+	if(have > head + body)
+	{
+		return -1;
+	}
+
+	for(body -= have - head; body > 0; body -= (size_t)n)
+	{
+		if((n = recv(fd, buf, body < LOAD_BUF_SIZE ? body : LOAD_BUF_SIZE, 0)) <= 0)
+		{
+			return -1;
+		}
+	}
+
+	return status;
+}
+
+
+static void load_sleep_until(uint64_t ns)
+{
+	struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	{
+	}
+}
+
+
+static void* load_conn_run(void* arg)
+{
+	load_conn* c = arg;
+	const load_conf* conf = c->conf;
+	char request[1024], *buf;
+	size_t reqlen;
+	uint64_t interval = 0, next, sent, done, bytes;
+	int fd = -1, status;
+
+	reqlen = (size_t)snprintf(request, sizeof(request),
+	                          "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: bench_load\r\n\r\n",
+	                          conf->path, conf->addr, conf->port);
+
+	if((buf = malloc(LOAD_BUF_SIZE)) == NULL)
+	{
+		return NULL;
+	}
+
+	/* The default 50 us timer slack would show up as latency in open loop */
+	prctl(PR_SET_TIMERSLACK, 1UL);
+
+	if(conf->rate > 0)
+	{
+		interval = (uint64_t)(1e9 * conf->conns / conf->rate);
+	}
+
+	/* Spread the first sends of the connections over one interval */
+	next = bench_now_ns() + interval * (uint64_t)c->index / (uint64_t)conf->conns;
+
+	for(;;)
+	{
+		if(interval)
+		{
+			load_sleep_until(next);
+		}
+		else
+		{
+			next = bench_now_ns();
+		}
+
+		/* Behind schedule the backlog is not worked off past the end */
+		if(next >= c->end || bench_now_ns() >= c->end)
+		{
+			break;
+		}
+
+		if(fd < 0 && (fd = load_connect(conf)) < 0)
+		{
+			c->errors++;
+			load_sleep_until(bench_now_ns() + 10000000);
+			next += interval;
+			continue;
+		}
+
+		bytes = 0;
+		sent = bench_now_ns();
+
+		if(load_send(fd, request, reqlen) != 0 || (status = load_response(fd, buf, &bytes)) < 0)
+		{
+			c->errors++;
+			close(fd);
+			fd = -1;
+			next += interval;
+			continue;
+		}
+
+		done = bench_now_ns();
+
+		if(sent >= c->start)
+		{
+			c->requests++;
+			c->bytes += bytes;
+			c->non2xx += status < 200 || status > 299;
+			c->late += interval && sent - next > interval;
+			bench_hist_record(&c->raw, done - sent);
+
+			if(interval)
+			{
+				bench_hist_record(&c->intended, done - next);
+			}
+		}
+
+		next += interval;
+	}
+
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+
+
+
+/* ============================ SELF SERVER ========================= */
+
+
+static const char self_response[] =
+	"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 13\r\n\r\nHello, world\n";
+
+
+/* One keep-alive connection per job, answering every request it reads */
+static void* self_conn_job(void* arg, int index)
+{
+	int fd = (int)(intptr_t)arg, one = 1;
+	char buf[4096];
+	size_t have = 0;
+	ssize_t n;
+	char* end;
+	(void)index;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	while((n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0)) > 0)
+	{
+		have += (size_t)n;
+		buf[have] = 0;
+
+		while((end = strstr(buf, "\r\n\r\n")) != NULL)
+		{
+			if(load_send(fd, self_response, sizeof(self_response) - 1) != 0)
+			{
+				goto self_done;
+			}
+
+			have -= (size_t)(end + 4 - buf);
+			memmove(buf, end + 4, have + 1);
+		}
+
+		if(have == sizeof(buf) - 1)
+		{
+			break;
+		}
+	}
+
+self_done:
+	close(fd);
+	return NULL;
+}
+
+
+typedef struct self_server
+{
+	threadpool pool;
+	int        listenfd;
+	pthread_t  thread;
+} self_server;
+
+
+static void* self_accept(void* arg)
+{
+	self_server* s = arg;
+	int fd;
+
+	while((fd = accept(s->listenfd, NULL, NULL)) >= 0)
+	{
+		thpool_add_work(s->pool, self_conn_job, (void*)(intptr_t)fd, fd);
+	}
+
+	return NULL;
+}
+
+
+static int self_start(self_server* s, int threads)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((s->listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+	   || bind(s->listenfd, (struct sockaddr*)&sin, sizeof(sin)) != 0
+	   || listen(s->listenfd, 1024) != 0
+	   || getsockname(s->listenfd, (struct sockaddr*)&sin, &len) != 0)
+	{
+		perror("self server");
+		return -1;
+	}
+
+	s->pool = thpool_init(threads);
+	pthread_create(&s->thread, NULL, self_accept, s);
+	return ntohs(sin.sin_port);
+}
+
+
+static void self_stop(self_server* s)
+{
+	shutdown(s->listenfd, SHUT_RDWR);
+	pthread_join(s->thread, NULL);
+	close(s->listenfd);
+	thpool_wait(s->pool);
+	thpool_destroy(s->pool);
+}
+
+
+
+
+/* =============================== MAIN ============================= */
+
+
+int main(int argc, char** argv)
+{
+	load_conf conf = { "127.0.0.1", 8080, 4, 5, 1, 0, "/" };
+	const char* out = NULL;
+	load_conn* conns;
+	bench_hist raw, corrected;
+	self_server self;
+	bench_json json;
+	uint64_t start, requests = 0, bytes = 0, non2xx = 0, errors = 0, late = 0, mean, k;
+	int self_mode = 0, opt, i;
+
+	while((opt = getopt(argc, argv, "sa:p:c:d:w:r:u:o:")) != -1)
+	{
+		switch(opt)
+		{
+		case 's': self_mode = 1; break;
+		case 'a': conf.addr = optarg; break;
+		case 'p': conf.port = atoi(optarg); break;
+		case 'c': conf.conns = atoi(optarg); break;
+		case 'd': conf.duration = atof(optarg); break;
+		case 'w': conf.warmup = atof(optarg); break;
+		case 'r': conf.rate = atof(optarg); break;
+		case 'u': conf.path = optarg; break;
+		case 'o': out = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-s | -a addr -p port] [-c conns] [-d secs] "
+			                "[-w warmup] [-r rate] [-u path] [-o results.json]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(conf.conns < 1 || conf.duration <= 0 || conf.warmup < 0 || conf.rate < 0)
+	{
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if(self_mode && (conf.port = self_start(&self, conf.conns)) < 0)
+	{
+		return 1;
+	}
+
+	if((conns = calloc((size_t)conf.conns, sizeof(load_conn))) == NULL)
+	{
+		return 1;
+	}
+
+	start = bench_now_ns() + (uint64_t)(conf.warmup * 1e9);
+
+	for(i = 0; i < conf.conns; i++)
+	{
+		conns[i].conf = &conf;
+		conns[i].index = i;
+		conns[i].start = start;
+		conns[i].end = start + (uint64_t)(conf.duration * 1e9);
+		bench_hist_init(&conns[i].raw);
+		bench_hist_init(&conns[i].intended);
+		pthread_create(&conns[i].thread, NULL, load_conn_run, &conns[i]);
+	}
+
+	bench_hist_init(&raw);
+	bench_hist_init(&corrected);
+
+	for(i = 0; i < conf.conns; i++)
+	{
+		pthread_join(conns[i].thread, NULL);
+		bench_hist_merge(&raw, &conns[i].raw);
+		bench_hist_merge(&corrected, &conns[i].intended);
+		requests += conns[i].requests;
+		bytes += conns[i].bytes;
+		non2xx += conns[i].non2xx;
+		errors += conns[i].errors;
+		late += conns[i].late;
+	}
+
+	/* Closed loop: add back the samples hidden behind slow answers */
+	if(conf.rate == 0 && raw.count > 0)
+	{
+		mean = (uint64_t)(raw.sum / (double)raw.count);
+
+		for(i = 0; i < BENCH_BUCKETS; i++)
+		{
+			for(k = 0; k < raw.counts[i]; k++)
+			{
+				bench_hist_record_corrected(&corrected, bench_hist_value(i), mean);
+			}
+		}
+	}
+
+	if(self_mode)
+	{
+		self_stop(&self);
+	}
+
+	if(bench_json_begin(&json, out, "load") != 0)
+	{
+		return 1;
+	}
+
+	bench_json_open(&json, "config", '{');
+	bench_json_str(&json, "target", self_mode ? "self" : conf.addr);
+	bench_json_int(&json, "port", (uint64_t)conf.port);
+	bench_json_str(&json, "path", conf.path);
+	bench_json_str(&json, "mode", conf.rate > 0 ? "open" : "closed");
+	bench_json_int(&json, "connections", (uint64_t)conf.conns);
+	bench_json_num(&json, "duration_s", conf.duration);
+	bench_json_num(&json, "warmup_s", conf.warmup);
+	bench_json_num(&json, "rate", conf.rate);
+	bench_json_close(&json, '}');
+
+	bench_json_int(&json, "requests", requests);
+	bench_json_num(&json, "requests_per_sec", (double)requests / conf.duration);
+	bench_json_int(&json, "bytes", bytes);
+	bench_json_int(&json, "non2xx", non2xx);
+	bench_json_int(&json, "errors", errors);
+	bench_json_int(&json, "late", late);
+	bench_json_hist(&json, "latency_us", &raw, 1e-3);
+	bench_json_hist(&json, "latency_corrected_us", &corrected, 1e-3);
+	bench_json_end(&json);
+
+	fprintf(stderr, "%llu requests, %.0f/s, p50 %.1f us, p99 %.1f us, corrected p99 %.1f us, %llu errors\n",
+	        (unsigned long long)requests, (double)requests / conf.duration,
+	        (double)bench_hist_percentile(&raw, 50) / 1e3, (double)bench_hist_percentile(&raw, 99) / 1e3,
+	        (double)bench_hist_percentile(&corrected, 99) / 1e3, (unsigned long long)errors);
+
+	free(conns);
+	return 0;
+}
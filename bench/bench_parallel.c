@@ -0,0 +1,171 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench_parallel.c
+ *
+ *    Description:  thpool_parallel_for / thpool_parallel_reduce against the serial path
+ *
+ *          Build:  gcc -O2 -Isrc -Iinclude bench/bench_parallel.c src/threadpool.c src/trace.c \
+ *                      src/hugemem.c -o bin/bench_parallel -lpthread
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+#define BUF_SIZE   (256u << 20)
+#define ROUNDS     5
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Position-weighted checksum, the kind of body run over a request payload */
+static void sum_body(size_t begin, size_t end, void* acc, void* arg, int index)
+{
+	const uint8_t* p = (const uint8_t*)arg;
+	uint64_t s = 0;
+	(void)index;
+
+	for(; begin < end; begin++)
+	{
+		s += (uint64_t)p[begin] * (begin + 1);
+	}
+
+	*(uint64_t*)acc += s;
+}
+
+
+static void sum_join(void* acc, const void* part, void* arg)
+{
+	(void)arg;
+	*(uint64_t*)acc += *(const uint64_t*)part;
+}
+
+
+/* Byte transform standing in for block encoding */
+static void xor_body(size_t begin, size_t end, void* arg, int index)
+{
+	uint8_t* p = (uint8_t*)arg;
+	(void)index;
+
+	for(; begin < end; begin++)
+	{
+		p[begin] = (uint8_t)((p[begin] ^ 0x5a) * 7 + 1);
+	}
+}
+
+
+/* Serial path goes through the same out-of-line bodies as the parallel one */
+static void (* volatile serial_sum)(size_t, size_t, void*, void*, int) = sum_body;
+static void (* volatile serial_xor)(size_t, size_t, void*, int) = xor_body;
+
+
+static void report(const char* name, size_t grain, double serial, double parallel)
+{
+	printf("%-8s grain=%-10zu serial=%7.2f ms  parallel=%7.2f ms  speedup=%5.2fx  %6.2f GB/s\n",
+	       name, grain, serial * 1e3, parallel * 1e3, serial / parallel,
+	       BUF_SIZE / parallel / 1e9);
+}
+
+
+int main(int argc, char* argv[])
+{
+	int threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	size_t grains[] = { 0, 1u << 14, 1u << 18, 1u << 22 };
+	uint8_t* buf = (uint8_t*)malloc(BUF_SIZE);
+	threadpool thpool;
+	double t, serial, best;
+	uint64_t expect, got;
+	unsigned i, g;
+	int r;
+
+	if(buf == NULL)
+	{
+		return 1;
+	}
+
+	for(i = 0; i < BUF_SIZE; i++)
+	{
+		buf[i] = (uint8_t)(i * 2654435761u >> 24);
+	}
+
+	thpool = thpool_init(threads);
+
+	/* Checksum: serial */
+	serial = 1e9;
+
+	for(r = 0; r < ROUNDS; r++)
+	{
+		expect = 0;
+		t = now_sec();
+		serial_sum(0, BUF_SIZE, &expect, buf, -1);
+		t = now_sec() - t;
+		serial = t < serial ? t : serial;
+	}
+
+	for(g = 0; g < sizeof(grains) / sizeof(grains[0]); g++)
+	{
+		best = 1e9;
+
+		for(r = 0; r < ROUNDS; r++)
+		{
+			got = 0;
+			t = now_sec();
+			thpool_parallel_reduce(thpool, 0, BUF_SIZE, grains[g], sum_body, sum_join,
+			                       &got, sizeof(got), buf);
+			t = now_sec() - t;
+			best = t < best ? t : best;
+		}
+
+		if(got != expect)
+		{
+			fprintf(stderr, "reduce: checksum mismatch\n");
+			return 1;
+		}
+
+		report("reduce", grains[g], serial, best);
+	}
+
+	/* Transform: serial */
+	serial = 1e9;
+
+	for(r = 0; r < ROUNDS; r++)
+	{
+		t = now_sec();
+		serial_xor(0, BUF_SIZE, buf, -1);
+		t = now_sec() - t;
+		serial = t < serial ? t : serial;
+	}
+
+	for(g = 0; g < sizeof(grains) / sizeof(grains[0]); g++)
+	{
+		best = 1e9;
+
+		for(r = 0; r < ROUNDS; r++)
+		{
+			t = now_sec();
+			thpool_parallel_for(thpool, 0, BUF_SIZE, grains[g], xor_body, buf);
+			t = now_sec() - t;
+			best = t < best ? t : best;
+		}
+
+		report("for", grains[g], serial, best);
+	}
+
+	thpool_destroy(thpool);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench_query.c
+ *
+ *    Description:  query_parse against uri_decode + strkvm_parse on 1-10 KB queries
+ *
+ *          Build:  gcc -O2 -Isrc bench/bench_query.c src/query.c src/strkvm.c \
+ *                      src/strutils.c src/uri.c src/atom.c -o bin/bench_query -lpthread
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "query.h"
+#include "strkvm.h"
+#include "uri.h"
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Mix of ids, counters, free text with escapes and repeated filter keys */
+static size_t make_query(char* buf, size_t target)
+{
+	size_t len = 0;
+	int n = 0;
+
+	while(len + 64 < target)
+	{
+		switch(n % 4)
+		{
+		case 0:
+			len += sprintf(buf + len, "id%d=%d&", n, n * 7919);
+			break;
+		case 1:
+			len += sprintf(buf + len, "q%d=caf%%C3%%A9+au+lait%%21&", n);
+			break;
+		case 2:
+			len += sprintf(buf + len, "filter=tag%%3A%d&", n);
+			break;
+		default:
+			len += sprintf(buf + len, "price%d=%d.25&", n, n);
+			break;
+		}
+
+		n++;
+	}
+
+	buf[--len] = 0;
+	return len;
+}
+
+
+static void run(size_t target)
+{
+	char* buf = malloc(target + 1);
+	size_t len = make_query(buf, target);
+	int rounds = (int)(20000000 / len);
+	int r, i, k, sink = 0;
+	double t_old, t_new;
+	char name[16];
+
+	t_old = now_sec();
+
+	for(r = 0; r < rounds; r++)
+	{
+		st_strkvm kvm;
+		char* dec = uri_decode(buf);
+		int v;
+
+		strkvm_init(&kvm);
+		strkvm_parse(&kvm, dec, strlen(dec), '&');
+
+		/* Typical handler: a few typed reads, some of them repeated */
+		for(k = 0; k < 8; k++)
+		{
+			sprintf(name, "id%d", (k % 4) * 4);
+			if(strkvm_get_int(&kvm, name, &v) == 0) sink += v;
+		}
+
+		strkvm_free(&kvm);
+		free(dec);
+	}
+
+	t_old = now_sec() - t_old;
+	t_new = now_sec();
+
+	for(r = 0; r < rounds; r++)
+	{
+		st_query q;
+		long v;
+
+		query_init(&q);
+		query_parse(&q, buf, len);
+
+		for(k = 0; k < 8; k++)
+		{
+			sprintf(name, "id%d", (k % 4) * 4);
+			if(query_get_int(&q, name, &v) == 0) sink += (int)v;
+		}
+
+		i = query_count(&q, "filter");
+		sink += i;
+		query_free(&q);
+	}
+
+	t_new = now_sec() - t_new;
+
+	printf("size=%-6zu  decode+strkvm=%8.2f us  query_parse=%7.2f us  speedup=%5.1fx  (%d)\n",
+	       len, t_old / rounds * 1e6, t_new / rounds * 1e6, t_old / t_new, sink & 1);
+	free(buf);
+}
+
+
+int main(void)
+{
+	run(1024);
+	run(4096);
+	run(10240);
+	return 0;
+}
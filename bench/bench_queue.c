@@ -0,0 +1,195 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench_queue.c
+ *
+ *    Description:  job queue contention: THPOOL_QUEUE_LIST against THPOOL_QUEUE_RING
+ *                  with 1 to 64 producer threads and 1 to 64 workers, jobs and ring
+ *                  on huge pages with -H, page faults per job, results as JSON
+ *
+ *          Build:  gcc -O2 -Isrc -Iinclude bench/bench_queue.c src/threadpool.c src/trace.c \
+ *                      src/hugemem.c -o bin/bench_queue -lpthread
+ *
+ *          Usage:  bin/bench_queue [-o results.json] [-n jobs] [-m max_threads] [-H]
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "threadpool.h"
+
+#define ROUNDS     3
+
+
+typedef struct bench_queue
+{
+	threadpool pool;
+	uint64_t   jobs;                           /* per producer              */
+	uint64_t   retries;                        /* refused, ring full        */
+	pthread_barrier_t start;
+} bench_queue;
+
+
+static void* job_empty(void* arg, int index)
+{
+	(void)arg;
+	(void)index;
+	return NULL;
+}
+
+
+/* Queue jobs as fast as possible, again when the ring is full */
+static void* producer(void* arg)
+{
+	bench_queue* q = arg;
+	uint64_t i, retries = 0;
+
+	pthread_barrier_wait(&q->start);
+
+	for(i = 0; i < q->jobs; i++)
+	{
+		while(thpool_add_work(q->pool, job_empty, NULL, -1) == THPOOL_SHED)
+		{
+			retries++;
+			sched_yield();
+		}
+	}
+
+	__atomic_add_fetch(&q->retries, retries, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+
+/* Best of ROUNDS, ns per job from the first push until the pool is idle
+ *
+ * faults counts every round, pool start included: what a cold burst pays.
+ */
+static double run_once(int queue, int flags, int producers, int consumers, uint64_t jobs,
+                       uint64_t* retries, uint64_t* faults)
+{
+	thpool_options opt = { queue, 0, flags, 0 };
+	uint64_t minor, major, minor_end, major_end;
+	pthread_t threads[64];
+	bench_queue q;
+	double best = 0, t;
+	uint64_t start;
+	int r, i;
+
+	bench_faults(&minor, &major);
+	q.pool = thpool_init_ex(consumers, &opt);
+	q.jobs = jobs / (uint64_t)producers;
+	*retries = 0;
+
+	for(r = 0; r < ROUNDS; r++)
+	{
+		q.retries = 0;
+		pthread_barrier_init(&q.start, NULL, (unsigned)producers + 1);
+
+		for(i = 0; i < producers; i++)
+		{
+			pthread_create(&threads[i], NULL, producer, &q);
+		}
+
+		pthread_barrier_wait(&q.start);
+		start = bench_now_ns();
+
+		for(i = 0; i < producers; i++)
+		{
+			pthread_join(threads[i], NULL);
+		}
+
+		thpool_wait(q.pool);
+		t = (double)(bench_now_ns() - start) / (double)(q.jobs * (uint64_t)producers);
+		pthread_barrier_destroy(&q.start);
+
+		if(r == 0 || t < best)
+		{
+			best = t;
+			*retries = q.retries;
+		}
+	}
+
+	bench_faults(&minor_end, &major_end);
+	*faults = minor_end - minor + major_end - major;
+
+	thpool_destroy(q.pool);
+	return best;
+}
+
+
+int main(int argc, char** argv)
+{
+	static const int counts[] = { 1, 4, 16, 64 };
+	static const char* names[] = { "list", "ring" };
+	const char* out = NULL;
+	uint64_t jobs = 200000, retries, faults;
+	int max = 64, flags = 0, opt, queue, p, c;
+	bench_json json;
+	char name[48];
+	double ns;
+
+	while((opt = getopt(argc, argv, "o:n:m:H")) != -1)
+	{
+		switch(opt)
+		{
+		case 'o':
+			out = optarg;
+			break;
+		case 'n':
+			jobs = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			max = atoi(optarg);
+			break;
+		case 'H':
+			flags = THPOOL_HUGEPAGES;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o results.json] [-n jobs] [-m max_threads] [-H]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(bench_json_begin(&json, out, "queue") != 0)
+	{
+		return 1;
+	}
+
+	bench_json_int(&json, "jobs", jobs);
+	bench_json_int(&json, "hugepages", flags == THPOOL_HUGEPAGES);
+	bench_json_open(&json, "results", '[');
+
+	for(p = 0; p < 4 && counts[p] <= max; p++)
+	{
+		for(c = 0; c < 4 && counts[c] <= max; c++)
+		{
+			for(queue = THPOOL_QUEUE_LIST; queue <= THPOOL_QUEUE_RING; queue++)
+			{
+				ns = run_once(queue, flags, counts[p], counts[c], jobs, &retries, &faults);
+				snprintf(name, sizeof(name), "%s/p%d/c%d", names[queue], counts[p], counts[c]);
+
+				bench_json_open(&json, NULL, '{');
+				bench_json_str(&json, "name", name);
+				bench_json_int(&json, "producers", (uint64_t)counts[p]);
+				bench_json_int(&json, "consumers", (uint64_t)counts[c]);
+				bench_json_num(&json, "ns_per_job", ns);
+				bench_json_num(&json, "jobs_per_sec", 1e9 / ns);
+				bench_json_int(&json, "retries", retries);
+				bench_json_num(&json, "faults_per_job", (double)faults / (double)(jobs * ROUNDS));
+				bench_json_close(&json, '}');
+			}
+		}
+	}
+
+	bench_json_close(&json, ']');
+	bench_json_end(&json);
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench_router.c
+ *
+ *    Description:  router_match lookups over realistic route tables
+ *
+ *          Build:  gcc -O2 -Isrc bench/bench_router.c src/router.c src/strkvm.c \
+ *                      src/strutils.c src/atom.c -o bin/bench_router -lpthread
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "router.h"
+
+#define LOOKUPS   2000000
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* REST resources, nested resources, static pages and asset wildcards */
+static const char* shapes[] =
+{
+	"/api/v%d/%s",
+	"/api/v%d/%s/:id",
+	"/api/v%d/%s/:id/comments",
+	"/api/v%d/%s/:id/comments/:comment",
+	"/api/v%d/%s/:id/attachments/*file",
+	"/docs/v%d/%s/index.html",
+	"/static/%d/%s/*asset",
+	"/admin/%d/%s/settings",
+};
+
+static const char* requests[] =
+{
+	"/api/v%d/%s",
+	"/api/v%d/%s/12345",
+	"/api/v%d/%s/12345/comments",
+	"/api/v%d/%s/987/comments/42",
+	"/api/v%d/%s/987/attachments/2024/06/report.pdf",
+	"/docs/v%d/%s/index.html",
+	"/static/%d/%s/js/app.min.js",
+	"/admin/%d/%s/settings",
+};
+
+
+static void resource(char* out, size_t size, int n)
+{
+	static const char* words[] = { "users", "orders", "invoices", "products", "carts",
+	                               "reviews", "shipments", "accounts", "teams", "projects" };
+
+	snprintf(out, size, "%s%d", words[n % 10], n / 10);
+}
+
+
+static void run(int nroutes)
+{
+	int nshapes = sizeof(shapes) / sizeof(shapes[0]);
+	int nres = nroutes / nshapes;
+	char (*paths)[128];
+	char pattern[160], name[32];
+	st_router router;
+	st_router_match match;
+	double t;
+	int i, npaths = 1024, found = 0;
+
+	router_init(&router);
+
+	for(i = 0; i < nres * nshapes; i++)
+	{
+		resource(name, sizeof(name), i / nshapes);
+		snprintf(pattern, sizeof(pattern), shapes[i % nshapes], (i / nshapes) % 3 + 1, name);
+		router_add(&router, pattern, (void*)(long)(i + 1));
+	}
+
+	router_compile(&router);
+
+	paths = malloc(sizeof(*paths) * npaths);
+	srand(7);
+
+	for(i = 0; i < npaths; i++)
+	{
+		int r = rand() % nres;
+		resource(name, sizeof(name), r);
+		snprintf(paths[i], sizeof(paths[i]), requests[i % nshapes], r % 3 + 1, name);
+	}
+
+	t = now_sec();
+
+	for(i = 0; i < LOOKUPS; i++)
+	{
+		const char* p = paths[i & (npaths - 1)];
+		found += router_match(&router, p, strlen(p), &match) == 0;
+	}
+
+	t = now_sec() - t;
+
+	printf("routes=%-6d nodes=%-6u lookups=%d found=%d  %6.1f ns/lookup\n",
+	       nres * nshapes, router.nnodes, LOOKUPS, found, t / LOOKUPS * 1e9);
+
+	free(paths);
+	router_free(&router);
+}
+
+
+int main(void)
+{
+	run(100);
+	run(1000);
+	run(10000);
+	return 0;
+}
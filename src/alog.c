@@ -0,0 +1,694 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  alog.c
+ *
+ *    Description:  访问日志 (per-thread rings drained by one flusher thread)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "alog.h"
+
+#define ALOG_MASK            (ALOG_RING_SIZE - 1)
+#define ALOG_BATCH           64                /* iovecs per writev         */
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Ring of one thread: it writes head, the flusher writes tail */
+typedef struct alog_ring
+{
+	struct alog_ring* next;                    /* registry link             */
+	int      dead;                             /* thread exited             */
+
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t lines;
+	time_t   stamp_sec;                        /* cached timestamp          */
+	char     stamp[32];
+
+	uint64_t tail __attribute__((aligned(64)));
+
+	char     data[ALOG_RING_SIZE] __attribute__((aligned(64)));
+} alog_ring;
+
+
+static pthread_mutex_t alog_lock = PTHREAD_MUTEX_INITIALIZER;   /* registry, open/close */
+static pthread_once_t  alog_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   alog_key;
+static pthread_t       alog_thread;
+static alog_ring*      alog_rings;
+static __thread alog_ring* alog_mine;
+
+static int      alog_fd = -1;
+static int      alog_wake_fd = -1;
+static char*    alog_path;
+static volatile int alog_running;
+static volatile int alog_reopen_flag;
+
+static uint64_t alog_dropped;
+static uint64_t alog_bytes;
+static uint64_t alog_writes;
+static uint64_t alog_errors;
+static uint64_t alog_retired_lines;            /* lines of freed rings      */
+
+static const char alog_months[12][4] =
+{
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static void       alog_key_init(void);
+static void       alog_thread_exit(void* ring);
+static alog_ring* alog_ring_get(void);
+static int        alog_push(const char* line, size_t len);
+static void*      alog_flusher(void* arg);
+static void       alog_drain(void);
+static void       alog_writev(struct iovec* iov, int count);
+
+static char*      alog_put(char* p, char* end, const char* s, size_t len);
+static char*      alog_put_quoted(char* p, char* end, const char* s);
+static char*      alog_put_u64(char* p, char* end, uint64_t v);
+static char*      alog_put_2(char* p, unsigned v);
+static char*      alog_put_stamp(alog_ring* ring, char* p, char* end);
+
+
+
+
+/* ============================== API =============================== */
+
+
+/* Open and start the flusher */
+int alog_open(const char* path)
+{
+	if(path == NULL)
+	{
+		return -1;
+	}
+
+	pthread_once(&alog_once, alog_key_init);
+	pthread_mutex_lock(&alog_lock);
+
+	if(alog_running)
+	{
+		pthread_mutex_unlock(&alog_lock);
+		return -1;
+	}
+
+	alog_fd   = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	alog_path = strdup(path);
+
+	if(alog_fd < 0 || alog_wake_fd < 0 || alog_path == NULL)
+	{
+		Log(("alog_open: Could not open %s", path));
+		goto open_fail;
+	}
+
+	__atomic_store_n(&alog_running, 1, __ATOMIC_RELEASE);
+
+	if(pthread_create(&alog_thread, NULL, alog_flusher, NULL) != 0)
+	{
+		Log(("alog_open: Could not create flusher thread"));
+		__atomic_store_n(&alog_running, 0, __ATOMIC_RELEASE);
+		goto open_fail;
+	}
+
+	pthread_mutex_unlock(&alog_lock);
+	return 0;
+
+open_fail:
+	if(alog_fd >= 0) close(alog_fd);
+	free(alog_path);
+	alog_fd = -1;
+	alog_path = NULL;
+	pthread_mutex_unlock(&alog_lock);
+	return -1;
+}
+
+
+/* Flush and stop */
+void alog_close(void)
+{
+	alog_ring** pp;
+	alog_ring*  ring;
+	uint64_t    one = 1;
+
+	pthread_mutex_lock(&alog_lock);
+
+	if(!alog_running)
+	{
+		pthread_mutex_unlock(&alog_lock);
+		return;
+	}
+
+	__atomic_store_n(&alog_running, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&alog_lock);
+
+	if(write(alog_wake_fd, &one, sizeof(one)) < 0)
+	{
+		/* The flusher wakes on its own anyway */
+	}
+
+	pthread_join(alog_thread, NULL);
+
+	/* Rings of exited threads go; live threads keep theirs */
+	pthread_mutex_lock(&alog_lock);
+
+	for(pp = &alog_rings; (ring = *pp) != NULL; )
+	{
+		if(ring->dead)
+		{
+			*pp = ring->next;
+			alog_retired_lines += ring->lines;
+			free(ring);
+		}
+		else
+		{
+			pp = &ring->next;
+		}
+	}
+
+	close(alog_fd);
+	free(alog_path);
+	alog_fd = -1;
+	alog_path = NULL;
+	pthread_mutex_unlock(&alog_lock);
+}
+
+
+/* Reopen on next flush */
+void alog_reopen(void)
+{
+	__atomic_store_n(&alog_reopen_flag, 1, __ATOMIC_RELEASE);
+}
+
+
+/* Access log line */
+int alog_access(const alog_entry* entry)
+{
+	char  line[ALOG_LINE_MAX];
+	char* end = line + sizeof(line) - 1;       /* room for the newline      */
+	char* p   = line;
+	alog_ring* ring;
+
+	if(entry == NULL || (ring = alog_ring_get()) == NULL)
+	{
+		__atomic_add_fetch(&alog_dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	p = alog_put(p, end, entry->remote ? entry->remote : "-", SIZE_MAX);
+	p = alog_put(p, end, " - - ", 5);
+	p = alog_put_stamp(ring, p, end);
+	p = alog_put(p, end, " \"", 2);
+	p = alog_put(p, end, entry->method ? entry->method : "-", SIZE_MAX);
+	p = alog_put(p, end, " ", 1);
+	p = alog_put_quoted(p, end, entry->path);
+	p = alog_put(p, end, " ", 1);
+	p = alog_put(p, end, entry->protocol ? entry->protocol : "-", SIZE_MAX);
+	p = alog_put(p, end, "\" ", 2);
+	p = alog_put_u64(p, end, entry->status > 0 ? (uint64_t)entry->status : 0);
+	p = alog_put(p, end, " ", 1);
+	p = alog_put_u64(p, end, entry->bytes);
+	p = alog_put(p, end, " \"", 2);
+	p = alog_put_quoted(p, end, entry->referer);
+	p = alog_put(p, end, "\" \"", 3);
+	p = alog_put_quoted(p, end, entry->user_agent);
+	p = alog_put(p, end, "\" ", 2);
+	p = alog_put_u64(p, end, entry->duration_us);
+	*p++ = '\n';
+
+	return alog_push(line, (size_t)(p - line));
+}
+
+
+/* Preformatted line */
+int alog_write(const char* line, size_t len)
+{
+	char  buf[ALOG_LINE_MAX];
+	char* p;
+
+	if(line == NULL)
+	{
+		return -1;
+	}
+
+	p = alog_put(buf, buf + sizeof(buf) - 1, line, len);
+	*p++ = '\n';
+
+	return alog_push(buf, (size_t)(p - buf));
+}
+
+
+/* Read totals */
+void alog_get_stats(alog_stats* stats)
+{
+	alog_ring* ring;
+
+	pthread_mutex_lock(&alog_lock);
+	stats->lines = alog_retired_lines;
+
+	for(ring = alog_rings; ring; ring = ring->next)
+	{
+		stats->lines += __atomic_load_n(&ring->lines, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&alog_lock);
+
+	stats->dropped = __atomic_load_n(&alog_dropped, __ATOMIC_RELAXED);
+	stats->bytes   = __atomic_load_n(&alog_bytes, __ATOMIC_RELAXED);
+	stats->writes  = __atomic_load_n(&alog_writes, __ATOMIC_RELAXED);
+	stats->errors  = __atomic_load_n(&alog_errors, __ATOMIC_RELAXED);
+}
+
+
+
+
+/* ============================= RINGS ============================== */
+
+
+/* Thread exit hook and wakeup descriptor, kept for the life of the process
+ * so a thread racing alog_close never writes to a reused descriptor
+ */
+static void alog_key_init(void)
+{
+	pthread_key_create(&alog_key, alog_thread_exit);
+	alog_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+
+/* Thread exited: its ring is freed once drained */
+static void alog_thread_exit(void* arg)
+{
+	alog_ring*  ring = (alog_ring*)arg;
+	alog_ring** pp;
+
+	pthread_mutex_lock(&alog_lock);
+
+	if(alog_running)
+	{
+		ring->dead = 1;
+	}
+	else
+	{
+		for(pp = &alog_rings; *pp != ring; pp = &(*pp)->next);
+
+		*pp = ring->next;
+		alog_retired_lines += ring->lines;
+		free(ring);
+	}
+
+	pthread_mutex_unlock(&alog_lock);
+}
+
+
+/* Ring of the calling thread, made on first use
+ *
+ * @return ring, NULL if the log is closed or on error.
+ */
+static alog_ring* alog_ring_get(void)
+{
+	alog_ring* ring = alog_mine;
+
+	if(!__atomic_load_n(&alog_running, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+
+	if(ring != NULL)
+	{
+		return ring;
+	}
+
+	if(posix_memalign((void**)&ring, 64, sizeof(alog_ring)) != 0)
+	{
+		Log(("alog_ring_get: Could not allocate memory for ring"));
+		return NULL;
+	}
+
+	memset(ring, 0, offsetof(alog_ring, data));
+
+	pthread_mutex_lock(&alog_lock);
+	ring->next = alog_rings;
+	alog_rings = ring;
+	pthread_mutex_unlock(&alog_lock);
+
+	pthread_setspecific(alog_key, ring);
+	alog_mine = ring;
+	return ring;
+}
+
+
+/* Copy a line into the ring, or drop it
+ *
+ * @return 0 on success, -1 if dropped.
+ */
+static int alog_push(const char* line, size_t len)
+{
+	alog_ring* ring = alog_ring_get();
+	uint64_t   head, tail, used, one = 1;
+	size_t     at, first;
+
+	if(ring == NULL)
+	{
+		__atomic_add_fetch(&alog_dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	used = head - tail;
+
+	if(len > ALOG_RING_SIZE - used)
+	{
+		__atomic_add_fetch(&alog_dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	at    = (size_t)(head & ALOG_MASK);
+	first = ALOG_RING_SIZE - at < len ? ALOG_RING_SIZE - at : len;
+	memcpy(ring->data + at, line, first);
+	memcpy(ring->data, line + first, len - first);
+
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->lines, ring->lines + 1, __ATOMIC_RELAXED);
+
+	/* Crossing half full: don't wait for the timer */
+	if(used < ALOG_RING_SIZE / 2 && used + len >= ALOG_RING_SIZE / 2)
+	{
+		if(write(alog_wake_fd, &one, sizeof(one)) < 0)
+		{
+			/* Counter saturated, the flusher is awake already */
+		}
+	}
+
+	return 0;
+}
+
+
+
+
+/* ============================ FLUSHER ============================= */
+
+
+/* Flusher thread */
+static void* alog_flusher(void* arg)
+{
+	struct pollfd pfd;
+	uint64_t n;
+
+	(void)arg;
+
+	pfd.fd     = alog_wake_fd;
+	pfd.events = POLLIN;
+
+	while(__atomic_load_n(&alog_running, __ATOMIC_ACQUIRE))
+	{
+		if(poll(&pfd, 1, ALOG_FLUSH_MS) > 0 && read(alog_wake_fd, &n, sizeof(n)) < 0)
+		{
+			/* Nothing to clear */
+		}
+
+		alog_drain();
+	}
+
+	/* Lines pushed before alog_running dropped */
+	alog_drain();
+	return NULL;
+}
+
+
+/* Write out every ring */
+static void alog_drain(void)
+{
+	struct iovec iov[ALOG_BATCH];
+	alog_ring*   rings[ALOG_BATCH];
+	uint64_t     heads[ALOG_BATCH];
+	alog_ring**  pp;
+	alog_ring*   ring;
+	uint64_t     head, tail;
+	size_t       at, len;
+	int          count = 0, nrings = 0, i, fd;
+
+	if(__atomic_exchange_n(&alog_reopen_flag, 0, __ATOMIC_ACQ_REL) &&
+	   (fd = open(alog_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) >= 0)
+	{
+		dup2(fd, alog_fd);
+		close(fd);
+	}
+
+	pthread_mutex_lock(&alog_lock);
+
+	for(ring = alog_rings; ; ring = ring->next)
+	{
+		/* Batch full or last ring: write, then give the space back */
+		if(ring == NULL || count > ALOG_BATCH - 2)
+		{
+			alog_writev(iov, count);
+
+			for(i = 0; i < nrings; i++)
+			{
+				__atomic_store_n(&rings[i]->tail, heads[i], __ATOMIC_RELEASE);
+			}
+
+			count = nrings = 0;
+		}
+
+		if(ring == NULL)
+		{
+			break;
+		}
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		tail = ring->tail;
+
+		if(head == tail)
+		{
+			continue;
+		}
+
+		/* At most two pieces, where the ring wraps */
+		at  = (size_t)(tail & ALOG_MASK);
+		len = (size_t)(head - tail);
+
+		iov[count].iov_base = ring->data + at;
+		iov[count].iov_len  = ALOG_RING_SIZE - at < len ? ALOG_RING_SIZE - at : len;
+		count++;
+
+		if(iov[count - 1].iov_len < len)
+		{
+			iov[count].iov_base = ring->data;
+			iov[count].iov_len  = len - iov[count - 1].iov_len;
+			count++;
+		}
+
+		rings[nrings]   = ring;
+		heads[nrings++] = head;
+	}
+
+	/* Drained rings of exited threads */
+	for(pp = &alog_rings; (ring = *pp) != NULL; )
+	{
+		if(ring->dead && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		{
+			*pp = ring->next;
+			alog_retired_lines += ring->lines;
+			free(ring);
+		}
+		else
+		{
+			pp = &ring->next;
+		}
+	}
+
+	pthread_mutex_unlock(&alog_lock);
+}
+
+
+/* writev all of it, lines are lost on error rather than blocking threads */
+static void alog_writev(struct iovec* iov, int count)
+{
+	ssize_t n;
+
+	while(count > 0)
+	{
+		n = writev(alog_fd, iov, count);
+
+		if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		__atomic_add_fetch(&alog_writes, 1, __ATOMIC_RELAXED);
+
+		if(n < 0)
+		{
+			__atomic_add_fetch(&alog_errors, 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		__atomic_add_fetch(&alog_bytes, (uint64_t)n, __ATOMIC_RELAXED);
+
+		while(count > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if(count > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+}
+
+
+
+
+/* ========================== FORMATTING ============================ */
+
+
+/* Append at most len bytes of s, up to its NUL */
+static char* alog_put(char* p, char* end, const char* s, size_t len)
+{
+	while(len-- > 0 && *s && p < end)
+	{
+		*p++ = *s++;
+	}
+
+	return p;
+}
+
+
+/* Append s escaped for a quoted field, "-" if NULL or empty */
+static char* alog_put_quoted(char* p, char* end, const char* s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned char c;
+
+	if(s == NULL || *s == 0)
+	{
+		return alog_put(p, end, "-", 1);
+	}
+
+	for(; *s && p < end; s++)
+	{
+		c = (unsigned char)*s;
+
+		if(c == '"' || c == '\\' || c < 0x20 || c >= 0x7f)
+		{
+			if(end - p < 4)
+			{
+				break;
+			}
+
+			*p++ = '\\';
+			*p++ = 'x';
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 15];
+		}
+		else
+		{
+			*p++ = (char)c;
+		}
+	}
+
+	return p;
+}
+
+
+/* Append a decimal number */
+static char* alog_put_u64(char* p, char* end, uint64_t v)
+{
+	char   digits[20];
+	size_t n = 0;
+
+	do
+	{
+		digits[n++] = (char)('0' + v % 10);
+		v /= 10;
+	}
+	while(v);
+
+	while(n > 0 && p < end)
+	{
+		*p++ = digits[--n];
+	}
+
+	return p;
+}
+
+
+/* Append two digits */
+static char* alog_put_2(char* p, unsigned v)
+{
+	*p++ = (char)('0' + v / 10 % 10);
+	*p++ = (char)('0' + v % 10);
+	return p;
+}
+
+
+/* Append [19/Oct/2026:08:01:02 +0000], rebuilt once per second per thread */
+static char* alog_put_stamp(alog_ring* ring, char* p, char* end)
+{
+	struct timespec ts;
+	struct tm tm;
+	char* s;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	if(ts.tv_sec != ring->stamp_sec || ring->stamp[0] == 0)
+	{
+		gmtime_r(&ts.tv_sec, &tm);
+
+		s = ring->stamp;
+		*s++ = '[';
+		s = alog_put_2(s, (unsigned)tm.tm_mday);
+		*s++ = '/';
+		memcpy(s, alog_months[tm.tm_mon], 3);
+		s += 3;
+		*s++ = '/';
+		s = alog_put_2(s, (unsigned)(tm.tm_year + 1900) / 100);
+		s = alog_put_2(s, (unsigned)(tm.tm_year + 1900) % 100);
+		*s++ = ':';
+		s = alog_put_2(s, (unsigned)tm.tm_hour);
+		*s++ = ':';
+		s = alog_put_2(s, (unsigned)tm.tm_min);
+		*s++ = ':';
+		s = alog_put_2(s, (unsigned)tm.tm_sec);
+		memcpy(s, " +0000]", 8);
+
+		ring->stamp_sec = ts.tv_sec;
+	}
+
+	return alog_put(p, end, ring->stamp, sizeof(ring->stamp));
+}
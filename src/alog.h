@@ -0,0 +1,125 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  alog.h
+ *
+ *    Description:  访问日志 (per-thread rings drained by one flusher thread)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef ALOG_H_
+#define ALOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Bytes of the ring of each logging thread, a power of two */
+#define ALOG_RING_SIZE       (256 * 1024)
+
+/* Longest line, longer fields are cut */
+#define ALOG_LINE_MAX        4096
+
+/* The flusher runs at least this often, and when a ring is half full */
+#define ALOG_FLUSH_MS        50
+
+
+/* Fields of one access log line, strings may be NULL */
+typedef struct alog_entry
+{
+	const char* remote;                        /* client address            */
+	const char* method;
+	const char* path;
+	const char* protocol;                      /* "HTTP/1.1", "HTTP/2"..    */
+	int         status;
+	uint64_t    bytes;                         /* body bytes sent           */
+	const char* referer;
+	const char* user_agent;
+	uint64_t    duration_us;
+} alog_entry;
+
+
+/* Totals since alog_open */
+typedef struct alog_stats
+{
+	uint64_t lines;                            /* accepted into rings       */
+	uint64_t dropped;                          /* rings were full           */
+	uint64_t bytes;                            /* written to the file       */
+	uint64_t writes;                           /* writev calls              */
+	uint64_t errors;                           /* failed writes             */
+} alog_stats;
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Open the access log and start the flusher thread
+ *
+ * @param  path      file, opened for appending
+ * @return 0 on success, -1 otherwise.
+ */
+int alog_open(const char* path);
+
+
+/**
+ * @brief Write out what is left and stop the flusher thread
+ *
+ * Lines logged afterwards are dropped.
+ *
+ * @return nothing
+ */
+void alog_close(void);
+
+
+/**
+ * @brief Reopen the file on the next flush, after it was rotated
+ *
+ * Safe to call from a signal handler.
+ *
+ * @return nothing
+ */
+void alog_reopen(void);
+
+
+/**
+ * @brief Log a request in combined log format, plus the duration
+ *
+ *    remote - - [19/Oct/2026:08:01:02 +0000] "GET /x HTTP/1.1" 200 512 "ref" "agent" 93
+ *
+ * Formatted without stdio into the ring of the calling thread. Never
+ * blocks: when the ring is full the line is dropped and counted.
+ *
+ * @param  entry     fields of the line
+ * @return 0 on success, -1 if the line was dropped
+ */
+int alog_access(const alog_entry* entry);
+
+
+/**
+ * @brief Log a preformatted line
+ *
+ * @param  line      text, a newline is added
+ * @param  len       length of line
+ * @return 0 on success, -1 if the line was dropped
+ */
+int alog_write(const char* line, size_t len);
+
+
+/**
+ * @brief Read the totals
+ *
+ * @param  stats     receives the totals
+ * @return nothing
+ */
+void alog_get_stats(alog_stats* stats);
+
+#endif /* ALOG_H_ */
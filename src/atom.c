@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "atom.h"
+
+//! Interned name
+typedef struct {
+  const char *name;                   //!< NUL terminated copy
+  uint32_t len;                       //!< Length of name
+  uint32_t hash;                      //!< Hash of name
+} st_atom;
+
+/* Entries are written before their slot is published and never change
+ * after, so readers need no lock: an acquire load of the slot is enough. */
+static st_atom atom_table[ATOM_MAX + 1];
+static uint32_t atom_slots[ATOM_SLOTS];
+static uint32_t atom_count;
+
+static pthread_mutex_t atom_lock = PTHREAD_MUTEX_INITIALIZER;  //!< Writers
+static pthread_once_t atom_once = PTHREAD_ONCE_INIT;
+
+//! Names interned at start
+static const char *const atom_seed_names[] = {
+  /* HTTP/2 pseudo headers and the HPACK static table */
+  ":authority", ":method", ":path", ":scheme", ":status",
+  "accept-charset", "accept-encoding", "accept-language", "accept-ranges", "accept",
+  "access-control-allow-origin", "age", "allow", "authorization", "cache-control",
+  "content-disposition", "content-encoding", "content-language", "content-length",
+  "content-location", "content-range", "content-type", "cookie", "date", "etag",
+  "expect", "expires", "from", "host", "if-match", "if-modified-since", "if-none-match",
+  "if-range", "if-unmodified-since", "last-modified", "link", "location", "max-forwards",
+  "proxy-authenticate", "proxy-authorization", "range", "referer", "refresh",
+  "retry-after", "server", "set-cookie", "strict-transport-security",
+  "transfer-encoding", "user-agent", "vary", "via", "www-authenticate",
+  /* other frequent header names */
+  "connection", "keep-alive", "upgrade", "te", "origin", "x-forwarded-for",
+  "x-forwarded-proto", "x-real-ip", "x-request-id", "http2-settings",
+  /* HTTP/1 spelling of the most frequent ones */
+  "Host", "User-Agent", "Accept", "Accept-Encoding", "Accept-Language", "Connection",
+  "Content-Type", "Content-Length", "Cookie", "Authorization", "Referer",
+  "Transfer-Encoding", "Cache-Control", "If-None-Match", "If-Modified-Since", "Origin",
+  /* form, query and config keys */
+  "id", "name", "type", "page", "limit", "offset", "sort", "q", "user", "token"
+};
+
+/*****************************************************************************/
+/* Prototypes of Static Functions
+*/
+/*****************************************************************************/
+
+/**
+ * \brief	Hash of a name (FNV-1a).
+ * \param	name		Name
+ * \param	len			Length of name
+ * \return	Hash value.
+ */
+static uint32_t atom_hash(const char *name, size_t len);
+
+/**
+ * \brief	Probe the table.
+ * \param	name		Name
+ * \param	len			Length of name
+ * \param	hash		Hash of name
+ * \param	slot		Receives the first free slot when not found, may be NULL
+ * \return	Atom id, 0 if not found.
+ */
+static uint32_t atom_probe(const char *name, size_t len, uint32_t hash, uint32_t *slot);
+
+/**
+ * \brief	Add a name, writer lock held or during seeding.
+ * \param	name		Name
+ * \param	len			Length of name
+ * \return	Atom id, 0 on error.
+ */
+static uint32_t atom_add(const char *name, size_t len);
+
+/**
+ * \brief	Intern the seed names, run once.
+ */
+static void atom_seed(void);
+
+/*****************************************************************************/
+/* Functions to atom
+*/
+/*****************************************************************************/
+
+uint32_t atom_find(const char *name, size_t len)
+{
+  if (name == NULL || len == 0 || len > ATOM_NAME_MAX)
+    return 0;
+
+  pthread_once(&atom_once, atom_seed);
+  return atom_probe(name, len, atom_hash(name, len), NULL);
+}
+/*****************************************************************************/
+
+uint32_t atom_intern(const char *name, size_t len)
+{
+  uint32_t atom;
+
+  if (name == NULL || len == 0 || len > ATOM_NAME_MAX)
+    return 0;
+
+  pthread_once(&atom_once, atom_seed);
+
+  if ((atom = atom_probe(name, len, atom_hash(name, len), NULL)) != 0)
+    return atom;
+
+  pthread_mutex_lock(&atom_lock);
+  atom = atom_add(name, len);
+  pthread_mutex_unlock(&atom_lock);
+  return atom;
+}
+/*****************************************************************************/
+
+const char *atom_name(uint32_t atom)
+{
+  if (atom == 0 || atom > __atomic_load_n(&atom_count, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  return atom_table[atom].name;
+}
+/*****************************************************************************/
+
+size_t atom_len(uint32_t atom)
+{
+  if (atom == 0 || atom > __atomic_load_n(&atom_count, __ATOMIC_ACQUIRE))
+    return 0;
+
+  return atom_table[atom].len;
+}
+
+/*****************************************************************************/
+/* Static Functions
+*/
+/*****************************************************************************/
+
+static uint32_t atom_hash(const char *name, size_t len)
+{
+  uint32_t h = 2166136261u;
+
+  while (len--)
+    h = (h ^ (uint8_t)*name++) * 16777619u;
+
+  return h;
+}
+/*****************************************************************************/
+
+static uint32_t atom_probe(const char *name, size_t len, uint32_t hash, uint32_t *slot)
+{
+  const st_atom *a;
+  uint32_t h, id;
+
+  for (h = hash & (ATOM_SLOTS - 1);; h = (h + 1) & (ATOM_SLOTS - 1)) {
+    id = __atomic_load_n(&atom_slots[h], __ATOMIC_ACQUIRE);
+    if (id == 0)
+      break;
+
+    a = &atom_table[id];
+    if (a->hash == hash && a->len == len && memcmp(a->name, name, len) == 0)
+      return id;
+  }
+
+  if (slot)
+    *slot = h;
+  return 0;
+}
+/*****************************************************************************/
+
+static uint32_t atom_add(const char *name, size_t len)
+{
+  uint32_t hash = atom_hash(name, len), slot, id;
+  char *copy;
+
+  /* Another writer may have added it meanwhile */
+  if ((id = atom_probe(name, len, hash, &slot)) != 0)
+    return id;
+
+  if (atom_count >= ATOM_MAX)
+    return 0;
+
+  copy = strndup(name, len);
+  if (copy == NULL)
+    return 0;
+
+  id = atom_count + 1;
+  atom_table[id].name = copy;
+  atom_table[id].len = (uint32_t)len;
+  atom_table[id].hash = hash;
+
+  __atomic_store_n(&atom_count, id, __ATOMIC_RELEASE);
+  __atomic_store_n(&atom_slots[slot], id, __ATOMIC_RELEASE);
+  return id;
+}
+/*****************************************************************************/
+
+static void atom_seed(void)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(atom_seed_names) / sizeof(atom_seed_names[0]); i++)
+    atom_add(atom_seed_names[i], strlen(atom_seed_names[i]));
+}
+/*****************************************************************************/
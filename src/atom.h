@@ -0,0 +1,58 @@
+#ifndef __ATOM_H_INCLUDED__
+#define __ATOM_H_INCLUDED__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+//! Most atoms, ids are 1..ATOM_MAX
+#define ATOM_MAX 4096
+
+//! Slots of the hash table, a power of two at least twice ATOM_MAX
+#define ATOM_SLOTS 8192
+
+//! Longest name that is interned
+#define ATOM_NAME_MAX 64
+
+/**
+ * \brief	Find the atom of a name.
+ *
+ * Lock free, allocates nothing: any thread may call it while another
+ * interns. The table starts with the well-known HTTP header names
+ * (lower case, as HTTP/2 sends them) and common form and config keys.
+ * Names are compared case sensitively: HTTP/1 field names must be folded
+ * first, as strkvm_add_header does.
+ *
+ * \param	name		Name, not necessarily NUL terminated
+ * \param	len			Length of name
+ * \return	Atom id, 0 if the name is not interned.
+ */
+uint32_t atom_find(const char* name, size_t len);
+
+/**
+ * \brief	Intern a name.
+ *
+ * Atoms are never removed and the table never grows, so only names that
+ * are known to repeat should be interned, not names taken from requests.
+ *
+ * \param	name		Name, not necessarily NUL terminated
+ * \param	len			Length of name
+ * \return	Atom id, 0 if the table is full or the name too long.
+ */
+uint32_t atom_intern(const char* name, size_t len);
+
+/**
+ * \brief	Name of an atom.
+ * \param	atom		Atom id
+ * \return	NUL terminated name, valid until exit. NULL for a bad id.
+ */
+const char* atom_name(uint32_t atom);
+
+/**
+ * \brief	Length of the name of an atom.
+ * \param	atom		Atom id
+ * \return	Length, 0 for a bad id.
+ */
+size_t atom_len(uint32_t atom);
+
+#endif /* __ATOM_H_INCLUDED__ */
@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <strings.h>
+
+#include "bodyparser.h"
+
+//! Chunked decoder states
+enum {
+  CHUNKED_SIZE,
+  CHUNKED_EXT,
+  CHUNKED_SIZE_LF,
+  CHUNKED_DATA,
+  CHUNKED_DATA_CR,
+  CHUNKED_DATA_LF,
+  CHUNKED_TRAILER,
+  CHUNKED_DONE,
+  CHUNKED_ERROR
+};
+
+//! Multipart parser states
+enum {
+  MULTIPART_PREAMBLE,
+  MULTIPART_AFTER_BOUNDARY,
+  MULTIPART_AFTER_BOUNDARY_LF,
+  MULTIPART_FINAL_DASH,
+  MULTIPART_HEADERS,
+  MULTIPART_BODY,
+  MULTIPART_DONE,
+  MULTIPART_ERROR
+};
+
+//! Longest chunk size line, in hex digits
+#define CHUNKED_DIGITS_MAX   15
+//! Most trailer bytes skipped after the last chunk
+#define CHUNKED_TRAILER_MAX  8192
+
+/*****************************************************************************/
+/* Prototypes of Static Functions
+*/
+/*****************************************************************************/
+
+/**
+ * \brief	Look for the delimiter, passing the bytes before it to a sink.
+ * \param	multipart	Struct multipart
+ * \param	data			Bytes received
+ * \param	len				Count of bytes
+ * \param	pos				Position in data, updated
+ * \param	sink			Receives bytes that are not part of the delimiter, may be NULL
+ * \return	1 if delimiter found, 0 if data ran out, -1 if sink failed.
+ */
+static int multipart_scan(st_multipart* multipart, const char* data, size_t len,
+                          size_t* pos, body_sink_fn sink);
+
+/**
+ * \brief	Split the header block of a part into views.
+ * \param	multipart	Struct multipart
+ * \return	0 if Ok. Otherwise error code.
+ */
+static int multipart_parse_head(st_multipart* multipart);
+
+/*****************************************************************************/
+/* Functions to chunked bodies
+*/
+/*****************************************************************************/
+
+int chunked_init(st_chunked *chunked)
+{
+  if (chunked == NULL)
+    return -1;
+
+  memset(chunked, 0, sizeof(st_chunked));
+  chunked->state = CHUNKED_SIZE;
+  return 0;
+}
+/*****************************************************************************/
+
+ssize_t chunked_feed(st_chunked *chunked, const char *data, size_t len, body_sink_fn sink, void *arg)
+{
+  size_t i = 0, n;
+  char c;
+  int d;
+
+  if (chunked == NULL || (data == NULL && len > 0))
+    return -1;
+
+  while (i < len && chunked->state != CHUNKED_DONE) {
+    if (chunked->state == CHUNKED_DATA) {
+      n = len - i;
+      if (n > chunked->remaining)
+        n = (size_t)chunked->remaining;
+
+      if (sink != NULL && sink(arg, data + i, n) != 0)
+        goto feed_error;
+
+      i += n;
+      chunked->remaining -= n;
+      if (chunked->remaining == 0)
+        chunked->state = CHUNKED_DATA_CR;
+      continue;
+    }
+
+    c = data[i++];
+
+    switch (chunked->state) {
+    case CHUNKED_SIZE:
+      if (c >= '0' && c <= '9')
+        d = c - '0';
+      else if (c >= 'a' && c <= 'f')
+        d = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        d = c - 'A' + 10;
+      else
+        d = -1;
+
+      if (d >= 0) {
+        if (++chunked->digits > CHUNKED_DIGITS_MAX)
+          goto feed_error;
+        chunked->remaining = chunked->remaining * 16 + (uint64_t)d;
+      } else if (chunked->digits == 0) {
+        goto feed_error;
+      } else if (c == '\r') {
+        chunked->state = CHUNKED_SIZE_LF;
+      } else if (c == ';' || c == ' ' || c == '\t') {
+        chunked->state = CHUNKED_EXT;
+      } else {
+        goto feed_error;
+      }
+      break;
+
+    case CHUNKED_EXT:
+      if (c == '\r')
+        chunked->state = CHUNKED_SIZE_LF;
+      break;
+
+    case CHUNKED_SIZE_LF:
+      if (c != '\n')
+        goto feed_error;
+      chunked->state = chunked->remaining ? CHUNKED_DATA : CHUNKED_TRAILER;
+      chunked->line = 0;
+      break;
+
+    case CHUNKED_DATA_CR:
+      if (c != '\r')
+        goto feed_error;
+      chunked->state = CHUNKED_DATA_LF;
+      break;
+
+    case CHUNKED_DATA_LF:
+      if (c != '\n')
+        goto feed_error;
+      chunked->state = CHUNKED_SIZE;
+      chunked->digits = 0;
+      break;
+
+    case CHUNKED_TRAILER:
+      if (++chunked->trailer > CHUNKED_TRAILER_MAX)
+        goto feed_error;
+      if (c == '\n') {
+        if (chunked->line == 0)
+          chunked->state = CHUNKED_DONE;
+        chunked->line = 0;
+      } else if (c != '\r') {
+        chunked->line++;
+      }
+      break;
+
+    default:
+      goto feed_error;
+    }
+  }
+
+  return (ssize_t)i;
+
+feed_error:
+  chunked->state = CHUNKED_ERROR;
+  return -1;
+}
+/*****************************************************************************/
+
+bool chunked_done(const st_chunked *chunked)
+{
+  return chunked != NULL && chunked->state == CHUNKED_DONE;
+}
+
+/*****************************************************************************/
+/* Functions to multipart bodies
+*/
+/*****************************************************************************/
+
+int multipart_boundary(const char *content_type, const char **boundary, size_t *len)
+{
+  size_t n;
+
+  if (content_type == NULL || boundary == NULL || len == NULL)
+    return -1;
+
+  if (strncasecmp(content_type, "multipart/", 10) != 0)
+    return -1;
+
+  n = strlen(content_type);
+  if (multipart_header_param(content_type, n, "boundary", boundary, len) != 0)
+    return -1;
+
+  if (*len == 0 || *len > MULTIPART_BOUNDARY_MAX)
+    return -1;
+
+  return 0;
+}
+/*****************************************************************************/
+
+int multipart_header_param(const char *value, size_t value_len, const char *param,
+                           const char **out, size_t *out_len)
+{
+  const char *p = value, *end = value + value_len, *v;
+  size_t plen;
+
+  if (value == NULL || param == NULL || out == NULL || out_len == NULL)
+    return -1;
+
+  plen = strlen(param);
+
+  while ((p = memchr(p, ';', (size_t)(end - p))) != NULL) {
+    p++;
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+
+    if ((size_t)(end - p) <= plen || strncasecmp(p, param, plen) != 0 || p[plen] != '=')
+      continue;
+
+    v = p + plen + 1;
+    if (v < end && *v == '"') {
+      for (p = ++v; p < end && *p != '"'; p++)
+        ;
+    } else {
+      for (p = v; p < end && *p != ';' && *p != ' ' && *p != '\t'; p++)
+        ;
+    }
+
+    *out = v;
+    *out_len = (size_t)(p - v);
+    return 0;
+  }
+  return -1;
+}
+/*****************************************************************************/
+
+int multipart_init(st_multipart *multipart, const char *boundary, size_t len,
+                   int (*on_part)(void *arg, const st_body_header *headers, size_t count),
+                   body_sink_fn on_data, int (*on_part_end)(void *arg), void *arg)
+{
+  if (multipart == NULL || boundary == NULL || len == 0 || len > MULTIPART_BOUNDARY_MAX)
+    return -1;
+
+  memset(multipart, 0, sizeof(st_multipart));
+  memcpy(multipart->delim, "\r\n--", 4);
+  memcpy(multipart->delim + 4, boundary, len);
+  multipart->delim_len = len + 4;
+
+  /* The first boundary may open the body, without a CRLF before it */
+  multipart->match = 2;
+  multipart->state = MULTIPART_PREAMBLE;
+  multipart->on_part = on_part;
+  multipart->on_data = on_data;
+  multipart->on_part_end = on_part_end;
+  multipart->arg = arg;
+  return 0;
+}
+/*****************************************************************************/
+
+ssize_t multipart_feed(st_multipart *multipart, const char *data, size_t len)
+{
+  size_t i = 0;
+  int found;
+  char c;
+
+  if (multipart == NULL || (data == NULL && len > 0))
+    return -1;
+
+  while (i < len) {
+    switch (multipart->state) {
+    case MULTIPART_PREAMBLE:
+      found = multipart_scan(multipart, data, len, &i, NULL);
+      if (found > 0)
+        multipart->state = MULTIPART_AFTER_BOUNDARY;
+      break;
+
+    case MULTIPART_BODY:
+      found = multipart_scan(multipart, data, len, &i, multipart->on_data);
+      if (found < 0)
+        goto feed_error;
+      if (found > 0) {
+        if (multipart->on_part_end != NULL && multipart->on_part_end(multipart->arg) != 0)
+          goto feed_error;
+        multipart->state = MULTIPART_AFTER_BOUNDARY;
+      }
+      break;
+
+    case MULTIPART_AFTER_BOUNDARY:
+      c = data[i++];
+      if (c == '-')
+        multipart->state = MULTIPART_FINAL_DASH;
+      else if (c == '\r')
+        multipart->state = MULTIPART_AFTER_BOUNDARY_LF;
+      else if (c != ' ' && c != '\t')
+        goto feed_error;
+      break;
+
+    case MULTIPART_AFTER_BOUNDARY_LF:
+      if (data[i++] != '\n')
+        goto feed_error;
+      multipart->state = MULTIPART_HEADERS;
+      multipart->head_len = 0;
+      break;
+
+    case MULTIPART_FINAL_DASH:
+      if (data[i++] != '-')
+        goto feed_error;
+      multipart->state = MULTIPART_DONE;
+      break;
+
+    case MULTIPART_HEADERS:
+      if (multipart->head_len == MULTIPART_HEAD_MAX)
+        goto feed_error;
+
+      multipart->head[multipart->head_len++] = data[i++];
+
+      /* Blank line ends the block; a part may have no headers at all */
+      if ((multipart->head_len == 2 && memcmp(multipart->head, "\r\n", 2) == 0) ||
+          (multipart->head_len >= 4 &&
+           memcmp(multipart->head + multipart->head_len - 4, "\r\n\r\n", 4) == 0)) {
+        if (multipart_parse_head(multipart) != 0)
+          goto feed_error;
+        if (multipart->on_part != NULL &&
+            multipart->on_part(multipart->arg, multipart->headers, multipart->header_count) != 0)
+          goto feed_error;
+        multipart->state = MULTIPART_BODY;
+        multipart->match = 0;
+      }
+      break;
+
+    case MULTIPART_DONE:
+      /* Epilogue is ignored */
+      return (ssize_t)len;
+
+    default:
+      goto feed_error;
+    }
+  }
+
+  return (ssize_t)i;
+
+feed_error:
+  multipart->state = MULTIPART_ERROR;
+  return -1;
+}
+/*****************************************************************************/
+
+int multipart_sink(void *multipart, const char *data, size_t len)
+{
+  return multipart_feed((st_multipart *)multipart, data, len) < 0 ? -1 : 0;
+}
+/*****************************************************************************/
+
+bool multipart_done(const st_multipart *multipart)
+{
+  return multipart != NULL && multipart->state == MULTIPART_DONE;
+}
+/*****************************************************************************/
+
+int body_sink_fd(void *fd, const char *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(*(int *)fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/*****************************************************************************/
+/* Static Functions
+*/
+/*****************************************************************************/
+
+static int multipart_scan(st_multipart *multipart, const char *data, size_t len,
+                          size_t *pos, body_sink_fn sink)
+{
+  const char *cr;
+  size_t i = *pos;
+
+#define emit(p, n) \
+  do { \
+    if (sink != NULL && (n) > 0 && sink(multipart->arg, (p), (n)) != 0) { \
+      *pos = i; \
+      return -1; \
+    } \
+  } while (0)
+
+  while (i < len) {
+    if (multipart->match == 0) {
+      /* Fast path: nothing can match before the next CR */
+      cr = memchr(data + i, '\r', len - i);
+      if (cr == NULL) {
+        emit(data + i, len - i);
+        i = len;
+        break;
+      }
+      emit(data + i, (size_t)(cr - (data + i)));
+      i = (size_t)(cr - data) + 1;
+      multipart->match = 1;
+      continue;
+    }
+
+    if (data[i] == multipart->delim[multipart->match]) {
+      i++;
+      if (++multipart->match == multipart->delim_len) {
+        multipart->match = 0;
+        *pos = i;
+        return 1;
+      }
+      continue;
+    }
+
+    /* Mismatch: what matched was data after all. CR only starts the
+     * delimiter, so the current byte is simply looked at again. */
+    emit(multipart->delim, multipart->match);
+    multipart->match = 0;
+  }
+
+#undef emit
+
+  *pos = i;
+  return 0;
+}
+/*****************************************************************************/
+
+static int multipart_parse_head(st_multipart *multipart)
+{
+  char *p = multipart->head, *end = multipart->head + multipart->head_len - 2;
+  char *eol, *colon, *v, *ve;
+  st_body_header *h;
+
+  multipart->header_count = 0;
+
+  while (p < end) {
+    eol = memchr(p, '\r', (size_t)(end - p));
+    if (eol == NULL)
+      eol = end;
+
+    colon = memchr(p, ':', (size_t)(eol - p));
+    if (colon == NULL || colon == p || multipart->header_count == MULTIPART_HEADERS_MAX)
+      return -1;
+
+    for (v = colon + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+      ;
+    for (ve = eol; ve > v && (ve[-1] == ' ' || ve[-1] == '\t'); ve--)
+      ;
+
+    h = &multipart->headers[multipart->header_count++];
+    h->name = p;
+    h->name_len = (size_t)(colon - p);
+    h->value = v;
+    h->value_len = (size_t)(ve - v);
+
+    p = eol + 2;
+  }
+  return 0;
+}
+/*****************************************************************************/
@@ -0,0 +1,161 @@
+#ifndef __BODYPARSER_H_INCLUDED__
+#define __BODYPARSER_H_INCLUDED__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//! Longest part header block kept for one multipart part
+#define MULTIPART_HEAD_MAX      4096
+//! Most headers of one multipart part
+#define MULTIPART_HEADERS_MAX   16
+//! Longest boundary allowed by RFC 2046
+#define MULTIPART_BOUNDARY_MAX  70
+
+/**
+ * \brief	Receives body bytes as they are decoded.
+ * \param	arg			Argument given with the sink
+ * \param	data		Decoded bytes, valid only during the call
+ * \param	len			Count of bytes
+ * \return	0 to go on, -1 to abort parsing.
+ */
+typedef int (*body_sink_fn)(void* arg, const char* data, size_t len);
+
+//! Header view, slices of the parser buffer
+typedef struct {
+	const char* name;							//!< Name, not NUL terminated
+	size_t name_len;							//!< Length of name
+	const char* value;						//!< Value, not NUL terminated
+	size_t value_len;							//!< Length of value
+} st_body_header;
+
+//! Incremental Transfer-Encoding: chunked decoder
+typedef struct {
+	int state;										//!< Parser state
+	uint64_t remaining;						//!< Bytes left in current chunk
+	uint32_t digits;							//!< Digits of current chunk size
+	uint32_t line;								//!< Length of current trailer line
+	uint32_t trailer;							//!< Bytes of trailers so far
+} st_chunked;
+
+//! Incremental multipart/form-data parser
+typedef struct {
+	int state;										//!< Parser state
+	char delim[MULTIPART_BOUNDARY_MAX + 4];	//!< "\r\n--" and boundary
+	size_t delim_len;							//!< Length of delim
+	size_t match;									//!< Bytes of delim matched so far
+	char head[MULTIPART_HEAD_MAX];	//!< Headers of current part
+	size_t head_len;							//!< Bytes in head
+	st_body_header headers[MULTIPART_HEADERS_MAX];	//!< Views into head
+	size_t header_count;					//!< Total of headers
+	int (*on_part)(void* arg, const st_body_header* headers, size_t count);	//!< Part begins
+	body_sink_fn on_data;					//!< Part body bytes
+	int (*on_part_end)(void* arg);	//!< Part ends
+	void* arg;										//!< Argument of callbacks
+} st_multipart;
+
+/**
+ * \brief	Initialize chunked decoder.
+ * \param	chunked	Struct that will be initialized.
+ * \return	0 if Ok or -1 if param is null.
+ */
+int chunked_init(st_chunked* chunked);
+
+/**
+ * \brief	Decode the next bytes of a chunked body.
+ *
+ * Can be fed any split of the input. Chunk data goes to sink without
+ * copies; sizes, extensions and trailers are skipped.
+ *
+ * \param	chunked	Struct chunked
+ * \param	data		Bytes received
+ * \param	len			Count of bytes
+ * \param	sink		Receives chunk data
+ * \param	arg			Argument of sink
+ * \return	Bytes consumed (less than len once the body ended), -1 on error.
+ */
+ssize_t chunked_feed(st_chunked* chunked, const char* data, size_t len, body_sink_fn sink, void* arg);
+
+/**
+ * \brief	Tell if the last chunk and trailers were read.
+ * \param	chunked	Struct chunked
+ * \return	true if body is complete.
+ */
+bool chunked_done(const st_chunked* chunked);
+
+/**
+ * \brief	Get the boundary of a multipart Content-Type.
+ * \param	content_type	Value of Content-Type header, NUL terminated
+ * \param	boundary			Start of boundary in content_type
+ * \param	len						Length of boundary
+ * \return	0 if Ok. Otherwise error code.
+ */
+int multipart_boundary(const char* content_type, const char** boundary, size_t* len);
+
+/**
+ * \brief	Get a parameter of a header value, e.g. name of Content-Disposition.
+ * \param	value		Header value
+ * \param	value_len	Length of value
+ * \param	param		Parameter name, NUL terminated
+ * \param	out			Start of parameter value in value, quotes removed
+ * \param	out_len	Length of parameter value
+ * \return	0 if Ok. Otherwise error code.
+ */
+int multipart_header_param(const char* value, size_t value_len, const char* param,
+                           const char** out, size_t* out_len);
+
+/**
+ * \brief	Initialize multipart parser.
+ *
+ * Memory use is the struct itself, whatever the size of the body.
+ *
+ * \param	multipart		Struct that will be initialized.
+ * \param	boundary		Boundary from multipart_boundary
+ * \param	len					Length of boundary
+ * \param	on_part			Called with the headers of each part, may be NULL
+ * \param	on_data			Called with the body bytes of each part, may be NULL
+ * \param	on_part_end	Called after the body of each part, may be NULL
+ * \param	arg					Argument of callbacks
+ * \return	0 if Ok. Otherwise error code.
+ */
+int multipart_init(st_multipart* multipart, const char* boundary, size_t len,
+                   int (*on_part)(void* arg, const st_body_header* headers, size_t count),
+                   body_sink_fn on_data, int (*on_part_end)(void* arg), void* arg);
+
+/**
+ * \brief	Parse the next bytes of a multipart body.
+ * \param	multipart	Struct multipart
+ * \param	data			Bytes received
+ * \param	len				Count of bytes
+ * \return	Bytes consumed, -1 on error.
+ */
+ssize_t multipart_feed(st_multipart* multipart, const char* data, size_t len);
+
+/**
+ * \brief	Sink adapter, so a chunked body can feed a multipart parser.
+ * \param	multipart	Struct multipart
+ * \param	data			Bytes received
+ * \param	len				Count of bytes
+ * \return	0 if Ok, -1 on error.
+ */
+int multipart_sink(void* multipart, const char* data, size_t len);
+
+/**
+ * \brief	Tell if the closing boundary was read.
+ * \param	multipart	Struct multipart
+ * \return	true if body is complete.
+ */
+bool multipart_done(const st_multipart* multipart);
+
+/**
+ * \brief	Sink writing everything to a file descriptor.
+ * \param	fd			Pointer to an int holding the descriptor
+ * \param	data		Bytes to write
+ * \param	len			Count of bytes
+ * \return	0 if Ok, -1 on error.
+ */
+int body_sink_fd(void* fd, const char* data, size_t len);
+
+#endif /* __BODYPARSER_H_INCLUDED__ */
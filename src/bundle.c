@@ -0,0 +1,449 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bundle.c
+ *
+ *    Description:  静态资源包 (memory-mapped static asset bundle, see tools/bundlepack.c)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "bundle.h"
+#include "rcu.h"
+#include "strutils.h"
+#include "uri.h"
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static int   bundle_range(uint64_t off, uint64_t len, uint64_t size);
+static int   bundle_check(const bundle* b);
+static void  bundle_unmap(bundle* b);
+static int   bundle_etag_match(const char* if_none_match, const char* etag, size_t etag_len);
+static int   bundle_writev(int sockfd, struct iovec* iov, int cnt);
+
+
+
+
+
+/* ============================= STORE ============================== */
+
+
+/* Initialise an empty store */
+int bundle_init(bundle_store* store)
+{
+	if(store == NULL)
+	{
+		return -1;
+	}
+
+	memset(store, 0, sizeof(bundle_store));
+	pthread_mutex_init(&store->lock, NULL);
+	return 0;
+}
+
+
+/* Map a bundle, check it, publish it */
+int bundle_open(bundle_store* store, const char* path)
+{
+	struct stat st;
+	bundle* b, *old;
+	void* base;
+	int fd;
+
+	if(store == NULL || path == NULL)
+	{
+		return -1;
+	}
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+	{
+		Log(("bundle_open: Could not open %s, errno %d", path, errno));
+		return -1;
+	}
+
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bundle_header))
+	{
+		Log(("bundle_open: %s is too short", path));
+		close(fd);
+		return -2;
+	}
+
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(base == MAP_FAILED)
+	{
+		Log(("bundle_open: Could not map %s, errno %d", path, errno));
+		return -1;
+	}
+
+	/* Index and small assets are read at random, fetch them now */
+	madvise(base, (size_t)st.st_size, MADV_WILLNEED);
+
+	if((b = (bundle*)calloc(1, sizeof(bundle))) == NULL)
+	{
+		munmap(base, (size_t)st.st_size);
+		return -1;
+	}
+
+	b->base    = (const char*)base;
+	b->size    = (size_t)st.st_size;
+	b->header  = (const bundle_header*)base;
+	b->seeds   = (const uint32_t*)(b->base + b->header->seeds);
+	b->entries = (const bundle_entry*)(b->base + b->header->entries);
+
+	if(bundle_check(b) != 0)
+	{
+		Log(("bundle_open: %s is not a valid bundle", path));
+		bundle_unmap(b);
+		return -2;
+	}
+
+	pthread_mutex_lock(&store->lock);
+	b->generation = ++store->generation;
+
+	/* Publish, then wait out readers still sending from the old one */
+	old = rcu_exchange(store->current, b);
+	if(old)
+	{
+		rcu_synchronize();
+		bundle_unmap(old);
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	Log(("bundle_open: %s, %u assets, generation %llu", path, b->header->count,
+	     (unsigned long long)b->generation));
+	return 0;
+}
+
+
+/* Take the current bundle */
+const bundle* bundle_acquire(bundle_store* store)
+{
+	rcu_read_lock();
+	return store ? rcu_dereference(store->current) : NULL;
+}
+
+
+/* Give it back */
+void bundle_release(const bundle* b)
+{
+	(void)b;
+	rcu_read_unlock();
+}
+
+
+/* Unpublish and unmap */
+void bundle_close(bundle_store* store)
+{
+	bundle* old;
+
+	if(store == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&store->lock);
+	old = rcu_exchange(store->current, NULL);
+	if(old)
+	{
+		rcu_synchronize();
+		bundle_unmap(old);
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+
+
+
+
+/* ============================= LOOKUP ============================= */
+
+
+/* Find a request path */
+int bundle_find(const bundle* b, const char* path, const char* accept_encoding,
+                bundle_file* file)
+{
+	char  raw[BUNDLE_PATH_MAX + 1];
+	char* decoded = NULL;
+	const bundle_entry*   e;
+	const bundle_variant* v;
+	const char* key = path;
+	size_t len, i;
+	uint64_t h;
+	int enc;
+
+	if(b == NULL || path == NULL || file == NULL || b->header->count == 0)
+	{
+		return -1;
+	}
+
+	len = strcspn(path, "?#");
+
+	if(len == 0 || len > BUNDLE_PATH_MAX)
+	{
+		return -1;
+	}
+
+	if(memchr(path, '%', len) != NULL)
+	{
+		/* uri_decode keeps a cut escape as is, no packed path has one */
+		for(i = 0; i < len; i++)
+		{
+			if(path[i] == '%' &&
+			   (i + 2 >= len || !isxdigit((unsigned char)path[i + 1]) || !isxdigit((unsigned char)path[i + 2])))
+			{
+				return -1;
+			}
+		}
+
+		memcpy(raw, path, len);
+		raw[len] = 0;
+
+		if((decoded = uri_decode(raw)) == NULL)
+		{
+			return -1;
+		}
+
+		key = decoded;
+		len = strlen(decoded);
+	}
+
+	h = bundle_hash(key, len);
+	e = &b->entries[bundle_slot(h, b->seeds[(h >> 32) % b->header->buckets]) % b->header->count];
+
+	if(e->hash != h || e->path_len != len || memcmp(b->base + e->path, key, len) != 0)
+	{
+		free(decoded);
+		return -1;
+	}
+
+	free(decoded);
+
+	enc = compress_negotiate(accept_encoding, e->available);
+	if(enc < 0 || !(e->available & (1u << enc)))
+	{
+		/* Identity refused or not packed, send what there is */
+		enc = COMPRESS_IDENTITY;
+		while(!(e->available & (1u << enc)))
+		{
+			enc++;
+		}
+	}
+
+	v = &e->variant[enc];
+	file->path     = b->base + e->path;
+	file->path_len = e->path_len;
+	file->head     = b->base + v->head;
+	file->head_len = v->head_len;
+	file->etag     = b->base + v->etag;
+	file->etag_len = v->etag_len;
+	file->body     = b->base + v->body;
+	file->body_len = v->body_len;
+	file->encoding = enc;
+	return 0;
+}
+
+
+/* Send status line, headers and body in one go */
+int bundle_send(int sockfd, const bundle_file* file, const char* if_none_match,
+                const char* extra, size_t extra_len)
+{
+	static const char ok[]  = "HTTP/1.1 200 OK\r\n";
+	static const char nm[]  = "HTTP/1.1 304 Not Modified\r\n";
+	struct iovec iov[5];
+	int status = 200, cnt = 0;
+
+	if(file == NULL)
+	{
+		return -1;
+	}
+
+	if(if_none_match != NULL && bundle_etag_match(if_none_match, file->etag, file->etag_len))
+	{
+		status = 304;
+	}
+
+	iov[cnt].iov_base   = (void*)(status == 200 ? ok : nm);
+	iov[cnt++].iov_len  = status == 200 ? sizeof(ok) - 1 : sizeof(nm) - 1;
+	iov[cnt].iov_base   = (void*)file->head;
+	iov[cnt++].iov_len  = file->head_len;
+
+	if(extra != NULL && extra_len > 0)
+	{
+		iov[cnt].iov_base  = (void*)extra;
+		iov[cnt++].iov_len = extra_len;
+	}
+
+	iov[cnt].iov_base   = (void*)"\r\n";
+	iov[cnt++].iov_len  = 2;
+
+	if(status == 200 && file->body_len > 0)
+	{
+		iov[cnt].iov_base  = (void*)file->body;
+		iov[cnt++].iov_len = file->body_len;
+	}
+
+	return bundle_writev(sockfd, iov, cnt) == 0 ? status : -1;
+}
+
+
+
+
+
+/* ============================= STATIC ============================= */
+
+
+/* Whether off + len lies within size, without overflow */
+static int bundle_range(uint64_t off, uint64_t len, uint64_t size)
+{
+	return off <= size && len <= size - off;
+}
+
+
+/* Check every offset once, so lookups need not */
+static int bundle_check(const bundle* b)
+{
+	const bundle_header* hd = b->header;
+	const bundle_variant* v;
+	const bundle_entry* e;
+	uint32_t i;
+	int enc;
+
+	if(memcmp(hd->magic, BUNDLE_MAGIC, sizeof(hd->magic)) != 0 ||
+	   hd->version != BUNDLE_VERSION || hd->size != b->size ||
+	   (hd->count > 0 && hd->buckets == 0) ||
+	   hd->seeds % sizeof(uint32_t) != 0 || hd->entries % sizeof(uint64_t) != 0 ||
+	   !bundle_range(hd->seeds, (uint64_t)hd->buckets * sizeof(uint32_t), b->size) ||
+	   !bundle_range(hd->entries, (uint64_t)hd->count * sizeof(bundle_entry), b->size))
+	{
+		return -1;
+	}
+
+	for(i = 0; i < hd->count; i++)
+	{
+		e = &b->entries[i];
+
+		if(!bundle_range(e->path, e->path_len, b->size) ||
+		   e->available == 0 || e->available >= (1u << BUNDLE_VARIANTS))
+		{
+			return -1;
+		}
+
+		for(enc = 0; enc < BUNDLE_VARIANTS; enc++)
+		{
+			v = &e->variant[enc];
+
+			if((e->available & (1u << enc)) &&
+			   (!bundle_range(v->body, v->body_len, b->size) ||
+			    !bundle_range(v->head, v->head_len, b->size) ||
+			    !bundle_range(v->etag, v->etag_len, b->size)))
+			{
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/* Unmap and free, no reader left */
+static void bundle_unmap(bundle* b)
+{
+	munmap((void*)b->base, b->size);
+	free(b);
+}
+
+
+/* If-None-Match: "*" or a list of tags, compared weakly */
+static int bundle_etag_match(const char* if_none_match, const char* etag, size_t etag_len)
+{
+	st_strutils_iter list;
+	const char* tok;
+	size_t len;
+
+	strutils_split_init(&list, if_none_match, strlen(if_none_match), ',', STRUTILS_SPLIT_TRIM);
+
+	while(strutils_split_next(&list, &tok, &len))
+	{
+		if(len > 2 && tok[0] == 'W' && tok[1] == '/')
+		{
+			tok += 2;
+			len -= 2;
+		}
+
+		if((len == 1 && *tok == '*') || (len == etag_len && memcmp(tok, etag, len) == 0))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* writev all of it, resuming after short writes */
+static int bundle_writev(int sockfd, struct iovec* iov, int cnt)
+{
+	ssize_t n;
+	size_t step;
+	int i = 0;
+
+	while(i < cnt)
+	{
+		n = writev(sockfd, iov + i, cnt - i);
+
+		if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(n <= 0)
+		{
+			return -1;
+		}
+
+		/* Skip what was written */
+		for(; i < cnt && n > 0; i++)
+		{
+			step = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+			iov[i].iov_base = (char*)iov[i].iov_base + step;
+			iov[i].iov_len -= step;
+			n -= (ssize_t)step;
+
+			if(iov[i].iov_len > 0)
+			{
+				break;
+			}
+		}
+
+		while(i < cnt && iov[i].iov_len == 0)
+		{
+			i++;
+		}
+	}
+
+	return 0;
+}
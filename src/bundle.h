@@ -0,0 +1,251 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bundle.h
+ *
+ *    Description:  静态资源包 (memory-mapped static asset bundle, see tools/bundlepack.c)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef BUNDLE_H_
+#define BUNDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "compress.h"
+
+
+#define BUNDLE_MAGIC         "SHBUNDLE"
+#define BUNDLE_VERSION       1                 /* byte swapped: refused     */
+#define BUNDLE_ALIGN         64                /* bodies start on a line    */
+#define BUNDLE_VARIANTS      (COMPRESS_BR + 1) /* by enum compress_encoding */
+#define BUNDLE_PATH_MAX      4096
+
+
+/* ========================== FILE FORMAT =========================== */
+
+/*
+ * Host byte order; every offset is from the start of the file.
+ *
+ *    bundle_header
+ *    uint32_t        seeds[buckets]         displacement of each bucket
+ *    bundle_entry    entries[count]         one slot per path, no hole
+ *    paths, header blocks, bodies
+ *
+ * Lookup: h = bundle_hash(path), bucket = (h >> 32) % buckets,
+ * slot = bundle_slot(h, seeds[bucket]) % count. The packer picked the
+ * seeds so every path has a slot of its own; a path not in the bundle
+ * lands on some slot too, so the stored hash and path are compared.
+ */
+
+
+/* Start of the file */
+typedef struct bundle_header
+{
+	char     magic[8];                         /* BUNDLE_MAGIC, no NUL      */
+	uint32_t version;                          /* BUNDLE_VERSION            */
+	uint32_t count;                            /* entries                   */
+	uint32_t buckets;                          /* seeds                     */
+	uint32_t reserved;
+	uint64_t seeds;                            /* offset of seeds           */
+	uint64_t entries;                          /* offset of entries         */
+	uint64_t size;                             /* file size                 */
+	uint64_t created;                          /* unix time of packing      */
+} bundle_header;
+
+
+/* One coding of an asset, body_len 0 and head_len 0 if absent */
+typedef struct bundle_variant
+{
+	uint64_t body;                             /* offset of the bytes       */
+	uint64_t body_len;
+	uint64_t head;                             /* header lines, CRLF ended  */
+	uint32_t head_len;                         /* no status, no blank line  */
+	uint32_t etag_len;
+	uint64_t etag;                             /* quoted, also in head      */
+} bundle_variant;
+
+
+/* One path */
+typedef struct bundle_entry
+{
+	uint64_t hash;                             /* bundle_hash of path       */
+	uint64_t path;                             /* offset, decoded, no NUL   */
+	uint32_t path_len;
+	uint32_t available;                        /* 1 << coding, per variant  */
+	bundle_variant variant[BUNDLE_VARIANTS];
+} bundle_entry;
+
+
+/* FNV-1a, 64 bits */
+static inline uint64_t bundle_hash(const char* path, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while(len--)
+	{
+		h = (h ^ (uint8_t)*path++) * 1099511628211ull;
+	}
+
+	return h;
+}
+
+
+/* Slot hash of a path hash under a bucket seed, splitmix64 finaliser */
+static inline uint64_t bundle_slot(uint64_t hash, uint32_t seed)
+{
+	hash ^= (uint64_t)seed * 0x9e3779b97f4a7c15ull;
+	hash  = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+	hash  = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+	return hash ^ (hash >> 31);
+}
+
+
+/* ============================ RUNTIME ============================= */
+
+
+/* A mapped bundle, never changed once published */
+typedef struct bundle
+{
+	const char*          base;                 /* mapping                   */
+	size_t               size;
+	const bundle_header* header;
+	const uint32_t*      seeds;
+	const bundle_entry*  entries;
+	uint64_t             generation;           /* counts bundle_open        */
+} bundle;
+
+
+/* What to send for a request, views into the mapping */
+typedef struct bundle_file
+{
+	const char* path;
+	size_t      path_len;
+	const char* head;                          /* header lines, CRLF ended  */
+	size_t      head_len;
+	const char* etag;                          /* quoted                    */
+	size_t      etag_len;
+	const void* body;
+	size_t      body_len;
+	int         encoding;                      /* enum compress_encoding    */
+} bundle_file;
+
+
+/* Bundle store */
+typedef struct bundle_store
+{
+	pthread_mutex_t lock;                      /* writers                   */
+	bundle*         current;                   /* published, may be NULL    */
+	uint64_t        generation;                /* last bundle opened        */
+} bundle_store;
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Initialise an empty store
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int bundle_init(bundle_store* store);
+
+
+/**
+ * @brief Map a bundle and swap it in
+ *
+ * The file is checked whole before it is published, so a truncated or
+ * foreign file leaves the current bundle in place. Readers that still
+ * hold the previous bundle keep it until they release it; this call
+ * waits for them, then unmaps it. Safe to call again for each deploy.
+ *
+ * @param  store     store
+ * @param  path      file written by bundlepack
+ * @return 0 on success, -1 if it cannot be mapped, -2 if it is not a
+ *         valid bundle
+ */
+int bundle_open(bundle_store* store, const char* path);
+
+
+/**
+ * @brief Take the current bundle, NULL if none
+ *
+ * Must be paired with bundle_release() on the same thread. Views of
+ * bundle_find stay valid in between, including during bundle_send.
+ *
+ * @example
+ *
+ *    const bundle* b = bundle_acquire(&assets);
+ *    bundle_file   f;
+ *    if(bundle_find(b, path, accept_encoding, &f) == 0)
+ *    {
+ *        bundle_send(sockfd, &f, if_none_match, NULL, 0);
+ *    }
+ *    bundle_release(b);
+ *
+ * @return the bundle, or NULL
+ */
+const bundle* bundle_acquire(bundle_store* store);
+
+
+/**
+ * @brief Give back the bundle of bundle_acquire
+ *
+ * @return nothing
+ */
+void bundle_release(const bundle* b);
+
+
+/**
+ * @brief Look up a request path
+ *
+ * The query string is ignored and %XX escapes are decoded, as the packer
+ * decoded the stored paths. The coding is negotiated from the variants
+ * the asset has.
+ *
+ * @param  b                 bundle, may be NULL
+ * @param  path              request target, "/css/site.css?v=3"
+ * @param  accept_encoding   value of Accept-Encoding, NULL if absent
+ * @param  file              receives the views to send
+ * @return 0 if found, -1 otherwise
+ */
+int bundle_find(const bundle* b, const char* path, const char* accept_encoding,
+                bundle_file* file);
+
+
+/**
+ * @brief Send an asset in one writev
+ *
+ * Status line, the precomputed header lines, extra and the body go out
+ * straight from the mapping; nothing is copied. A matching If-None-Match
+ * gets a 304 with the same headers and no body.
+ *
+ * @param  sockfd            connected socket, blocking
+ * @param  file              from bundle_find
+ * @param  if_none_match     value of If-None-Match, NULL if absent
+ * @param  extra             more header lines, CRLF ended, may be NULL
+ * @param  extra_len         length of extra
+ * @return 200 or 304 once sent, -1 on a write error
+ */
+int bundle_send(int sockfd, const bundle_file* file, const char* if_none_match,
+                const char* extra, size_t extra_len);
+
+
+/**
+ * @brief Unpublish and unmap the current bundle
+ *
+ * @return nothing
+ */
+void bundle_close(bundle_store* store);
+
+#endif /* BUNDLE_H_ */
@@ -0,0 +1,555 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  compress.c
+ *
+ *    Description:  响应压缩 (precompressed files and streaming gzip/deflate)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "compress.h"
+#include "strutils.h"
+
+#define COMPRESS_LEVEL          6
+#define COMPRESS_MAX_ENTROPY    7.5            /* bits per byte             */
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* zlib context and output buffer */
+typedef struct compress_ctx
+{
+	z_stream zs;
+	int      ready;                            /* deflateInit2 done         */
+	int      busy;                             /* used by a stream          */
+	int      pooled;                           /* thread's own context      */
+	unsigned char out[COMPRESS_CHUNK];
+} compress_ctx;
+
+
+/* One context per coding and thread, kept for the life of the thread */
+static __thread compress_ctx* compress_tls[COMPRESS_DEFLATE + 1];
+
+/* Frees them when the thread exits */
+static pthread_key_t  compress_key;
+static pthread_once_t compress_key_once = PTHREAD_ONCE_INIT;
+
+static compress_stats compress_totals;
+
+
+/* Media types that gain nothing from another compression pass */
+static const char* compress_skip_types[] =
+{
+	"image/", "video/", "audio/", "font/woff", "application/zip",
+	"application/gzip", "application/x-gzip", "application/x-bzip2",
+	"application/x-xz", "application/zstd", "application/pdf",
+	"application/octet-stream", NULL
+};
+
+
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static double      compress_quality(const char* accept, const char* coding, size_t len);
+static compress_ctx* compress_ctx_get(int encoding);
+static void        compress_ctx_put(compress_ctx* ctx);
+static void        compress_key_init(void);
+static void        compress_tls_free(void* arg);
+static int         compress_run(compress_stream* stream, int flush);
+static uint64_t    compress_cpu_ns(void);
+
+
+
+
+/* ========================== NEGOTIATION =========================== */
+
+
+/* Best accepted coding */
+int compress_negotiate(const char* accept, unsigned int available)
+{
+	static const char* names[] = { "identity", "gzip", "deflate", "br" };
+	static const int   order[] = { COMPRESS_BR, COMPRESS_GZIP, COMPRESS_DEFLATE };
+	double best_q = 0.0, q;
+	int best = -1;
+	int n;
+
+	/* No header: anything goes, but identity is the safe choice */
+	if(accept == NULL)
+	{
+		return COMPRESS_IDENTITY;
+	}
+
+	for(n = 0; n < 3; n++)
+	{
+		if(!(available & (1u << order[n])))
+		{
+			continue;
+		}
+
+		q = compress_quality(accept, names[order[n]], strlen(names[order[n]]));
+
+		if(q > best_q)
+		{
+			best_q = q;
+			best   = order[n];
+		}
+	}
+
+	if(best != -1)
+	{
+		return best;
+	}
+
+	/* Identity is acceptable unless refused explicitly */
+	q = compress_quality(accept, "identity", 8);
+	return q != 0.0 ? COMPRESS_IDENTITY : -1;
+}
+
+
+/* Precompressed sibling of a static file */
+int compress_static_path(const char* path, const char* accept,
+                         char* out, size_t size, int* encoding)
+{
+	static const char* ext[] = { "", ".gz", "", ".br" };
+	unsigned int available = 0;
+	struct stat st, sib;
+	int n, enc;
+
+	if(path == NULL || out == NULL || encoding == NULL)
+	{
+		return -1;
+	}
+
+	*encoding = COMPRESS_IDENTITY;
+
+	if(accept != NULL && stat(path, &st) == 0)
+	{
+		for(n = COMPRESS_GZIP; n <= COMPRESS_BR; n++)
+		{
+			if(ext[n][0] == 0)
+			{
+				continue;
+			}
+
+			/* Stale siblings are ignored */
+			if(snprintf(out, size, "%s%s", path, ext[n]) < (int)size &&
+			   stat(out, &sib) == 0 && S_ISREG(sib.st_mode) && sib.st_mtime >= st.st_mtime)
+			{
+				available |= 1u << n;
+			}
+		}
+
+		enc = available ? compress_negotiate(accept, available) : COMPRESS_IDENTITY;
+
+		if(enc > COMPRESS_IDENTITY)
+		{
+			snprintf(out, size, "%s%s", path, ext[enc]);
+			*encoding = enc;
+			__atomic_add_fetch(&compress_totals.static_hits, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
+	if(snprintf(out, size, "%s", path) >= (int)size)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Quality a client gives to a coding, 0 if not accepted
+ *
+ * An explicit entry wins over "*"; a coding not listed at all gets 0,
+ * except identity which gets 1.
+ */
+static double compress_quality(const char* accept, const char* coding, size_t len)
+{
+	st_strutils_iter list, params;
+	const char *tok, *param;
+	double star = -1.0, q;
+	size_t tlen, plen;
+
+	strutils_split_init(&list, accept, strlen(accept), ',', STRUTILS_SPLIT_TRIM);
+
+	while(strutils_split_next(&list, &tok, &tlen))
+	{
+		/* Coding, then parameters: only q matters */
+		strutils_split_init(&params, tok, tlen, ';', STRUTILS_SPLIT_TRIM);
+		strutils_split_next(&params, &tok, &tlen);
+		q = 1.0;
+
+		while(strutils_split_next(&params, &param, &plen))
+		{
+			if(plen > 2 && (*param == 'q' || *param == 'Q') && param[1] == '=')
+			{
+				if(strutils_parse_double(param + 2, plen - 2, &q, NULL) != 0)
+				{
+					q = 0.0;
+				}
+			}
+		}
+
+		if(tlen == len && strncasecmp(tok, coding, len) == 0)
+		{
+			return q;
+		}
+
+		if(tlen == 1 && *tok == '*')
+		{
+			star = q;
+		}
+	}
+
+	if(star >= 0.0)
+	{
+		return star;
+	}
+
+	return len == 8 && strncasecmp(coding, "identity", 8) == 0 ? 1.0 : 0.0;
+}
+
+
+/* Whether to compress a dynamic body */
+int compress_worth(const char* content_type, size_t length,
+                   const void* sample, size_t sample_len)
+{
+	const unsigned char* s = (const unsigned char*)sample;
+	unsigned int hist[256];
+	double entropy = 0.0, p;
+	size_t n;
+	int i;
+
+	if(length != 0 && length < COMPRESS_MIN_SIZE)
+	{
+		goto worth_skip;
+	}
+
+	if(content_type != NULL)
+	{
+		for(i = 0; compress_skip_types[i]; i++)
+		{
+			if(strncasecmp(content_type, compress_skip_types[i],
+			               strlen(compress_skip_types[i])) == 0 &&
+			   strncasecmp(content_type, "image/svg", 9) != 0)
+			{
+				goto worth_skip;
+			}
+		}
+	}
+
+	/* Shannon entropy of the sample: random-looking data won't shrink */
+	if(s != NULL && sample_len >= 256)
+	{
+		memset(hist, 0, sizeof(hist));
+
+		for(n = 0; n < sample_len; n++)
+		{
+			hist[s[n]]++;
+		}
+
+		for(i = 0; i < 256; i++)
+		{
+			if(hist[i])
+			{
+				p = (double)hist[i] / (double)sample_len;
+				entropy -= p * log2(p);
+			}
+		}
+
+		if(entropy > COMPRESS_MAX_ENTROPY)
+		{
+			goto worth_skip;
+		}
+	}
+
+	return 1;
+
+worth_skip:
+	__atomic_add_fetch(&compress_totals.skipped, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+
+
+/* ============================ STREAMING =========================== */
+
+
+/* Start a compressed response */
+int compress_begin(compress_stream* stream, int encoding, body_sink_fn sink, void* arg)
+{
+	compress_ctx* ctx;
+
+	if(stream == NULL || sink == NULL ||
+	   (encoding != COMPRESS_GZIP && encoding != COMPRESS_DEFLATE))
+	{
+		return -1;
+	}
+
+	memset(stream, 0, sizeof(compress_stream));
+
+	if((ctx = compress_ctx_get(encoding)) == NULL)
+	{
+		return -1;
+	}
+
+	stream->zs       = ctx;
+	stream->encoding = encoding;
+	stream->sink     = sink;
+	stream->arg      = arg;
+	return 0;
+}
+
+
+/* Compress a piece of body */
+int compress_write(compress_stream* stream, const void* data, size_t len)
+{
+	compress_ctx* ctx = (compress_ctx*)stream->zs;
+
+	if(ctx == NULL)
+	{
+		return -1;
+	}
+
+	stream->bytes_in += len;
+
+	/* avail_in is an unsigned int, feed larger bodies in pieces */
+	while(len > 0)
+	{
+		size_t n = len < UINT_MAX ? len : UINT_MAX;
+
+		ctx->zs.next_in  = (Bytef*)data;
+		ctx->zs.avail_in = (uInt)n;
+
+		if(compress_run(stream, Z_NO_FLUSH) != 0)
+		{
+			return -1;
+		}
+
+		data = (const char*)data + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/* Finish the response and give the context back */
+int compress_end(compress_stream* stream)
+{
+	compress_ctx* ctx = (compress_ctx*)stream->zs;
+	int result;
+
+	if(ctx == NULL)
+	{
+		return -1;
+	}
+
+	ctx->zs.next_in  = NULL;
+	ctx->zs.avail_in = 0;
+	result = compress_run(stream, Z_FINISH);
+
+	compress_ctx_put(ctx);
+	stream->zs = NULL;
+
+	__atomic_add_fetch(&compress_totals.streams, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&compress_totals.bytes_in, stream->bytes_in, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&compress_totals.bytes_out, stream->bytes_out, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&compress_totals.cpu_ns, stream->cpu_ns, __ATOMIC_RELAXED);
+
+	return result;
+}
+
+
+/* Read totals */
+void compress_get_stats(compress_stats* stats)
+{
+	stats->streams     = __atomic_load_n(&compress_totals.streams, __ATOMIC_RELAXED);
+	stats->skipped     = __atomic_load_n(&compress_totals.skipped, __ATOMIC_RELAXED);
+	stats->static_hits = __atomic_load_n(&compress_totals.static_hits, __ATOMIC_RELAXED);
+	stats->bytes_in    = __atomic_load_n(&compress_totals.bytes_in, __ATOMIC_RELAXED);
+	stats->bytes_out   = __atomic_load_n(&compress_totals.bytes_out, __ATOMIC_RELAXED);
+	stats->cpu_ns      = __atomic_load_n(&compress_totals.cpu_ns, __ATOMIC_RELAXED);
+}
+
+
+/* Deflate pending input, handing full output buffers to the sink
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int compress_run(compress_stream* stream, int flush)
+{
+	compress_ctx* ctx = (compress_ctx*)stream->zs;
+	uint64_t start;
+	size_t   have;
+	int      ret;
+
+	do
+	{
+		ctx->zs.next_out  = ctx->out;
+		ctx->zs.avail_out = COMPRESS_CHUNK;
+
+		start = compress_cpu_ns();
+		ret = deflate(&ctx->zs, flush);
+		stream->cpu_ns += compress_cpu_ns() - start;
+
+		if(ret == Z_STREAM_ERROR)
+		{
+			return -1;
+		}
+
+		have = COMPRESS_CHUNK - ctx->zs.avail_out;
+
+		if(have)
+		{
+			stream->bytes_out += have;
+
+			if(stream->sink(stream->arg, (const char*)ctx->out, have) != 0)
+			{
+				return -1;
+			}
+		}
+	}
+	while(ctx->zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+	return 0;
+}
+
+
+
+
+/* ============================ CONTEXTS ============================ */
+
+
+/* Get the thread's context for a coding
+ *
+ * If it is in use (e.g. two coroutines of one thread compressing at
+ * once) a private context is made for the stream.
+ */
+static compress_ctx* compress_ctx_get(int encoding)
+{
+	compress_ctx* ctx = compress_tls[encoding];
+	int pooled = 1;
+
+	if(ctx == NULL || ctx->busy)
+	{
+		pooled = ctx == NULL;
+		ctx = (compress_ctx*)calloc(1, sizeof(compress_ctx));
+
+		if(ctx == NULL)
+		{
+			Log(("compress_ctx_get: Could not allocate memory for context"));
+			return NULL;
+		}
+
+		/* gzip wrapper for "gzip", zlib wrapper for "deflate" */
+		if(deflateInit2(&ctx->zs, COMPRESS_LEVEL, Z_DEFLATED,
+		                encoding == COMPRESS_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			free(ctx);
+			return NULL;
+		}
+
+		ctx->ready  = 1;
+		ctx->pooled = pooled;
+
+		if(pooled)
+		{
+			compress_tls[encoding] = ctx;
+
+			pthread_once(&compress_key_once, compress_key_init);
+			pthread_setspecific(compress_key, compress_tls);
+		}
+	}
+	else
+	{
+		deflateReset(&ctx->zs);
+	}
+
+	ctx->busy = 1;
+	return ctx;
+}
+
+
+/* Give a context back */
+static void compress_ctx_put(compress_ctx* ctx)
+{
+	ctx->busy = 0;
+
+	if(!ctx->pooled)
+	{
+		deflateEnd(&ctx->zs);
+		free(ctx);
+	}
+}
+
+
+/* Create the key whose destructor frees a thread's contexts */
+static void compress_key_init(void)
+{
+	pthread_key_create(&compress_key, compress_tls_free);
+}
+
+
+/* Thread exit: free its contexts, or leave one still in use to compress_ctx_put */
+static void compress_tls_free(void* arg)
+{
+	compress_ctx** tls = (compress_ctx**)arg;
+	int i;
+
+	for(i = 0; i <= COMPRESS_DEFLATE; i++)
+	{
+		compress_ctx* ctx = tls[i];
+
+		if(ctx == NULL)
+		{
+			continue;
+		}
+
+		tls[i] = NULL;
+
+		if(ctx->busy)
+		{
+			ctx->pooled = 0;
+			continue;
+		}
+
+		deflateEnd(&ctx->zs);
+		free(ctx);
+	}
+}
+
+
+/* CPU time of the calling thread */
+static uint64_t compress_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,170 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  compress.h
+ *
+ *    Description:  响应压缩 (precompressed files and streaming gzip/deflate)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bodyparser.h"
+
+
+/* Bodies smaller than this are sent as is */
+#define COMPRESS_MIN_SIZE    1024
+
+/* Output is handed to the sink in pieces of at most this size */
+#define COMPRESS_CHUNK       16384
+
+
+/* Content codings, also usable as bit masks (1 << encoding) */
+enum compress_encoding
+{
+	COMPRESS_IDENTITY,
+	COMPRESS_GZIP,
+	COMPRESS_DEFLATE,
+	COMPRESS_BR                                /* precompressed files only  */
+};
+
+
+/* Streaming compressor, lives for one response */
+typedef struct compress_stream
+{
+	void*        zs;                           /* per-thread z_stream       */
+	int          encoding;
+	body_sink_fn sink;                         /* receives compressed data  */
+	void*        arg;
+	uint64_t     bytes_in;
+	uint64_t     bytes_out;
+	uint64_t     cpu_ns;
+} compress_stream;
+
+
+/* Totals over all threads */
+typedef struct compress_stats
+{
+	uint64_t streams;                          /* responses compressed      */
+	uint64_t skipped;                          /* too small/incompressible  */
+	uint64_t static_hits;                      /* .gz/.br siblings served   */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t cpu_ns;                           /* thread CPU time deflating */
+} compress_stats;
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Pick the best coding a client accepts
+ *
+ * Honours q-values, "*" and "identity;q=0". Among equally rated codings
+ * br is preferred over gzip over deflate.
+ *
+ * @param  accept_encoding   value of Accept-Encoding, NULL if absent
+ * @param  available         mask of codings on offer, (1 << COMPRESS_GZIP) | ..
+ * @return enum compress_encoding, -1 if even identity is refused
+ */
+int compress_negotiate(const char* accept_encoding, unsigned int available);
+
+
+/**
+ * @brief Find a precompressed sibling of a static file
+ *
+ * Looks for "path.br" and "path.gz" that are not older than path and that
+ * the client accepts. Siblings served are counted in the stats.
+ *
+ * @example
+ *
+ *    char file[PATH_MAX];
+ *    int  enc;
+ *    compress_static_path(path, accept, file, sizeof(file), &enc);
+ *    fd = open(file, O_RDONLY);             //Content-Encoding from enc
+ *
+ * @param  path              path of the uncompressed file
+ * @param  accept_encoding   value of Accept-Encoding, NULL if absent
+ * @param  out               receives the path to serve
+ * @param  size              size of out
+ * @param  encoding          receives the coding of out
+ * @return 0 on success, -1 if out is too small
+ */
+int compress_static_path(const char* path, const char* accept_encoding,
+                         char* out, size_t size, int* encoding);
+
+
+/**
+ * @brief Tell if a dynamic body is worth compressing
+ *
+ * Skips bodies under COMPRESS_MIN_SIZE, media types that are compressed
+ * already and samples whose byte entropy says they will not shrink.
+ * Skipped bodies are counted in the stats.
+ *
+ * @param  content_type      value of Content-Type, may be NULL
+ * @param  length            body length, 0 if unknown
+ * @param  sample            first bytes of the body, may be NULL
+ * @param  sample_len        length of sample
+ * @return 1 if it should be compressed, 0 otherwise
+ */
+int compress_worth(const char* content_type, size_t length,
+                   const void* sample, size_t sample_len);
+
+
+/**
+ * @brief Start compressing a response
+ *
+ * The zlib context is owned by the calling thread and reused by every
+ * response it compresses, so nothing is allocated per request. A second
+ * stream of the same coding on that thread gets a private context.
+ *
+ * @param  stream    stream to start
+ * @param  encoding  COMPRESS_GZIP or COMPRESS_DEFLATE
+ * @param  sink      receives compressed output in pieces of COMPRESS_CHUNK
+ * @param  arg       argument of sink
+ * @return 0 on success, -1 otherwise.
+ */
+int compress_begin(compress_stream* stream, int encoding, body_sink_fn sink, void* arg);
+
+
+/**
+ * @brief Compress the next piece of the body
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int compress_write(compress_stream* stream, const void* data, size_t len);
+
+
+/**
+ * @brief Flush the end of the compressed body
+ *
+ * Must be called even after an error so the context can be reused.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int compress_end(compress_stream* stream);
+
+
+/**
+ * @brief Read the totals over all threads
+ *
+ * Ratio is bytes_out / bytes_in.
+ *
+ * @param  stats     receives the totals
+ * @return nothing
+ */
+void compress_get_stats(compress_stats* stats);
+
+#endif /* COMPRESS_H_ */
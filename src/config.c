@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "config.h"
+#include "rcu.h"
+#include "strutils.h"
+
+/*****************************************************************************/
+/* Prototypes of Static Functions
+*/
+/*****************************************************************************/
+
+/**
+ * \brief	Hash of a name (FNV-1a).
+ * \param	name		Name
+ * \return	Hash value.
+ */
+static uint32_t config_hash(const char *name);
+
+/**
+ * \brief	Find a name in a hash table of key ids.
+ * \param	index		Table, key id + 1 or 0 per slot
+ * \param	mask		Size of table minus one
+ * \param	names		Name of each key id
+ * \param	stride	Distance in bytes between two names
+ * \param	name		Name to find
+ * \return	Key id if found, -1 otherwise.
+ */
+static int config_probe(const uint32_t *index, uint32_t mask, const char *const *names,
+                        size_t stride, const char *name);
+
+/**
+ * \brief	Convert a value to the type of its field.
+ * \param	type		CONFIG_*
+ * \param	string	Value as written
+ * \param	value		Result, string is not set
+ * \return	0 if Ok, -2 if the value does not convert.
+ */
+static int config_convert(int type, const char *string, st_config_value *value);
+
+/**
+ * \brief	Build and publish a snapshot, writer lock held.
+ * \param	config	Config store
+ * \param	strkvm	Fields
+ * \return	0 if Ok. Otherwise error code.
+ */
+static int config_publish(st_config *config, const st_strkvm *strkvm);
+
+/*****************************************************************************/
+/* Functions to config
+*/
+/*****************************************************************************/
+
+int config_init(st_config *config)
+{
+  if (config == NULL)
+    return -1;
+
+  memset(config, 0, sizeof(st_config));
+  pthread_mutex_init(&config->lock, NULL);
+  return 0;
+}
+/*****************************************************************************/
+
+int config_key(st_config *config, const char *name, int type, const char *def)
+{
+  st_config_value check;
+  st_config_key *keys;
+  uint32_t *index, mask, h, i;
+  int id;
+
+  if (config == NULL || name == NULL || *name == 0 || type < CONFIG_STRING || type > CONFIG_BOOL)
+    return -1;
+
+  if (def != NULL && config_convert(type, def, &check) != 0)
+    return -1;
+
+  pthread_mutex_lock(&config->lock);
+
+  id = config->index ? config_probe(config->index, config->mask, (const char *const *)&config->keys->name,
+                                    sizeof(st_config_key), name) : -1;
+  if (id >= 0) {
+    if (config->keys[id].type != type)
+      id = -1;
+    goto key_end;
+  }
+
+  /* Keep the table at most half full */
+  if (config->index == NULL || (config->nkeys + 1) * 2 > config->mask + 1) {
+    mask = config->index ? config->mask * 2 + 1 : 15;
+    index = (uint32_t *)calloc(mask + 1, sizeof(uint32_t));
+    if (index == NULL)
+      goto key_end;
+
+    for (i = 0; i < config->nkeys; i++) {
+      for (h = config_hash(config->keys[i].name) & mask; index[h]; h = (h + 1) & mask);
+      index[h] = i + 1;
+    }
+
+    free(config->index);
+    config->index = index;
+    config->mask = mask;
+  }
+
+  keys = (st_config_key *)realloc(config->keys, sizeof(st_config_key) * (config->nkeys + 1));
+  if (keys == NULL)
+    goto key_end;
+  config->keys = keys;
+
+  keys[config->nkeys].name = strdup(name);
+  keys[config->nkeys].def = def ? strdup(def) : NULL;
+  keys[config->nkeys].type = type;
+  if (keys[config->nkeys].name == NULL || (def && keys[config->nkeys].def == NULL)) {
+    free(keys[config->nkeys].name);
+    free(keys[config->nkeys].def);
+    goto key_end;
+  }
+
+  for (h = config_hash(name) & config->mask; config->index[h]; h = (h + 1) & config->mask);
+  config->index[h] = config->nkeys + 1;
+  id = (int)config->nkeys++;
+
+key_end:
+  pthread_mutex_unlock(&config->lock);
+  return id;
+}
+/*****************************************************************************/
+
+int config_load(st_config *config, const char *buffer, size_t size, char split)
+{
+  st_strkvm strkvm;
+  int result;
+
+  if (config == NULL || buffer == NULL)
+    return -1;
+
+  strkvm_init(&strkvm);
+
+  /* An empty source is valid, every field takes its default */
+  if (size > 0 && strkvm_parse(&strkvm, (char *)buffer, size, split) != 0) {
+    strkvm_free(&strkvm);
+    return -1;
+  }
+
+  result = config_load_kvm(config, &strkvm);
+  strkvm_free(&strkvm);
+  return result;
+}
+/*****************************************************************************/
+
+int config_load_kvm(st_config *config, const st_strkvm *strkvm)
+{
+  int result;
+
+  if (config == NULL || strkvm == NULL)
+    return -1;
+
+  pthread_mutex_lock(&config->lock);
+  result = config_publish(config, strkvm);
+  pthread_mutex_unlock(&config->lock);
+  return result;
+}
+/*****************************************************************************/
+
+const st_config_snap *config_acquire(st_config *config)
+{
+  rcu_read_lock();
+  return config ? rcu_dereference(config->current) : NULL;
+}
+/*****************************************************************************/
+
+void config_release(const st_config_snap *snap)
+{
+  (void)snap;
+  rcu_read_unlock();
+}
+/*****************************************************************************/
+
+int config_lookup(const st_config_snap *snap, const char *name)
+{
+  if (snap == NULL || name == NULL || snap->count == 0)
+    return -1;
+
+  return config_probe(snap->index, snap->mask, snap->names, sizeof(char *), name);
+}
+/*****************************************************************************/
+
+int config_free(st_config *config)
+{
+  st_config_snap *old;
+  uint32_t i;
+
+  if (config == NULL)
+    return -1;
+
+  old = rcu_exchange(config->current, NULL);
+  if (old) {
+    rcu_synchronize();
+    free(old);
+  }
+
+  for (i = 0; i < config->nkeys; i++) {
+    free(config->keys[i].name);
+    free(config->keys[i].def);
+  }
+
+  free(config->keys);
+  free(config->index);
+  pthread_mutex_destroy(&config->lock);
+  memset(config, 0, sizeof(st_config));
+  return 0;
+}
+
+/*****************************************************************************/
+/* Static Functions
+*/
+/*****************************************************************************/
+
+static uint32_t config_hash(const char *name)
+{
+  uint32_t h = 2166136261u;
+
+  while (*name)
+    h = (h ^ (uint8_t)*name++) * 16777619u;
+
+  return h;
+}
+/*****************************************************************************/
+
+static int config_probe(const uint32_t *index, uint32_t mask, const char *const *names,
+                        size_t stride, const char *name)
+{
+  const char *n;
+  uint32_t h;
+
+  for (h = config_hash(name) & mask; index[h]; h = (h + 1) & mask) {
+    n = *(const char *const *)((const char *)names + stride * (index[h] - 1));
+    if (strcmp(n, name) == 0)
+      return (int)index[h] - 1;
+  }
+
+  return -1;
+}
+/*****************************************************************************/
+
+static int config_convert(int type, const char *string, st_config_value *value)
+{
+  memset(value, 0, sizeof(st_config_value));
+
+  switch (type) {
+  case CONFIG_INT:
+    if (strutils_parse_int(string, strlen(string), &value->integer, NULL) != 0)
+      return -2;
+    value->number = (double)value->integer;
+    value->boolean = value->integer != 0;
+    break;
+
+  case CONFIG_FLOAT:
+    if (strutils_parse_double(string, strlen(string), &value->number, NULL) != 0)
+      return -2;
+    /* inf, nan and 1e300 parse too; a cast out of range is undefined */
+    if (isnan(value->number))
+      value->integer = 0;
+    else if (value->number >= 9223372036854775808.0)
+      value->integer = INT64_MAX;
+    else if (value->number < -9223372036854775808.0)
+      value->integer = INT64_MIN;
+    else
+      value->integer = (int64_t)value->number;
+    value->boolean = value->number != 0.0;
+    break;
+
+  case CONFIG_BOOL:
+    if (strcmp(string, "true") == 0 || strcmp(string, "yes") == 0 ||
+        strcmp(string, "on") == 0 || strcmp(string, "1") == 0)
+      value->boolean = true;
+    else if (strcmp(string, "false") != 0 && strcmp(string, "no") != 0 &&
+             strcmp(string, "off") != 0 && strcmp(string, "0") != 0)
+      return -2;
+    value->integer = value->boolean;
+    value->number = value->boolean;
+    break;
+
+  default:
+    break;
+  }
+
+  return 0;
+}
+/*****************************************************************************/
+
+static int config_publish(st_config *config, const st_strkvm *strkvm)
+{
+  const char **found = NULL;
+  st_config_snap *snap, *old;
+  st_config_value *values;
+  const char **names;
+  uint32_t *index;
+  const st_strkv *var;
+  const char *s;
+  uint32_t n = config->nkeys, mask = 7, i, h;
+  size_t blob = 0, len;
+  char *p;
+  int id, result = -1;
+
+  if (n > 0) {
+    found = (const char **)calloc(n, sizeof(char *));
+    if (found == NULL)
+      return -1;
+  }
+
+  /* Nodes are in insertion order, so a later hit is the last one written */
+  for (var = strkvm_get_next((st_strkvm *)strkvm, NULL); var && n > 0;
+       var = strkvm_get_next((st_strkvm *)strkvm, var)) {
+    id = config_probe(config->index, config->mask, (const char *const *)&config->keys->name,
+                      sizeof(st_config_key), strkvm_name(strkvm, var));
+    if (id >= 0)
+      found[id] = var->val_off != STRKVM_NO_VALUE ? strkvm_value(strkvm, var)
+                  : config->keys[id].type == CONFIG_BOOL ? "true" : "";
+  }
+
+  while ((mask + 1) < n * 2)
+    mask = mask * 2 + 1;
+
+  for (i = 0; i < n; i++) {
+    s = found[i] ? found[i] : config->keys[i].def ? config->keys[i].def : "";
+    blob += strlen(config->keys[i].name) + strlen(s) + 2;
+  }
+
+  /* One block: header, values, names, index, strings */
+  snap = (st_config_snap *)malloc(sizeof(st_config_snap) + sizeof(st_config_value) * n +
+                                  sizeof(char *) * n + sizeof(uint32_t) * (mask + 1) + blob);
+  if (snap == NULL)
+    goto publish_end;
+
+  values = (st_config_value *)(snap + 1);
+  names = (const char **)(values + n);
+  index = (uint32_t *)(names + n);
+  p = (char *)(index + mask + 1);
+  memset(index, 0, sizeof(uint32_t) * (mask + 1));
+
+  for (i = 0; i < n; i++) {
+    s = found[i] ? found[i] : config->keys[i].def ? config->keys[i].def : "";
+
+    if (config_convert(config->keys[i].type, s, &values[i]) != 0) {
+      if (found[i] == NULL) {
+        /* No default, the type's zero */
+        config_convert(CONFIG_STRING, s, &values[i]);
+      } else {
+        free(snap);
+        result = -2;
+        goto publish_end;
+      }
+    }
+
+    values[i].set = found[i] != NULL;
+
+    len = strlen(config->keys[i].name) + 1;
+    names[i] = memcpy(p, config->keys[i].name, len);
+    p += len;
+
+    len = strlen(s) + 1;
+    values[i].string = memcpy(p, s, len);
+    p += len;
+
+    for (h = config_hash(names[i]) & mask; index[h]; h = (h + 1) & mask);
+    index[h] = i + 1;
+  }
+
+  snap->generation = ++config->generation;
+  snap->count = n;
+  snap->mask = mask;
+  snap->index = index;
+  snap->names = names;
+  snap->values = values;
+
+  /* Publish, then wait out readers still on the old snapshot */
+  old = rcu_exchange(config->current, snap);
+  if (old) {
+    rcu_synchronize();
+    free(old);
+  }
+  result = 0;
+
+publish_end:
+  free(found);
+  return result;
+}
+/*****************************************************************************/
@@ -0,0 +1,173 @@
+#ifndef __CONFIG_H_INCLUDED__
+#define __CONFIG_H_INCLUDED__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "strkvm.h"
+
+//! Type of a field
+enum {
+	CONFIG_STRING,
+	CONFIG_INT,
+	CONFIG_FLOAT,
+	CONFIG_BOOL
+};
+
+//! Declared field
+typedef struct {
+	char* name;										//!< Name
+	int type;											//!< CONFIG_*
+	char* def;										//!< Default value or NULL
+} st_config_key;
+
+//! Value of a field, converted once when the snapshot is built
+typedef struct {
+	const char* string;						//!< Value as written, never NULL
+	int64_t integer;							//!< CONFIG_INT value
+	double number;								//!< CONFIG_FLOAT value
+	bool boolean;									//!< CONFIG_BOOL value
+	bool set;											//!< Present in the source
+} st_config_value;
+
+//! Compiled config, never changed once published
+typedef struct {
+	uint64_t generation;					//!< Counts loads, starts at 1
+	uint32_t count;								//!< Total of fields
+	uint32_t mask;								//!< Size of index minus one
+	const uint32_t* index;				//!< Name hash table, key id + 1 or 0
+	const char* const* names;			//!< Name of each field
+	const st_config_value* values;	//!< Value of each field, by key id
+} st_config_snap;
+
+//! Config store
+typedef struct {
+	pthread_mutex_t lock;					//!< Writers
+	st_config_key* keys;					//!< Declared fields, by key id
+	uint32_t nkeys;								//!< Total of declared fields
+	uint32_t* index;							//!< Name hash table, key id + 1 or 0
+	uint32_t mask;								//!< Size of index minus one
+	uint64_t generation;					//!< Last generation built
+	st_config_snap* current;			//!< Published snapshot
+} st_config;
+
+/**
+ * \brief	Initialize config store.
+ * \param	config	Struct that will be initialized.
+ * \return	0 if Ok or -1 if param is null.
+ */
+int config_init(st_config* config);
+
+/**
+ * \brief	Declare a field.
+ *
+ * Names are interned: declaring a name again returns the same id, which
+ * must have the same type. Ids are dense, from 0, and never change, so
+ * they can be kept in globals and used as array indexes. A field declared
+ * after a load is in the snapshots of the following loads.
+ *
+ * \param	config	Config store
+ * \param	name		Name of field
+ * \param	type		CONFIG_*
+ * \param	def			Default value, NULL for none ("", 0 or false)
+ * \return	Key id if Ok. Otherwise -1.
+ */
+int config_key(st_config* config, const char* name, int type, const char* def);
+
+/**
+ * \brief	Build a snapshot from a formated string and publish it.
+ *
+ * The string is read with strkvm_parse; a name given twice keeps the last
+ * value. A bool is "true", "false", "yes", "no", "on", "off", "1", "0" or a
+ * name alone, which is true. Names that were not declared are skipped.
+ * Nothing is published if a value does not convert: the running config
+ * stays as it was. The old snapshot is freed once no reader can see it.
+ *
+ * \param	config	Config store
+ * \param	buffer	Formated string
+ * \param	size		Size buffer
+ * \param	split		Separator of fields
+ * \return	0 if Ok, -2 if a value does not convert. Otherwise -1.
+ */
+int config_load(st_config* config, const char* buffer, size_t size, char split);
+
+/**
+ * \brief	Build a snapshot from a key/value struct and publish it.
+ * \param	config	Config store
+ * \param	strkvm	Fields, for a name given twice the newest node wins
+ * \return	0 if Ok, -2 if a value does not convert. Otherwise -1.
+ */
+int config_load_kvm(st_config* config, const st_strkvm* strkvm);
+
+/**
+ * \brief	Take the current snapshot.
+ *
+ * Enters an RCU read side section: no lock, no allocation, no write to
+ * shared memory. The snapshot and all strings in it stay valid until
+ * config_release. Keep the section short, a reload waits for it.
+ *
+ * \param	config	Config store
+ * \return	Snapshot, NULL before the first load.
+ */
+const st_config_snap* config_acquire(st_config* config);
+
+/**
+ * \brief	Give a snapshot back.
+ * \param	snap		Result of config_acquire
+ */
+void config_release(const st_config_snap* snap);
+
+/**
+ * \brief	Find the key id of a name in a snapshot, one hash probe.
+ * \param	snap		Snapshot
+ * \param	name		Name of field
+ * \return	Key id if found, -1 otherwise.
+ */
+int config_lookup(const st_config_snap* snap, const char* name);
+
+/**
+ * \brief	Frees memory space used by config store.
+ *
+ * No reader may still be using a snapshot.
+ *
+ * \param	config	Config store
+ * \return	0 if Ok or -1 if param is null.
+ */
+int config_free(st_config* config);
+
+//! Value of a field, or an empty unset value ("", zeros) when the id is not
+//! in the snapshot, e.g. a key declared after it was built or a NULL snapshot
+static inline const st_config_value* config_value(const st_config_snap* snap, int key)
+{
+	static const st_config_value none = { "", 0, 0.0, false, false };
+
+	if (snap == NULL || key < 0 || (uint32_t)key >= snap->count)
+		return &none;
+	return &snap->values[key];
+}
+
+//! Typed reads, O(1) and allocation free
+static inline const char* config_string(const st_config_snap* snap, int key)
+{
+	return config_value(snap, key)->string;
+}
+
+static inline int64_t config_int(const st_config_snap* snap, int key)
+{
+	return config_value(snap, key)->integer;
+}
+
+static inline double config_float(const st_config_snap* snap, int key)
+{
+	return config_value(snap, key)->number;
+}
+
+static inline bool config_bool(const st_config_snap* snap, int key)
+{
+	return config_value(snap, key)->boolean;
+}
+
+#endif /* __CONFIG_H_INCLUDED__ */
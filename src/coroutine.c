@@ -0,0 +1,637 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  coroutine.c
+ *
+ *    Description:  协程调度 (stackful coroutines on threadpool workers)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "coroutine.h"
+
+#define CO_EVENTS_MAX   64
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Coroutine state */
+enum co_state
+{
+	CO_READY,                                  /* in run queue              */
+	CO_RUNNING,                                /* currently resumed         */
+	CO_WAITING,                                /* blocked on a descriptor   */
+	CO_DEAD                                    /* handler returned          */
+};
+
+
+/* Pooled stack */
+typedef struct co_stack
+{
+	struct co_stack* next;                     /* next free stack           */
+	void*  base;                               /* start of mapping (guard)  */
+} co_stack;
+
+
+/* Coroutine */
+typedef struct coroutine
+{
+	struct coroutine* next;                    /* run queue / inbox link    */
+	struct coroutine* all_prev;                /* list of live coroutines   */
+	struct coroutine* all_next;
+	ucontext_t ctx;                            /* saved registers           */
+	co_stack*  stack;                          /* stack it runs on          */
+	void     (*function)(void* arg, int sockfd);
+	void*      arg;
+	int        sockfd;
+	int        wait_fd;                        /* fd registered, suspended  */
+	enum co_state state;
+} coroutine;
+
+
+/* Scheduler */
+typedef struct co_sched_
+{
+	ucontext_t main_ctx;                       /* scheduler loop context    */
+	coroutine* current;                        /* coroutine being resumed   */
+	coroutine* runq_front;                     /* ready coroutines          */
+	coroutine* runq_rear;
+	coroutine* all;                            /* every live coroutine      */
+	co_stack*  free_stacks;                    /* stack pool                */
+	size_t     stack_size;                     /* mapping size incl. guard  */
+	size_t     page_size;
+	int        epfd;
+	int        wakefd;                         /* eventfd for the inbox     */
+
+	pthread_mutex_t inbox_lock;                /* used for fields below     */
+	coroutine* inbox;                          /* spawned from other thread */
+	int        live;                           /* coroutines alive          */
+	int        max_live;
+	volatile int stop;
+} co_sched_;
+
+
+/* Scheduler running on this thread */
+static __thread co_sched_* co_sched_self;
+
+
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static co_stack* co_stack_get(co_sched_* sched_p);
+static void      co_stack_put(co_sched_* sched_p, co_stack* stack_p);
+static void      co_entry(void);
+static void      co_resume(co_sched_* sched_p, coroutine* co_p);
+static void      co_free(co_sched_* sched_p, coroutine* co_p);
+static void      co_runq_push(co_sched_* sched_p, coroutine* co_p);
+static coroutine* co_runq_pull(co_sched_* sched_p);
+static int       co_wait(int fd, unsigned int events);
+
+
+
+
+/* ========================== SCHEDULER ============================= */
+
+
+/* Initialise scheduler */
+struct co_sched_* co_sched_init(size_t stack_size, int max_coroutines)
+{
+	co_sched_* sched_p;
+	struct epoll_event ev;
+
+	sched_p = (struct co_sched_*)calloc(1, sizeof(struct co_sched_));
+
+	if(sched_p == NULL)
+	{
+		Log(("co_sched_init: Could not allocate memory for scheduler"));
+		return NULL;
+	}
+
+	sched_p->page_size  = (size_t)sysconf(_SC_PAGESIZE);
+	sched_p->stack_size = (stack_size + sched_p->page_size - 1) & ~(sched_p->page_size - 1);
+	sched_p->stack_size += sched_p->page_size;    /* guard page */
+	sched_p->max_live   = max_coroutines;
+
+	sched_p->epfd   = epoll_create1(EPOLL_CLOEXEC);
+	sched_p->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(sched_p->epfd == -1 || sched_p->wakefd == -1)
+	{
+		Log(("co_sched_init: Could not create event descriptors"));
+		goto init_error;
+	}
+
+	/* data.ptr == NULL marks the inbox */
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if(epoll_ctl(sched_p->epfd, EPOLL_CTL_ADD, sched_p->wakefd, &ev) == -1)
+	{
+		goto init_error;
+	}
+
+	pthread_mutex_init(&sched_p->inbox_lock, NULL);
+	return sched_p;
+
+init_error:
+	if(sched_p->epfd != -1) close(sched_p->epfd);
+	if(sched_p->wakefd != -1) close(sched_p->wakefd);
+	free(sched_p);
+	return NULL;
+}
+
+
+/* Scheduler loop */
+void* co_sched_run(void* arg, int index)
+{
+	co_sched_* sched_p = (struct co_sched_*)arg;
+	struct epoll_event events[CO_EVENTS_MAX];
+	coroutine* co_p;
+	coroutine* last;
+	uint64_t   v;
+	int n, i;
+	(void)index;
+
+	co_sched_self = sched_p;
+
+	while(!sched_p->stop)
+	{
+		/* Take over coroutines spawned from other threads */
+		pthread_mutex_lock(&sched_p->inbox_lock);
+		co_p = sched_p->inbox;
+		sched_p->inbox = NULL;
+		pthread_mutex_unlock(&sched_p->inbox_lock);
+
+		while(co_p)
+		{
+			coroutine* next = co_p->next;
+			co_runq_push(sched_p, co_p);
+			co_p = next;
+		}
+
+		/* Resume what is ready now; coroutines yielding go after 'last' */
+		last = sched_p->runq_rear;
+
+		while(last && (co_p = co_runq_pull(sched_p)))
+		{
+			co_resume(sched_p, co_p);
+
+			if(co_p == last)
+			{
+				break;
+			}
+		}
+
+		n = epoll_wait(sched_p->epfd, events, CO_EVENTS_MAX,
+		               sched_p->runq_front ? 0 : -1);
+
+		for(i = 0; i < n; i++)
+		{
+			co_p = (coroutine*)events[i].data.ptr;
+
+			if(co_p == NULL)
+			{
+				if(read(sched_p->wakefd, &v, sizeof(v)) < 0) {}
+				continue;
+			}
+
+			if(co_p->state == CO_WAITING)
+			{
+				co_runq_push(sched_p, co_p);
+			}
+		}
+	}
+
+	co_sched_self = NULL;
+	return NULL;
+}
+
+
+/* Stop the scheduler loop */
+void co_sched_stop(co_sched_* sched_p)
+{
+	uint64_t v = 1;
+
+	sched_p->stop = 1;
+
+	if(write(sched_p->wakefd, &v, sizeof(v)) < 0) {}
+}
+
+
+/* Destroy the scheduler */
+void co_sched_destroy(co_sched_* sched_p)
+{
+	co_stack* stack_p;
+	coroutine* co_p;
+
+	if(sched_p == NULL) return ;
+
+	while(sched_p->all)
+	{
+		co_free(sched_p, sched_p->all);
+	}
+
+	while(sched_p->inbox)
+	{
+		co_p = sched_p->inbox;
+		sched_p->inbox = co_p->next;
+		co_stack_put(sched_p, co_p->stack);
+		free(co_p);
+	}
+
+	while((stack_p = sched_p->free_stacks))
+	{
+		sched_p->free_stacks = stack_p->next;
+		munmap(stack_p->base, sched_p->stack_size);
+		free(stack_p);
+	}
+
+	close(sched_p->epfd);
+	close(sched_p->wakefd);
+	pthread_mutex_destroy(&sched_p->inbox_lock);
+	free(sched_p);
+}
+
+
+/* Start a handler as a coroutine */
+int co_spawn(co_sched_* sched_p, void (*func)(void* arg, int sockfd), void* arg, int sockfd)
+{
+	coroutine* co_p;
+	uint64_t v = 1;
+	int flags;
+
+	if(sched_p == NULL || func == NULL || sched_p->stop)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&sched_p->inbox_lock);
+
+	if(sched_p->max_live && sched_p->live >= sched_p->max_live)
+	{
+		pthread_mutex_unlock(&sched_p->inbox_lock);
+		return -1;
+	}
+
+	sched_p->live++;
+	pthread_mutex_unlock(&sched_p->inbox_lock);
+
+	co_p = (struct coroutine*)calloc(1, sizeof(struct coroutine));
+
+	if(co_p == NULL)
+	{
+		Log(("co_spawn: Could not allocate memory for coroutine"));
+		goto spawn_error;
+	}
+
+	if(sockfd >= 0 && (flags = fcntl(sockfd, F_GETFL)) != -1)
+	{
+		fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	co_p->function = func;
+	co_p->arg      = arg;
+	co_p->sockfd   = sockfd;
+	co_p->wait_fd  = -1;
+	co_p->state    = CO_READY;
+
+	/* Stack and context are set up by the scheduler thread on first resume */
+	pthread_mutex_lock(&sched_p->inbox_lock);
+	co_p->next = sched_p->inbox;
+	sched_p->inbox = co_p;
+	pthread_mutex_unlock(&sched_p->inbox_lock);
+
+	if(write(sched_p->wakefd, &v, sizeof(v)) < 0) {}
+
+	return 0;
+
+spawn_error:
+	pthread_mutex_lock(&sched_p->inbox_lock);
+	sched_p->live--;
+	pthread_mutex_unlock(&sched_p->inbox_lock);
+	return -1;
+}
+
+
+
+
+
+/* ============================ COROUTINE =========================== */
+
+
+/* Switch to a coroutine until it yields, blocks or returns */
+static void co_resume(co_sched_* sched_p, coroutine* co_p)
+{
+	if(co_p->stack == NULL)
+	{
+		co_p->stack = co_stack_get(sched_p);
+
+		if(co_p->stack == NULL)
+		{
+			/* Out of stacks: try again on the next pass */
+			co_runq_push(sched_p, co_p);
+			return ;
+		}
+
+		getcontext(&co_p->ctx);
+		co_p->ctx.uc_stack.ss_sp   = (char*)co_p->stack->base + sched_p->page_size;
+		co_p->ctx.uc_stack.ss_size = sched_p->stack_size - sched_p->page_size;
+		co_p->ctx.uc_link          = &sched_p->main_ctx;
+		makecontext(&co_p->ctx, co_entry, 0);
+
+		co_p->all_next = sched_p->all;
+		co_p->all_prev = NULL;
+
+		if(sched_p->all)
+		{
+			sched_p->all->all_prev = co_p;
+		}
+
+		sched_p->all = co_p;
+	}
+
+	co_p->state = CO_RUNNING;
+	sched_p->current = co_p;
+	swapcontext(&sched_p->main_ctx, &co_p->ctx);
+	sched_p->current = NULL;
+
+	if(co_p->state == CO_DEAD)
+	{
+		co_free(sched_p, co_p);
+	}
+}
+
+
+/* First function run on a coroutine stack */
+static void co_entry(void)
+{
+	coroutine* co_p = co_sched_self->current;
+
+	co_p->function(co_p->arg, co_p->sockfd);
+	co_p->state = CO_DEAD;
+	/* returns to main_ctx through uc_link */
+}
+
+
+/* Release a coroutine and its stack */
+static void co_free(co_sched_* sched_p, coroutine* co_p)
+{
+	if(co_p->wait_fd != -1)
+	{
+		/* Freed while suspended in co_wait: the handler never got control
+		 * back, so the fd is still the one it registered */
+		epoll_ctl(sched_p->epfd, EPOLL_CTL_DEL, co_p->wait_fd, NULL);
+	}
+
+	if(co_p->all_prev)
+	{
+		co_p->all_prev->all_next = co_p->all_next;
+	}
+	else
+	{
+		sched_p->all = co_p->all_next;
+	}
+
+	if(co_p->all_next)
+	{
+		co_p->all_next->all_prev = co_p->all_prev;
+	}
+
+	co_stack_put(sched_p, co_p->stack);
+	free(co_p);
+
+	pthread_mutex_lock(&sched_p->inbox_lock);
+	sched_p->live--;
+	pthread_mutex_unlock(&sched_p->inbox_lock);
+}
+
+
+/* Suspend the current coroutine until fd is ready
+ *
+ * @return 0 when resumed, -1 if not in a coroutine or epoll failed.
+ */
+static int co_wait(int fd, unsigned int events)
+{
+	co_sched_* sched_p = co_sched_self;
+	coroutine* co_p;
+	struct epoll_event ev;
+
+	if(sched_p == NULL || (co_p = sched_p->current) == NULL)
+	{
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = events | EPOLLONESHOT;
+	ev.data.ptr = co_p;
+
+	if(epoll_ctl(sched_p->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		return -1;
+	}
+
+	co_p->wait_fd = fd;
+	co_p->state   = CO_WAITING;
+	swapcontext(&co_p->ctx, &sched_p->main_ctx);
+
+	/* Deregister before the handler runs again: once it may close fd, the
+	 * number can belong to another coroutine's socket */
+	epoll_ctl(sched_p->epfd, EPOLL_CTL_DEL, fd, NULL);
+	co_p->wait_fd = -1;
+	return 0;
+}
+
+
+/* Read, suspending while nothing is available */
+ssize_t co_read(int fd, void* buf, size_t len)
+{
+	ssize_t n;
+
+	for(;;)
+	{
+		n = read(fd, buf, len);
+
+		if(n >= 0 || errno == EINTR)
+		{
+			if(n >= 0) return n;
+			continue;
+		}
+
+		if((errno != EAGAIN && errno != EWOULDBLOCK) || co_wait(fd, EPOLLIN) == -1)
+		{
+			return -1;
+		}
+	}
+}
+
+
+/* Write everything, suspending while the socket is full */
+ssize_t co_write(int fd, const void* buf, size_t len)
+{
+	const char* p = (const char*)buf;
+	size_t done = 0;
+	ssize_t n;
+
+	while(done < len)
+	{
+		n = write(fd, p + done, len - done);
+
+		if(n >= 0)
+		{
+			done += (size_t)n;
+			continue;
+		}
+
+		if(errno == EINTR)
+		{
+			continue;
+		}
+
+		if((errno != EAGAIN && errno != EWOULDBLOCK) || co_wait(fd, EPOLLOUT) == -1)
+		{
+			return -1;
+		}
+	}
+
+	return (ssize_t)len;
+}
+
+
+/* Give way to the other ready coroutines */
+void co_yield(void)
+{
+	co_sched_* sched_p = co_sched_self;
+	coroutine* co_p;
+
+	if(sched_p == NULL || (co_p = sched_p->current) == NULL)
+	{
+		return ;
+	}
+
+	co_runq_push(sched_p, co_p);
+	swapcontext(&co_p->ctx, &sched_p->main_ctx);
+}
+
+
+
+
+
+/* ============================ RUN QUEUE =========================== */
+
+
+/* Add coroutine to the rear of the run queue */
+static void co_runq_push(co_sched_* sched_p, coroutine* co_p)
+{
+	co_p->state = CO_READY;
+	co_p->next  = NULL;
+
+	if(sched_p->runq_rear)
+	{
+		sched_p->runq_rear->next = co_p;
+	}
+	else
+	{
+		sched_p->runq_front = co_p;
+	}
+
+	sched_p->runq_rear = co_p;
+}
+
+
+/* Take coroutine from the front of the run queue */
+static coroutine* co_runq_pull(co_sched_* sched_p)
+{
+	coroutine* co_p = sched_p->runq_front;
+
+	if(co_p)
+	{
+		sched_p->runq_front = co_p->next;
+
+		if(sched_p->runq_front == NULL)
+		{
+			sched_p->runq_rear = NULL;
+		}
+	}
+
+	return co_p;
+}
+
+
+
+
+
+/* ============================ STACK POOL ========================== */
+
+
+/* Get a stack from the pool, mapping a new one if it is empty */
+static co_stack* co_stack_get(co_sched_* sched_p)
+{
+	co_stack* stack_p = sched_p->free_stacks;
+
+	if(stack_p)
+	{
+		sched_p->free_stacks = stack_p->next;
+		return stack_p;
+	}
+
+	stack_p = (struct co_stack*)malloc(sizeof(struct co_stack));
+
+	if(stack_p == NULL)
+	{
+		return NULL;
+	}
+
+	stack_p->base = mmap(NULL, sched_p->stack_size, PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+	if(stack_p->base == MAP_FAILED)
+	{
+		Log(("co_stack_get: Could not map coroutine stack"));
+		free(stack_p);
+		return NULL;
+	}
+
+	/* Stacks grow down: lowest page is the guard */
+	if(mprotect(stack_p->base, sched_p->page_size, PROT_NONE) == -1)
+	{
+		munmap(stack_p->base, sched_p->stack_size);
+		free(stack_p);
+		return NULL;
+	}
+
+	return stack_p;
+}
+
+
+/* Return a stack to the pool */
+static void co_stack_put(co_sched_* sched_p, co_stack* stack_p)
+{
+	if(stack_p == NULL) return ;
+
+	stack_p->next = sched_p->free_stacks;
+	sched_p->free_stacks = stack_p;
+}
@@ -0,0 +1,142 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  coroutine.h
+ *
+ *    Description:  协程调度 (stackful coroutines on threadpool workers)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef COROUTINE_H_
+#define COROUTINE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* =================================== API ======================================= */
+
+
+typedef struct co_sched_* co_sched;
+
+
+/**
+ * @brief  Initialize a coroutine scheduler
+ *
+ * A scheduler multiplexes many connection handlers on the one thread that
+ * runs co_sched_run(). Each handler gets its own stack, taken from a pool
+ * owned by the scheduler. Every stack has a guard page below it, so a
+ * stack overflow faults instead of corrupting a neighbour.
+ *
+ * @example
+ *
+ *    ..
+ *    co_sched sched = co_sched_init(64 * 1024, 10000);
+ *    thpool_add_work(thpool, co_sched_run, sched, -1);  //one worker drives it
+ *    ..
+ *    co_spawn(sched, handle_client, client, sockfd);
+ *    ..
+ *
+ * @param  stack_size       usable stack size of each coroutine, rounded up
+ *                          to whole pages
+ * @param  max_coroutines   most coroutines alive at once, 0 for no limit
+ * @return co_sched         created scheduler on success,
+ *                          NULL on error
+ */
+co_sched co_sched_init(size_t stack_size, int max_coroutines);
+
+
+/**
+ * @brief Run the scheduler loop
+ *
+ * Resumes ready coroutines and waits for I/O on the ones that are blocked
+ * until co_sched_stop() is called. The signature matches thpool_add_work()
+ * so the scheduler can be handed to a threadpool worker as a job; the
+ * worker then stays with the scheduler until it is stopped.
+ *
+ * @param  sched     the scheduler to run
+ * @param  index     id of the worker running it, unused
+ * @return NULL
+ */
+void* co_sched_run(void* sched, int index);
+
+
+/**
+ * @brief Stop the scheduler loop
+ *
+ * co_sched_run() returns after its current pass. Coroutines that have not
+ * finished are left suspended and released by co_sched_destroy().
+ *
+ * @param  sched     the scheduler to stop
+ * @return nothing
+ */
+void co_sched_stop(co_sched sched);
+
+
+/**
+ * @brief Destroy the scheduler
+ *
+ * Must only be called once co_sched_run() has returned. Suspended
+ * coroutines are dropped without being resumed; their sockets are not
+ * closed.
+ *
+ * @param  sched     the scheduler to destroy
+ * @return nothing
+ */
+void co_sched_destroy(co_sched sched);
+
+
+/**
+ * @brief Start a handler as a coroutine
+ *
+ * May be called from any thread. sockfd (if not -1) is switched to
+ * non-blocking mode so that co_read() and co_write() can suspend on it.
+ *
+ * @param  sched     the scheduler that will run the handler
+ * @param  func      the handler
+ * @param  arg       argument passed to the handler
+ * @param  sockfd    connection socket, passed to the handler, or -1
+ * @return 0 on successs, -1 if the scheduler is full or stopped.
+ */
+int co_spawn(co_sched sched, void (*func)(void* arg, int sockfd), void* arg, int sockfd);
+
+
+/**
+ * @brief Read from a descriptor, suspending the coroutine while no data is ready
+ *
+ * Behaves like read(2). Outside of a coroutine it is a plain read(2).
+ *
+ * @return number of bytes read, 0 on end of file, -1 on error
+ */
+ssize_t co_read(int fd, void* buf, size_t len);
+
+
+/**
+ * @brief Write to a descriptor, suspending the coroutine while it would block
+ *
+ * Writes the whole buffer unless an error happens. Outside of a coroutine
+ * it loops on write(2).
+ *
+ * @return len on success, -1 on error
+ */
+ssize_t co_write(int fd, const void* buf, size_t len);
+
+
+/**
+ * @brief Let the other ready coroutines run
+ *
+ * Does nothing outside of a coroutine.
+ *
+ * @return nothing
+ */
+void co_yield(void);
+
+#endif /* COROUTINE_H_ */
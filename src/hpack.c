@@ -0,0 +1,608 @@
+#include <stdio.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "hpack.h"
+
+//! Overhead of a table entry, RFC 7541 4.1
+#define HPACK_ENTRY_OVERHEAD  32
+//! Largest integer accepted in a block
+#define HPACK_INT_MAX         0x7fffffffu
+//! Huffman end of string symbol
+#define HPACK_EOS             256
+
+//! Static table, RFC 7541 Appendix A
+static const struct {
+  const char *name;
+  const char *value;
+} hpack_static[HPACK_STATIC_COUNT + 1] = {
+  { NULL, NULL },
+  { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+  { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+  { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+  { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+  { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+  { "age", "" }, { "allow", "" }, { "authorization", "" },
+  { "cache-control", "" }, { "content-disposition", "" }, { "content-encoding", "" },
+  { "content-language", "" }, { "content-length", "" }, { "content-location", "" },
+  { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+  { "date", "" }, { "etag", "" }, { "expect", "" },
+  { "expires", "" }, { "from", "" }, { "host", "" },
+  { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+  { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+  { "link", "" }, { "location", "" }, { "max-forwards", "" },
+  { "proxy-authenticate", "" }, { "proxy-authorization", "" }, { "range", "" },
+  { "referer", "" }, { "refresh", "" }, { "retry-after", "" },
+  { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+  { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" },
+  { "via", "" }, { "www-authenticate", "" }
+};
+
+/* Code lengths of the Huffman code, RFC 7541 Appendix B. The code is
+   canonical, so the codes themselves follow from the lengths. */
+static const uint8_t hpack_huff_len[HPACK_EOS + 1] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+};
+
+//! Huffman tables built from hpack_huff_len
+static struct {
+  uint32_t code[HPACK_EOS + 1];   //!< Code of each symbol, right aligned
+  uint64_t limit[31];             //!< First code after length n, left aligned in 32 bits
+  int32_t offset[31];             //!< Index in sorted of code 0 of length n
+  uint16_t sorted[HPACK_EOS + 1]; //!< Symbols by length, then value
+} hpack_huff;
+
+static pthread_once_t hpack_huff_once = PTHREAD_ONCE_INIT;
+
+/*****************************************************************************/
+/* Prototypes of Static Functions
+*/
+/*****************************************************************************/
+
+/**
+ * \brief	Build the Huffman tables, once.
+ */
+static void hpack_huff_build(void);
+
+/**
+ * \brief	Decode an integer with a prefix of n bits.
+ * \param	p				Position in block, moved past the integer
+ * \param	end			End of block
+ * \param	n				Prefix bits
+ * \param	value		Decoded integer
+ * \return	0 if Ok, -1 on error.
+ */
+static int hpack_int_decode(const uint8_t **p, const uint8_t *end, int n, uint32_t *value);
+
+/**
+ * \brief	Encode an integer with a prefix of n bits.
+ * \param	out			Output buffer
+ * \param	size		Size of out
+ * \param	flags		Bits above the prefix in the first byte
+ * \param	n				Prefix bits
+ * \param	value		Integer
+ * \return	Bytes written, -1 if out is too small.
+ */
+static ssize_t hpack_int_encode(uint8_t *out, size_t size, uint8_t flags, int n, size_t value);
+
+/**
+ * \brief	Decode a string literal into scratch.
+ * \param	hpack		Struct hpack
+ * \param	p				Position in block, moved past the string
+ * \param	end			End of block
+ * \param	at			Offset in scratch to write at
+ * \param	len			Length of decoded string
+ * \return	0 if Ok, -1 on error.
+ */
+static int hpack_str_decode(st_hpack *hpack, const uint8_t **p, const uint8_t *end, size_t at, size_t *len);
+
+/**
+ * \brief	Encode a string literal.
+ * \param	out			Output buffer
+ * \param	size		Size of out
+ * \param	str			String
+ * \param	len			Length of str
+ * \param	lower		Lowercase while encoding
+ * \return	Bytes written, -1 if out is too small.
+ */
+static ssize_t hpack_str_encode(uint8_t *out, size_t size, const char *str, size_t len, int lower);
+
+/**
+ * \brief	Make room in scratch.
+ * \param	hpack		Struct hpack
+ * \param	need		Bytes needed
+ * \return	0 if Ok, -1 on error.
+ */
+static int hpack_scratch(st_hpack *hpack, size_t need);
+
+/**
+ * \brief	Copy the name, and value if wanted, of an index into scratch.
+ * \param	hpack		Struct hpack
+ * \param	index		Index, static or dynamic
+ * \param	name_len	Length of name
+ * \param	value_len	Length of value, NULL to skip the value
+ * \return	0 if Ok, -1 if index is not in the tables.
+ */
+static int hpack_index_copy(st_hpack *hpack, uint32_t index, size_t *name_len, size_t *value_len);
+
+/**
+ * \brief	Add the field in scratch to the dynamic table.
+ * \param	hpack		Struct hpack
+ * \param	name_len	Length of name
+ * \param	value_len	Length of value
+ * \return	0 if Ok, -1 on error.
+ */
+static int hpack_table_add(st_hpack *hpack, size_t name_len, size_t value_len);
+
+/**
+ * \brief	Drop the oldest entries until the table fits in max.
+ * \param	hpack		Struct hpack
+ * \param	max			Size to fit in
+ */
+static void hpack_table_evict(st_hpack *hpack, size_t max);
+
+/*****************************************************************************/
+/* Functions to hpack
+*/
+/*****************************************************************************/
+
+int hpack_init(st_hpack *hpack, size_t limit)
+{
+  if (hpack == NULL)
+    return -1;
+
+  pthread_once(&hpack_huff_once, hpack_huff_build);
+
+  memset(hpack, 0, sizeof(st_hpack));
+  hpack->cap = (uint32_t)(limit / HPACK_ENTRY_OVERHEAD + 1);
+  hpack->entries = (st_hpack_entry *)calloc(hpack->cap, sizeof(st_hpack_entry));
+  if (hpack->entries == NULL)
+    return -1;
+
+  hpack->max_size = hpack->limit = limit;
+  return 0;
+}
+/*****************************************************************************/
+
+int hpack_free(st_hpack *hpack)
+{
+  if (hpack == NULL)
+    return -1;
+
+  hpack_table_evict(hpack, 0);
+  free(hpack->entries);
+  free(hpack->scratch);
+  memset(hpack, 0, sizeof(st_hpack));
+  return 0;
+}
+/*****************************************************************************/
+
+int hpack_decode(st_hpack *hpack, const uint8_t *block, size_t len, hpack_emit_fn emit, void *arg)
+{
+  const uint8_t *p = block, *end = block + len;
+  size_t name_len, value_len;
+  int fields = 0, index_it;
+  uint32_t index;
+
+  if (hpack == NULL || (block == NULL && len > 0) || emit == NULL)
+    return -1;
+
+  while (p < end) {
+    if (*p & 0x80) {
+      /* Indexed field */
+      if (hpack_int_decode(&p, end, 7, &index) != 0 || index == 0 ||
+          hpack_index_copy(hpack, index, &name_len, &value_len) != 0)
+        return -1;
+    } else if ((*p & 0xe0) == 0x20) {
+      /* Table size update, only before the first field */
+      if (fields > 0 || hpack_int_decode(&p, end, 5, &index) != 0 || index > hpack->limit)
+        return -1;
+      hpack->max_size = index;
+      hpack_table_evict(hpack, index);
+      continue;
+    } else {
+      /* Literal: with indexing (01), without (0000) or never indexed (0001) */
+      index_it = (*p & 0xc0) == 0x40;
+      if (hpack_int_decode(&p, end, index_it ? 6 : 4, &index) != 0)
+        return -1;
+
+      if (index > 0) {
+        if (hpack_index_copy(hpack, index, &name_len, NULL) != 0)
+          return -1;
+      } else if (hpack_str_decode(hpack, &p, end, 0, &name_len) != 0) {
+        return -1;
+      }
+
+      if (hpack_str_decode(hpack, &p, end, name_len + 1, &value_len) != 0)
+        return -1;
+
+      if (index_it && hpack_table_add(hpack, name_len, value_len) != 0)
+        return -1;
+    }
+
+    fields++;
+    if (emit(arg, hpack->scratch, name_len, hpack->scratch + name_len + 1, value_len) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+/*****************************************************************************/
+
+ssize_t hpack_encode(uint8_t *out, size_t size, const char *name, const char *value)
+{
+  size_t name_len, value_len;
+  ssize_t n, used;
+  int i, found = 0;
+
+  if (out == NULL || name == NULL || value == NULL)
+    return -1;
+
+  pthread_once(&hpack_huff_once, hpack_huff_build);
+
+  for (i = 1; i <= HPACK_STATIC_COUNT; i++) {
+    if (strcasecmp(hpack_static[i].name, name) != 0)
+      continue;
+    if (strcmp(hpack_static[i].value, value) == 0)
+      return hpack_int_encode(out, size, 0x80, 7, (size_t)i);
+    if (found == 0)
+      found = i;
+  }
+
+  name_len = strlen(name);
+  value_len = strlen(value);
+
+  /* Literal without indexing, so the peer's table is never touched */
+  if ((used = hpack_int_encode(out, size, 0x00, 4, (size_t)found)) < 0)
+    return -1;
+
+  if (found == 0) {
+    if ((n = hpack_str_encode(out + used, size - (size_t)used, name, name_len, 1)) < 0)
+      return -1;
+    used += n;
+  }
+
+  if ((n = hpack_str_encode(out + used, size - (size_t)used, value, value_len, 0)) < 0)
+    return -1;
+
+  return used + n;
+}
+/*****************************************************************************/
+
+ssize_t hpack_huffman_decode(const uint8_t *in, size_t len, char *out, size_t size)
+{
+  uint64_t acc = 0;
+  uint32_t peek;
+  size_t i = 0, used = 0;
+  int bits = 0, n, sym;
+
+  pthread_once(&hpack_huff_once, hpack_huff_build);
+
+  for (;;) {
+    while (bits <= 56 && i < len) {
+      acc |= (uint64_t)in[i++] << (56 - bits);
+      bits += 8;
+    }
+    if (bits == 0)
+      break;
+
+    peek = (uint32_t)(acc >> 32);
+    for (n = 5; peek >= hpack_huff.limit[n]; n++)
+      ;
+
+    if (n > bits) {
+      /* Padding: fewer than 8 bits, all of them ones */
+      if (bits >= 8 || (peek >> (32 - bits)) != (1u << bits) - 1)
+        return -1;
+      break;
+    }
+
+    sym = hpack_huff.sorted[hpack_huff.offset[n] + (int32_t)(peek >> (32 - n))];
+    if (sym == HPACK_EOS || used == size)
+      return -1;
+
+    out[used++] = (char)sym;
+    acc <<= n;
+    bits -= n;
+  }
+
+  return (ssize_t)used;
+}
+/*****************************************************************************/
+
+size_t hpack_huffman_encode(const char *in, size_t len, uint8_t *out, int lower)
+{
+  uint64_t acc = 0;
+  size_t i, used = 0;
+  int bits = 0;
+  unsigned char c;
+
+  pthread_once(&hpack_huff_once, hpack_huff_build);
+
+  for (i = 0; i < len; i++) {
+    c = (unsigned char)in[i];
+    if (lower && c >= 'A' && c <= 'Z')
+      c = (unsigned char)(c + 'a' - 'A');
+
+    acc = acc << hpack_huff_len[c] | hpack_huff.code[c];
+    bits += hpack_huff_len[c];
+
+    while (bits >= 8) {
+      bits -= 8;
+      if (out != NULL)
+        out[used] = (uint8_t)(acc >> bits);
+      used++;
+    }
+  }
+
+  if (bits > 0) {
+    /* Pad with the high bits of EOS, all ones */
+    if (out != NULL)
+      out[used] = (uint8_t)(acc << (8 - bits) | (0xffu >> bits));
+    used++;
+  }
+
+  return used;
+}
+
+/*****************************************************************************/
+/* Static Functions
+*/
+/*****************************************************************************/
+
+static void hpack_huff_build(void)
+{
+  uint32_t code = 0, count[31] = { 0 };
+  int32_t index = 0;
+  int n, sym;
+
+  for (sym = 0; sym <= HPACK_EOS; sym++)
+    count[hpack_huff_len[sym]]++;
+
+  for (n = 1; n <= 30; n++) {
+    /* Symbols of this length, in value order */
+    hpack_huff.offset[n] = index - (int32_t)code;
+    for (sym = 0; sym <= HPACK_EOS; sym++) {
+      if (hpack_huff_len[sym] == n) {
+        hpack_huff.code[sym] = code++;
+        hpack_huff.sorted[index++] = (uint16_t)sym;
+      }
+    }
+    hpack_huff.limit[n] = (uint64_t)code << (32 - n);
+    code <<= 1;
+  }
+}
+/*****************************************************************************/
+
+static int hpack_int_decode(const uint8_t **p, const uint8_t *end, int n, uint32_t *value)
+{
+  uint32_t max = (1u << n) - 1, v;
+  int shift = 0;
+  uint8_t b;
+
+  if (*p >= end)
+    return -1;
+
+  v = *(*p)++ & max;
+  if (v < max) {
+    *value = v;
+    return 0;
+  }
+
+  do {
+    if (*p >= end || shift > 28)
+      return -1;
+    b = *(*p)++;
+    v += (uint32_t)(b & 0x7f) << shift;
+    if (v > HPACK_INT_MAX)
+      return -1;
+    shift += 7;
+  } while (b & 0x80);
+
+  *value = v;
+  return 0;
+}
+/*****************************************************************************/
+
+static ssize_t hpack_int_encode(uint8_t *out, size_t size, uint8_t flags, int n, size_t value)
+{
+  size_t max = ((size_t)1 << n) - 1, used = 0;
+
+  if (size == 0)
+    return -1;
+
+  if (value < max) {
+    out[0] = (uint8_t)(flags | value);
+    return 1;
+  }
+
+  out[used++] = (uint8_t)(flags | max);
+  value -= max;
+
+  while (value >= 0x80) {
+    if (used == size)
+      return -1;
+    out[used++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+
+  if (used == size)
+    return -1;
+  out[used++] = (uint8_t)value;
+  return (ssize_t)used;
+}
+/*****************************************************************************/
+
+static int hpack_str_decode(st_hpack *hpack, const uint8_t **p, const uint8_t *end, size_t at, size_t *len)
+{
+  uint32_t raw;
+  ssize_t n;
+  int huffman;
+
+  if (*p >= end)
+    return -1;
+
+  huffman = **p & 0x80;
+  if (hpack_int_decode(p, end, 7, &raw) != 0 || raw > (size_t)(end - *p))
+    return -1;
+
+  /* Shortest code is 5 bits, so a string grows at most by 8/5 */
+  if (hpack_scratch(hpack, at + (size_t)raw * 8 / 5 + 2) != 0)
+    return -1;
+
+  if (huffman) {
+    if ((n = hpack_huffman_decode(*p, raw, hpack->scratch + at, (size_t)raw * 8 / 5 + 1)) < 0)
+      return -1;
+    *len = (size_t)n;
+  } else {
+    memcpy(hpack->scratch + at, *p, raw);
+    *len = raw;
+  }
+
+  hpack->scratch[at + *len] = 0;
+  *p += raw;
+  return 0;
+}
+/*****************************************************************************/
+
+static ssize_t hpack_str_encode(uint8_t *out, size_t size, const char *str, size_t len, int lower)
+{
+  size_t hlen = hpack_huffman_encode(str, len, NULL, lower), i;
+  ssize_t n;
+
+  if (hlen < len) {
+    if ((n = hpack_int_encode(out, size, 0x80, 7, hlen)) < 0 || size - (size_t)n < hlen)
+      return -1;
+    hpack_huffman_encode(str, len, out + n, lower);
+    return n + (ssize_t)hlen;
+  }
+
+  if ((n = hpack_int_encode(out, size, 0x00, 7, len)) < 0 || size - (size_t)n < len)
+    return -1;
+
+  for (i = 0; i < len; i++)
+    out[n + (ssize_t)i] = (uint8_t)((lower && str[i] >= 'A' && str[i] <= 'Z') ? str[i] + 'a' - 'A' : str[i]);
+
+  return n + (ssize_t)len;
+}
+/*****************************************************************************/
+
+static int hpack_scratch(st_hpack *hpack, size_t need)
+{
+  size_t cap;
+  char *scratch;
+
+  if (need <= hpack->scratch_cap)
+    return 0;
+
+  for (cap = hpack->scratch_cap ? hpack->scratch_cap : 256; cap < need; cap *= 2)
+    ;
+
+  scratch = (char *)realloc(hpack->scratch, cap);
+  if (scratch == NULL)
+    return -1;
+
+  hpack->scratch = scratch;
+  hpack->scratch_cap = cap;
+  return 0;
+}
+/*****************************************************************************/
+
+static int hpack_index_copy(st_hpack *hpack, uint32_t index, size_t *name_len, size_t *value_len)
+{
+  const char *name, *value;
+  st_hpack_entry *entry;
+  size_t vlen;
+
+  if (index == 0)
+    return -1;
+
+  if (index <= HPACK_STATIC_COUNT) {
+    name = hpack_static[index].name;
+    value = hpack_static[index].value;
+    *name_len = strlen(name);
+    vlen = strlen(value);
+  } else {
+    if (index - HPACK_STATIC_COUNT > hpack->count)
+      return -1;
+    entry = &hpack->entries[(hpack->head + index - HPACK_STATIC_COUNT - 1) % hpack->cap];
+    name = entry->name;
+    value = entry->name + entry->name_len + 1;
+    *name_len = entry->name_len;
+    vlen = entry->value_len;
+  }
+
+  /* Copied, as adding the field to the table may evict its source */
+  if (hpack_scratch(hpack, *name_len + vlen + 2) != 0)
+    return -1;
+
+  memcpy(hpack->scratch, name, *name_len + 1);
+  if (value_len != NULL) {
+    memcpy(hpack->scratch + *name_len + 1, value, vlen + 1);
+    *value_len = vlen;
+  }
+  return 0;
+}
+/*****************************************************************************/
+
+static int hpack_table_add(st_hpack *hpack, size_t name_len, size_t value_len)
+{
+  size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+  st_hpack_entry *entry;
+  char *block;
+
+  /* An entry larger than the table just empties it, RFC 7541 4.4 */
+  if (size > hpack->max_size) {
+    hpack_table_evict(hpack, 0);
+    return 0;
+  }
+
+  hpack_table_evict(hpack, hpack->max_size - size);
+
+  block = (char *)malloc(name_len + value_len + 2);
+  if (block == NULL)
+    return -1;
+  memcpy(block, hpack->scratch, name_len + value_len + 2);
+
+  hpack->head = (hpack->head + hpack->cap - 1) % hpack->cap;
+  entry = &hpack->entries[hpack->head];
+  entry->name = block;
+  entry->name_len = name_len;
+  entry->value_len = value_len;
+  hpack->count++;
+  hpack->size += size;
+  return 0;
+}
+/*****************************************************************************/
+
+static void hpack_table_evict(st_hpack *hpack, size_t max)
+{
+  st_hpack_entry *entry;
+
+  while (hpack->count > 0 && hpack->size > max) {
+    entry = &hpack->entries[(hpack->head + hpack->count - 1) % hpack->cap];
+    hpack->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+    free(entry->name);
+    entry->name = NULL;
+    hpack->count--;
+  }
+}
+/*****************************************************************************/
@@ -0,0 +1,111 @@
+#ifndef __HPACK_H_INCLUDED__
+#define __HPACK_H_INCLUDED__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//! Default size of the dynamic table (SETTINGS_HEADER_TABLE_SIZE)
+#define HPACK_TABLE_SIZE        4096
+//! Entries of the static table
+#define HPACK_STATIC_COUNT      61
+
+/**
+ * \brief	Receives each decoded header field.
+ * \param	arg			Argument given with the callback
+ * \param	name		Name, NUL terminated, valid only during the call
+ * \param	name_len	Length of name
+ * \param	value		Value, NUL terminated, valid only during the call
+ * \param	value_len	Length of value
+ * \return	0 to go on, -1 to abort decoding.
+ */
+typedef int (*hpack_emit_fn)(void* arg, const char* name, size_t name_len,
+                             const char* value, size_t value_len);
+
+//! Entry of the dynamic table, name and value in one block
+typedef struct {
+	char* name;										//!< Name, value follows its NUL
+	size_t name_len;							//!< Length of name
+	size_t value_len;							//!< Length of value
+} st_hpack_entry;
+
+//! HPACK decoder state of one connection
+typedef struct {
+	st_hpack_entry* entries;			//!< Ring of dynamic entries, newest at head
+	uint32_t cap;									//!< Slots in entries
+	uint32_t head;								//!< Slot of the newest entry
+	uint32_t count;								//!< Entries in the table
+	size_t size;									//!< Size as counted by RFC 7541 4.1
+	size_t max_size;							//!< Size set by the last table size update
+	size_t limit;									//!< Largest size the peer may choose
+	char* scratch;								//!< Decoded name and value
+	size_t scratch_cap;						//!< Size of scratch
+} st_hpack;
+
+/**
+ * \brief	Initialize decoder.
+ * \param	hpack	Struct that will be initialized.
+ * \param	limit	Table size announced in SETTINGS_HEADER_TABLE_SIZE
+ * \return	0 if Ok or -1 on error.
+ */
+int hpack_init(st_hpack* hpack, size_t limit);
+
+/**
+ * \brief	Frees memory space used by the decoder.
+ * \param	hpack	Struct hpack
+ * \return	0 if Ok or -1 if param is null.
+ */
+int hpack_free(st_hpack* hpack);
+
+/**
+ * \brief	Decode a complete header block.
+ *
+ * Handles indexed fields, literals with and without indexing, Huffman
+ * strings and table size updates. Any error is a connection error
+ * (COMPRESSION_ERROR), as the table can not be trusted afterwards.
+ *
+ * \param	hpack	Struct hpack
+ * \param	block	Header block, CONTINUATION frames already joined
+ * \param	len		Length of block
+ * \param	emit	Receives each field in order
+ * \param	arg		Argument of emit
+ * \return	0 if Ok, -1 on error.
+ */
+int hpack_decode(st_hpack* hpack, const uint8_t* block, size_t len, hpack_emit_fn emit, void* arg);
+
+/**
+ * \brief	Encode one header field without touching any table.
+ *
+ * Uses the static table for whole fields and names when it can, Huffman
+ * when it is shorter, and lowercases the name as HTTP/2 requires.
+ *
+ * \param	out			Output buffer
+ * \param	size		Size of out
+ * \param	name		Name, NUL terminated
+ * \param	value		Value, NUL terminated
+ * \return	Bytes written, -1 if out is too small.
+ */
+ssize_t hpack_encode(uint8_t* out, size_t size, const char* name, const char* value);
+
+/**
+ * \brief	Decode a Huffman string.
+ * \param	in			Encoded bytes
+ * \param	len			Length of in
+ * \param	out			Output buffer, needs at most len * 8 / 5 bytes
+ * \param	size		Size of out
+ * \return	Length of decoded string, -1 on error.
+ */
+ssize_t hpack_huffman_decode(const uint8_t* in, size_t len, char* out, size_t size);
+
+/**
+ * \brief	Huffman encode a string.
+ * \param	in			String
+ * \param	len			Length of in
+ * \param	out			Output buffer, may be NULL to get the length only
+ * \param	lower		Lowercase while encoding
+ * \return	Length of the encoded string.
+ */
+size_t hpack_huffman_encode(const char* in, size_t len, uint8_t* out, int lower);
+
+#endif /* __HPACK_H_INCLUDED__ */
@@ -0,0 +1,1842 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  http2.c
+ *
+ *    Description:  HTTP/2 连接 (h2c and prior knowledge, streams run as jobs)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "hpack.h"
+#include "http2.h"
+#include "hugemem.h"
+#include "trace.h"
+
+#define H2_PREFACE           "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_HEADER_LEN        9
+#define H2_WINDOW_MAX        0x7fffffff
+#define H2_READ_BUFFER       (4 * (H2_HEADER_LEN + H2_FRAME_SIZE))
+#define H2_BUFFER            (H2_READ_BUFFER > H2_HEADER_BLOCK_MAX ? H2_READ_BUFFER : H2_HEADER_BLOCK_MAX)
+
+
+/* Frame types */
+enum h2_type
+{
+	H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+	H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+
+/* Frame flags */
+#define H2_FLAG_END_STREAM   0x01
+#define H2_FLAG_ACK          0x01
+#define H2_FLAG_END_HEADERS  0x04
+#define H2_FLAG_PADDED       0x08
+#define H2_FLAG_PRIORITY     0x20
+
+/* Settings */
+enum h2_setting
+{
+	H2_SET_HEADER_TABLE_SIZE = 1, H2_SET_ENABLE_PUSH, H2_SET_MAX_CONCURRENT_STREAMS,
+	H2_SET_INITIAL_WINDOW_SIZE, H2_SET_MAX_FRAME_SIZE, H2_SET_MAX_HEADER_LIST_SIZE
+};
+
+/* Error codes */
+enum h2_error
+{
+	H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+	H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+	H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+};
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+typedef struct h2_conn h2_conn;
+
+
+/* Stream, owned by the connection table and by its job */
+struct h2_stream
+{
+	struct h2_stream* next;                    /* connection table link     */
+	h2_conn*   conn;
+	h2_request req;
+	int        refs;
+	int        in_table;
+	int        remote_closed;                  /* END_STREAM received       */
+	int        local_closed;                   /* END_STREAM sent           */
+	int        reset;                          /* RST_STREAM either way     */
+	int        headers_sent;
+	int        bad;                            /* malformed request         */
+	int        header_count;
+	uint64_t   trace;                          /* trace id, or 0            */
+	int64_t    send_window;
+	int64_t    recv_window;
+	char*      body;
+	size_t     body_cap;
+	char*      pseudo[4];                      /* method path scheme auth.  */
+};
+
+
+/* Connection */
+struct h2_conn
+{
+	int             sockfd;
+	threadpool      pool;
+	h2_handler_fn   handler;
+	void*           arg;
+
+	pthread_mutex_t lock;                      /* everything below          */
+	pthread_cond_t  cond;                      /* windows, jobs, dead       */
+	pthread_mutex_t write_lock;                /* keeps frames whole        */
+
+	h2_stream*      streams;
+	uint32_t        open_count;
+	uint32_t        jobs;                      /* handlers running          */
+	uint32_t        last_stream_id;
+	int             dead;
+	int             goaway;
+
+	int64_t         send_window;
+	int64_t         peer_initial_window;
+	uint32_t        peer_max_frame;
+	int64_t         recv_consumed;             /* not yet given back        */
+
+	st_hpack        hpack;                     /* reader thread only        */
+	uint8_t*        block;                     /* header block being read   */
+	size_t          block_len;
+	uint32_t        block_stream;
+	int             block_end_stream;
+
+	uint8_t*        rbuf;                      /* H2_READ_BUFFER, pooled    */
+	size_t          rpos;
+	size_t          rlen;
+};
+
+
+/* Read buffers and header blocks of all connections */
+static hugemem_pool   h2_buffers;
+static int            h2_buffers_ok;
+static pthread_once_t h2_buffers_once = PTHREAD_ONCE_INIT;
+
+
+/* Pseudo-header names, index into h2_stream.pseudo */
+static const char* h2_pseudo_names[4] = { ":method", ":path", ":scheme", ":authority" };
+
+
+/* Fields that only make sense on an HTTP/1.1 connection */
+static const char* h2_hop_fields[] =
+{
+	"connection", "keep-alive", "proxy-connection", "transfer-encoding",
+	"upgrade", "http2-settings", NULL
+};
+
+
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static h2_conn*   h2_conn_new(threadpool pool, int sockfd, h2_handler_fn handler, void* arg,
+                              const void* preread, size_t preread_len);
+static int        h2_conn_run(h2_conn* conn, int expect_preface);
+static void       h2_conn_free(h2_conn* conn);
+static void       h2_conn_kill(h2_conn* conn);
+static void       h2_buffers_init(void);
+static uint8_t*   h2_buffer_get(void);
+static void       h2_buffer_put(uint8_t* buf);
+static uint8_t*   h2_need(h2_conn* conn, size_t len);
+
+static int        h2_frame(h2_conn* conn, const uint8_t* head, uint8_t* payload);
+static int        h2_on_data(h2_conn* conn, uint32_t sid, uint8_t flags, uint8_t* p, uint32_t len);
+static int        h2_on_headers(h2_conn* conn, uint32_t sid, uint8_t flags, uint8_t* p, uint32_t len);
+static int        h2_on_block(h2_conn* conn);
+static int        h2_on_settings(h2_conn* conn, uint8_t flags, const uint8_t* p, uint32_t len);
+static int        h2_on_window(h2_conn* conn, uint32_t sid, const uint8_t* p, uint32_t len);
+static int        h2_on_rst(h2_conn* conn, uint32_t sid, uint32_t len);
+static int        h2_strip_padding(uint8_t flags, uint8_t** p, uint32_t* len);
+static int        h2_hop_field(const char* name);
+
+static int        h2_header_emit(void* arg, const char* name, size_t name_len,
+                                 const char* value, size_t value_len);
+static int        h2_header_discard(void* arg, const char* name, size_t name_len,
+                                    const char* value, size_t value_len);
+static int        h2_stream_check(h2_stream* stream);
+static h2_stream* h2_stream_new(h2_conn* conn, uint32_t sid);
+static h2_stream* h2_stream_find(h2_conn* conn, uint32_t sid);
+static void       h2_stream_unlink(h2_stream* stream);
+static void       h2_stream_release(h2_stream* stream);
+static uint32_t   h2_stream_dispatch(h2_stream* stream);
+static void       h2_stream_end_local(h2_stream* stream);
+static void*      h2_stream_job(void* arg, int index);
+static void       h2_stream_reset(h2_conn* conn, h2_stream* stream, uint32_t sid, uint32_t code);
+static void       h2_stream_cancel(h2_stream* stream);
+
+static int        h2_write_frame(h2_conn* conn, uint8_t type, uint8_t flags, uint32_t sid,
+                                 const void* payload, size_t len);
+static int        h2_write_locked(h2_conn* conn, uint8_t type, uint8_t flags, uint32_t sid,
+                                  const void* payload, size_t len);
+static int        h2_write_all(h2_conn* conn, struct iovec* iov, int count);
+static int        h2_send_window(h2_conn* conn, uint32_t sid, uint32_t increment);
+static int        h2_send_goaway(h2_conn* conn, uint32_t code);
+static int        h2_settings_apply(h2_conn* conn, uint16_t id, uint32_t value);
+static int        h2_settings_decode(h2_conn* conn, const char* b64);
+
+static inline uint32_t h2_get32(const uint8_t* p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void h2_put32(uint8_t* p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+}
+
+
+
+
+/* ============================ SERVER ============================== */
+
+
+/* Map the buffer pool now rather than on the first connection */
+int h2_init(void)
+{
+	pthread_once(&h2_buffers_once, h2_buffers_init);
+	return h2_buffers_ok ? 0 : -1;
+}
+
+
+/* Sniff the preface */
+int h2_is_preface(const void* buf, size_t len)
+{
+	if(len < H2_PREFACE_LEN)
+	{
+		return memcmp(buf, H2_PREFACE, len) == 0 ? -1 : 0;
+	}
+
+	return memcmp(buf, H2_PREFACE, H2_PREFACE_LEN) == 0;
+}
+
+
+/* Prior knowledge connection */
+int h2_serve(threadpool pool, int sockfd, h2_handler_fn handler, void* arg,
+             const void* preread, size_t preread_len)
+{
+	h2_conn* conn;
+	int result;
+
+	if((conn = h2_conn_new(pool, sockfd, handler, arg, preread, preread_len)) == NULL)
+	{
+		return -1;
+	}
+
+	result = h2_conn_run(conn, 1);
+	h2_conn_free(conn);
+	return result;
+}
+
+
+/* h2c upgrade, RFC 7540 3.2 */
+int h2_upgrade(threadpool pool, int sockfd, h2_handler_fn handler, void* arg,
+               const h2_request* req, const void* preread, size_t preread_len)
+{
+	static const char switching[] =
+		"HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	const char* settings = NULL;
+	const char* name;
+	const char* value;
+	h2_stream* stream;
+	h2_conn*   conn;
+	st_strkv*  kv;
+	struct iovec iov;
+	int result;
+
+	if(req == NULL || req->method == NULL || req->path == NULL)
+	{
+		return -1;
+	}
+
+	if((conn = h2_conn_new(pool, sockfd, handler, arg, preread, preread_len)) == NULL)
+	{
+		return -1;
+	}
+
+	iov.iov_base = (void*)switching;
+	iov.iov_len  = sizeof(switching) - 1;
+
+	if(h2_write_all(conn, &iov, 1) != 0)
+	{
+		h2_conn_free(conn);
+		return -1;
+	}
+
+	/* The request becomes stream 1, already half closed by the client */
+	stream = h2_stream_new(conn, 1);
+
+	if(stream == NULL)
+	{
+		h2_conn_free(conn);
+		return -1;
+	}
+
+	stream->pseudo[0] = strdup(req->method);
+	stream->pseudo[1] = strdup(req->path);
+	stream->pseudo[2] = strdup(req->scheme ? req->scheme : "http");
+
+	for(kv = strkvm_get_next((st_strkvm*)&req->headers, NULL); kv;
+	    kv = strkvm_get_next((st_strkvm*)&req->headers, kv))
+	{
+		name  = strkvm_name(&req->headers, kv);
+		value = kv->val_off != STRKVM_NO_VALUE ? strkvm_value(&req->headers, kv) : "";
+
+		if(strcasecmp(name, "http2-settings") == 0)
+		{
+			settings = value;
+		}
+		else if(strcasecmp(name, "host") == 0 && stream->pseudo[3] == NULL)
+		{
+			stream->pseudo[3] = strdup(value);
+		}
+		else if(!h2_hop_field(name))
+		{
+			h2_header_emit(stream, name, kv->name_len, value, strlen(value));
+		}
+	}
+
+	if(req->body_len > 0 && (stream->body = (char*)malloc(req->body_len)) != NULL)
+	{
+		memcpy(stream->body, req->body, req->body_len);
+		stream->body_cap = req->body_len;
+		stream->req.body_len = req->body_len;
+	}
+
+	stream->remote_closed = 1;
+	conn->last_stream_id  = 1;
+	conn->streams         = stream;
+	conn->open_count      = 1;
+	stream->in_table      = 1;
+
+	if(h2_settings_decode(conn, settings) != 0 || h2_stream_check(stream) != 0 ||
+	   (req->body_len > 0 && stream->body == NULL))
+	{
+		h2_conn_free(conn);
+		return -1;
+	}
+
+	result = h2_conn_run(conn, 1);
+	h2_conn_free(conn);
+	return result;
+}
+
+
+/* New connection state */
+static h2_conn* h2_conn_new(threadpool pool, int sockfd, h2_handler_fn handler, void* arg,
+                            const void* preread, size_t preread_len)
+{
+	h2_conn* conn;
+	int one = 1;
+
+	if(pool == NULL || handler == NULL || preread_len > H2_READ_BUFFER)
+	{
+		return NULL;
+	}
+
+	conn = (h2_conn*)calloc(1, sizeof(h2_conn));
+
+	if(conn == NULL)
+	{
+		Log(("h2_conn_new: Could not allocate memory for connection"));
+		return NULL;
+	}
+
+	if((conn->rbuf = h2_buffer_get()) == NULL)
+	{
+		Log(("h2_conn_new: Could not allocate memory for read buffer"));
+		free(conn);
+		return NULL;
+	}
+
+	if(hpack_init(&conn->hpack, HPACK_TABLE_SIZE) != 0)
+	{
+		h2_buffer_put(conn->rbuf);
+		free(conn);
+		return NULL;
+	}
+
+	pthread_mutex_init(&conn->lock, NULL);
+	pthread_mutex_init(&conn->write_lock, NULL);
+	pthread_cond_init(&conn->cond, NULL);
+
+	conn->sockfd              = sockfd;
+	conn->pool                = pool;
+	conn->handler             = handler;
+	conn->arg                 = arg;
+	conn->send_window         = 65535;
+	conn->peer_initial_window = 65535;
+	conn->peer_max_frame      = 16384;
+
+	/* Frames are written whole, Nagle would only hold back the last one */
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if(preread_len > 0)
+	{
+		memcpy(conn->rbuf, preread, preread_len);
+		conn->rlen = preread_len;
+	}
+
+	return conn;
+}
+
+
+/* Read frames until the connection ends */
+static int h2_conn_run(h2_conn* conn, int expect_preface)
+{
+	uint8_t  settings[3 * 6];
+	uint8_t  head[H2_HEADER_LEN];
+	uint8_t* p;
+	h2_stream* stream;
+	uint32_t len, code;
+	int result = 0, first = 1;
+
+	/* Our SETTINGS must be the first frame we send */
+	settings[0] = 0; settings[1] = H2_SET_MAX_CONCURRENT_STREAMS; h2_put32(settings + 2, H2_MAX_STREAMS);
+	settings[6] = 0; settings[7] = H2_SET_INITIAL_WINDOW_SIZE;    h2_put32(settings + 8, H2_STREAM_WINDOW);
+	settings[12] = 0; settings[13] = H2_SET_ENABLE_PUSH;          h2_put32(settings + 14, 0);
+
+	if(h2_write_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings)) != 0 ||
+	   h2_send_window(conn, 0, H2_CONN_WINDOW - 65535) != 0)
+	{
+		result = -1;
+		goto run_end;
+	}
+
+	/* Upgraded request */
+	if((stream = h2_stream_find(conn, 1)) != NULL && (code = h2_stream_dispatch(stream)) != 0)
+	{
+		h2_stream_reset(conn, stream, 1, code);
+	}
+
+	if(expect_preface)
+	{
+		if((p = h2_need(conn, H2_PREFACE_LEN)) == NULL ||
+		   memcmp(p, H2_PREFACE, H2_PREFACE_LEN) != 0)
+		{
+			result = -1;
+			goto run_end;
+		}
+
+		conn->rpos += H2_PREFACE_LEN;
+	}
+
+	for(;;)
+	{
+		if((p = h2_need(conn, H2_HEADER_LEN)) == NULL)
+		{
+			/* Clean end only between frames */
+			result = conn->rpos == conn->rlen && !conn->dead ? 0 : -1;
+			break;
+		}
+
+		memcpy(head, p, H2_HEADER_LEN);
+		len = (uint32_t)head[0] << 16 | (uint32_t)head[1] << 8 | head[2];
+
+		if(len > H2_FRAME_SIZE || (first && head[3] != H2_SETTINGS))
+		{
+			h2_send_goaway(conn, first ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+			result = -1;
+			break;
+		}
+
+		if((p = h2_need(conn, H2_HEADER_LEN + len)) == NULL)
+		{
+			result = -1;
+			break;
+		}
+
+		conn->rpos += H2_HEADER_LEN + len;
+		first = 0;
+
+		if((result = h2_frame(conn, head, p + H2_HEADER_LEN)) != 0)
+		{
+			h2_send_goaway(conn, (uint32_t)result);
+			result = -1;
+			break;
+		}
+	}
+
+run_end:
+	h2_conn_kill(conn);
+	return result;
+}
+
+
+/* Stop all streams and wait for their jobs */
+static void h2_conn_kill(h2_conn* conn)
+{
+	pthread_mutex_lock(&conn->lock);
+	conn->dead = 1;
+
+	while(conn->streams)
+	{
+		conn->streams->reset = 1;
+		h2_stream_unlink(conn->streams);
+	}
+
+	pthread_cond_broadcast(&conn->cond);
+
+	while(conn->jobs > 0)
+	{
+		pthread_cond_wait(&conn->cond, &conn->lock);
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+}
+
+
+/* Free a connection with no jobs left */
+static void h2_conn_free(h2_conn* conn)
+{
+	h2_conn_kill(conn);
+	hpack_free(&conn->hpack);
+	h2_buffer_put(conn->block);
+	h2_buffer_put(conn->rbuf);
+	pthread_mutex_destroy(&conn->lock);
+	pthread_mutex_destroy(&conn->write_lock);
+	pthread_cond_destroy(&conn->cond);
+	free(conn);
+}
+
+
+/* Map H2_BUFFER_POOL buffers, run once */
+static void h2_buffers_init(void)
+{
+	h2_buffers_ok = hugemem_pool_init(&h2_buffers, H2_BUFFER, H2_BUFFER_POOL, HUGEMEM_DEFAULT) == 0;
+
+	if(!h2_buffers_ok)
+	{
+		Log(("h2_buffers_init: Could not map buffer pool, buffers come from malloc"));
+	}
+}
+
+
+/* Read buffer or header block, H2_BUFFER bytes */
+static uint8_t* h2_buffer_get(void)
+{
+	pthread_once(&h2_buffers_once, h2_buffers_init);
+
+	if(h2_buffers_ok)
+	{
+		return (uint8_t*)hugemem_pool_get(&h2_buffers);
+	}
+
+	return (uint8_t*)malloc(H2_BUFFER);
+}
+
+
+/* Give back a buffer of h2_buffer_get, NULL is fine */
+static void h2_buffer_put(uint8_t* buf)
+{
+	if(h2_buffers_ok)
+	{
+		hugemem_pool_put(&h2_buffers, buf);
+	}
+	else
+	{
+		free(buf);
+	}
+}
+
+
+/* Have len contiguous bytes at rpos
+ *
+ * @return pointer to them, NULL on end of connection or error.
+ */
+static uint8_t* h2_need(h2_conn* conn, size_t len)
+{
+	ssize_t n;
+
+	if(conn->rlen - conn->rpos >= len)
+	{
+		return conn->rbuf + conn->rpos;
+	}
+
+	if(conn->rpos + len > H2_READ_BUFFER)
+	{
+		memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen - conn->rpos);
+		conn->rlen -= conn->rpos;
+		conn->rpos  = 0;
+	}
+
+	while(conn->rlen - conn->rpos < len)
+	{
+		n = recv(conn->sockfd, conn->rbuf + conn->rlen, H2_READ_BUFFER - conn->rlen, 0);
+
+		if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(n <= 0)
+		{
+			return NULL;
+		}
+
+		conn->rlen += (size_t)n;
+	}
+
+	return conn->rbuf + conn->rpos;
+}
+
+
+
+
+/* ============================= FRAMES ============================= */
+
+
+/* Handle one frame
+ *
+ * @return 0, or the error code of a connection error.
+ */
+static int h2_frame(h2_conn* conn, const uint8_t* head, uint8_t* p)
+{
+	uint32_t len   = (uint32_t)head[0] << 16 | (uint32_t)head[1] << 8 | head[2];
+	uint8_t  type  = head[3];
+	uint8_t  flags = head[4];
+	uint32_t sid   = h2_get32(head + 5) & 0x7fffffff;
+
+	/* A header block may not be interrupted */
+	if(conn->block_stream != 0 && (type != H2_CONTINUATION || sid != conn->block_stream))
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	switch(type)
+	{
+		case H2_DATA:
+			return h2_on_data(conn, sid, flags, p, len);
+
+		case H2_HEADERS:
+			return h2_on_headers(conn, sid, flags, p, len);
+
+		case H2_PRIORITY:
+			if(sid == 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+
+			if(len != 5)
+			{
+				h2_stream_reset(conn, NULL, sid, H2_FRAME_SIZE_ERROR);
+			}
+
+			/* Deprecated by RFC 9113, streams run as they come */
+			return 0;
+
+		case H2_RST_STREAM:
+			return h2_on_rst(conn, sid, len);
+
+		case H2_SETTINGS:
+			return sid != 0 ? H2_PROTOCOL_ERROR : h2_on_settings(conn, flags, p, len);
+
+		case H2_PUSH_PROMISE:
+			return H2_PROTOCOL_ERROR;
+
+		case H2_PING:
+			if(len != 8)
+			{
+				return H2_FRAME_SIZE_ERROR;
+			}
+
+			if(sid != 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+
+			if(!(flags & H2_FLAG_ACK))
+			{
+				h2_write_frame(conn, H2_PING, H2_FLAG_ACK, 0, p, 8);
+			}
+
+			return 0;
+
+		case H2_GOAWAY:
+			if(sid != 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+
+			/* No new streams; running ones finish, the peer closes */
+			pthread_mutex_lock(&conn->lock);
+			conn->goaway = 1;
+			pthread_mutex_unlock(&conn->lock);
+			return 0;
+
+		case H2_WINDOW_UPDATE:
+			return h2_on_window(conn, sid, p, len);
+
+		case H2_CONTINUATION:
+			if(conn->block_stream == 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+
+			if(conn->block_len + len > H2_HEADER_BLOCK_MAX)
+			{
+				return H2_ENHANCE_YOUR_CALM;
+			}
+
+			memcpy(conn->block + conn->block_len, p, len);
+			conn->block_len += len;
+
+			return (flags & H2_FLAG_END_HEADERS) ? h2_on_block(conn) : 0;
+
+		default:
+			/* Unknown types are ignored */
+			return 0;
+	}
+}
+
+
+/* DATA */
+static int h2_on_data(h2_conn* conn, uint32_t sid, uint8_t flags, uint8_t* p, uint32_t len)
+{
+	h2_stream* stream;
+	uint32_t frame_len = len;
+	uint32_t give_conn = 0, give_stream = 0, code;
+	size_t   cap;
+	char*    body;
+
+	if(sid == 0)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	if(h2_strip_padding(flags, &p, &len) != 0)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	pthread_mutex_lock(&conn->lock);
+
+	/* The whole frame counts against flow control, padding included */
+	conn->recv_consumed += frame_len;
+
+	if(conn->recv_consumed > H2_CONN_WINDOW)
+	{
+		pthread_mutex_unlock(&conn->lock);
+		return H2_FLOW_CONTROL_ERROR;
+	}
+
+	if(conn->recv_consumed >= H2_CONN_WINDOW / 2)
+	{
+		give_conn = (uint32_t)conn->recv_consumed;
+		conn->recv_consumed = 0;
+	}
+
+	stream = h2_stream_find(conn, sid);
+
+	if(stream == NULL || stream->remote_closed)
+	{
+		if(sid > conn->last_stream_id)
+		{
+			pthread_mutex_unlock(&conn->lock);
+			return H2_PROTOCOL_ERROR;
+		}
+
+		/* A dispatched stream may be freed by its job once the lock is dropped */
+		if(stream != NULL)
+		{
+			h2_stream_cancel(stream);
+		}
+
+		pthread_mutex_unlock(&conn->lock);
+		h2_stream_reset(conn, NULL, sid, H2_STREAM_CLOSED);
+		goto data_window;
+	}
+
+	stream->recv_window -= frame_len;
+
+	if(stream->recv_window < 0 || stream->req.body_len + len > H2_BODY_MAX)
+	{
+		code = stream->recv_window < 0 ? H2_FLOW_CONTROL_ERROR : H2_CANCEL;
+		h2_stream_cancel(stream);
+		pthread_mutex_unlock(&conn->lock);
+		h2_stream_reset(conn, NULL, sid, code);
+		goto data_window;
+	}
+
+	if(stream->req.body_len + len > stream->body_cap)
+	{
+		for(cap = stream->body_cap ? stream->body_cap * 2 : 16384; cap < stream->req.body_len + len; cap *= 2);
+
+		if((body = (char*)realloc(stream->body, cap)) == NULL)
+		{
+			h2_stream_cancel(stream);
+			pthread_mutex_unlock(&conn->lock);
+			h2_stream_reset(conn, NULL, sid, H2_INTERNAL_ERROR);
+			goto data_window;
+		}
+
+		stream->body     = body;
+		stream->body_cap = cap;
+	}
+
+	if(len > 0)
+	{
+		memcpy(stream->body + stream->req.body_len, p, len);
+		stream->req.body_len += len;
+	}
+
+	if(flags & H2_FLAG_END_STREAM)
+	{
+		stream->remote_closed = 1;
+	}
+	else if(stream->recv_window < H2_STREAM_WINDOW / 2)
+	{
+		give_stream = (uint32_t)(H2_STREAM_WINDOW - stream->recv_window);
+		stream->recv_window = H2_STREAM_WINDOW;
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+
+	if(give_stream)
+	{
+		h2_send_window(conn, sid, give_stream);
+	}
+
+	if((flags & H2_FLAG_END_STREAM) && (code = h2_stream_dispatch(stream)) != 0)
+	{
+		h2_stream_reset(conn, stream, sid, code);
+	}
+
+data_window:
+	/* Even discarded data gives back connection window */
+	if(give_conn)
+	{
+		h2_send_window(conn, 0, give_conn);
+	}
+
+	return 0;
+}
+
+
+/* HEADERS, the block may go on in CONTINUATION frames */
+static int h2_on_headers(h2_conn* conn, uint32_t sid, uint8_t flags, uint8_t* p, uint32_t len)
+{
+	if(sid == 0 || (sid & 1) == 0)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	if(h2_strip_padding(flags, &p, &len) != 0)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	if(flags & H2_FLAG_PRIORITY)
+	{
+		if(len < 5)
+		{
+			return H2_FRAME_SIZE_ERROR;
+		}
+
+		p   += 5;
+		len -= 5;
+	}
+
+	if(conn->block == NULL && (conn->block = h2_buffer_get()) == NULL)
+	{
+		return H2_INTERNAL_ERROR;
+	}
+
+	memcpy(conn->block, p, len);
+	conn->block_len        = len;
+	conn->block_stream     = sid;
+	conn->block_end_stream = flags & H2_FLAG_END_STREAM;
+
+	return (flags & H2_FLAG_END_HEADERS) ? h2_on_block(conn) : 0;
+}
+
+
+/* Complete header block: a new request or trailers */
+static int h2_on_block(h2_conn* conn)
+{
+	uint32_t   sid = conn->block_stream;
+	h2_stream* stream;
+	h2_stream  discard;
+	uint32_t   refuse = 0, code;
+	int        trailers = 0;
+
+	conn->block_stream = 0;
+
+	pthread_mutex_lock(&conn->lock);
+
+	if(sid <= conn->last_stream_id)
+	{
+		stream = h2_stream_find(conn, sid);
+
+		if(stream == NULL || stream->remote_closed)
+		{
+			refuse = H2_STREAM_CLOSED;
+		}
+		else
+		{
+			trailers = 1;
+		}
+	}
+	else
+	{
+		conn->last_stream_id = sid;
+		stream = NULL;
+
+		if(conn->goaway || conn->dead || conn->open_count >= H2_MAX_STREAMS)
+		{
+			refuse = H2_REFUSED_STREAM;
+		}
+		else if((stream = h2_stream_new(conn, sid)) == NULL)
+		{
+			refuse = H2_INTERNAL_ERROR;
+		}
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+
+	/* The block is decoded even when refused, to keep the table in sync */
+	if(refuse)
+	{
+		memset(&discard, 0, sizeof(discard));
+
+		if(hpack_decode(&conn->hpack, conn->block, conn->block_len, h2_header_discard, &discard) != 0)
+		{
+			return H2_COMPRESSION_ERROR;
+		}
+
+		h2_stream_reset(conn, NULL, sid, refuse);
+		return 0;
+	}
+
+	if(hpack_decode(&conn->hpack, conn->block, conn->block_len, h2_header_emit, stream) != 0)
+	{
+		if(!trailers)
+		{
+			h2_stream_release(stream);
+		}
+
+		return H2_COMPRESSION_ERROR;
+	}
+
+	/* Trailers must end the stream */
+	if(trailers ? !conn->block_end_stream : h2_stream_check(stream) != 0)
+	{
+		stream->bad = 1;
+	}
+
+	if(stream->bad)
+	{
+		if(trailers)
+		{
+			h2_stream_reset(conn, stream, sid, H2_PROTOCOL_ERROR);
+		}
+		else
+		{
+			h2_stream_release(stream);
+			h2_stream_reset(conn, NULL, sid, H2_PROTOCOL_ERROR);
+		}
+
+		return 0;
+	}
+
+	pthread_mutex_lock(&conn->lock);
+
+	if(!trailers)
+	{
+		stream->next     = conn->streams;
+		conn->streams    = stream;
+		stream->in_table = 1;
+		conn->open_count++;
+	}
+
+	if(conn->block_end_stream)
+	{
+		stream->remote_closed = 1;
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+
+	if(stream->remote_closed && (code = h2_stream_dispatch(stream)) != 0)
+	{
+		h2_stream_reset(conn, stream, sid, code);
+	}
+
+	return 0;
+}
+
+
+/* SETTINGS */
+static int h2_on_settings(h2_conn* conn, uint8_t flags, const uint8_t* p, uint32_t len)
+{
+	uint32_t i;
+	int result;
+
+	if(flags & H2_FLAG_ACK)
+	{
+		return len != 0 ? H2_FRAME_SIZE_ERROR : 0;
+	}
+
+	if(len % 6 != 0)
+	{
+		return H2_FRAME_SIZE_ERROR;
+	}
+
+	for(i = 0; i < len; i += 6)
+	{
+		if((result = h2_settings_apply(conn, (uint16_t)(p[i] << 8 | p[i + 1]), h2_get32(p + i + 2))) != 0)
+		{
+			return result;
+		}
+	}
+
+	h2_write_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+	return 0;
+}
+
+
+/* One setting of the peer
+ *
+ * @return 0, or the error code of a connection error.
+ */
+static int h2_settings_apply(h2_conn* conn, uint16_t id, uint32_t value)
+{
+	h2_stream* stream;
+	int64_t delta;
+
+	switch(id)
+	{
+		case H2_SET_ENABLE_PUSH:
+			return value > 1 ? H2_PROTOCOL_ERROR : 0;
+
+		case H2_SET_INITIAL_WINDOW_SIZE:
+			if(value > H2_WINDOW_MAX)
+			{
+				return H2_FLOW_CONTROL_ERROR;
+			}
+
+			/* Applies to the windows of open streams too */
+			pthread_mutex_lock(&conn->lock);
+			delta = (int64_t)value - conn->peer_initial_window;
+			conn->peer_initial_window = value;
+
+			for(stream = conn->streams; stream; stream = stream->next)
+			{
+				stream->send_window += delta;
+
+				if(stream->send_window > H2_WINDOW_MAX)
+				{
+					pthread_mutex_unlock(&conn->lock);
+					return H2_FLOW_CONTROL_ERROR;
+				}
+			}
+
+			pthread_cond_broadcast(&conn->cond);
+			pthread_mutex_unlock(&conn->lock);
+			return 0;
+
+		case H2_SET_MAX_FRAME_SIZE:
+			if(value < 16384 || value > 16777215)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+
+			/* Our frames stay within what we accept ourselves */
+			pthread_mutex_lock(&conn->lock);
+			conn->peer_max_frame = value < H2_FRAME_SIZE ? value : H2_FRAME_SIZE;
+			pthread_mutex_unlock(&conn->lock);
+			return 0;
+
+		default:
+			/* Header table size needs nothing, the encoder has no table */
+			return 0;
+	}
+}
+
+
+/* WINDOW_UPDATE */
+static int h2_on_window(h2_conn* conn, uint32_t sid, const uint8_t* p, uint32_t len)
+{
+	h2_stream* stream;
+	uint32_t increment;
+
+	if(len != 4)
+	{
+		return H2_FRAME_SIZE_ERROR;
+	}
+
+	increment = h2_get32(p) & 0x7fffffff;
+
+	if(sid == 0)
+	{
+		if(increment == 0)
+		{
+			return H2_PROTOCOL_ERROR;
+		}
+
+		pthread_mutex_lock(&conn->lock);
+		conn->send_window += increment;
+
+		if(conn->send_window > H2_WINDOW_MAX)
+		{
+			pthread_mutex_unlock(&conn->lock);
+			return H2_FLOW_CONTROL_ERROR;
+		}
+
+		pthread_cond_broadcast(&conn->cond);
+		pthread_mutex_unlock(&conn->lock);
+		return 0;
+	}
+
+	if(sid > conn->last_stream_id)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	stream = h2_stream_find(conn, sid);
+
+	if(stream != NULL)
+	{
+		stream->send_window += increment;
+
+		if(increment == 0 || stream->send_window > H2_WINDOW_MAX)
+		{
+			/* Its job may be running, unlink before the lock is dropped */
+			h2_stream_cancel(stream);
+			pthread_mutex_unlock(&conn->lock);
+			h2_stream_reset(conn, NULL, sid, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+			return 0;
+		}
+
+		pthread_cond_broadcast(&conn->cond);
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+	return 0;
+}
+
+
+/* RST_STREAM */
+static int h2_on_rst(h2_conn* conn, uint32_t sid, uint32_t len)
+{
+	h2_stream* stream;
+
+	if(len != 4)
+	{
+		return H2_FRAME_SIZE_ERROR;
+	}
+
+	if(sid == 0 || sid > conn->last_stream_id)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	pthread_mutex_lock(&conn->lock);
+
+	if((stream = h2_stream_find(conn, sid)) != NULL)
+	{
+		stream->reset = 1;
+		h2_stream_unlink(stream);
+		pthread_cond_broadcast(&conn->cond);
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+	return 0;
+}
+
+
+/* Drop the padding of DATA and HEADERS */
+static int h2_strip_padding(uint8_t flags, uint8_t** p, uint32_t* len)
+{
+	uint8_t pad;
+
+	if(!(flags & H2_FLAG_PADDED))
+	{
+		return 0;
+	}
+
+	if(*len < 1 || (pad = (*p)[0]) >= *len)
+	{
+		return -1;
+	}
+
+	*p   += 1;
+	*len -= 1 + (uint32_t)pad;
+	return 0;
+}
+
+
+
+
+/* ============================ STREAMS ============================= */
+
+
+/* Store a decoded field of a request */
+static int h2_header_emit(void* arg, const char* name, size_t name_len,
+                          const char* value, size_t value_len)
+{
+	h2_stream* stream = (h2_stream*)arg;
+	size_t n;
+	int    i;
+
+	if(stream->bad)
+	{
+		return 0;
+	}
+
+	/* NUL, CR or LF in a value would split the field once rebuilt as HTTP/1 */
+	if(++stream->header_count > H2_HEADERS_MAX || name_len == 0 ||
+	   memchr(name, 0, name_len) != NULL || memchr(value, 0, value_len) != NULL ||
+	   memchr(value, '\r', value_len) != NULL || memchr(value, '\n', value_len) != NULL)
+	{
+		stream->bad = 1;
+		return 0;
+	}
+
+	if(name[0] == ':')
+	{
+		/* Pseudo-headers come first and only once */
+		for(i = 0; i < 4 && strcmp(name, h2_pseudo_names[i]) != 0; i++);
+
+		if(i == 4 || stream->pseudo[i] != NULL || strkvm_count(&stream->req.headers) > 0 ||
+		   stream->req.method != NULL ||
+		   (stream->pseudo[i] = strdup(value)) == NULL)
+		{
+			stream->bad = 1;
+		}
+
+		return 0;
+	}
+
+	/* Names must be sent in lower case */
+	for(n = 0; n < name_len; n++)
+	{
+		if(name[n] >= 'A' && name[n] <= 'Z')
+		{
+			stream->bad = 1;
+			return 0;
+		}
+	}
+
+	/* Connection specific fields make a request malformed */
+	if(h2_hop_field(name) || strkvm_add_n(&stream->req.headers, name, name_len, value, value_len) != 0)
+	{
+		stream->bad = 1;
+	}
+
+	return 0;
+}
+
+
+/* Connection specific field, any case */
+static int h2_hop_field(const char* name)
+{
+	int i;
+
+	for(i = 0; h2_hop_fields[i]; i++)
+	{
+		if(strcasecmp(name, h2_hop_fields[i]) == 0)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Decode a refused block for nothing */
+static int h2_header_discard(void* arg, const char* name, size_t name_len,
+                             const char* value, size_t value_len)
+{
+	(void)arg; (void)name; (void)name_len; (void)value; (void)value_len;
+	return 0;
+}
+
+
+/* Fill the request view, RFC 9113 8.3.1
+ *
+ * @return 0 if the request is well formed, -1 otherwise.
+ */
+static int h2_stream_check(h2_stream* stream)
+{
+	if(stream->bad || stream->pseudo[0] == NULL)
+	{
+		return -1;
+	}
+
+	/* CONNECT carries only :method and :authority */
+	if(strcmp(stream->pseudo[0], "CONNECT") == 0 ?
+	   (stream->pseudo[3] == NULL || stream->pseudo[1] || stream->pseudo[2]) :
+	   (stream->pseudo[1] == NULL || stream->pseudo[1][0] == 0 || stream->pseudo[2] == NULL))
+	{
+		return -1;
+	}
+
+	stream->req.method    = stream->pseudo[0];
+	stream->req.path      = stream->pseudo[1];
+	stream->req.scheme    = stream->pseudo[2];
+	stream->req.authority = stream->pseudo[3];
+	return 0;
+}
+
+
+/* New stream, not yet in the table */
+static h2_stream* h2_stream_new(h2_conn* conn, uint32_t sid)
+{
+	h2_stream* stream = (h2_stream*)calloc(1, sizeof(h2_stream));
+
+	if(stream == NULL)
+	{
+		Log(("h2_stream_new: Could not allocate memory for stream"));
+		return NULL;
+	}
+
+	strkvm_init(&stream->req.headers);
+	stream->conn          = conn;
+	stream->req.stream_id = sid;
+	stream->refs          = 1;
+	stream->send_window   = conn->peer_initial_window;
+	stream->recv_window   = H2_STREAM_WINDOW;
+	stream->trace         = trace_begin();
+	return stream;
+}
+
+
+/* Stream in the table, conn->lock held */
+static h2_stream* h2_stream_find(h2_conn* conn, uint32_t sid)
+{
+	h2_stream* stream;
+
+	for(stream = conn->streams; stream && stream->req.stream_id != sid; stream = stream->next);
+	return stream;
+}
+
+
+/* Take a stream out of the table, conn->lock held */
+static void h2_stream_unlink(h2_stream* stream)
+{
+	h2_conn*    conn = stream->conn;
+	h2_stream** pp;
+
+	if(!stream->in_table)
+	{
+		return;
+	}
+
+	for(pp = &conn->streams; *pp != stream; pp = &(*pp)->next);
+
+	*pp = stream->next;
+	stream->in_table = 0;
+	conn->open_count--;
+	h2_stream_release(stream);
+}
+
+
+/* Drop a reference, conn->lock held unless the stream was never shared */
+static void h2_stream_release(h2_stream* stream)
+{
+	int i;
+
+	if(--stream->refs > 0)
+	{
+		return;
+	}
+
+	for(i = 0; i < 4; i++)
+	{
+		free(stream->pseudo[i]);
+	}
+
+	strkvm_free(&stream->req.headers);
+	free(stream->body);
+	free(stream);
+}
+
+
+/* Hand a complete request to the pool
+ *
+ * @return 0 on success, else the error code to reset the stream with
+ */
+static uint32_t h2_stream_dispatch(h2_stream* stream)
+{
+	h2_conn* conn = stream->conn;
+	uint64_t prev;
+	int      result;
+
+	stream->req.body = stream->body;
+	trace_point(stream->trace, TRACE_PARSE_DONE);
+
+	pthread_mutex_lock(&conn->lock);
+	stream->refs++;
+	conn->jobs++;
+	pthread_mutex_unlock(&conn->lock);
+
+	prev   = trace_set_current(stream->trace);
+	/* No socket: a stream can not be answered with a raw 503 from the queue.
+	 * Not keyed: the reader may be blocked in recv on the home worker, and
+	 * streams of one connection are meant to run in parallel */
+	result = thpool_add_work(conn->pool, h2_stream_job, stream, -1);
+	trace_set_current(prev);
+
+	if(result != 0)
+	{
+		pthread_mutex_lock(&conn->lock);
+		stream->refs--;
+		conn->jobs--;
+		pthread_mutex_unlock(&conn->lock);
+
+		/* Refused streams were not processed, the client may retry them */
+		return result == THPOOL_SHED ? H2_REFUSED_STREAM : H2_INTERNAL_ERROR;
+	}
+
+	return 0;
+}
+
+
+/* Job: run the handler of one stream */
+static void* h2_stream_job(void* arg, int index)
+{
+	h2_stream* stream = (h2_stream*)arg;
+	h2_conn*   conn   = stream->conn;
+	int        gone;
+
+	(void)index;
+
+	conn->handler(stream, &stream->req, conn->arg);
+	trace_point(stream->trace, TRACE_HANDLER_DONE);
+
+	pthread_mutex_lock(&conn->lock);
+	gone = stream->reset || conn->dead;
+	pthread_mutex_unlock(&conn->lock);
+
+	/* Make sure the stream ends */
+	if(!gone && !stream->headers_sent)
+	{
+		h2_respond(stream, 500, NULL, NULL, 0);
+	}
+	else if(!gone && !stream->local_closed)
+	{
+		h2_send_data(stream, NULL, 0, 1);
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	h2_stream_release(stream);
+	conn->jobs--;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+
+	return NULL;
+}
+
+
+/* Reset a stream, stream may be NULL if not in the table; a dispatched one
+ * must instead be cancelled under the lock it was found with */
+static void h2_stream_reset(h2_conn* conn, h2_stream* stream, uint32_t sid, uint32_t code)
+{
+	uint8_t payload[4];
+
+	if(stream != NULL)
+	{
+		pthread_mutex_lock(&conn->lock);
+		h2_stream_cancel(stream);
+		pthread_mutex_unlock(&conn->lock);
+	}
+
+	h2_put32(payload, code);
+	h2_write_frame(conn, H2_RST_STREAM, 0, sid, payload, 4);
+}
+
+
+/* Mark a stream reset and drop it from the table, conn->lock held */
+static void h2_stream_cancel(h2_stream* stream)
+{
+	stream->reset = 1;
+	h2_stream_unlink(stream);
+	pthread_cond_broadcast(&stream->conn->cond);
+}
+
+
+/* Close our side of a stream, it leaves the table once both sides are */
+static void h2_stream_end_local(h2_stream* stream)
+{
+	trace_point(stream->trace, TRACE_LAST_BYTE);
+
+	pthread_mutex_lock(&stream->conn->lock);
+	stream->local_closed = 1;
+
+	if(stream->remote_closed)
+	{
+		h2_stream_unlink(stream);
+	}
+
+	pthread_mutex_unlock(&stream->conn->lock);
+}
+
+
+
+
+/* =========================== RESPONSES ============================ */
+
+
+/* Response headers */
+int h2_send_headers(h2_stream* stream, int status, st_strkvm* headers, int end_stream)
+{
+	h2_conn* conn;
+	st_strkv* kv;
+	const char* name;
+	const char* value;
+	uint8_t* block;
+	size_t   size = 4096, used = 0, off, n;
+	ssize_t  k;
+	char     code[16];
+	int      result = 0;
+	uint8_t  type;
+
+	if(stream == NULL || stream->headers_sent || status < 100 || status > 999)
+	{
+		return -1;
+	}
+
+	conn = stream->conn;
+
+	if((block = (uint8_t*)malloc(size)) == NULL)
+	{
+		return -1;
+	}
+
+	snprintf(code, sizeof(code), "%d", status);
+	used = (size_t)hpack_encode(block, size, ":status", code);
+
+	for(kv = headers ? strkvm_get_next(headers, NULL) : NULL; kv; kv = strkvm_get_next(headers, kv))
+	{
+		name  = strkvm_name(headers, kv);
+		value = strkvm_value(headers, kv);
+
+		if(name[0] == ':' || value == NULL)
+		{
+			continue;
+		}
+
+		if(h2_hop_field(name))
+		{
+			continue;
+		}
+
+		while((k = hpack_encode(block + used, size - used, name, value)) < 0)
+		{
+			uint8_t* grown = (uint8_t*)realloc(block, size * 2);
+
+			if(grown == NULL)
+			{
+				free(block);
+				return -1;
+			}
+
+			block = grown;
+			size *= 2;
+		}
+
+		used += (size_t)k;
+	}
+
+	/* HEADERS and its CONTINUATIONs must not be interleaved with other frames */
+	pthread_mutex_lock(&conn->write_lock);
+
+	for(off = 0, type = H2_HEADERS; result == 0 && off < used; off += n, type = H2_CONTINUATION)
+	{
+		n = used - off < conn->peer_max_frame ? used - off : conn->peer_max_frame;
+		result = h2_write_locked(conn, type,
+		                         (uint8_t)((off + n == used ? H2_FLAG_END_HEADERS : 0) |
+		                                   (type == H2_HEADERS && end_stream ? H2_FLAG_END_STREAM : 0)),
+		                         stream->req.stream_id, block + off, n);
+	}
+
+	pthread_mutex_unlock(&conn->write_lock);
+	free(block);
+
+	stream->headers_sent = 1;
+
+	if(result == 0 && end_stream)
+	{
+		h2_stream_end_local(stream);
+	}
+
+	return result;
+}
+
+
+/* Response body */
+int h2_send_data(h2_stream* stream, const void* data, size_t len, int end_stream)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	h2_conn* conn;
+	int64_t  n;
+	int      last;
+
+	if(stream == NULL || !stream->headers_sent || stream->local_closed)
+	{
+		return -1;
+	}
+
+	conn = stream->conn;
+
+	do
+	{
+		pthread_mutex_lock(&conn->lock);
+
+		while(len > 0 && !conn->dead && !stream->reset &&
+		      (conn->send_window <= 0 || stream->send_window <= 0))
+		{
+			pthread_cond_wait(&conn->cond, &conn->lock);
+		}
+
+		if(conn->dead || stream->reset)
+		{
+			pthread_mutex_unlock(&conn->lock);
+			return -1;
+		}
+
+		n = (int64_t)len;
+		n = n < conn->send_window ? n : conn->send_window;
+		n = n < stream->send_window ? n : stream->send_window;
+		n = n < (int64_t)conn->peer_max_frame ? n : (int64_t)conn->peer_max_frame;
+
+		conn->send_window   -= n;
+		stream->send_window -= n;
+		pthread_mutex_unlock(&conn->lock);
+
+		last = end_stream && (size_t)n == len;
+
+		if(h2_write_frame(conn, H2_DATA, last ? H2_FLAG_END_STREAM : 0,
+		                  stream->req.stream_id, p, (size_t)n) != 0)
+		{
+			return -1;
+		}
+
+		p   += n;
+		len -= (size_t)n;
+	}
+	while(len > 0);
+
+	if(end_stream)
+	{
+		h2_stream_end_local(stream);
+	}
+
+	return 0;
+}
+
+
+/* Whole response */
+int h2_respond(h2_stream* stream, int status, st_strkvm* headers,
+               const void* body, size_t len)
+{
+	if(len == 0)
+	{
+		return h2_send_headers(stream, status, headers, 1);
+	}
+
+	if(h2_send_headers(stream, status, headers, 0) != 0)
+	{
+		return -1;
+	}
+
+	return h2_send_data(stream, body, len, 1);
+}
+
+
+
+
+/* ============================= OUTPUT ============================= */
+
+
+/* Write one frame */
+static int h2_write_frame(h2_conn* conn, uint8_t type, uint8_t flags, uint32_t sid,
+                          const void* payload, size_t len)
+{
+	int result;
+
+	pthread_mutex_lock(&conn->write_lock);
+	result = h2_write_locked(conn, type, flags, sid, payload, len);
+	pthread_mutex_unlock(&conn->write_lock);
+	return result;
+}
+
+
+/* Write one frame, write_lock held */
+static int h2_write_locked(h2_conn* conn, uint8_t type, uint8_t flags, uint32_t sid,
+                           const void* payload, size_t len)
+{
+	uint8_t head[H2_HEADER_LEN];
+	struct iovec iov[2];
+
+	head[0] = (uint8_t)(len >> 16);
+	head[1] = (uint8_t)(len >> 8);
+	head[2] = (uint8_t)len;
+	head[3] = type;
+	head[4] = flags;
+	h2_put32(head + 5, sid);
+
+	iov[0].iov_base = head;
+	iov[0].iov_len  = H2_HEADER_LEN;
+	iov[1].iov_base = (void*)payload;
+	iov[1].iov_len  = len;
+
+	return h2_write_all(conn, iov, len > 0 ? 2 : 1);
+}
+
+
+/* Write everything, a failed write ends the connection */
+static int h2_write_all(h2_conn* conn, struct iovec* iov, int count)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = (size_t)count;
+
+	while(msg.msg_iovlen > 0)
+	{
+		n = sendmsg(conn->sockfd, &msg, MSG_NOSIGNAL);
+
+		if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(n < 0)
+		{
+			pthread_mutex_lock(&conn->lock);
+			conn->dead = 1;
+			pthread_cond_broadcast(&conn->cond);
+			pthread_mutex_unlock(&conn->lock);
+
+			/* Wakes the reader too */
+			shutdown(conn->sockfd, SHUT_RDWR);
+			return -1;
+		}
+
+		while(msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len)
+		{
+			n -= (ssize_t)msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if(msg.msg_iovlen > 0)
+		{
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= (size_t)n;
+		}
+	}
+
+	return 0;
+}
+
+
+/* WINDOW_UPDATE */
+static int h2_send_window(h2_conn* conn, uint32_t sid, uint32_t increment)
+{
+	uint8_t payload[4];
+
+	h2_put32(payload, increment);
+	return h2_write_frame(conn, H2_WINDOW_UPDATE, 0, sid, payload, 4);
+}
+
+
+/* GOAWAY */
+static int h2_send_goaway(h2_conn* conn, uint32_t code)
+{
+	uint8_t payload[8];
+
+	h2_put32(payload, conn->last_stream_id);
+	h2_put32(payload + 4, code);
+	return h2_write_frame(conn, H2_GOAWAY, 0, 0, payload, 8);
+}
+
+
+/* HTTP2-Settings: base64url SETTINGS payload
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int h2_settings_decode(h2_conn* conn, const char* b64)
+{
+	uint8_t  payload[6 * 16];
+	uint32_t acc = 0, len = 0, i;
+	int bits = 0, v;
+	const char* p;
+
+	if(b64 == NULL)
+	{
+		return -1;
+	}
+
+	for(p = b64; *p && *p != '='; p++)
+	{
+		if(*p >= 'A' && *p <= 'Z')      v = *p - 'A';
+		else if(*p >= 'a' && *p <= 'z') v = *p - 'a' + 26;
+		else if(*p >= '0' && *p <= '9') v = *p - '0' + 52;
+		else if(*p == '-' || *p == '+') v = 62;
+		else if(*p == '_' || *p == '/') v = 63;
+		else return -1;
+
+		acc   = acc << 6 | (uint32_t)v;
+		bits += 6;
+
+		if(bits >= 8)
+		{
+			if(len == sizeof(payload))
+			{
+				return -1;
+			}
+
+			bits -= 8;
+			payload[len++] = (uint8_t)(acc >> bits);
+		}
+	}
+
+	if(len % 6 != 0)
+	{
+		return -1;
+	}
+
+	for(i = 0; i < len; i += 6)
+	{
+		if(h2_settings_apply(conn, (uint16_t)(payload[i] << 8 | payload[i + 1]), h2_get32(payload + i + 2)) != 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  http2.h
+ *
+ *    Description:  HTTP/2 连接 (h2c and prior knowledge, streams run as jobs)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef HTTP2_H_
+#define HTTP2_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+#include "strkvm.h"
+
+
+/* Settings we announce */
+#define H2_MAX_STREAMS       100               /* concurrent streams        */
+#define H2_STREAM_WINDOW     (1 << 20)         /* receive window per stream */
+#define H2_CONN_WINDOW       (1 << 24)         /* receive window per conn   */
+#define H2_FRAME_SIZE        16384             /* largest frame accepted    */
+
+/* Request limits, beyond them the stream is reset */
+#define H2_HEADER_BLOCK_MAX  65536
+#define H2_HEADERS_MAX       128
+#define H2_BODY_MAX          (8 << 20)
+
+/* Read buffers and header blocks mapped at start, more come from malloc */
+#define H2_BUFFER_POOL       64
+
+/* Length of the client connection preface */
+#define H2_PREFACE_LEN       24
+
+
+typedef struct h2_stream h2_stream;
+
+
+/* Request of one stream, valid until the handler returns */
+typedef struct h2_request
+{
+	uint32_t    stream_id;
+	const char* method;                        /* pseudo-headers            */
+	const char* path;
+	const char* scheme;
+	const char* authority;
+	st_strkvm   headers;                       /* other fields, lowercase   */
+	const char* body;                          /* whole body, may be NULL   */
+	size_t      body_len;
+} h2_request;
+
+
+/* Called on a pool thread for each request */
+typedef void (*h2_handler_fn)(h2_stream* stream, const h2_request* req, void* arg);
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Map and fault in the buffer pool of connections
+ *
+ * Read buffers and header blocks come from H2_BUFFER_POOL blocks on huge
+ * pages, faulted in here rather than on the first requests. Optional:
+ * the first connection does it otherwise.
+ *
+ * @return 0 on success, -1 if connections will use malloc
+ */
+int h2_init(void);
+
+
+/**
+ * @brief Tell if a connection starts with the HTTP/2 preface
+ *
+ * @param  buf       first bytes read from the connection
+ * @param  len       length of buf
+ * @return 1 if it does, 0 if it does not, -1 if more bytes are needed
+ */
+int h2_is_preface(const void* buf, size_t len);
+
+
+/**
+ * @brief Serve a prior knowledge HTTP/2 connection
+ *
+ * Reads frames until the connection closes. Each request is handed to
+ * the handler as a job on pool once its body is complete, so streams of
+ * one connection run in parallel. Returns after the last of them; the
+ * caller closes sockfd.
+ *
+ * The connection itself occupies the calling thread, normally a pool
+ * worker, so the pool needs at least one more thread for the streams.
+ *
+ * @example
+ *
+ *    n = recv(sockfd, buf, H2_PREFACE_LEN, MSG_PEEK);
+ *    if(h2_is_preface(buf, n) == 1)
+ *        h2_serve(thpool, sockfd, handler, NULL, NULL, 0);
+ *
+ * @param  pool          threadpool running the streams
+ * @param  sockfd        connected socket
+ * @param  handler       called for each request
+ * @param  arg           argument of handler
+ * @param  preread       bytes already read from sockfd, may be NULL
+ * @param  preread_len   length of preread
+ * @return 0 when the peer closed cleanly, -1 on error
+ */
+int h2_serve(threadpool pool, int sockfd, h2_handler_fn handler, void* arg,
+             const void* preread, size_t preread_len);
+
+
+/**
+ * @brief Upgrade an HTTP/1.1 connection to h2c and serve it
+ *
+ * For a request carrying "Upgrade: h2c" and "HTTP2-Settings". Sends the
+ * 101 response, applies the settings and serves the request as stream 1,
+ * then goes on as h2_serve.
+ *
+ * @param  pool          threadpool running the streams
+ * @param  sockfd        connected socket
+ * @param  handler       called for each request
+ * @param  arg           argument of handler
+ * @param  req           the HTTP/1.1 request, copied; Host gives :authority
+ * @param  preread       bytes read from sockfd after the request, may be NULL
+ * @param  preread_len   length of preread
+ * @return 0 when the peer closed cleanly, -1 on error
+ */
+int h2_upgrade(threadpool pool, int sockfd, h2_handler_fn handler, void* arg,
+               const h2_request* req, const void* preread, size_t preread_len);
+
+
+/**
+ * @brief Send the response headers of a stream
+ *
+ * Connection specific fields (Connection, Keep-Alive, Transfer-Encoding..)
+ * are dropped and names are lowercased.
+ *
+ * @param  stream        stream of the request
+ * @param  status        HTTP status
+ * @param  headers       response fields, may be NULL
+ * @param  end_stream    1 if there is no body
+ * @return 0 on success, -1 if the stream or connection is gone
+ */
+int h2_send_headers(h2_stream* stream, int status, st_strkvm* headers, int end_stream);
+
+
+/**
+ * @brief Send body bytes of a stream
+ *
+ * Split into frames that fit the peer's flow control windows, waiting for
+ * WINDOW_UPDATE when they are exhausted. The connection is not held
+ * between frames, so responses of concurrent streams interleave.
+ *
+ * @param  stream        stream of the request
+ * @param  data          body bytes
+ * @param  len           length of data, may be 0 to just end the stream
+ * @param  end_stream    1 if this is the end of the body
+ * @return 0 on success, -1 if the stream or connection is gone
+ */
+int h2_send_data(h2_stream* stream, const void* data, size_t len, int end_stream);
+
+
+/**
+ * @brief Send a whole response
+ *
+ * A handler that returns without responding gets a 500 sent for it.
+ *
+ * @return 0 on success, -1 if the stream or connection is gone
+ */
+int h2_respond(h2_stream* stream, int status, st_strkvm* headers,
+               const void* body, size_t len);
+
+#endif /* HTTP2_H_ */
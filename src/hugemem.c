@@ -0,0 +1,258 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  hugemem.c
+ *
+ *    Description:  大页内存 (huge page backed, pre-faulted regions and block pools)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "hugemem.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* Free list end, index + 1 is stored so 0 can mean empty */
+#define HUGEMEM_NIL          0u
+
+
+static void hugemem_prefault(void* p, size_t size);
+
+
+/* ============================== REGION ============================== */
+
+
+void* hugemem_map(size_t size, int flags, size_t* mapped, int* kind)
+{
+	size_t len, skip;
+	char*  p;
+
+	if(size == 0 || mapped == NULL)
+	{
+		return NULL;
+	}
+
+	/* Whole huge pages, a tail page would be split anyway */
+	len = (size + HUGEMEM_PAGE - 1) & ~((size_t)HUGEMEM_PAGE - 1);
+
+#ifdef MAP_HUGETLB
+	if(flags & HUGEMEM_TRY_HUGETLB)
+	{
+		/* Fails with ENOMEM unless vm.nr_hugepages has room */
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(p != MAP_FAILED)
+		{
+			if(flags & HUGEMEM_PREFAULT)
+			{
+				hugemem_prefault(p, len);
+			}
+			*mapped = len;
+			if(kind) *kind = HUGEMEM_HUGETLB;
+			return p;
+		}
+	}
+#endif
+
+	if(!(flags & HUGEMEM_TRY_THP))
+	{
+		len = (size + (size_t)getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED)
+		{
+			Log(("hugemem_map: mmap of %zu bytes failed, errno %d", len, errno));
+			return NULL;
+		}
+		if(flags & HUGEMEM_PREFAULT)
+		{
+			hugemem_prefault(p, len);
+		}
+		*mapped = len;
+		if(kind) *kind = HUGEMEM_NORMAL;
+		return p;
+	}
+
+	/* THP only backs 2 MB aligned ranges, map one page more and trim */
+	p = mmap(NULL, len + HUGEMEM_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED)
+	{
+		Log(("hugemem_map: mmap of %zu bytes failed, errno %d", len + HUGEMEM_PAGE, errno));
+		return NULL;
+	}
+
+	skip = (HUGEMEM_PAGE - ((uintptr_t)p & (HUGEMEM_PAGE - 1))) & (HUGEMEM_PAGE - 1);
+	if(skip)
+	{
+		munmap(p, skip);
+	}
+	munmap(p + skip + len, HUGEMEM_PAGE - skip);
+	p += skip;
+
+	/* EINVAL when THP is off or "never", the region still works */
+	if(kind)
+	{
+		*kind = madvise(p, len, MADV_HUGEPAGE) == 0 ? HUGEMEM_THP : HUGEMEM_NORMAL;
+	}
+	else
+	{
+		madvise(p, len, MADV_HUGEPAGE);
+	}
+
+	if(flags & HUGEMEM_PREFAULT)
+	{
+		hugemem_prefault(p, len);
+	}
+
+	*mapped = len;
+	return p;
+}
+
+
+void hugemem_unmap(void* p, size_t mapped)
+{
+	if(p != NULL && mapped > 0)
+	{
+		munmap(p, mapped);
+	}
+}
+
+
+/* Fault every page in, the kernel does it in one call since 5.14 */
+static void hugemem_prefault(void* p, size_t size)
+{
+	volatile char* c;
+	size_t page, i;
+
+	if(madvise(p, size, MADV_POPULATE_WRITE) == 0)
+	{
+		return;
+	}
+
+	/* Older kernels: one write per base page, a huge page takes the first */
+	page = (size_t)getpagesize();
+	for(c = p, i = 0; i < size; i += page)
+	{
+		c[i] = 0;
+	}
+}
+
+
+/* =============================== POOL =============================== */
+
+
+int hugemem_pool_init(hugemem_pool* pool, size_t block, uint32_t count, int flags)
+{
+	uint32_t i;
+
+	if(pool == NULL || block == 0 || count == 0 || count >= UINT32_MAX)
+	{
+		return -1;
+	}
+
+	memset(pool, 0, sizeof(hugemem_pool));
+	pool->block = (block + 63) & ~(size_t)63;
+	pool->count = count;
+	pool->base  = hugemem_map(pool->block * count, flags, &pool->mapped, &pool->kind);
+	if(pool->base == NULL)
+	{
+		return -1;
+	}
+
+	/* Chain every block, the next index + 1 sits in the block itself */
+	for(i = 0; i < count; i++)
+	{
+		*(uint32_t*)(pool->base + pool->block * i) = i + 1 < count ? i + 2 : HUGEMEM_NIL;
+	}
+	pool->head = 1;
+
+	return 0;
+}
+
+
+void* hugemem_pool_get(hugemem_pool* pool)
+{
+	uint64_t head, next;
+	uint32_t index;
+	void*    p;
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do
+	{
+		index = (uint32_t)head;
+		if(index == HUGEMEM_NIL)
+		{
+			__atomic_add_fetch(&pool->fallback, 1, __ATOMIC_RELAXED);
+			if(posix_memalign(&p, 64, pool->block) != 0)
+			{
+				return NULL;
+			}
+			return p;
+		}
+
+		p = pool->base + pool->block * (index - 1);
+
+		/* The tag changes on every pop, a block popped and pushed back meanwhile fails the CAS */
+		next = ((head >> 32) + 1) << 32 | __atomic_load_n((uint32_t*)p, __ATOMIC_RELAXED);
+	}
+	while(!__atomic_compare_exchange_n(&pool->head, &head, next, 1,
+	                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return p;
+}
+
+
+void hugemem_pool_put(hugemem_pool* pool, void* p)
+{
+	uint64_t head, next;
+	uint32_t index;
+
+	if(p == NULL)
+	{
+		return;
+	}
+
+	if((char*)p < pool->base || (char*)p >= pool->base + pool->block * pool->count)
+	{
+		free(p);
+		return;
+	}
+
+	index = (uint32_t)(((char*)p - pool->base) / pool->block) + 1;
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+	do
+	{
+		__atomic_store_n((uint32_t*)p, (uint32_t)head, __ATOMIC_RELAXED);
+		next = (head & ~(uint64_t)UINT32_MAX) | index;
+	}
+	while(!__atomic_compare_exchange_n(&pool->head, &head, next, 1,
+	                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+void hugemem_pool_destroy(hugemem_pool* pool)
+{
+	if(pool == NULL)
+	{
+		return;
+	}
+
+	hugemem_unmap(pool->base, pool->mapped);
+	memset(pool, 0, sizeof(hugemem_pool));
+}
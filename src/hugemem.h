@@ -0,0 +1,130 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  hugemem.h
+ *
+ *    Description:  大页内存 (huge page backed, pre-faulted regions and block pools)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef HUGEMEM_H_
+#define HUGEMEM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Size of a huge page on x86-64 and arm64 with 4 KB base pages */
+#define HUGEMEM_PAGE         (2u << 20)
+
+/* What backs a region */
+#define HUGEMEM_NORMAL       0                 /* 4 KB pages                */
+#define HUGEMEM_THP          1                 /* madvise(MADV_HUGEPAGE)    */
+#define HUGEMEM_HUGETLB      2                 /* MAP_HUGETLB, reserved     */
+
+/* Flags of hugemem_map and hugemem_pool_init */
+#define HUGEMEM_TRY_HUGETLB  0x01              /* vm.nr_hugepages pool      */
+#define HUGEMEM_TRY_THP      0x02              /* transparent huge pages    */
+#define HUGEMEM_PREFAULT     0x04              /* fault every page in now   */
+#define HUGEMEM_DEFAULT      (HUGEMEM_TRY_HUGETLB | HUGEMEM_TRY_THP | HUGEMEM_PREFAULT)
+
+
+/* Pool of equal blocks carved from one region */
+typedef struct hugemem_pool
+{
+	char*    base;                             /* region                    */
+	size_t   mapped;                           /* bytes mapped              */
+	size_t   block;                            /* bytes per block           */
+	uint32_t count;                            /* blocks in the region      */
+	int      kind;                             /* HUGEMEM_NORMAL..          */
+	uint64_t head;                             /* free list, ABA tag:index  */
+	uint64_t fallback;                         /* blocks taken from malloc  */
+} hugemem_pool;
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Map a region, on huge pages when the system has them
+ *
+ * Tries, as flags allow, reserved huge pages (MAP_HUGETLB, only if the
+ * administrator set vm.nr_hugepages), then transparent huge pages on a
+ * 2 MB aligned mapping, then plain pages. With HUGEMEM_PREFAULT every
+ * page is faulted in before returning, so the first requests of a burst
+ * take no page faults.
+ *
+ * @example
+ *
+ *    size_t mapped;
+ *    int    kind;
+ *    void*  p = hugemem_map(64 << 20, HUGEMEM_DEFAULT, &mapped, &kind);
+ *    ..
+ *    hugemem_unmap(p, mapped);
+ *
+ * @param  size          bytes wanted
+ * @param  flags         HUGEMEM_TRY_HUGETLB | HUGEMEM_TRY_THP | HUGEMEM_PREFAULT
+ * @param  mapped        receives the bytes mapped, pass it to hugemem_unmap
+ * @param  kind          receives HUGEMEM_NORMAL.., may be NULL
+ * @return the region, zero filled, NULL on error
+ */
+void* hugemem_map(size_t size, int flags, size_t* mapped, int* kind);
+
+
+/**
+ * @brief Unmap a region of hugemem_map
+ *
+ * @return nothing
+ */
+void hugemem_unmap(void* p, size_t mapped);
+
+
+/**
+ * @brief Make a pool of count blocks of block bytes
+ *
+ * Blocks are aligned on 64 bytes and come from one hugemem_map region.
+ * Taking and giving back is lock-free. When the pool is empty blocks come
+ * from malloc and go back to free, so a pool that is too small is slower
+ * but never fails.
+ *
+ * @param  pool          pool to initialise
+ * @param  block         bytes per block, rounded up to 64
+ * @param  count         blocks in the region
+ * @param  flags         as for hugemem_map
+ * @return 0 on success, -1 otherwise
+ */
+int hugemem_pool_init(hugemem_pool* pool, size_t block, uint32_t count, int flags);
+
+
+/**
+ * @brief Take a block, not zeroed
+ *
+ * @return the block, NULL if the pool is empty and malloc failed
+ */
+void* hugemem_pool_get(hugemem_pool* pool);
+
+
+/**
+ * @brief Give a block back
+ *
+ * @return nothing
+ */
+void hugemem_pool_put(hugemem_pool* pool, void* p);
+
+
+/**
+ * @brief Unmap the pool, every block must have been given back
+ *
+ * @return nothing
+ */
+void hugemem_pool_destroy(hugemem_pool* pool);
+
+#endif /* HUGEMEM_H_ */
@@ -0,0 +1,626 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  plugin.c
+ *
+ *    Description:  插件加载 (handler plugins loaded from plugin/)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "rcu.h"
+#include "plugin.h"
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Loaded plugin */
+typedef struct plugin_lib
+{
+	void* handle;                              /* from dlopen               */
+	const hs_plugin* desc;
+	void* ctx;                                 /* from desc->init           */
+} plugin_lib;
+
+
+/* Route resolved to a handler */
+typedef struct plugin_route
+{
+	const char*   path;
+	size_t        path_len;
+	const char*   method;
+	size_t        method_len;
+	hs_handler_fn handler;
+	void*         ctx;
+	size_t        order;                       /* position in load order    */
+} plugin_route;
+
+
+/* Routing table, replaced as a whole on reload */
+typedef struct plugin_table
+{
+	plugin_lib*   libs;
+	int           lib_count;
+	plugin_route* routes;                      /* sorted by path, method    */
+	size_t        route_count;
+} plugin_table;
+
+
+static plugin_table* plugin_current;           /* read under rcu            */
+static pthread_mutex_t plugin_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static void* plugin_open_copy(const char* path);
+static int   plugin_table_add(plugin_table* table, const char* path);
+static void  plugin_table_free(plugin_table* table);
+static int   plugin_route_cmp(const void* a, const void* b);
+static int   plugin_route_order_cmp(const void* a, const void* b);
+static int   plugin_key_cmp(const char* path, size_t path_len, const char* method,
+                            size_t method_len, const plugin_route* route);
+
+static int   plugin_resp_status(hs_response* resp, int status, const char* reason);
+static int   plugin_resp_header(hs_response* resp, const char* name, size_t name_len,
+                                const char* value, size_t value_len);
+static int   plugin_resp_write(hs_response* resp, const void* data, size_t len);
+static int   plugin_buf_append(char** buf, size_t* len, size_t* cap,
+                               const void* data, size_t size);
+
+static const hs_response_ops plugin_resp_ops =
+{
+	plugin_resp_status,
+	plugin_resp_header,
+	plugin_resp_write
+};
+
+
+
+
+/* ============================ LOADER ============================== */
+
+
+/* Load a directory as the new routing table */
+int plugin_load_dir(const char* dir)
+{
+	plugin_table* table;
+	plugin_table* old;
+	struct dirent* ent;
+	DIR*   d;
+	char   path[4096];
+	size_t n, len;
+	int    result;
+
+	if(dir == NULL || (d = opendir(dir)) == NULL)
+	{
+		return -1;
+	}
+
+	table = (struct plugin_table*)calloc(1, sizeof(struct plugin_table));
+
+	if(table == NULL)
+	{
+		closedir(d);
+		return -1;
+	}
+
+	pthread_mutex_lock(&plugin_reload_lock);
+
+	while((ent = readdir(d)))
+	{
+		len = strlen(ent->d_name);
+
+		if(ent->d_name[0] == '.' || len < 4 || strcmp(ent->d_name + len - 3, ".so"))
+		{
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+
+		/* All or nothing: a half loaded directory would drop live routes */
+		if(plugin_table_add(table, path) != 0)
+		{
+			Log(("plugin_load_dir: Could not load %s, keeping the current table", path));
+			closedir(d);
+			plugin_table_free(table);
+			pthread_mutex_unlock(&plugin_reload_lock);
+			return -1;
+		}
+	}
+
+	closedir(d);
+
+	/* qsort is not stable, equal routes are kept in load order */
+	qsort(table->routes, table->route_count, sizeof(plugin_route), plugin_route_order_cmp);
+
+	/* First plugin to claim a route keeps it */
+	for(n = 1; n < table->route_count; n++)
+	{
+		if(plugin_route_cmp(&table->routes[n - 1], &table->routes[n]) == 0)
+		{
+			Log(("plugin_load_dir: duplicate route %s %s", table->routes[n].method,
+			     table->routes[n].path));
+			memmove(&table->routes[n], &table->routes[n + 1],
+			        (table->route_count - n - 1) * sizeof(plugin_route));
+			table->route_count--;
+			n--;
+		}
+	}
+
+	result = (int)table->route_count;
+
+	/* Publish, then wait out requests still running on the old table */
+	old = rcu_exchange(plugin_current, table);
+
+	if(old)
+	{
+		rcu_synchronize();
+		plugin_table_free(old);
+	}
+
+	/* A reload may free table once the lock is dropped */
+	Log(("plugin_load_dir: %d plugins, %d routes", table->lib_count, result));
+	pthread_mutex_unlock(&plugin_reload_lock);
+
+	return result;
+}
+
+
+/* Unload everything */
+void plugin_unload_all(void)
+{
+	plugin_table* old;
+
+	pthread_mutex_lock(&plugin_reload_lock);
+	old = rcu_exchange(plugin_current, NULL);
+
+	if(old)
+	{
+		rcu_synchronize();
+		plugin_table_free(old);
+	}
+
+	pthread_mutex_unlock(&plugin_reload_lock);
+}
+
+
+/* Find and run handler */
+int plugin_dispatch(const hs_request* req, hs_response* resp)
+{
+	plugin_table* table;
+	plugin_route* route = NULL;
+	size_t lo, hi, mid;
+	int c, result = 1;
+
+	rcu_read_lock();
+	table = rcu_dereference(plugin_current);
+
+	if(table)
+	{
+		lo = 0;
+		hi = table->route_count;
+
+		while(lo < hi)
+		{
+			mid = lo + (hi - lo) / 2;
+			c = plugin_key_cmp(req->path.ptr, req->path.len, req->method.ptr,
+			                   req->method.len, &table->routes[mid]);
+
+			if(c == 0)
+			{
+				route = &table->routes[mid];
+				break;
+			}
+
+			if(c < 0) hi = mid;
+			else      lo = mid + 1;
+		}
+	}
+
+	if(route)
+	{
+		result = route->handler(req, resp, route->ctx) == 0 ? 0 : -1;
+	}
+
+	rcu_read_unlock();
+	return result;
+}
+
+
+/* Map a private copy of a plugin
+ *
+ * dlopen() hands back the already loaded image for a path it has seen,
+ * which would defeat reloading a plugin rebuilt in place. A copy under a
+ * fresh name always gets its own image.
+ *
+ * @return dlopen handle, NULL on error
+ */
+static void* plugin_open_copy(const char* path)
+{
+	char    tmp[] = "/tmp/hs-plugin-XXXXXX";
+	char    buf[65536];
+	void*   handle = NULL;
+	ssize_t n;
+	int     in, out;
+
+	if((in = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+	{
+		return NULL;
+	}
+
+	if((out = mkstemp(tmp)) == -1)
+	{
+		close(in);
+		return NULL;
+	}
+
+	while((n = read(in, buf, sizeof(buf))) > 0)
+	{
+		if(write(out, buf, (size_t)n) != n)
+		{
+			n = -1;
+			break;
+		}
+	}
+
+	close(in);
+	close(out);
+
+	if(n == 0)
+	{
+		handle = dlopen(tmp, RTLD_NOW | RTLD_LOCAL);
+
+		if(handle == NULL)
+		{
+			Log(("plugin_open_copy: %s", dlerror()));
+		}
+	}
+
+	/* The mapping outlives the name */
+	unlink(tmp);
+	return handle;
+}
+
+
+/* Load one plugin and add its routes
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int plugin_table_add(plugin_table* table, const char* path)
+{
+	hs_plugin_entry_fn entry;
+	const hs_plugin* desc;
+	plugin_lib*   lib;
+	plugin_route* routes;
+	void*  handle;
+	void*  ctx = NULL;
+	size_t n;
+
+	if((handle = plugin_open_copy(path)) == NULL)
+	{
+		return -1;
+	}
+
+	*(void**)&entry = dlsym(handle, HS_PLUGIN_ENTRY);
+
+	if(entry == NULL || (desc = entry()) == NULL ||
+	   desc->abi_version != HS_PLUGIN_ABI_VERSION ||
+	   desc->struct_size < sizeof(hs_plugin))
+	{
+		Log(("plugin_table_add: %s has no compatible " HS_PLUGIN_ENTRY, path));
+		dlclose(handle);
+		return -1;
+	}
+
+	if(desc->init && desc->init(&ctx) != 0)
+	{
+		dlclose(handle);
+		return -1;
+	}
+
+	lib = (struct plugin_lib*)realloc(table->libs, (table->lib_count + 1) * sizeof(plugin_lib));
+	routes = (struct plugin_route*)realloc(table->routes,
+	                                       (table->route_count + desc->route_count) *
+	                                       sizeof(plugin_route) + 1);
+
+	if(lib) table->libs = lib;
+	if(routes) table->routes = routes;
+
+	if(lib == NULL || routes == NULL)
+	{
+		if(desc->fini) desc->fini(ctx);
+		dlclose(handle);
+		return -1;
+	}
+
+	lib = &table->libs[table->lib_count++];
+	lib->handle = handle;
+	lib->desc   = desc;
+	lib->ctx    = ctx;
+
+	/* Resolved once here, requests only compare keys */
+	for(n = 0; n < desc->route_count; n++)
+	{
+		const hs_route* r = &desc->routes[n];
+		plugin_route* route;
+
+		if(r->method == NULL || r->path == NULL || r->handler == NULL)
+		{
+			continue;
+		}
+
+		route = &table->routes[table->route_count];
+		route->order      = table->route_count++;
+		route->path       = r->path;
+		route->path_len   = strlen(r->path);
+		route->method     = r->method;
+		route->method_len = strlen(r->method);
+		route->handler    = r->handler;
+		route->ctx        = ctx;
+	}
+
+	return 0;
+}
+
+
+/* Finalize and unload the plugins of a table */
+static void plugin_table_free(plugin_table* table)
+{
+	int n;
+
+	for(n = 0; n < table->lib_count; n++)
+	{
+		if(table->libs[n].desc->fini)
+		{
+			table->libs[n].desc->fini(table->libs[n].ctx);
+		}
+
+		dlclose(table->libs[n].handle);
+	}
+
+	free(table->libs);
+	free(table->routes);
+	free(table);
+}
+
+
+/* Order routes by path, then method */
+static int plugin_route_cmp(const void* a, const void* b)
+{
+	const plugin_route* ra = (const plugin_route*)a;
+
+	return plugin_key_cmp(ra->path, ra->path_len, ra->method, ra->method_len,
+	                      (const plugin_route*)b);
+}
+
+
+/* Sort order: by key, then the route loaded first */
+static int plugin_route_order_cmp(const void* a, const void* b)
+{
+	const plugin_route* ra = (const plugin_route*)a;
+	const plugin_route* rb = (const plugin_route*)b;
+	int c = plugin_route_cmp(a, b);
+
+	if(c != 0)
+	{
+		return c;
+	}
+
+	return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+
+/* Compare a request key against a route */
+static int plugin_key_cmp(const char* path, size_t path_len, const char* method,
+                          size_t method_len, const plugin_route* route)
+{
+	size_t n = path_len < route->path_len ? path_len : route->path_len;
+	int c = memcmp(path, route->path, n);
+
+	if(c) return c;
+	if(path_len != route->path_len) return path_len < route->path_len ? -1 : 1;
+
+	n = method_len < route->method_len ? method_len : route->method_len;
+	c = memcmp(method, route->method, n);
+
+	if(c) return c;
+	if(method_len != route->method_len) return method_len < route->method_len ? -1 : 1;
+
+	return 0;
+}
+
+
+
+
+/* ============================ RESPONSE ============================ */
+
+
+/* Initialise response builder */
+void plugin_response_init(plugin_response* resp)
+{
+	memset(resp, 0, sizeof(plugin_response));
+	resp->base.ops = &plugin_resp_ops;
+	resp->status   = 200;
+	strcpy(resp->reason, "OK");
+}
+
+
+/* Send status line, headers and body */
+int plugin_response_send(plugin_response* resp, int sockfd)
+{
+	char   line[192];
+	struct iovec iov[3];
+	size_t total, done = 0;
+	ssize_t n;
+	int    cnt = 0, i;
+
+	snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", resp->status, resp->reason);
+	total = strlen(line);
+
+	if(plugin_buf_append(&resp->head, &resp->head_len, &resp->head_cap, line, total) != 0)
+	{
+		return -1;
+	}
+
+	/* Status line went to the end, rotate it to the front */
+	memmove(resp->head + total, resp->head, resp->head_len - total);
+	memcpy(resp->head, line, total);
+
+	snprintf(line, sizeof(line), "Content-Length: %zu\r\n\r\n", resp->body_len);
+
+	if(plugin_buf_append(&resp->head, &resp->head_len, &resp->head_cap, line, strlen(line)) != 0)
+	{
+		return -1;
+	}
+
+	iov[cnt].iov_base   = resp->head;
+	iov[cnt++].iov_len  = resp->head_len;
+
+	if(resp->body_len)
+	{
+		iov[cnt].iov_base  = resp->body;
+		iov[cnt++].iov_len = resp->body_len;
+	}
+
+	total = resp->head_len + resp->body_len;
+
+	while(done < total)
+	{
+		n = writev(sockfd, iov, cnt);
+
+		if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(n <= 0)
+		{
+			return -1;
+		}
+
+		done += (size_t)n;
+
+		/* Skip what was written */
+		for(i = 0; i < cnt && n > 0; i++)
+		{
+			size_t step = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+			iov[i].iov_base = (char*)iov[i].iov_base + step;
+			iov[i].iov_len -= step;
+			n -= (ssize_t)step;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Free builder buffers */
+void plugin_response_free(plugin_response* resp)
+{
+	free(resp->head);
+	free(resp->body);
+	memset(resp, 0, sizeof(plugin_response));
+}
+
+
+static int plugin_resp_status(hs_response* base, int status, const char* reason)
+{
+	plugin_response* resp = (plugin_response*)base;
+
+	/* A line break in the reason would end the status line early */
+	if(status < 100 || status > 999 || (reason && strpbrk(reason, "\r\n")))
+	{
+		return -1;
+	}
+
+	resp->status = status;
+	snprintf(resp->reason, sizeof(resp->reason), "%s", reason ? reason : "");
+	return 0;
+}
+
+
+static int plugin_resp_header(hs_response* base, const char* name, size_t name_len,
+                              const char* value, size_t value_len)
+{
+	plugin_response* resp = (plugin_response*)base;
+
+	if(name == NULL || value == NULL ||
+	   memchr(value, '\n', value_len) || memchr(name, '\n', name_len) ||
+	   memchr(value, '\r', value_len) || memchr(name, '\r', name_len))
+	{
+		return -1;
+	}
+
+	if(plugin_buf_append(&resp->head, &resp->head_len, &resp->head_cap, name, name_len) ||
+	   plugin_buf_append(&resp->head, &resp->head_len, &resp->head_cap, ": ", 2) ||
+	   plugin_buf_append(&resp->head, &resp->head_len, &resp->head_cap, value, value_len) ||
+	   plugin_buf_append(&resp->head, &resp->head_len, &resp->head_cap, "\r\n", 2))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int plugin_resp_write(hs_response* base, const void* data, size_t len)
+{
+	plugin_response* resp = (plugin_response*)base;
+
+	return plugin_buf_append(&resp->body, &resp->body_len, &resp->body_cap, data, len);
+}
+
+
+/* Append to a growing buffer
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int plugin_buf_append(char** buf, size_t* len, size_t* cap,
+                             const void* data, size_t size)
+{
+	if(*len + size > *cap)
+	{
+		size_t ncap = *cap ? *cap : 256;
+		char*  nbuf;
+
+		while(ncap < *len + size)
+		{
+			ncap *= 2;
+		}
+
+		if((nbuf = (char*)realloc(*buf, ncap)) == NULL)
+		{
+			return -1;
+		}
+
+		*buf = nbuf;
+		*cap = ncap;
+	}
+
+	memcpy(*buf + *len, data, size);
+	*len += size;
+	return 0;
+}
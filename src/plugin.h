@@ -0,0 +1,120 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  plugin.h
+ *
+ *    Description:  插件加载 (handler plugins loaded from plugin/)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef PLUGIN_H_
+#define PLUGIN_H_
+
+#include <stddef.h>
+
+#include "plugin_abi.h"
+
+
+/* Response builder backed by memory buffers */
+typedef struct plugin_response
+{
+	hs_response base;                          /* given to handlers         */
+	int    status;
+	char   reason[64];
+	char*  head;                               /* header lines              */
+	size_t head_len;
+	size_t head_cap;
+	char*  body;
+	size_t body_len;
+	size_t body_cap;
+} plugin_response;
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Load every plugin of a directory and make it the routing table
+ *
+ * Every "*.so" file in dir is loaded and its routes are resolved to
+ * handler pointers. The new table replaces the current one atomically.
+ * Requests already running on the old table finish on it; the old
+ * plugins are unloaded once they are done. Only the calling thread waits
+ * for that, workers are never paused.
+ *
+ * Calling it again reloads the directory (hot reload). Each load maps a
+ * private copy of the file, so a plugin rebuilt in place is picked up.
+ * If any plugin fails to load, nothing of the directory is published.
+ *
+ * @example
+ *
+ *    plugin_load_dir("plugin");             //at start and on SIGHUP
+ *
+ * @param  dir       directory holding the plugins
+ * @return number of routes loaded, -1 on error (current table is kept)
+ */
+int plugin_load_dir(const char* dir);
+
+
+/**
+ * @brief Unload all plugins
+ *
+ * @return nothing
+ */
+void plugin_unload_all(void);
+
+
+/**
+ * @brief Run the handler of a request
+ *
+ * Lock and allocation free on the lookup path. Safe to call from any
+ * number of threadpool workers at once.
+ *
+ * @param  req       request view
+ * @param  resp      response builder, see plugin_response_init()
+ * @return 0 on success, 1 if no route matches, -1 if the handler failed
+ */
+int plugin_dispatch(const hs_request* req, hs_response* resp);
+
+
+/**
+ * @brief Initialize a response builder
+ *
+ * Status defaults to 200.
+ *
+ * @param  resp      builder to initialize
+ * @return nothing
+ */
+void plugin_response_init(plugin_response* resp);
+
+
+/**
+ * @brief Send the response built so far to a socket
+ *
+ * Adds Content-Length and writes status line, headers and body with a
+ * single writev().
+ *
+ * @param  resp      built response
+ * @param  sockfd    socket to write to
+ * @return 0 on success, -1 otherwise.
+ */
+int plugin_response_send(plugin_response* resp, int sockfd);
+
+
+/**
+ * @brief Free the buffers of a response builder
+ *
+ * @param  resp      builder to free
+ * @return nothing
+ */
+void plugin_response_free(plugin_response* resp);
+
+#endif /* PLUGIN_H_ */
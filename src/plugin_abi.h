@@ -0,0 +1,116 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  plugin_abi.h
+ *
+ *    Description:  插件接口 (C ABI shared with handler plugins)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef PLUGIN_ABI_H_
+#define PLUGIN_ABI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Bumped on every incompatible change of the structures below */
+#define HS_PLUGIN_ABI_VERSION   1
+
+/* Symbol every plugin exports, of type hs_plugin_entry_fn */
+#define HS_PLUGIN_ENTRY         "hs_plugin_entry"
+
+
+/* Slice of the request buffer, not NUL terminated */
+typedef struct hs_str
+{
+	const char* ptr;
+	size_t      len;
+} hs_str;
+
+
+/* Header view */
+typedef struct hs_header
+{
+	hs_str name;
+	hs_str value;
+} hs_header;
+
+
+/* Request view, valid only during the handler call */
+typedef struct hs_request
+{
+	hs_str method;
+	hs_str path;                               /* decoded path              */
+	hs_str query;                              /* raw query, without '?'    */
+	hs_str version;
+	const hs_header* headers;
+	size_t header_count;
+	hs_str body;                               /* body read so far          */
+	int    sockfd;
+} hs_request;
+
+
+/* Response builder, implemented by the server. set_status and add_header
+ * return -1 on a CR or LF, which would split the response */
+typedef struct hs_response hs_response;
+
+typedef struct hs_response_ops
+{
+	int (*set_status)(hs_response* resp, int status, const char* reason);
+	int (*add_header)(hs_response* resp, const char* name, size_t name_len,
+	                  const char* value, size_t value_len);
+	int (*write)(hs_response* resp, const void* data, size_t len);
+} hs_response_ops;
+
+struct hs_response
+{
+	const hs_response_ops* ops;
+};
+
+
+/* Handler, returns 0 on success, -1 to make the server answer 500 */
+typedef int (*hs_handler_fn)(const hs_request* req, hs_response* resp, void* ctx);
+
+
+/* Route exported by a plugin */
+typedef struct hs_route
+{
+	const char*   method;                      /* "GET", "POST", ..         */
+	const char*   path;                        /* exact decoded path        */
+	hs_handler_fn handler;
+} hs_route;
+
+
+/* Plugin descriptor returned by the entry point */
+typedef struct hs_plugin
+{
+	uint32_t abi_version;                      /* HS_PLUGIN_ABI_VERSION     */
+	uint32_t struct_size;                      /* sizeof(hs_plugin)         */
+	const char* name;
+	const hs_route* routes;
+	size_t   route_count;
+	int    (*init)(void** ctx);                /* optional, 0 on success    */
+	void   (*fini)(void* ctx);                 /* optional                  */
+} hs_plugin;
+
+typedef const hs_plugin* (*hs_plugin_entry_fn)(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PLUGIN_ABI_H_ */
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <limits.h>
+
+#include "query.h"
+#include "strutils.h"
+
+//! Cached conversion flags
+#define QUERY_INT_DONE    0x01
+#define QUERY_INT_OK      0x02
+#define QUERY_FLOAT_DONE  0x04
+#define QUERY_FLOAT_OK    0x08
+
+//! FNV-1a
+#define QUERY_HASH_INIT   2166136261u
+#define QUERY_HASH(h, c)  (((h) ^ (unsigned char)(c)) * 16777619u)
+
+/*****************************************************************************/
+/* Prototypes of Static Functions
+*/
+/*****************************************************************************/
+
+/**
+ * \brief	Value of a hexadecimal digit.
+ * \param	c		Character
+ * \return	0 to 15, -1 if not a digit.
+ */
+static int query_hex(char c);
+
+/**
+ * \brief	Hash a name the way query_parse does.
+ * \param	name		NUL terminated name
+ * \param	len			Set to length of name
+ * \return	Hash of name.
+ */
+static uint32_t query_hash(const char* name, size_t* len);
+
+/**
+ * \brief	Append an empty pair.
+ * \param	query		Struct query
+ * \return	The pair if Ok, NULL otherwise.
+ */
+static st_query_pair* query_pair_add(st_query* query);
+
+/*****************************************************************************/
+/* Functions to query
+*/
+/*****************************************************************************/
+
+int query_init(st_query *query)
+{
+  if (query == NULL)
+    return -1;
+
+  memset(query, 0, sizeof(st_query));
+  return 0;
+}
+/*****************************************************************************/
+
+int query_parse(st_query *query, const char *buffer, size_t size)
+{
+  const char *p, *end;
+  char *out, *start;
+  st_query_pair *pair = NULL;
+  uint32_t hash = QUERY_HASH_INIT;
+  int hi, lo;
+  char c;
+
+  if (query == NULL || buffer == NULL)
+    return -1;
+
+  query_free(query);
+
+  /* Decoding never grows the text; '=' and '&' make room for the NULs */
+  query->arena = (char *)malloc(size + 1);
+  if (query->arena == NULL)
+    return -1;
+
+  out = start = query->arena;
+  end = buffer + size;
+
+  for (p = buffer; p <= end; p++) {
+    c = (p < end) ? *p : '&';
+
+    if (c == '&') {
+      if (pair != NULL) {
+        *out = 0;
+        if (pair->value == NULL) {
+          /* Name only: value is the empty string at its end */
+          pair->name_len = (uint32_t)(out - start);
+          pair->hash = hash;
+          pair->value = out;
+        } else {
+          pair->value_len = (uint32_t)(out - pair->value);
+        }
+        out++;
+      }
+      pair = NULL;
+      continue;
+    }
+
+    if (pair == NULL) {
+      if ((pair = query_pair_add(query)) == NULL)
+        return -1;
+      pair->name = start = out;
+      hash = QUERY_HASH_INIT;
+    }
+
+    if (c == '=' && pair->value == NULL) {
+      *out++ = 0;
+      pair->name_len = (uint32_t)(out - 1 - start);
+      pair->hash = hash;
+      pair->value = out;
+      continue;
+    }
+
+    if (c == '+') {
+      c = ' ';
+    } else if (c == '%' && end - p > 2 && (hi = query_hex(p[1])) >= 0 && (lo = query_hex(p[2])) >= 0) {
+      c = (char)(hi << 4 | lo);
+      p += 2;
+    }
+
+    if (pair->value == NULL)
+      hash = QUERY_HASH(hash, c);
+    *out++ = c;
+  }
+
+  return 0;
+}
+/*****************************************************************************/
+
+int query_free(st_query *query)
+{
+  if (query == NULL)
+    return -1;
+
+  free(query->arena);
+  free(query->pairs);
+  memset(query, 0, sizeof(st_query));
+  return 0;
+}
+/*****************************************************************************/
+
+int query_find(const st_query *query, const char *name, int from)
+{
+  uint32_t hash, i;
+  size_t len;
+
+  if (query == NULL || name == NULL || from < 0)
+    return -1;
+
+  hash = query_hash(name, &len);
+
+  for (i = (uint32_t)from; i < query->count; i++)
+    if (query->pairs[i].hash == hash && query->pairs[i].name_len == len &&
+        memcmp(query->pairs[i].name, name, len) == 0)
+      return (int)i;
+
+  return -1;
+}
+/*****************************************************************************/
+
+int query_count(const st_query *query, const char *name)
+{
+  int i, count = 0;
+
+  if (query == NULL || name == NULL)
+    return -1;
+
+  for (i = query_find(query, name, 0); i >= 0; i = query_find(query, name, i + 1))
+    count++;
+
+  return count;
+}
+/*****************************************************************************/
+
+int query_get_string(const st_query *query, const char *name, const char **value)
+{
+  int i;
+
+  if (value == NULL || (i = query_find(query, name, 0)) < 0)
+    return -1;
+
+  *value = query->pairs[i].value;
+  return 0;
+}
+/*****************************************************************************/
+
+int query_get_int(st_query *query, const char *name, long *value)
+{
+  st_query_pair *pair;
+  int64_t v;
+  int i;
+
+  if (value == NULL || (i = query_find(query, name, 0)) < 0)
+    return -1;
+
+  pair = &query->pairs[i];
+  if (!(pair->flags & QUERY_INT_DONE)) {
+    /* Not strtol: no spaces, no '+', and a decoded %00 must not end the number */
+    if (pair->value_len > 0 && pair->value[0] != '+' &&
+        strutils_parse_int(pair->value, pair->value_len, &v, NULL) == 0 &&
+        v >= LONG_MIN && v <= LONG_MAX) {
+      pair->ival = (long)v;
+      pair->flags |= QUERY_INT_OK;
+    }
+    pair->flags |= QUERY_INT_DONE;
+  }
+
+  if (!(pair->flags & QUERY_INT_OK))
+    return -1;
+
+  *value = pair->ival;
+  return 0;
+}
+/*****************************************************************************/
+
+int query_get_float(st_query *query, const char *name, double *value)
+{
+  st_query_pair *pair;
+  int i;
+
+  if (value == NULL || (i = query_find(query, name, 0)) < 0)
+    return -1;
+
+  pair = &query->pairs[i];
+  if (!(pair->flags & QUERY_FLOAT_DONE)) {
+    /* Not strtod: "1.5" must not depend on the locale of the process */
+    if (strutils_parse_double(pair->value, pair->value_len, &pair->fval, NULL) == 0)
+      pair->flags |= QUERY_FLOAT_OK;
+    pair->flags |= QUERY_FLOAT_DONE;
+  }
+
+  if (!(pair->flags & QUERY_FLOAT_OK))
+    return -1;
+
+  *value = pair->fval;
+  return 0;
+}
+/*****************************************************************************/
+
+int query_get_bool(const st_query *query, const char *name, bool *value)
+{
+  const char *v;
+  int i;
+
+  if (value == NULL || (i = query_find(query, name, 0)) < 0)
+    return -1;
+
+  v = query->pairs[i].value;
+  *value = (strcmp(v, "true") == 0 || strcmp(v, "1") == 0 || strcmp(v, "on") == 0) ? true : false;
+  return 0;
+}
+/*****************************************************************************/
+
+int query_tokvm(const st_query *query, st_strkvm *strkvm)
+{
+  uint32_t i;
+  int result;
+
+  if (query == NULL || strkvm == NULL)
+    return -1;
+
+  for (i = 0; i < query->count; i++) {
+    result = strkvm_add_string(strkvm, query->pairs[i].name, query->pairs[i].value);
+    if (result != 0)
+      return result;
+  }
+  return 0;
+}
+
+/*****************************************************************************/
+/* Static Functions
+*/
+/*****************************************************************************/
+
+static int query_hex(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+/*****************************************************************************/
+
+static uint32_t query_hash(const char *name, size_t *len)
+{
+  uint32_t hash = QUERY_HASH_INIT;
+  const char *p;
+
+  for (p = name; *p; p++)
+    hash = QUERY_HASH(hash, *p);
+
+  *len = (size_t)(p - name);
+  return hash;
+}
+/*****************************************************************************/
+
+static st_query_pair *query_pair_add(st_query *query)
+{
+  st_query_pair *pairs;
+  uint32_t cap;
+
+  if (query->count == query->cap) {
+    cap = query->cap ? query->cap * 2 : 16;
+    pairs = (st_query_pair *)realloc(query->pairs, sizeof(st_query_pair) * cap);
+    if (pairs == NULL)
+      return NULL;
+
+    query->pairs = pairs;
+    query->cap = cap;
+  }
+
+  pairs = &query->pairs[query->count++];
+  memset(pairs, 0, sizeof(st_query_pair));
+  return pairs;
+}
+/*****************************************************************************/
@@ -0,0 +1,128 @@
+#ifndef __QUERY_H_INCLUDED__
+#define __QUERY_H_INCLUDED__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "strkvm.h"
+
+//! Decoded name/value pair
+typedef struct {
+	const char* name;							//!< Decoded name, NUL terminated
+	const char* value;						//!< Decoded value, NUL terminated
+	uint32_t name_len;						//!< Length of name
+	uint32_t value_len;						//!< Length of value
+	uint32_t hash;								//!< Hash of name
+	uint32_t flags;								//!< Cached conversions
+	long ival;										//!< Cached integer value
+	double fval;									//!< Cached float value
+} st_query_pair;
+
+//! Parsed query string or form-urlencoded body
+typedef struct {
+	char* arena;									//!< Storage of all names and values
+	st_query_pair* pairs;					//!< Pairs in order of appearance
+	uint32_t count;								//!< Total of pairs
+	uint32_t cap;									//!< Capacity of pairs
+} st_query;
+
+/**
+ * \brief	Initialize query struct.
+ * \param	query		Struct that will be initialized.
+ * \return	0 if Ok or -1 if param is null.
+ */
+int query_init(st_query* query);
+
+/**
+ * \brief	Decode and split a query string in one pass.
+ *
+ * Handles "name=value" pairs separated by '&', '+' as space and %XX
+ * escapes. Decoded strings are stored in one arena as large as the input.
+ * Repeated names are all kept, in order. Invalid escapes are kept as is.
+ *
+ * \param	query		Initialized struct, previous content is replaced
+ * \param	buffer	Query string, without '?'
+ * \param	size		Size of buffer
+ * \return	0 if Ok. Otherwise error code.
+ */
+int query_parse(st_query* query, const char* buffer, size_t size);
+
+/**
+ * \brief	Frees memory space used by query.
+ * \param	query		Struct that will be freed.
+ * \return	0 if Ok or -1 if param is null.
+ */
+int query_free(st_query* query);
+
+/**
+ * \brief	Find the next pair with a name.
+ * \param	query		Parsed query
+ * \param	name		Name of variable
+ * \param	from		Index to start at, 0 for the first one
+ * \return	Index of the pair if found, -1 otherwise.
+ */
+int query_find(const st_query* query, const char* name, int from);
+
+/**
+ * \brief	Count the values of a name.
+ * \param	query		Parsed query
+ * \param	name		Name of variable
+ * \return	Count of values, -1 if param is null.
+ */
+int query_count(const st_query* query, const char* name);
+
+/**
+ * \brief	Get the first value of a name, without copying it.
+ * \param	query		Parsed query
+ * \param	name		Name of variable
+ * \param	value		Value of variable, owned by query
+ * \return	0 if Ok. Otherwise error code.
+ */
+int query_get_string(const st_query* query, const char* name, const char** value);
+
+/**
+ * \brief	Get the first value of a name as integer.
+ *
+ * The whole decoded value must be an optional '-' then decimal digits that
+ * fit a long. The conversion is done on first access and cached in the pair.
+ *
+ * \param	query		Parsed query
+ * \param	name		Name of variable
+ * \param	value		Value of variable
+ * \return	0 if Ok. Otherwise error code (missing or not an integer).
+ */
+int query_get_int(st_query* query, const char* name, long* value);
+
+/**
+ * \brief	Get the first value of a name as float.
+ *
+ * The conversion is done on first access and cached in the pair. The
+ * decimal point is always '.', whatever the locale.
+ *
+ * \param	query		Parsed query
+ * \param	name		Name of variable
+ * \param	value		Value of variable
+ * \return	0 if Ok. Otherwise error code (missing or not a number).
+ */
+int query_get_float(st_query* query, const char* name, double* value);
+
+/**
+ * \brief	Get the first value of a name as boolean.
+ * \param	query		Parsed query
+ * \param	name		Name of variable
+ * \param	value		true if value is "true", "1" or "on"
+ * \return	0 if Ok. Otherwise error code.
+ */
+int query_get_bool(const st_query* query, const char* name, bool* value);
+
+/**
+ * \brief	Copy every pair into a key/value struct.
+ * \param	query		Parsed query
+ * \param	strkvm	Initialized key/value struct
+ * \return	0 if Ok. Otherwise error code.
+ */
+int query_tokvm(const st_query* query, st_strkvm* strkvm);
+
+#endif /* __QUERY_H_INCLUDED__ */
@@ -0,0 +1,208 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  rcu.c
+ *
+ *    Description:  读-复制-更新 (epoch based read-copy-update)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <sched.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rcu.h"
+
+#define RCU_SLOTS        256                   /* threads with own slot     */
+#define RCU_CACHE_LINE   64
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Reader slot, one per thread, alone on its cache line */
+typedef struct rcu_slot
+{
+	volatile uint64_t epoch;                   /* epoch seen, 0 when idle   */
+	volatile int      owned;                   /* held by a live thread     */
+	char pad[RCU_CACHE_LINE - sizeof(uint64_t) - sizeof(int)];
+} __attribute__((aligned(RCU_CACHE_LINE))) rcu_slot;
+
+
+static rcu_slot rcu_slots[RCU_SLOTS];
+static volatile uint64_t rcu_epoch = 1;        /* current epoch             */
+static volatile int rcu_next_slot;             /* slots ever handed out     */
+static volatile int rcu_overflow;              /* readers without a slot    */
+static pthread_mutex_t rcu_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t  rcu_key;                 /* gives the slot back       */
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+
+static __thread int rcu_self = -1;             /* slot of this thread       */
+static __thread int rcu_nesting;               /* depth of read sections    */
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static int  rcu_slot_claim(void);
+static void rcu_key_init(void);
+static void rcu_slot_free(void* arg);
+
+
+
+
+/* ============================ READERS ============================= */
+
+
+/* Enter read side */
+void rcu_read_lock(void)
+{
+	if(rcu_nesting++)
+	{
+		return ;
+	}
+
+	if(rcu_self == -1)
+	{
+		rcu_self = rcu_slot_claim();
+	}
+
+	if(rcu_self == RCU_SLOTS)
+	{
+		/* Out of slots: count as a reader the writer must wait out */
+		__atomic_fetch_add(&rcu_overflow, 1, __ATOMIC_SEQ_CST);
+		return ;
+	}
+
+	/* Announce the epoch before loading any protected pointer */
+	__atomic_store_n(&rcu_slots[rcu_self].epoch,
+	                 __atomic_load_n(&rcu_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/* Leave read side */
+void rcu_read_unlock(void)
+{
+	if(--rcu_nesting)
+	{
+		return ;
+	}
+
+	if(rcu_self == RCU_SLOTS)
+	{
+		__atomic_fetch_sub(&rcu_overflow, 1, __ATOMIC_RELEASE);
+		return ;
+	}
+
+	__atomic_store_n(&rcu_slots[rcu_self].epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+
+
+/* ============================ WRITERS ============================= */
+
+
+/* Wait out readers of the previous epoch */
+void rcu_synchronize(void)
+{
+	uint64_t epoch;
+	uint64_t seen;
+	int n, slots;
+
+	pthread_mutex_lock(&rcu_writer_lock);
+
+	/* Pairs with the fence in rcu_read_lock() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	epoch = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+
+	slots = __atomic_load_n(&rcu_next_slot, __ATOMIC_ACQUIRE);
+
+	if(slots > RCU_SLOTS)
+	{
+		slots = RCU_SLOTS;
+	}
+
+	for(n = 0; n < slots; n++)
+	{
+		for(;;)
+		{
+			seen = __atomic_load_n(&rcu_slots[n].epoch, __ATOMIC_ACQUIRE);
+
+			if(seen == 0 || seen >= epoch)
+			{
+				break;
+			}
+
+			sched_yield();
+		}
+	}
+
+	while(__atomic_load_n(&rcu_overflow, __ATOMIC_ACQUIRE))
+	{
+		sched_yield();
+	}
+
+	pthread_mutex_unlock(&rcu_writer_lock);
+}
+
+
+
+
+
+/* ============================= STATIC ============================= */
+
+
+/* Take a slot left by an exited thread, else a fresh one, else RCU_SLOTS */
+static int rcu_slot_claim(void)
+{
+	int n, expected;
+
+	for(n = 0; n < RCU_SLOTS; n++)
+	{
+		expected = n;
+
+		/* None free below the mark, hand out one more; writers scan up to it */
+		__atomic_compare_exchange_n(&rcu_next_slot, &expected, n + 1, 0,
+		                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+
+		expected = 0;
+
+		if(__atomic_compare_exchange_n(&rcu_slots[n].owned, &expected, 1, 0,
+		                               __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			/* Key value must not be NULL for the destructor to run */
+			pthread_once(&rcu_key_once, rcu_key_init);
+			pthread_setspecific(rcu_key, (void*)(intptr_t)(n + 1));
+			return n;
+		}
+	}
+
+	return RCU_SLOTS;
+}
+
+
+/* Create the key whose destructor frees a thread's slot */
+static void rcu_key_init(void)
+{
+	pthread_key_create(&rcu_key, rcu_slot_free);
+}
+
+
+/* Thread exit: mark the slot idle and hand it to the next thread */
+static void rcu_slot_free(void* arg)
+{
+	int n = (int)(intptr_t)arg - 1;
+
+	__atomic_store_n(&rcu_slots[n].epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&rcu_slots[n].owned, 0, __ATOMIC_RELEASE);
+}
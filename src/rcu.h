@@ -0,0 +1,80 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  rcu.h
+ *
+ *    Description:  读-复制-更新 (epoch based read-copy-update)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef RCU_H_
+#define RCU_H_
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Enter a read side critical section
+ *
+ * Pointers loaded with rcu_dereference() stay valid until the matching
+ * rcu_read_unlock(). Sections may nest. Readers never block and never
+ * allocate; each thread claims a private, cache line sized slot the first
+ * time it reads and gives it back when it exits.
+ *
+ * @example
+ *
+ *    rcu_read_lock();
+ *    table = rcu_dereference(current_table);
+ *    ..                                    //use table
+ *    rcu_read_unlock();
+ *
+ * @return nothing
+ */
+void rcu_read_lock(void);
+
+
+/**
+ * @brief Leave a read side critical section
+ *
+ * @return nothing
+ */
+void rcu_read_unlock(void);
+
+
+/**
+ * @brief Wait for all readers that may still see an old pointer
+ *
+ * Returns once every read side critical section that started before the
+ * call has ended. Only the calling (writer) thread waits; readers go on.
+ * Must not be called from inside a read side critical section.
+ *
+ * @example
+ *
+ *    old = rcu_exchange(current_table, fresh);
+ *    rcu_synchronize();
+ *    free(old);
+ *
+ * @return nothing
+ */
+void rcu_synchronize(void);
+
+
+/* Load a pointer published by rcu_assign() or rcu_exchange() */
+#define rcu_dereference(p)       __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/* Publish a fully initialized object */
+#define rcu_assign(p, v)         __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* Publish a fully initialized object and get back the previous one */
+#define rcu_exchange(p, v)       __atomic_exchange_n(&(p), (v), __ATOMIC_ACQ_REL)
+
+#endif /* RCU_H_ */
@@ -0,0 +1,565 @@
+#include <stdio.h>
+
+#include "router.h"
+
+//! Kind of node
+enum {
+  ROUTER_STATIC,
+  ROUTER_PARAM,
+  ROUTER_WILDCARD
+};
+
+//! Node of the tree routes are added to, one per segment or param
+typedef struct st_router_bnode {
+  char* label;                        //!< Static segment, or param or wildcard name
+  size_t label_len;                   //!< Length of label
+  char* prefix;                       //!< Static text before the param or wildcard in its segment
+  size_t prefix_len;                  //!< Length of prefix
+  int kind;                           //!< Static, param or wildcard
+  struct st_router_bnode** children;  //!< Children of every kind
+  size_t nchildren;                   //!< Total of children
+  int route;                          //!< Route ending here or -1
+} st_router_bnode;
+
+/*****************************************************************************/
+/* Prototypes of Static Functions
+*/
+/*****************************************************************************/
+
+/**
+ * \brief	Create a tree node.
+ * \param	kind		Static, param or wildcard
+ * \param	prefix	Static text before a param or wildcard, copied
+ * \param	plen		Length of prefix
+ * \param	label		Label, copied
+ * \param	len			Length of label
+ * \return	A node if OK. Otherwise NULL.
+ */
+static st_router_bnode *router_bnode_new(int kind, const char *prefix, size_t plen,
+                                         const char *label, size_t len);
+
+/**
+ * \brief	Free a tree node and its children.
+ * \param	node		Node to free
+ */
+static void router_bnode_free(st_router_bnode *node);
+
+/**
+ * \brief	Find or add a child.
+ * \param	node		Parent
+ * \param	kind		Static, param or wildcard
+ * \param	prefix	Prefix of a param or wildcard
+ * \param	plen		Length of prefix
+ * \param	label		Segment of a static child, name of the others
+ * \param	len			Length of label
+ * \param	found		Set to 1 if the child was there already
+ * \return	The child if OK. Otherwise NULL.
+ */
+static st_router_bnode *router_bnode_child(st_router_bnode *node, int kind, const char *prefix,
+                                           size_t plen, const char *label, size_t len, int *found);
+
+/**
+ * \brief	Insert the rest of a pattern below a node.
+ * \param	node		Node whose own label is already matched
+ * \param	p				Rest of the pattern
+ * \param	len			Length of p
+ * \param	route		Index of the route
+ * \return	0 if Ok. Otherwise error code.
+ */
+static int router_insert(st_router_bnode *node, const char *p, size_t len, int route);
+
+/**
+ * \brief	Count nodes, static children and blob bytes of a tree.
+ * \param	node		Root of the tree
+ * \param	nnodes	Incremented by the nodes
+ * \param	nstatic	Incremented by the static children
+ * \param	nblob		Incremented by the bytes
+ */
+static void router_measure(const st_router_bnode *node, uint32_t *nnodes, uint32_t *nstatic,
+                           size_t *nblob);
+
+/**
+ * \brief	Hash of a segment below a node.
+ * \param	hash		FNV-1a of the segment
+ * \param	node		Index of the parent node
+ * \return	Hash value.
+ */
+static uint32_t router_hash(uint32_t hash, uint32_t node);
+
+/**
+ * \brief	Order edges: longest prefix first, params before wildcards.
+ * \param	a				Edge
+ * \param	b				Edge
+ * \return	Negative, zero or positive, as for qsort.
+ */
+static int router_edge_cmp(const void *a, const void *b);
+
+/**
+ * \brief	Walk the compiled tables.
+ * \param	router	Compiled router
+ * \param	index		Node reached
+ * \param	path		Rest of the path
+ * \param	len			Length of path
+ * \param	match		Result
+ * \return	Route index if found, -1 otherwise.
+ */
+static int router_walk(const st_router *router, uint32_t index, const char *path,
+                       size_t len, st_router_match *match);
+
+/*****************************************************************************/
+/* Functions to router
+*/
+/*****************************************************************************/
+
+int router_init(st_router *router)
+{
+  if (router == NULL)
+    return -1;
+
+  memset(router, 0, sizeof(st_router));
+
+  router->root = router_bnode_new(ROUTER_STATIC, "", 0, "", 0);
+  if (router->root == NULL)
+    return -1;
+
+  return 0;
+}
+/*****************************************************************************/
+
+int router_add(st_router *router, const char *pattern, void *handler)
+{
+  void **handlers;
+  size_t len;
+  int result;
+
+  if (router == NULL || router->root == NULL || pattern == NULL || pattern[0] != '/')
+    return -1;
+
+  len = strlen(pattern);
+  if (len > UINT16_MAX)
+    return -1;
+
+  handlers = (void **)realloc(router->handlers, sizeof(void *) * (router->nroutes + 1));
+  if (handlers == NULL)
+    return -1;
+
+  router->handlers = handlers;
+
+  result = router_insert(router->root, pattern, len, router->nroutes);
+  if (result != 0)
+    return result;
+
+  router->handlers[router->nroutes++] = handler;
+  return 0;
+}
+/*****************************************************************************/
+
+int router_compile(st_router *router)
+{
+  const st_router_bnode **queue = NULL;
+  st_router_node *nodes = NULL;
+  st_router_edge *edges = NULL, *e;
+  st_router_slot *slots = NULL, *slot;
+  char *blob = NULL;
+  uint32_t nnodes = 0, nstatic = 0, nedges = 0, nslots = 2, head, tail, hash;
+  size_t nblob = 0, used = 0, i, k;
+
+  if (router == NULL || router->root == NULL)
+    return -1;
+
+  router_measure(router->root, &nnodes, &nstatic, &nblob);
+
+  /* At most half full, so probes stay short */
+  while (nslots < nstatic * 2)
+    nslots *= 2;
+
+  nodes = (st_router_node *)calloc(nnodes, sizeof(st_router_node));
+  edges = (st_router_edge *)calloc(nnodes, sizeof(st_router_edge));
+  slots = (st_router_slot *)calloc(nslots, sizeof(st_router_slot));
+  queue = (const st_router_bnode **)malloc(sizeof(st_router_bnode *) * nnodes);
+  blob = (char *)malloc(nblob + 1);
+  if (nodes == NULL || edges == NULL || slots == NULL || queue == NULL || blob == NULL)
+    goto compile_error;
+
+  /* Breadth first, so that the edges of a node sit next to each other */
+  head = 0;
+  tail = 0;
+  queue[tail++] = router->root;
+
+  while (head < tail) {
+    const st_router_bnode *b = queue[head];
+    st_router_node *n = &nodes[head];
+
+    n->route = b->route;
+    n->first_edge = nedges;
+
+    for (i = 0; i < b->nchildren; i++) {
+      const st_router_bnode *c = b->children[i];
+
+      if (c->kind == ROUTER_STATIC) {
+        for (k = 0, hash = 2166136261u; k < c->label_len; k++)
+          hash = (hash ^ (unsigned char)c->label[k]) * 16777619u;
+        hash = router_hash(hash, head);
+
+        for (k = hash & (nslots - 1); slots[k].child != 0; k = (k + 1) & (nslots - 1))
+          ;
+        slot = &slots[k];
+        slot->hash = hash;
+        slot->node = head;
+        slot->child = tail;
+        slot->label_off = (uint32_t)used;
+        slot->label_len = (uint32_t)c->label_len;
+      } else {
+        e = &edges[nedges++];
+        e->kind = (uint8_t)c->kind;
+        e->target = tail;
+        e->prefix_off = (uint32_t)used;
+        e->prefix_len = (uint16_t)c->prefix_len;
+        memcpy(blob + used, c->prefix, c->prefix_len);
+        used += c->prefix_len;
+        e->name_off = (uint32_t)used;
+        e->name_len = (uint16_t)c->label_len;
+      }
+
+      memcpy(blob + used, c->label, c->label_len);
+      used += c->label_len;
+      queue[tail++] = c;
+    }
+
+    n->nedges = nedges - n->first_edge;
+    qsort(edges + n->first_edge, n->nedges, sizeof(st_router_edge), router_edge_cmp);
+    head++;
+  }
+
+  free(queue);
+  free(router->nodes);
+  free(router->edges);
+  free(router->slots);
+  free(router->blob);
+  router->nodes = nodes;
+  router->nnodes = nnodes;
+  router->edges = edges;
+  router->nedges = nedges;
+  router->slots = slots;
+  router->slot_mask = nslots - 1;
+  router->blob = blob;
+  return 0;
+
+compile_error:
+  free(nodes);
+  free(edges);
+  free(slots);
+  free(queue);
+  free(blob);
+  return -1;
+}
+/*****************************************************************************/
+
+int router_match(const st_router *router, const char *path, size_t len, st_router_match *match)
+{
+  int route;
+
+  if (router == NULL || router->nodes == NULL || path == NULL || match == NULL)
+    return -1;
+
+  match->count = 0;
+  route = router_walk(router, 0, path, len, match);
+  if (route < 0)
+    return -1;
+
+  match->route = route;
+  match->handler = router->handlers[route];
+  return 0;
+}
+/*****************************************************************************/
+
+int router_params_tokvm(const st_router_match *match, st_strkvm *strkvm)
+{
+  uint16_t i;
+
+  if (match == NULL || strkvm == NULL)
+    return -1;
+
+  for (i = 0; i < match->count; i++)
+    if (strkvm_add_n(strkvm, match->params[i].name, match->params[i].name_len,
+                     match->params[i].value, match->params[i].value_len) != 0)
+      return -1;
+
+  return 0;
+}
+/*****************************************************************************/
+
+int router_free(st_router *router)
+{
+  if (router == NULL)
+    return -1;
+
+  router_bnode_free(router->root);
+  free(router->handlers);
+  free(router->nodes);
+  free(router->edges);
+  free(router->slots);
+  free(router->blob);
+  memset(router, 0, sizeof(st_router));
+  return 0;
+}
+
+/*****************************************************************************/
+/* Static Functions
+*/
+/*****************************************************************************/
+
+static st_router_bnode *router_bnode_new(int kind, const char *prefix, size_t plen,
+                                         const char *label, size_t len)
+{
+  st_router_bnode *node;
+
+  node = (st_router_bnode *)malloc(sizeof(st_router_bnode));
+  if (node == NULL)
+    return NULL;
+
+  memset(node, 0, sizeof(st_router_bnode));
+  node->label = strndup(label, len);
+  node->prefix = strndup(prefix, plen);
+  if (node->label == NULL || node->prefix == NULL) {
+    free(node->label);
+    free(node->prefix);
+    free(node);
+    return NULL;
+  }
+
+  node->label_len = len;
+  node->prefix_len = plen;
+  node->kind = kind;
+  node->route = -1;
+  return node;
+}
+/*****************************************************************************/
+
+static void router_bnode_free(st_router_bnode *node)
+{
+  size_t i;
+
+  if (node == NULL)
+    return;
+
+  for (i = 0; i < node->nchildren; i++)
+    router_bnode_free(node->children[i]);
+
+  free(node->children);
+  free(node->label);
+  free(node->prefix);
+  free(node);
+}
+/*****************************************************************************/
+
+static st_router_bnode *router_bnode_child(st_router_bnode *node, int kind, const char *prefix,
+                                           size_t plen, const char *label, size_t len, int *found)
+{
+  st_router_bnode *child, **children;
+  size_t i;
+
+  /* Static children are told apart by segment, the others by prefix */
+  for (i = 0; i < node->nchildren; i++) {
+    child = node->children[i];
+    if (child->kind != kind)
+      continue;
+
+    if (kind == ROUTER_STATIC ? child->label_len == len && memcmp(child->label, label, len) == 0
+                              : child->prefix_len == plen && memcmp(child->prefix, prefix, plen) == 0) {
+      *found = 1;
+      return child;
+    }
+  }
+
+  *found = 0;
+  child = router_bnode_new(kind, prefix, plen, label, len);
+  if (child == NULL)
+    return NULL;
+
+  children = (st_router_bnode **)realloc(node->children, sizeof(st_router_bnode *) * (i + 1));
+  if (children == NULL) {
+    router_bnode_free(child);
+    return NULL;
+  }
+
+  node->children = children;
+  children[node->nchildren++] = child;
+  return child;
+}
+/*****************************************************************************/
+
+static int router_insert(st_router_bnode *node, const char *p, size_t len, int route)
+{
+  st_router_bnode *child;
+  size_t s, e;
+  int found;
+
+  if (len == 0) {
+    if (node->route >= 0)
+      return -1;
+
+    node->route = route;
+    return 0;
+  }
+
+  /* Static text up to the next segment, a param or a wildcard */
+  for (s = 0; s < len && p[s] != ':' && p[s] != '*' && (s == 0 || p[s] != '/'); s++)
+    ;
+
+  if (s == len || (s > 0 && p[s] == '/')) {
+    child = router_bnode_child(node, ROUTER_STATIC, "", 0, p, s, &found);
+    if (child == NULL)
+      return -1;
+    return router_insert(child, p + s, len - s, route);
+  }
+
+  if (p[s] == ':') {
+    for (e = s + 1; e < len && p[e] != '/'; e++)
+      ;
+    if (e == s + 1)
+      return -1;
+
+    child = router_bnode_child(node, ROUTER_PARAM, p, s, p + s + 1, e - s - 1, &found);
+    if (child == NULL)
+      return -1;
+
+    /* Same position, other name: ambiguous */
+    if (found && (child->label_len != e - s - 1 || memcmp(child->label, p + s + 1, e - s - 1) != 0))
+      return -1;
+    return router_insert(child, p + e, len - e, route);
+  }
+
+  if (memchr(p + s + 1, '/', len - s - 1) != NULL)
+    return -1;
+
+  child = router_bnode_child(node, ROUTER_WILDCARD, p, s, p + s + 1, len - s - 1, &found);
+  if (child == NULL || found)
+    return -1;
+
+  child->route = route;
+  return 0;
+}
+/*****************************************************************************/
+
+static void router_measure(const st_router_bnode *node, uint32_t *nnodes, uint32_t *nstatic,
+                           size_t *nblob)
+{
+  size_t i;
+
+  (*nnodes)++;
+  *nblob += node->label_len + node->prefix_len;
+  if (node->kind == ROUTER_STATIC && node->label_len > 0)
+    (*nstatic)++;
+
+  for (i = 0; i < node->nchildren; i++)
+    router_measure(node->children[i], nnodes, nstatic, nblob);
+}
+/*****************************************************************************/
+
+static uint32_t router_hash(uint32_t hash, uint32_t node)
+{
+  hash ^= node * 0x9e3779b9u;
+  return hash ^ (hash >> 16);
+}
+/*****************************************************************************/
+
+static int router_edge_cmp(const void *a, const void *b)
+{
+  const st_router_edge *ea = (const st_router_edge *)a;
+  const st_router_edge *eb = (const st_router_edge *)b;
+
+  /* A longer prefix is more static text, which wins as in a byte trie */
+  if (ea->prefix_len != eb->prefix_len)
+    return (int)eb->prefix_len - (int)ea->prefix_len;
+
+  return (int)ea->kind - (int)eb->kind;
+}
+/*****************************************************************************/
+
+static int router_walk(const st_router *router, uint32_t index, const char *path,
+                       size_t len, st_router_match *match)
+{
+  const st_router_node *n;
+  const st_router_edge *e, *end;
+  const st_router_slot *slot;
+  uint32_t hash, i;
+  uint16_t saved;
+  size_t s, v;
+  int child, route;
+
+  for (;;) {
+    n = &router->nodes[index];
+
+    if (len == 0 && n->route >= 0)
+      return n->route;
+
+    /* Next segment, its '/' up to the next one, hashed on the way */
+    child = -1;
+    s = 0;
+    if (len > 0) {
+      hash = (2166136261u ^ (unsigned char)path[0]) * 16777619u;
+      for (s = 1; s < len && path[s] != '/'; s++)
+        hash = (hash ^ (unsigned char)path[s]) * 16777619u;
+      hash = router_hash(hash, index);
+
+      for (i = hash & router->slot_mask; (slot = &router->slots[i])->child != 0;
+           i = (i + 1) & router->slot_mask)
+        if (slot->hash == hash && slot->node == index && slot->label_len == s &&
+            memcmp(router->blob + slot->label_off, path, s) == 0) {
+          child = (int)slot->child;
+          break;
+        }
+    }
+
+    /* Nothing to fall back to: descend without recursion */
+    if (n->nedges == 0) {
+      if (child < 0)
+        return -1;
+      index = (uint32_t)child;
+      path += s;
+      len -= s;
+      continue;
+    }
+
+    if (child >= 0) {
+      route = router_walk(router, (uint32_t)child, path + s, len - s, match);
+      if (route >= 0)
+        return route;
+    }
+
+    saved = match->count;
+    for (e = router->edges + n->first_edge, end = e + n->nedges; e < end; e++) {
+      if (e->prefix_len > len || memcmp(path, router->blob + e->prefix_off, e->prefix_len) != 0)
+        continue;
+
+      s = e->prefix_len;
+      v = len - s;
+      if (e->kind == ROUTER_PARAM) {
+        for (v = 0; s + v < len && path[s + v] != '/'; v++)
+          ;
+        if (v == 0)
+          continue;
+      }
+
+      if (match->count < ROUTER_MAX_PARAMS) {
+        match->params[match->count].name = router->blob + e->name_off;
+        match->params[match->count].name_len = e->name_len;
+        match->params[match->count].value = path + s;
+        match->params[match->count].value_len = v;
+        match->count++;
+      }
+
+      /* A wildcard takes the rest of the path */
+      if (e->kind == ROUTER_WILDCARD)
+        return router->nodes[e->target].route;
+
+      route = router_walk(router, e->target, path + s + v, len - s - v, match);
+      if (route >= 0)
+        return route;
+      match->count = saved;
+    }
+    return -1;
+  }
+}
+/*****************************************************************************/
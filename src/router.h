@@ -0,0 +1,138 @@
+#ifndef __ROUTER_H_INCLUDED__
+#define __ROUTER_H_INCLUDED__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "strkvm.h"
+
+//! Most path parameters returned by one match
+#define ROUTER_MAX_PARAMS 16
+
+struct st_router_bnode;
+
+//! Compiled node, one per distinct run of segments and params
+typedef struct {
+	int32_t route;								//!< Route ending here or -1
+	uint32_t first_edge;					//!< First of its param and wildcard edges
+	uint32_t nedges;							//!< Param and wildcard edges, longest prefix first
+} st_router_node;
+
+//! Param or wildcard edge of a compiled node
+typedef struct {
+	uint32_t prefix_off;					//!< Static text before it in its segment, in blob
+	uint16_t prefix_len;					//!< Length of prefix
+	uint16_t name_len;						//!< Length of name
+	uint32_t name_off;						//!< Param name in blob
+	uint32_t target;							//!< Node after the value
+	uint8_t kind;									//!< Param or wildcard
+} st_router_edge;
+
+//! Slot of the static segment hash: a node and a segment give a child
+typedef struct {
+	uint32_t hash;								//!< Hash of segment and node
+	uint32_t node;								//!< Parent node
+	uint32_t child;								//!< Child node, 0 for an empty slot
+	uint32_t label_off;						//!< Segment in blob
+	uint32_t label_len;						//!< Length of segment
+} st_router_slot;
+
+//! Path parameter, slices of the pattern and of the matched path
+typedef struct {
+	const char* name;							//!< Name, not NUL terminated
+	size_t name_len;							//!< Length of name
+	const char* value;						//!< Value, not NUL terminated
+	size_t value_len;							//!< Length of value
+} st_router_param;
+
+//! Result of a lookup
+typedef struct {
+	void* handler;								//!< Handler of the route
+	int route;										//!< Index of the route
+	uint16_t count;								//!< Total of params
+	st_router_param params[ROUTER_MAX_PARAMS];	//!< Params
+} st_router_match;
+
+//! Router
+typedef struct {
+	struct st_router_bnode* root;	//!< Tree routes are added to
+	void** handlers;							//!< Handler of each route
+	int nroutes;									//!< Total of routes
+	st_router_node* nodes;				//!< Compiled nodes, root first
+	uint32_t nnodes;							//!< Total of compiled nodes
+	st_router_edge* edges;				//!< Param and wildcard edges of all nodes
+	uint32_t nedges;							//!< Total of edges
+	st_router_slot* slots;				//!< Static segment hash, open addressing
+	uint32_t slot_mask;						//!< Slots minus one, a power of two
+	char* blob;										//!< Segments, prefixes and names
+} st_router;
+
+/**
+ * \brief	Initialize router.
+ * \param	router	Struct that will be initialized.
+ * \return	0 if Ok or -1 if param is null.
+ */
+int router_init(st_router* router);
+
+/**
+ * \brief	Register a route.
+ *
+ * Patterns start with '/' and are made of static text, ":name" params
+ * matching up to the next '/' and an optional trailing "*name" wildcard
+ * matching the rest of the path, e.g. "/users/:id" or "/files/" followed
+ * by "*path".
+ * Static text wins over params, params win over wildcards.
+ *
+ * \param	router	Struct router
+ * \param	pattern	Route pattern
+ * \param	handler	Value returned by router_match
+ * \return	0 if Ok. Otherwise error code (bad pattern or duplicate route).
+ */
+int router_add(st_router* router, const char* pattern, void* handler);
+
+/**
+ * \brief	Compile registered routes into the flat lookup tables.
+ *
+ * A path is looked up one segment (a '/' and the text up to the next one)
+ * at a time: one probe of a hash keyed by node and segment finds the
+ * static child, so the cost does not grow with the number of siblings.
+ *
+ * Must be called after the last router_add and before router_match.
+ * May be called again after more routes are added.
+ *
+ * \param	router	Struct router
+ * \return	0 if Ok. Otherwise error code.
+ */
+int router_compile(st_router* router);
+
+/**
+ * \brief	Find the route of a decoded path.
+ *
+ * Allocates nothing. Params point into the compiled router and into path,
+ * they stay valid while both do.
+ *
+ * \param	router	Compiled router
+ * \param	path		Decoded path, not necessarily NUL terminated
+ * \param	len			Length of path
+ * \param	match		Result
+ * \return	0 if found, -1 otherwise.
+ */
+int router_match(const st_router* router, const char* path, size_t len, st_router_match* match);
+
+/**
+ * \brief	Copy the params of a match into a key/value struct.
+ * \param	match		Result of router_match
+ * \param	strkvm	Initialized key/value struct
+ * \return	0 if Ok. Otherwise error code.
+ */
+int router_params_tokvm(const st_router_match* match, st_strkvm* strkvm);
+
+/**
+ * \brief	Frees memory space used by router.
+ * \param	router	Struct router
+ * \return	0 if Ok or -1 if param is null.
+ */
+int router_free(st_router* router);
+
+#endif /* __ROUTER_H_INCLUDED__ */
@@ -1,34 +1,85 @@
 #include <stdio.h>
+#include <ctype.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
 
 #include "strkvm.h"
+#include "atom.h"
 #include "strutils.h"
 
+//! Nodes of a block
+#define STRKVM_VARS(b) ((st_strkv *)((b) + 1))
+
+//! Strings of a block, right after the room for nodes
+#define STRKVM_BLOB(b) ((char *)(STRKVM_VARS(b) + (b)->capacity))
+
+//! Offsets are 32 bits, so is the whole block
+#define STRKVM_BLOCK_MAX ((size_t)UINT32_MAX)
+
 /*****************************************************************************/
 /* Prototypes of Static Functions
 */
 /*****************************************************************************/
 
 /**
- * \brief	Clean node.
- * \param	var		Current node
+ * \brief	Hash of a name (FNV-1a, as the atom table).
+ * \param	name		Name
+ * \param	len			Length of name
+ * \return	Hash value.
  */
-static void strkvm_var_clear(st_strkv *var);
+static uint32_t strkvm_hash(const char *name, size_t len);
 
 /**
- * \brief	Add node into key/value struct.
+ * \brief	Make room in the block.
  * \param	strkvm	Struct key/value
- * \param	var			Current node
- * \return	0 if Ok. Otherwise error code.
+ * \param	bytes		Bytes of strings about to be added with one more node
+ * \return	0 if Ok or -1 if out of memory or past the 32 bit limits.
+ */
+static int strkvm_reserve(st_strkvm *strkvm, size_t bytes);
+
+/**
+ * \brief	Move the strings of the nodes left down over removed ones.
+ * \param	b				Block
+ */
+static void strkvm_compact(st_strkvm_head *b);
+
+/**
+ * \brief	Point the nodes at their strings and at each other again.
+ * \param	b				Block, after it moved or its nodes did
  */
-static int strkvm_var_add(st_strkvm *strkvm, st_strkv *var);
+static void strkvm_rebase(st_strkvm_head *b);
+
+/**
+ * \brief	Append a node.
+ * \param	strkvm	Struct key/value
+ * \param	name		Name of variable
+ * \param	name_len	Length of name
+ * \param	value		Value or NULL
+ * \param	value_len	Length of value
+ * \param	fold		Store the name in lower case
+ * \return	0 if Ok or -1 if out of memory.
+ */
+static int strkvm_append(st_strkvm *strkvm, const char *name, size_t name_len,
+                         const char *value, size_t value_len, bool fold);
+
+/**
+ * \brief	Find the newest node of a name.
+ * \param	strkvm	Struct key/value
+ * \param	name		Name of variable
+ * \param	len			Length of name
+ * \return	A node if found. Otherwise NULL.
+ */
+static st_strkv *strkvm_var_find(const st_strkvm *strkvm, const char *name, size_t len);
 
 /**
  * \brief	Auxiliar in adding string into key/value struct.
  * \param	strkvm	Struct key/value
- * \param	string		String with information.
+ * \param	string		"name=value", spaces around both are trimmed.
+ * \param	len				Length of string
  * \return	0 if Ok. Otherwise error code.
  */
-static int strkvm_string_add(st_strkvm *strkvm, char *string);
+static int strkvm_string_add(st_strkvm *strkvm, const char *string, size_t len);
 
 /*****************************************************************************/
 /* Functions to key/value
@@ -47,41 +98,28 @@ int strkvm_init(st_strkvm *strkvm)
 
 int strkvm_parse(st_strkvm *strkvm, char *buffer, size_t size, char split)
 {
-  char *buf = NULL;
-  char *end, *begin;
-  int result = 0;
+  const char *begin, *end, *last;
+  int result;
 
   if (strkvm == NULL || buffer == NULL || size == 0)
     return -1;
 
-  buf = strndup(buffer, size);
+  /* Read in place: the buffer ends at size or at a NUL */
+  begin = buffer;
+  last = buffer + strnlen(buffer, size);
 
-  if (buf == NULL) {
-    result = -1;
-    goto parse_end;
-  }
-
-  begin = buf;
-  while ((end = strchr(begin, split))) {
-    *end = 0;
-
-    result = strkvm_string_add(strkvm, begin);
+  while ((end = memchr(begin, split, last - begin))) {
+    result = strkvm_string_add(strkvm, begin, end - begin);
     if (result != 0)
-      goto parse_end;
+      return result;
 
-    begin = ++end;
+    begin = end + 1;
   }
 
-  if (strlen(begin) > 0) {
-    result = strkvm_string_add(strkvm, begin);
-    if (result != 0)
-      goto parse_end;
-  }
+  if (begin < last)
+    return strkvm_string_add(strkvm, begin, last - begin);
 
-parse_end:
-  if (buf)
-    free(buf);
-  return result;
+  return 0;
 }
 /*****************************************************************************/
 
@@ -90,7 +128,7 @@ int strkvm_free(st_strkvm *strkvm)
   if (strkvm == NULL)
     return -1;
 
-  strkvm_var_clear(strkvm->vars);
+  free(strkvm->block);
   memset(strkvm, 0, sizeof(st_strkvm));
   return 0;
 }
@@ -98,77 +136,62 @@ int strkvm_free(st_strkvm *strkvm)
 
 int strkvm_add(st_strkvm *strkvm, const char *name)
 {
-  int result;
-  st_strkv *var;
-
   if (strkvm == NULL || name == NULL)
     return -1;
 
-  var = (st_strkv *)malloc(sizeof(st_strkv));
-  if (var == NULL)
-    return -1;
+  return strkvm_add_n(strkvm, name, strlen(name), NULL, 0);
+}
+/*****************************************************************************/
 
-  memset(var, 0, sizeof(st_strkv));
-  var->name = strdup(name);
+int strkvm_add_n(st_strkvm *strkvm, const char *name, size_t name_len,
+                 const char *value, size_t value_len)
+{
+  if (strkvm == NULL || name == NULL)
+    return -1;
 
-  result = strkvm_var_add(strkvm, var);
-  if (result != 0) {
-    free(var->name);
-    free(var);
-    return result;
-  }
-  return 0;
+  return strkvm_append(strkvm, name, name_len, value, value_len, false);
 }
 /*****************************************************************************/
 
-int strkvm_add_string(st_strkvm *strkvm, const char *name, const char *value)
+int strkvm_add_header(st_strkvm *strkvm, const char *name, size_t name_len,
+                      const char *value, size_t value_len)
 {
-  int result;
-  st_strkv *var;
-
   if (strkvm == NULL || name == NULL || value == NULL)
     return -1;
 
-  var = (st_strkv *)malloc(sizeof(st_strkv));
-  if (var == NULL)
-    return -1;
+  return strkvm_append(strkvm, name, name_len, value, value_len, true);
+}
+/*****************************************************************************/
 
-  memset(var, 0, sizeof(st_strkv));
-  var->name = strdup(name);
-  var->value = strdup(value);
+int strkvm_add_string(st_strkvm *strkvm, const char *name, const char *value)
+{
+  if (strkvm == NULL || name == NULL || value == NULL)
+    return -1;
 
-  result = strkvm_var_add(strkvm, var);
-  if (result != 0) {
-    free(var->name);
-    free(var->value);
-    free(var);
-    return result;
-  }
-  return 0;
+  return strkvm_add_n(strkvm, name, strlen(name), value, strlen(value));
 }
 /*****************************************************************************/
 
 int strkvm_add_int(st_strkvm *strkvm, const char *name, int value)
 {
-  char v[50];
+  char v[STRUTILS_INT_LEN];
 
   if (strkvm == NULL || name == NULL)
     return -1;
 
-  snprintf(v, sizeof(v), "%d", value);
-  return strkvm_add_string(strkvm, name, v);
+  return strkvm_add_n(strkvm, name, strlen(name), v, strutils_format_int(value, v));
 }
 /*****************************************************************************/
 
 int strkvm_add_float(st_strkvm *strkvm, const char *name, float value)
 {
-  char v[50];
+  char v[STRUTILS_DOUBLE_LEN];
 
   if (strkvm == NULL || name == NULL)
     return -1;
 
-  snprintf(v, sizeof(v), "%f", value);
-  return strkvm_add_string(strkvm, name, v);
+  /* Shortest form that reads back the same: 1.5, not 1.500000 */
+  return strkvm_add_n(strkvm, name, strlen(name), v, strutils_format_float(value, v));
 }
 /*****************************************************************************/
 
@@ -186,28 +209,26 @@ int strkvm_add_bool(st_strkvm *strkvm, const char *name, bool value)
 
 int strkvm_remove(st_strkvm *strkvm, const char *name)
 {
-  st_strkv *var = NULL;
-  st_strkv *prev = NULL;
+  st_strkvm_head *b;
+  st_strkv *var;
+  size_t i;
 
   if (strkvm == NULL || name == NULL)
     return -1;
 
-  for (var = strkvm->vars; var; var = var->next) {
-    if (strcmp(var->name, name) == 0) {
-      if (prev == NULL)
-        strkvm->vars = var->next;
-      else
-        prev->next = var->next;
+  if ((var = strkvm_var_find(strkvm, name, strlen(name))) == NULL)
+    return 0;
 
-      free(var->name);
-      free(var->value);
-      free(var);
+  /* Strings stay until the block needs room */
+  b = strkvm->block;
+  b->blob_dead += var->name_len + 1;
+  if (var->val_off != STRKVM_NO_VALUE)
+    b->blob_dead += var->val_len + 1;
 
-      strkvm->count--;
-      break;
-    }
-    prev = var;
-  }
+  i = var - STRKVM_VARS(b);
+  memmove(var, var + 1, (b->count - i - 1) * sizeof(st_strkv));
+  b->count--;
+  strkvm_rebase(b);
   return 0;
 }
 /*****************************************************************************/
@@ -223,11 +244,11 @@ int strkvm_tostring(st_strkvm *strkvm, char **buffer, size_t *length, char split
   if (!(out = open_memstream(buffer, length)))
     return -1;
 
-  for (var = strkvm->vars; var; var = var->next) {
-    if (var->value != NULL)
-      fprintf(out, "%s=%s%c", var->name, var->value, split);
+  for (var = strkvm_get_next(strkvm, NULL); var; var = strkvm_get_next(strkvm, var)) {
+    if (var->val_off != STRKVM_NO_VALUE)
+      fprintf(out, "%s=%s%c", strkvm_name(strkvm, var), strkvm_value(strkvm, var), split);
     else
-      fprintf(out, "%s;", var->name);
+      fprintf(out, "%s;", strkvm_name(strkvm, var));
   }
 
   fclose(out);
@@ -240,7 +261,7 @@ int strkvm_count(st_strkvm *strkvm)
   if (strkvm == NULL)
     return -1;
 
-  return (int)strkvm->count;
+  return strkvm->block ? (int)strkvm->block->count : 0;
 }
 /*****************************************************************************/
 
@@ -251,16 +272,12 @@ int strkvm_get_string(st_strkvm *strkvm, const char *name, char **value)
   if (strkvm == NULL || name == NULL || value == NULL)
     return -1;
 
-  for (var = strkvm->vars; var; var = var->next)
-    if (strcmp(var->name, name) == 0)
-      break;
-
-  if (var == NULL)
+  if ((var = strkvm_var_find(strkvm, name, strlen(name))) == NULL)
     return -1;
 
   *value = NULL;
-  if (var->value != NULL)
-    *value = strdup(var->value);
+  if (var->val_off != STRKVM_NO_VALUE)
+    *value = strdup(strkvm_value(strkvm, var));
 
   return 0;
 }
@@ -269,18 +286,20 @@ int strkvm_get_string(st_strkvm *strkvm, const char *name, char **value)
 int strkvm_get_int(st_strkvm *strkvm, const char *name, int *value)
 {
   st_strkv *var;
+  int64_t v;
 
   if (strkvm == NULL || name == NULL || value == NULL)
     return -1;
 
-  for (var = strkvm->vars; var; var = var->next)
-    if (strcmp(var->name, name) == 0)
-      break;
-
-  if (var == NULL)
+  if ((var = strkvm_var_find(strkvm, name, strlen(name))) == NULL ||
+      var->val_off == STRKVM_NO_VALUE)
     return -1;
 
-  *value = atoi(var->value);
+  if (strutils_parse_int(strkvm_value(strkvm, var), var->val_len, &v, NULL) != 0 ||
+      v < INT_MIN || v > INT_MAX)
+    return -2;
+
+  *value = (int)v;
   return 0;
 }
 /*****************************************************************************/
@@ -288,18 +307,20 @@ int strkvm_get_int(st_strkvm *strkvm, const char *name, int *value)
 int strkvm_get_float(st_strkvm *strkvm, const char *name, float *value)
 {
   st_strkv *var;
+  double v;
 
   if (strkvm == NULL || name == NULL || value == NULL)
     return -1;
 
-  for (var = strkvm->vars; var; var = var->next)
-    if (strcmp(var->name, name) == 0)
-      break;
-
-  if (var == NULL)
+  if ((var = strkvm_var_find(strkvm, name, strlen(name))) == NULL ||
+      var->val_off == STRKVM_NO_VALUE)
     return -1;
 
-  *value = atof(var->value);
+  if (strutils_parse_double(strkvm_value(strkvm, var), var->val_len, &v, NULL) != 0 ||
+      (isfinite(v) && fabs(v) > FLT_MAX))
+    return -2;
+
+  *value = (float)v;
   return 0;
 }
 /*****************************************************************************/
@@ -311,33 +332,154 @@ int strkvm_get_bool(st_strkvm *strkvm, const char *name, bool *value)
   if (strkvm == NULL || name == NULL || value == NULL)
     return -1;
 
-  for (var = strkvm->vars; var; var = var->next)
-    if (strcmp(var->name, name) == 0)
-      break;
-
-  if (var == NULL)
+  if ((var = strkvm_var_find(strkvm, name, strlen(name))) == NULL ||
+      var->val_off == STRKVM_NO_VALUE)
     return -1;
 
-  *value = (strcmp(var->value, "true") == 0) ? true : false;
+  *value = (strcmp(strkvm_value(strkvm, var), "true") == 0) ? true : false;
   return 0;
 }
 /*****************************************************************************/
 
+st_strkv *strkvm_get_atom(st_strkvm *strkvm, uint32_t atom)
+{
+  const char *name;
+  st_strkv *vars;
+  uint32_t hash, i;
+  size_t len;
+
+  if (strkvm == NULL || strkvm->block == NULL || (name = atom_name(atom)) == NULL)
+    return NULL;
+
+  len = atom_len(atom);
+  hash = strkvm_hash(name, len);
+  vars = STRKVM_VARS(strkvm->block);
+
+  /* A node without atom may still carry the name, if it was interned later */
+  for (i = strkvm->block->count; i-- > 0;)
+    if (vars[i].atom ? vars[i].atom == atom
+                     : vars[i].hash == hash && vars[i].name_len == len &&
+                       memcmp(strkvm_name(strkvm, &vars[i]), name, len) == 0)
+      return &vars[i];
+
+  return NULL;
+}
+/*****************************************************************************/
+
 st_strkv *strkvm_get_next(st_strkvm *strkvm, const st_strkv *var)
 {
-  st_strkv *v;
+  st_strkv *vars;
 
-  if (strkvm == NULL)
+  if (strkvm == NULL || strkvm->block == NULL || strkvm->block->count == 0)
     return NULL;
 
+  vars = STRKVM_VARS(strkvm->block);
+
   if (var == NULL)
-    return strkvm->vars;
+    return vars;
 
-  for (v = strkvm->vars; v; v = v->next)
-    if (var == v)
-      return v->next;
+  if (var < vars || var + 1 >= vars + strkvm->block->count)
+    return NULL;
 
-  return NULL;
+  return (st_strkv *)var + 1;
+}
+/*****************************************************************************/
+
+const char *strkvm_name(const st_strkvm *strkvm, const st_strkv *var)
+{
+  return STRKVM_BLOB(strkvm->block) + var->name_off;
+}
+/*****************************************************************************/
+
+const char *strkvm_value(const st_strkvm *strkvm, const st_strkv *var)
+{
+  if (var->val_off == STRKVM_NO_VALUE)
+    return NULL;
+
+  return STRKVM_BLOB(strkvm->block) + var->val_off;
+}
+/*****************************************************************************/
+
+int strkvm_image(const st_strkvm *strkvm, const void **data, size_t *size)
+{
+  const st_strkvm_head *b;
+
+  if (strkvm == NULL || data == NULL || size == NULL)
+    return -1;
+
+  b = strkvm->block;
+  *data = b;
+  *size = b ? sizeof(st_strkvm_head) + (size_t)b->capacity * sizeof(st_strkv) + b->blob_len : 0;
+  return 0;
+}
+/*****************************************************************************/
+
+int strkvm_load(st_strkvm *strkvm, const void *data, size_t size)
+{
+  st_strkvm_head head, *b;
+  const st_strkv *var;
+  const char *blob;
+  size_t vars, end, live;
+  uint32_t i;
+
+  if (strkvm == NULL || (data == NULL && size != 0))
+    return -1;
+
+  strkvm_free(strkvm);
+  if (size == 0)
+    return 0;
+
+  if (size < sizeof(st_strkvm_head) || size > STRKVM_BLOCK_MAX)
+    return -1;
+
+  memcpy(&head, data, sizeof(st_strkvm_head));
+  vars = sizeof(st_strkvm_head) + (size_t)head.capacity * sizeof(st_strkv);
+  if (head.count > head.capacity || vars > size || size - vars != head.blob_len ||
+      head.blob_dead > head.blob_len)
+    return -1;
+
+  /* Every string must be inside the blob, NUL terminated and after the
+   * one before it, as strkvm_compact moves them down in node order */
+  var = (const st_strkv *)((const st_strkvm_head *)data + 1);
+  blob = (const char *)data + vars;
+  for (i = 0, end = 0, live = 0; i < head.count; i++, var++) {
+    if (var->name_off < end || var->name_off >= head.blob_len ||
+        var->name_len >= head.blob_len - var->name_off ||
+        blob[var->name_off + var->name_len] != 0)
+      return -1;
+    end = var->name_off + var->name_len + 1;
+    live += var->name_len + 1;
+
+    if (var->val_off != STRKVM_NO_VALUE) {
+      if (var->val_off < end || var->val_off >= head.blob_len ||
+          var->val_len >= head.blob_len - var->val_off ||
+          blob[var->val_off + var->val_len] != 0)
+        return -1;
+      end = var->val_off + var->val_len + 1;
+      live += var->val_len + 1;
+    }
+  }
+
+  if (head.blob_dead != head.blob_len - live)
+    return -1;
+
+  b = (st_strkvm_head *)malloc(size);
+  if (b == NULL)
+    return -1;
+
+  memcpy(b, data, size);
+  b->blob_cap = b->blob_len;
+
+  /* Atoms are ids of this process */
+  for (i = 0, var = STRKVM_VARS(b); i < b->count; i++, var++) {
+    ((st_strkv *)var)->hash = strkvm_hash(STRKVM_BLOB(b) + var->name_off, var->name_len);
+    ((st_strkv *)var)->atom = atom_find(STRKVM_BLOB(b) + var->name_off, var->name_len);
+  }
+
+  /* Pointers are of the process that wrote the image */
+  strkvm_rebase(b);
+  strkvm->block = b;
+  return 0;
 }
 
 /*****************************************************************************/
@@ -345,78 +487,210 @@ st_strkv *strkvm_get_next(st_strkvm *strkvm, const st_strkv *var)
 */
 /*****************************************************************************/
 
-static void strkvm_var_clear(st_strkv *var)
+static uint32_t strkvm_hash(const char *name, size_t len)
 {
-  if (var == NULL)
-    return;
-
-  if (var->next != NULL)
-    strkvm_var_clear(var->next);
+  uint32_t h = 2166136261u;
 
-  if (var->name != NULL)
-    free(var->name);
-  if (var->value != NULL)
-    free(var->value);
+  while (len--)
+    h = (h ^ (uint8_t)*name++) * 16777619u;
 
-  free(var);
+  return h;
 }
 /*****************************************************************************/
 
-static int strkvm_var_add(st_strkvm *strkvm, st_strkv *var)
+static int strkvm_append(st_strkvm *strkvm, const char *name, size_t name_len,
+                         const char *value, size_t value_len, bool fold)
 {
-  if (strkvm == NULL || var == NULL)
+  st_strkvm_head *b;
+  st_strkv *var;
+  char *blob;
+  size_t i;
+
+  if (strkvm_reserve(strkvm, name_len + 1 + (value ? value_len + 1 : 0)) != 0)
     return -1;
 
-  var->next = strkvm->vars;
-  strkvm->vars = var;
-  strkvm->count++;
+  b = strkvm->block;
+  blob = STRKVM_BLOB(b);
+  var = &STRKVM_VARS(b)[b->count++];
+
+  var->name_off = b->blob_len;
+  var->name_len = (uint32_t)name_len;
+  var->name = memcpy(blob + b->blob_len, name, name_len);
+  blob[b->blob_len + name_len] = 0;
+  b->blob_len += (uint32_t)name_len + 1;
+
+  /* Atoms are case sensitive, fold before looking the name up. ASCII
+   * only: tolower would follow the locale */
+  for (i = 0; fold && i < name_len; i++)
+    if (var->name[i] >= 'A' && var->name[i] <= 'Z')
+      var->name[i] += 'a' - 'A';
+
+  var->hash = strkvm_hash(var->name, name_len);
+  var->atom = atom_find(var->name, name_len);
+
+  var->val_off = STRKVM_NO_VALUE;
+  var->val_len = 0;
+  var->value = NULL;
+  if (value != NULL) {
+    var->val_off = b->blob_len;
+    var->val_len = (uint32_t)value_len;
+    var->value = memcpy(blob + b->blob_len, value, value_len);
+    blob[b->blob_len + value_len] = 0;
+    b->blob_len += (uint32_t)value_len + 1;
+  }
+
+  var->next = NULL;
+  if (b->count > 1)
+    var[-1].next = var;
 
   return 0;
 }
 /*****************************************************************************/
 
-static int strkvm_string_add(st_strkvm *strkvm, char *string)
+static int strkvm_reserve(st_strkvm *strkvm, size_t bytes)
 {
-  char *n, *v;
-  st_strkv *var;
-  int result = 0;
+  st_strkvm_head *b = strkvm->block;
+  size_t capacity, blob_cap, size;
+
+  if (b == NULL) {
+    capacity = 8;
+    blob_cap = bytes > 248 ? bytes : 248;
+    size = sizeof(st_strkvm_head) + capacity * sizeof(st_strkv) + blob_cap;
+    if (size > STRKVM_BLOCK_MAX || (b = (st_strkvm_head *)malloc(size)) == NULL)
+      return -1;
+
+    memset(b, 0, sizeof(st_strkvm_head));
+    b->capacity = (uint32_t)capacity;
+    b->blob_cap = (uint32_t)blob_cap;
+    strkvm->block = b;
+    return 0;
+  }
+
+  if (b->blob_dead > 0 && b->blob_len + bytes > b->blob_cap && b->blob_len - b->blob_dead + bytes <= b->blob_cap) {
+    strkvm_compact(b);
+    strkvm_rebase(b);
+  }
 
-  if (strkvm == NULL || string == NULL)
+  if (b->count < b->capacity && b->blob_len + bytes <= b->blob_cap)
+    return 0;
+
+  /* Grow by doubling what is short, the strings move up past the new nodes */
+  capacity = b->capacity;
+  if (b->count >= capacity)
+    capacity *= 2;
+
+  blob_cap = b->blob_cap;
+  while ((size_t)b->blob_len + bytes > blob_cap)
+    blob_cap *= 2;
+
+  size = sizeof(st_strkvm_head) + capacity * sizeof(st_strkv) + blob_cap;
+  if (size > STRKVM_BLOCK_MAX) {
+    if (b->blob_dead == 0)
+      return -1;
+    strkvm_compact(b);
+    strkvm_rebase(b);
+    return b->count < b->capacity && b->blob_len + bytes <= b->blob_cap ? 0 : -1;
+  }
+
+  b = (st_strkvm_head *)realloc(b, size);
+  if (b == NULL)
     return -1;
 
-  n = strdup(string);
-  v = strchr(n, '=');
-  if (v != NULL) {
-    *v++ = 0;
-    strutils_trim(v);
+  if (capacity != b->capacity)
+    memmove((char *)(STRKVM_VARS(b) + capacity), STRKVM_BLOB(b), b->blob_len);
+
+  b->capacity = (uint32_t)capacity;
+  b->blob_cap = (uint32_t)blob_cap;
+  strkvm_rebase(b);
+  strkvm->block = b;
+  return 0;
+}
+/*****************************************************************************/
+
+static void strkvm_compact(st_strkvm_head *b)
+{
+  st_strkv *var = STRKVM_VARS(b);
+  char *blob = STRKVM_BLOB(b);
+  uint32_t i, len = 0;
+
+  /* Strings are in the order of their nodes, so each one only moves down */
+  for (i = 0; i < b->count; i++, var++) {
+    memmove(blob + len, blob + var->name_off, var->name_len + 1);
+    var->name_off = len;
+    len += var->name_len + 1;
+
+    if (var->val_off != STRKVM_NO_VALUE) {
+      memmove(blob + len, blob + var->val_off, var->val_len + 1);
+      var->val_off = len;
+      len += var->val_len + 1;
+    }
   }
 
-  strutils_trim(n);
+  b->blob_len = len;
+  b->blob_dead = 0;
+}
+/*****************************************************************************/
 
-  var = (st_strkv *)malloc(sizeof(st_strkv));
-  if (var == NULL) {
-    result = -1;
-    goto string_add_end;
+static void strkvm_rebase(st_strkvm_head *b)
+{
+  st_strkv *var = STRKVM_VARS(b);
+  char *blob = STRKVM_BLOB(b);
+  uint32_t i;
+
+  for (i = 0; i < b->count; i++, var++) {
+    var->name = blob + var->name_off;
+    var->value = var->val_off != STRKVM_NO_VALUE ? blob + var->val_off : NULL;
+    var->next = i + 1 < b->count ? var + 1 : NULL;
   }
+}
+/*****************************************************************************/
 
-  memset(var, 0, sizeof(st_strkv));
-  var->name = strdup(n);
+static st_strkv *strkvm_var_find(const st_strkvm *strkvm, const char *name, size_t len)
+{
+  uint32_t atom, hash, i;
+  st_strkv *vars;
 
-  if (v != NULL)
-    var->value = strdup(v);
+  if (strkvm->block == NULL)
+    return NULL;
+
+  /* Interned names compare as integers; the others, and nodes added
+   * before their name was interned, by hash and bytes */
+  atom = atom_find(name, len);
+  hash = strkvm_hash(name, len);
+  vars = STRKVM_VARS(strkvm->block);
 
-  result = strkvm_var_add(strkvm, var);
+  /* Newest first: the last value given for a name wins */
+  for (i = strkvm->block->count; i-- > 0;)
+    if (atom && vars[i].atom ? vars[i].atom == atom
+                             : vars[i].hash == hash && vars[i].name_len == len &&
+                               memcmp(strkvm_name(strkvm, &vars[i]), name, len) == 0)
+      return &vars[i];
 
-string_add_end:
-  if (n)
-    free(n);
-  if (result != 0 && var) {
-    if (var->name)
-      free(var->name);
-    if (var->value)
-      free(var->value);
-    free(var);
+  return NULL;
+}
+/*****************************************************************************/
+
+static int strkvm_string_add(st_strkvm *strkvm, const char *string, size_t len)
+{
+  const char *n = string, *n_end, *v = NULL, *v_end = NULL;
+
+  n_end = memchr(string, '=', len);
+  if (n_end != NULL) {
+    v = n_end + 1;
+    v_end = string + len;
+    while (v < v_end && isspace((unsigned char)*v))
+      v++;
+    while (v_end > v && isspace((unsigned char)v_end[-1]))
+      v_end--;
+  } else {
+    n_end = string + len;
   }
-  return result;
+
+  while (n < n_end && isspace((unsigned char)*n))
+    n++;
+  while (n_end > n && isspace((unsigned char)n_end[-1]))
+    n_end--;
+
+  return strkvm_add_n(strkvm, n, n_end - n, v, v ? (size_t)(v_end - v) : 0);
 }
 /*****************************************************************************/
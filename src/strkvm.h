@@ -6,17 +6,35 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+//! Value offset of a node with a name only
+#define STRKVM_NO_VALUE UINT32_MAX
+
 //! Structure with information
 typedef struct st_strkv {
-	char* name;									//!< Name
-	char* value;								//!< Value
-	struct st_strkv* next;			//!< Next node
+	char* name;									//!< Name, into the strings of its strkvm
+	char* value;								//!< Value or NULL, into the strings of its strkvm
+	uint32_t atom;							//!< Atom of name or 0
+	struct st_strkv* next;			//!< Next node or NULL
+	uint32_t hash;							//!< Hash of name
+	uint32_t name_off;					//!< Offset of name in the strings
+	uint32_t name_len;					//!< Length of name
+	uint32_t val_off;						//!< Offset of value or STRKVM_NO_VALUE
+	uint32_t val_len;						//!< Length of value
 } st_strkv;
 
+//! First bytes of the block, followed by the nodes and then the strings
+typedef struct {
+	uint32_t count;							//!< Total of nodes
+	uint32_t capacity;					//!< Room for nodes
+	uint32_t blob_len;					//!< Bytes of strings
+	uint32_t blob_cap;					//!< Room for strings
+	uint32_t blob_dead;					//!< Bytes of removed strings
+	uint32_t reserved;					//!< Zero
+} st_strkvm_head;
+
 //! Structure to make key/value string
 typedef struct {
-	uint16_t count; 							//!< Total of nodes
-	st_strkv* vars;					//!< List of nodes
+	st_strkvm_head* block;			//!< Head, nodes and strings in one allocation, or NULL
 } st_strkvm;
 
 /**
@@ -50,6 +68,36 @@ int strkvm_free(st_strkvm* strkvm);
  */
 int strkvm_add(st_strkvm* strkvm, const char* name);
 
+/**
+ * \brief	Add a variable given by lengths into strkvm list.
+ * \param	strkvm	Struct that will be added.
+ * \param	name		Name of variable, not necessarily NUL terminated
+ * \param	name_len	Length of name
+ * \param	value		Value of variable or NULL for a name only
+ * \param	value_len	Length of value
+ * \return	0 if Ok. Otherwise error code.
+ */
+int strkvm_add_n(st_strkvm* strkvm, const char* name, size_t name_len,
+                 const char* value, size_t value_len);
+
+/**
+ * \brief	Add an HTTP/1 header field into strkvm list.
+ *
+ * Field names are case insensitive and the atom table holds them in lower
+ * case, as HTTP/2 sends them, so the name is stored folded to lower case:
+ * "Content-Type" gets the atom of "content-type". Look it up by the lower
+ * case name or with strkvm_get_atom.
+ *
+ * \param	strkvm	Struct that will be added.
+ * \param	name		Field name, not necessarily NUL terminated
+ * \param	name_len	Length of name
+ * \param	value		Field value
+ * \param	value_len	Length of value
+ * \return	0 if Ok. Otherwise error code.
+ */
+int strkvm_add_header(st_strkvm* strkvm, const char* name, size_t name_len,
+                      const char* value, size_t value_len);
+
 /**
  * \brief	Add a string type variable into strkvm list.
  * \param	strkvm	Struct that will be added.
@@ -124,7 +172,7 @@ int strkvm_get_string(st_strkvm* strkvm, const char* name, char** value);
  * \param	strkvm	Struct with information.
  * \param	name		Name of variable
  * \param	value		Value of variable
- * \return	0 if Ok. Otherwise error code.
+ * \return	0 if Ok, -2 if the value is not a number in range. Otherwise -1.
  */
 int strkvm_get_int(st_strkvm* strkvm, const char* name, int* value);
 
@@ -133,7 +181,7 @@ int strkvm_get_int(st_strkvm* strkvm, const char* name, int* value);
  * \param	strkvm	Struct with information.
  * \param	name		Name of variable
  * \param	value		Value of variable
- * \return	0 if Ok. Otherwise error code.
+ * \return	0 if Ok, -2 if the value is not a number in range. Otherwise -1.
  */
 int strkvm_get_float(st_strkvm* strkvm, const char* name, float* value);
 
@@ -147,11 +195,70 @@ int strkvm_get_float(st_strkvm* strkvm, const char* name, float* value);
 int strkvm_get_bool(st_strkvm* strkvm, const char* name, bool* value);
 
 /**
- * \brief	Get a next node into strkvm list.
+ * \brief	Get a node by the atom of its name.
+ *
+ * Nodes keep the atom of their name, so this is an integer compare per
+ * node and allocates nothing.
+ *
+ * \param	strkvm	Struct with information.
+ * \param	atom		Atom of name, from atom_find or atom_intern
+ * \return	Newest node with that name if found. Otherwise NULL.
+ */
+st_strkv* strkvm_get_atom(st_strkvm* strkvm, uint32_t atom);
+
+/**
+ * \brief	Get a next node into strkvm list, in insertion order.
+ *
+ * Nodes live in one array: adding a variable may move them, so a node
+ * pointer is only valid until the next add or remove.
+ *
  * \param	strkvm	Struct with information.
- * \param	var			Current node.
- * \return	A bode if OK. Otherwise NULL.
+ * \param	var			Current node, NULL for the first one.
+ * \return	A node if OK. Otherwise NULL.
  */
 st_strkv* strkvm_get_next(st_strkvm* strkvm, const st_strkv* var);
 
+/**
+ * \brief	Name of a node.
+ * \param	strkvm	Struct with information.
+ * \param	var			Node of strkvm
+ * \return	NUL terminated name, valid while var is.
+ */
+const char* strkvm_name(const st_strkvm* strkvm, const st_strkv* var);
+
+/**
+ * \brief	Value of a node.
+ * \param	strkvm	Struct with information.
+ * \param	var			Node of strkvm
+ * \return	NUL terminated value, NULL for a name only.
+ */
+const char* strkvm_value(const st_strkvm* strkvm, const st_strkv* var);
+
+/**
+ * \brief	Serialized form of a strkvm.
+ *
+ * The block can be copied as is with one memcpy, written to a file or
+ * sent to another process, and read back with strkvm_load, which rebuilds
+ * the pointers of the nodes from their offsets.
+ *
+ * \param	strkvm	Struct with information.
+ * \param	data		Receives the start of the block, NULL when empty
+ * \param	size		Receives the bytes to copy
+ * \return	0 if Ok or -1 if param is null.
+ */
+int strkvm_image(const st_strkvm* strkvm, const void** data, size_t* size);
+
+/**
+ * \brief	Read a serialized strkvm.
+ *
+ * Every offset is checked, so data may come from outside: strings must
+ * lie inside the blob, in the order of their nodes and without overlap.
+ *
+ * \param	strkvm	Struct that will be initialized, freed first if it holds anything.
+ * \param	data		Block from strkvm_image
+ * \param	size		Size of data
+ * \return	0 if Ok. Otherwise error code.
+ */
+int strkvm_load(st_strkvm* strkvm, const void* data, size_t size);
+
 #endif /* __STRKVM_H_INCLUDED__ */
@@ -1,5 +1,11 @@
+#define _GNU_SOURCE
 #include "strutils.h"
 #include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
+#include <pthread.h>
 
 /*****************************************************************************/
 /* Functions to manipulate strings											 */
@@ -108,21 +114,49 @@ int strutils_str_tostr(const char* str, char** value)
   return 0;
 }
 
+/* Spaces around a number are allowed, as atoi and atof did */
+static void strutils_number_span(const char** str, size_t* len)
+{
+  const char *p = *str, *end = p + strlen(p);
+
+  while (isspace((unsigned char)*p))
+    p++;
+  while (end > p && isspace((unsigned char)end[-1]))
+    end--;
+
+  *str = p;
+  *len = end - p;
+}
+
 int strutils_str_toint(const char* str, int* value)
 {
+  int64_t v;
+  size_t len;
+
   if (str == NULL || value == NULL)
     return -1;
 
-  *value = atoi(str);
+  strutils_number_span(&str, &len);
+  if (strutils_parse_int(str, len, &v, NULL) != 0 || v < INT_MIN || v > INT_MAX)
+    return -1;
+
+  *value = (int)v;
   return 0;
 }
 
 int strutils_str_tofloat(const char* str, float* value)
 {
+  double v;
+  size_t len;
+
   if (str == NULL || value == NULL)
     return -1;
 
-  *value = atof(str);
+  strutils_number_span(&str, &len);
+  if (strutils_parse_double(str, len, &v, NULL) != 0 || (isfinite(v) && fabs(v) > FLT_MAX))
+    return -1;
+
+  *value = (float)v;
   return 0;
 }
 
@@ -253,4 +287,602 @@ static int strutils_split_copy(const char * string, char token, char ** array, u
 
   return 0;
 }
+/*****************************************************************************/
+
+int strutils_split_block(const char* string, char token, char *** array, uint32_t* count)
+{
+  st_strutils_iter iter;
+  const char *piece;
+  size_t len, max, used = 0, n = 0, i;
+  char **a, **shrunk, *bytes;
+
+  if (string == NULL || token == 0 || array == NULL || count == NULL)
+    return -1;
+
+  len = strlen(string);
+  if (len == 0)
+    return -1;
+
+  /* At most one piece per two bytes, and no more bytes than the string
+   * plus one NUL, so one block is always enough. Offsets are kept until
+   * the pointer array has its real size. */
+  max = (len + 1) / 2;
+  a = (char **)malloc(sizeof(char *) * max + len + 1);
+  if (a == NULL)
+    return -1;
+  bytes = (char *)(a + max);
+
+  strutils_split_init(&iter, string, len, token, 0);
+  while (strutils_split_next(&iter, &piece, &i)) {
+    a[n++] = (char *)(uintptr_t)used;
+    memcpy(bytes + used, piece, i);
+    used += i;
+    bytes[used++] = 0;
+  }
+
+  if (n == 0) {
+    free(a);
+    return -1;
+  }
+
+  if (n < max) {
+    memmove(a + n, bytes, used);
+    shrunk = (char **)realloc(a, sizeof(char *) * n + used);
+    if (shrunk != NULL)
+      a = shrunk;
+  }
+
+  bytes = (char *)(a + n);
+  for (i = 0; i < n; i++)
+    a[i] = bytes + (uintptr_t)a[i];
+
+  *count = (uint32_t)n;
+  *array = a;
+  return 0;
+}
+/*****************************************************************************/
+
+void strutils_split_init(st_strutils_iter* iter, const char* string, size_t len, char token, int flags)
+{
+  iter->next = string;
+  iter->end = string ? string + len : string;
+  iter->token = token;
+  iter->flags = flags;
+}
+/*****************************************************************************/
+
+int strutils_split_next(st_strutils_iter* iter, const char** piece, size_t* len)
+{
+  const char *p = iter->next, *q, *e;
+
+  while (p < iter->end) {
+    q = (const char *)memchr(p, iter->token, (size_t)(iter->end - p));
+    if (q == NULL)
+      q = iter->end;
+    e = q;
+
+    if (iter->flags & STRUTILS_SPLIT_TRIM) {
+      while (p < e && (*p == ' ' || *p == '\t'))
+        p++;
+      while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+        e--;
+    }
+
+    if (e > p) {
+      iter->next = q < iter->end ? q + 1 : q;
+      *piece = p;
+      *len = (size_t)(e - p);
+      return 1;
+    }
+
+    p = q + 1;
+  }
+
+  iter->next = iter->end;
+  return 0;
+}
+
+/*****************************************************************************/
+/* Number parsing and formatting
+*/
+/*****************************************************************************/
+
+//! Cached powers of ten 10^k, k = -348 + 8 * i, as 64 bit significand and binary exponent
+static const uint64_t strutils_pow10_f[] = {
+  0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+  0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+  0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+  0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+  0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+  0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+  0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+  0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+  0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+  0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+  0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+  0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+  0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+  0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+  0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+  0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+  0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+  0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+  0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+  0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+  0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+  0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+  0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+  0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+  0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+  0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+  0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+  0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+  0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull
+};
+
+static const int16_t strutils_pow10_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+//! Exact powers of ten as doubles, for the fast path
+static const double strutils_pow10_exact[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const uint64_t strutils_pow10_u64[] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+  100000000ull, 1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull,
+  10000000000000ull, 100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+  100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull
+};
+
+static const char strutils_digits2[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+//! Floating point number as f * 2^e
+typedef struct {
+  uint64_t f;
+  int e;
+} st_diyfp;
+
+static pthread_once_t strutils_c_once = PTHREAD_ONCE_INIT;
+static locale_t strutils_c_locale;
+
+static void strutils_c_init(void)
+{
+  strutils_c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+
+//! Case insensitive prefix test, word is lower case
+static int strutils_word(const char *p, const char *end, const char *word)
+{
+  size_t n = strlen(word);
+
+  if ((size_t)(end - p) < n)
+    return 0;
+
+  while (n--)
+    if ((*p++ | 0x20) != *word++)
+      return 0;
+
+  return 1;
+}
+
+int strutils_parse_int(const char* str, size_t len, int64_t* value, size_t* used)
+{
+  const char *p = str, *end = str + len, *digits;
+  uint64_t u = 0, limit;
+  int neg = 0, over = 0;
+  unsigned d;
+
+  if (str == NULL || value == NULL)
+    return -1;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+
+  limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+
+  for (digits = p; p < end && (d = (unsigned)(*p - '0')) <= 9; p++) {
+    if (u > (limit - d) / 10)
+      over = 1;
+    else
+      u = u * 10 + d;
+  }
+
+  if (p == digits || (used == NULL && p != end))
+    return -1;
+
+  if (used)
+    *used = p - str;
+
+  if (over) {
+    *value = neg ? INT64_MIN : INT64_MAX;
+    return -2;
+  }
+
+  *value = neg ? (int64_t)(0 - u) : (int64_t)u;
+  return 0;
+}
+
+int strutils_parse_double(const char* str, size_t len, double* value, size_t* used)
+{
+  const char *p = str, *end = str + len, *start;
+  uint64_t mant = 0;
+  int neg = 0, ndigits = 0, dropped = 0, shift = 0, frac = 0, exp10 = 0, eneg, e = 0;
+  char small[64], *copy;
+  unsigned d;
+  double v;
+
+  if (str == NULL || value == NULL)
+    return -1;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+
+  start = p;
+
+  if (strutils_word(p, end, "inf") || strutils_word(p, end, "nan")) {
+    v = (*p | 0x20) == 'n' ? NAN : INFINITY;
+    p += strutils_word(p, end, "infinity") ? 8 : 3;
+    goto parse_end;
+  }
+
+  /* Mantissa: the first 19 significant digits fit in 64 bits */
+  for (; p < end && (d = (unsigned)(*p - '0')) <= 9; p++, ndigits++) {
+    if (mant < 1000000000000000000ull) {
+      mant = mant * 10 + d;
+    } else {
+      shift++;
+      dropped++;
+    }
+  }
+
+  if (p < end && *p == '.')
+    for (p++; p < end && (d = (unsigned)(*p - '0')) <= 9; p++, ndigits++) {
+      if (mant < 1000000000000000000ull) {
+        mant = mant * 10 + d;
+        frac++;
+      } else {
+        dropped++;
+      }
+    }
+
+  if (ndigits == 0)
+    return -1;
+
+  /* Exponent, only if digits follow */
+  if (p < end && (*p | 0x20) == 'e') {
+    const char *q = p + 1;
+
+    eneg = 0;
+    if (q < end && (*q == '-' || *q == '+'))
+      eneg = *q++ == '-';
+
+    if (q < end && (unsigned)(*q - '0') <= 9) {
+      for (; q < end && (d = (unsigned)(*q - '0')) <= 9; q++)
+        if (e < 100000)
+          e = e * 10 + (int)d;
+      exp10 = eneg ? -e : e;
+      p = q;
+    }
+  }
+
+  exp10 += shift - frac;
+
+#if FLT_EVAL_METHOD == 0
+  /* Clinger: both exact as doubles, so one correctly rounded operation */
+  if (mant <= (1ull << 53) && dropped == 0) {
+    if (exp10 > 22 && exp10 <= 22 + 15 &&
+        mant <= (1ull << 53) / strutils_pow10_u64[exp10 - 22]) {
+      mant *= strutils_pow10_u64[exp10 - 22];
+      exp10 = 22;
+    }
+
+    if (exp10 >= -22 && exp10 <= 22) {
+      v = exp10 < 0 ? (double)mant / strutils_pow10_exact[-exp10]
+                    : (double)mant * strutils_pow10_exact[exp10];
+      goto parse_end;
+    }
+  }
+#endif
+
+  /* Slow path: the digits already checked, in the C locale */
+  pthread_once(&strutils_c_once, strutils_c_init);
+
+  copy = (size_t)(p - start) < sizeof(small) ? small : (char *)malloc(p - start + 1);
+  if (copy == NULL || strutils_c_locale == (locale_t)0) {
+    if (copy != small)
+      free(copy);
+    return -1;
+  }
+
+  memcpy(copy, start, p - start);
+  copy[p - start] = 0;
+  v = strtod_l(copy, NULL, strutils_c_locale);
+  if (copy != small)
+    free(copy);
+
+parse_end:
+  if (used == NULL && p != end)
+    return -1;
+
+  if (used)
+    *used = p - str;
+
+  *value = neg ? -v : v;
+  return isinf(v) && !strutils_word(start, end, "inf") ? -2 : 0;
+}
+
+//! Decimal digits of u, at least 1
+static unsigned strutils_count_digits(uint64_t u)
+{
+  unsigned t = ((64 - __builtin_clzll(u | 1)) * 1233) >> 12;
+
+  return t + ((u | 1) >= strutils_pow10_u64[t]);
+}
+
+//! Write u in n digits ending at end
+static void strutils_write_digits(uint64_t u, char *end)
+{
+  unsigned i;
+
+  while (u >= 100) {
+    i = (unsigned)(u % 100) * 2;
+    u /= 100;
+    *--end = strutils_digits2[i + 1];
+    *--end = strutils_digits2[i];
+  }
+
+  if (u >= 10) {
+    *--end = strutils_digits2[u * 2 + 1];
+    *--end = strutils_digits2[u * 2];
+  } else {
+    *--end = (char)('0' + u);
+  }
+}
 
+size_t strutils_format_int(int64_t value, char* buf)
+{
+  uint64_t u = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+  size_t sign = value < 0, n = strutils_count_digits(u);
+
+  buf[0] = '-';
+  strutils_write_digits(u, buf + sign + n);
+  buf[sign + n] = 0;
+  return sign + n;
+}
+
+static st_diyfp strutils_diy_mul(st_diyfp x, st_diyfp y)
+{
+  unsigned __int128 p = (unsigned __int128)x.f * y.f;
+  st_diyfp r;
+
+  /* Round the low half into the high one */
+  r.f = (uint64_t)(p >> 64) + (((uint64_t)p >> 63) & 1);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+static st_diyfp strutils_diy_normalize(st_diyfp x)
+{
+  int s = __builtin_clzll(x.f);
+
+  x.f <<= s;
+  x.e -= s;
+  return x;
+}
+
+//! Nudge the last digit towards the exact value while it stays inside the bounds
+static void strutils_grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                                 uint64_t ten_kappa, uint64_t wp_w)
+{
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+/**
+ * \brief	Grisu2 digit generation.
+ * \param	f			Significand, with the hidden bit
+ * \param	e			Binary exponent
+ * \param	hidden	Hidden bit of the type, for the lower boundary
+ * \param	buf		Receives up to 17 digits, no NUL
+ * \param	k			Receives the decimal exponent of the last digit
+ * \return	Number of digits.
+ */
+static int strutils_grisu2(uint64_t f, int e, uint64_t hidden, char *buf, int *k)
+{
+  st_diyfp v = { f, e }, plus, minus, c, w, wp, wm, one, wp_w;
+  uint64_t p2, delta, tmp;
+  uint32_t p1, div;
+  int kappa, len = 0, index;
+  unsigned i;
+  double dk;
+
+  /* Boundaries halfway to the neighbours, the lower one is closer at a power of two */
+  plus.f = (f << 1) + 1;
+  plus.e = e - 1;
+  plus = strutils_diy_normalize(plus);
+  if (f == hidden) {
+    minus.f = (f << 2) - 1;
+    minus.e = e - 2;
+  } else {
+    minus.f = (f << 1) - 1;
+    minus.e = e - 1;
+  }
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  /* Cached power that brings the exponent into [-60, -32] */
+  dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+  kappa = (int)dk;
+  if (dk - kappa > 0.0)
+    kappa++;
+  i = (unsigned)(kappa >> 3) + 1;
+  *k = -(-348 + (int)i * 8);
+  c.f = strutils_pow10_f[i];
+  c.e = strutils_pow10_e[i];
+
+  w = strutils_diy_mul(strutils_diy_normalize(v), c);
+  wp = strutils_diy_mul(plus, c);
+  wm = strutils_diy_mul(minus, c);
+  wm.f++;
+  wp.f--;
+
+  delta = wp.f - wm.f;
+  one.f = 1ull << -wp.e;
+  one.e = wp.e;
+  wp_w.f = wp.f - w.f;
+  p1 = (uint32_t)(wp.f >> -one.e);
+  p2 = wp.f & (one.f - 1);
+  kappa = (int)strutils_count_digits(p1);
+
+  while (kappa > 0) {
+    div = (uint32_t)strutils_pow10_u64[kappa - 1];
+    if (p1 / div || len)
+      buf[len++] = (char)('0' + p1 / div);
+    p1 %= div;
+    kappa--;
+
+    tmp = ((uint64_t)p1 << -one.e) + p2;
+    if (tmp <= delta) {
+      *k += kappa;
+      strutils_grisu_round(buf, len, delta, tmp, strutils_pow10_u64[kappa] << -one.e, wp_w.f);
+      return len;
+    }
+  }
+
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    if ((p2 >> -one.e) || len)
+      buf[len++] = (char)('0' + (p2 >> -one.e));
+    p2 &= one.f - 1;
+    kappa--;
+
+    if (p2 < delta) {
+      *k += kappa;
+      index = -kappa;
+      strutils_grisu_round(buf, len, delta, p2, one.f,
+                           wp_w.f * (index < 20 ? strutils_pow10_u64[index] : 0));
+      return len;
+    }
+  }
+}
+
+//! Lay out digits * 10^k
+static size_t strutils_format_digits(char *buf, int neg, char *digits, int len, int k)
+{
+  char *p = buf;
+  int kk = len + k, i;
+
+  if (neg)
+    *p++ = '-';
+
+  if (k >= 0 && kk <= 21) {
+    /* 1234e7 -> 12340000000 */
+    memcpy(p, digits, len);
+    memset(p + len, '0', k);
+    p += kk;
+  } else if (kk > 0 && kk <= 21) {
+    /* 1234e-2 -> 12.34 */
+    memcpy(p, digits, kk);
+    p[kk] = '.';
+    memcpy(p + kk + 1, digits + kk, len - kk);
+    p += len + 1;
+  } else if (kk > -6 && kk <= 0) {
+    /* 1234e-6 -> 0.001234 */
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -kk);
+    memcpy(p - kk, digits, len);
+    p += len - kk;
+  } else {
+    /* 1234e30 -> 1.234e+33 */
+    *p++ = digits[0];
+    if (len > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, len - 1);
+      p += len - 1;
+    }
+    *p++ = 'e';
+    *p++ = kk - 1 < 0 ? '-' : '+';
+    i = kk - 1 < 0 ? 1 - kk : kk - 1;
+    p += strutils_format_int(i, p);
+  }
+
+  *p = 0;
+  return p - buf;
+}
+
+//! Zero, infinity and NaN
+static size_t strutils_format_special(char *buf, int neg, int zero, int inf)
+{
+  const char *s = zero ? "0" : inf ? "inf" : "nan";
+  size_t n = strlen(s);
+
+  if (neg && (zero || inf))
+    *buf++ = '-';
+
+  memcpy(buf, s, n + 1);
+  return n + (neg && (zero || inf));
+}
+
+size_t strutils_format_double(double value, char* buf)
+{
+  uint64_t bits, f;
+  int biased, neg, len, k;
+  char digits[20];
+
+  memcpy(&bits, &value, sizeof(bits));
+  neg = (int)(bits >> 63);
+  biased = (int)((bits >> 52) & 0x7ff);
+  f = bits & ((1ull << 52) - 1);
+
+  if (biased == 0x7ff || (biased == 0 && f == 0))
+    return strutils_format_special(buf, neg, biased == 0, f == 0);
+
+  if (biased)
+    len = strutils_grisu2(f | (1ull << 52), biased - 1075, 1ull << 52, digits, &k);
+  else
+    len = strutils_grisu2(f, -1074, 1ull << 52, digits, &k);
+
+  return strutils_format_digits(buf, neg, digits, len, k);
+}
+
+size_t strutils_format_float(float value, char* buf)
+{
+  uint32_t bits;
+  uint64_t f;
+  int biased, neg, len, k;
+  char digits[20];
+
+  memcpy(&bits, &value, sizeof(bits));
+  neg = (int)(bits >> 31);
+  biased = (int)((bits >> 23) & 0xff);
+  f = bits & ((1u << 23) - 1);
+
+  if (biased == 0xff || (biased == 0 && f == 0))
+    return strutils_format_special(buf, neg, biased == 0, f == 0);
+
+  if (biased)
+    len = strutils_grisu2(f | (1u << 23), biased - 150, 1u << 23, digits, &k);
+  else
+    len = strutils_grisu2(f, -149, 1u << 23, digits, &k);
+
+  return strutils_format_digits(buf, neg, digits, len, k);
+}
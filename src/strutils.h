@@ -36,16 +36,16 @@ int strutils_no_space(char* str);
 int strutils_str_tostr(const char* str, char** value);
 /**
  * \brief	Convert string to int
- * \param	str		String that will be converted
+ * \param	str		String that will be converted, spaces around it are skipped
  * \param	value	Value converted
- * \return	0 if Ok or -1 if param is null.
+ * \return	0 if Ok or -1 if param is null, not a number or out of range.
  */
 int strutils_str_toint(const char* str, int* value);
 /**
  * \brief	Convert string to float
- * \param	str		String that will be converted
+ * \param	str		String that will be converted, spaces around it are skipped
  * \param	value	Value converted
- * \return	0 if Ok or -1 if param is null.
+ * \return	0 if Ok or -1 if param is null, not a number or out of range.
  */
 int strutils_str_tofloat(const char* str, float* value);
 /**
@@ -56,6 +56,73 @@ int strutils_str_tofloat(const char* str, float* value);
  */
 int strutils_str_tobool(const char* str, bool* value);
 
+//! Room for strutils_format_int, sign and NUL included
+#define STRUTILS_INT_LEN 21
+
+//! Room for strutils_format_double and strutils_format_float, NUL included
+#define STRUTILS_DOUBLE_LEN 32
+
+/**
+ * \brief	Parse a decimal integer, like from_chars.
+ *
+ * An optional sign then digits, no spaces, no base prefix. Does not look
+ * at the locale and does not need a NUL.
+ *
+ * \param	str		String that will be converted
+ * \param	len		Length of str
+ * \param	value	Value converted
+ * \param	used	Receives the bytes read. If NULL, all of str must be read.
+ * \return	0 if Ok, -1 if not a number, -2 if out of range.
+ */
+int strutils_parse_int(const char* str, size_t len, int64_t* value, size_t* used);
+
+/**
+ * \brief	Parse a decimal float, like from_chars.
+ *
+ * An optional sign, digits with an optional '.', an optional exponent,
+ * or "inf", "infinity", "nan". The decimal point is always '.'. Exactly
+ * rounded: a mantissa of up to 2^53 with a small exponent is converted
+ * with one exact multiplication or division (Clinger's fast path), the
+ * rest with strtod_l in the C locale.
+ *
+ * \param	str		String that will be converted
+ * \param	len		Length of str
+ * \param	value	Value converted
+ * \param	used	Receives the bytes read. If NULL, all of str must be read.
+ * \return	0 if Ok, -1 if not a number, -2 if too large.
+ */
+int strutils_parse_double(const char* str, size_t len, double* value, size_t* used);
+
+/**
+ * \brief	Format an integer, two digits per step.
+ * \param	value	Value
+ * \param	buf		At least STRUTILS_INT_LEN bytes
+ * \return	Length written, without the NUL.
+ */
+size_t strutils_format_int(int64_t value, char* buf);
+
+/**
+ * \brief	Format a double with the fewest digits that read back the same.
+ *
+ * Grisu2: the output always reads back to value and is the shortest one
+ * in all but a tiny fraction of cases. Plain notation for decimal
+ * exponents from -6 to 20 ("0.001", "1.5", "300"), else "1.5e+300".
+ * Does not look at the locale.
+ *
+ * \param	value	Value
+ * \param	buf		At least STRUTILS_DOUBLE_LEN bytes
+ * \return	Length written, without the NUL.
+ */
+size_t strutils_format_double(double value, char* buf);
+
+/**
+ * \brief	Format a float with the fewest digits that read back the same.
+ * \param	value	Value, 0.1f gives "0.1"
+ * \param	buf		At least STRUTILS_DOUBLE_LEN bytes
+ * \return	Length written, without the NUL.
+ */
+size_t strutils_format_float(float value, char* buf);
+
 /*
 * \brief	Count the occurrences of a char in a string
 * \param	s		Pointer to char, the string
@@ -70,5 +137,49 @@ int strutils_count_matches(char *s, char c);
 */
 int strutils_split(const char* string, char token, char *** array, uint32_t* count);
 
+/**
+ * \brief	Split like strutils_split, in one pass and one allocation.
+ *
+ * The pointer array and the bytes of all pieces are in the same block,
+ * so a single free(*array) releases everything. Empty pieces are skipped.
+ *
+ * \param	string	String that will be split
+ * \param	token		Separator
+ * \param	array		Receives the pieces, NUL terminated
+ * \param	count		Receives the total of pieces
+ * \return	0 if Ok, -1 on error or if there is no piece.
+ */
+int strutils_split_block(const char* string, char token, char *** array, uint32_t* count);
+
+//! Trim spaces and tabs around each piece, for HTTP header lists
+#define STRUTILS_SPLIT_TRIM 0x01
+
+//! Split iterator, views into the source string
+typedef struct {
+  const char* next;							//!< Start of what is left
+  const char* end;							//!< End of string
+  char token;										//!< Separator
+  int flags;										//!< STRUTILS_SPLIT_*
+} st_strutils_iter;
+
+/**
+ * \brief	Start splitting a string without copying it.
+ * \param	iter		Iterator
+ * \param	string	String, not necessarily NUL terminated
+ * \param	len			Length of string
+ * \param	token		Separator
+ * \param	flags		STRUTILS_SPLIT_* or 0
+ */
+void strutils_split_init(st_strutils_iter* iter, const char* string, size_t len, char token, int flags);
+
+/**
+ * \brief	Next piece of a split, empty pieces are skipped.
+ * \param	iter		Iterator
+ * \param	piece		Receives the start of the piece, in the source string
+ * \param	len			Receives the length of the piece
+ * \return	1 if a piece was found, 0 at the end.
+ */
+int strutils_split_next(st_strutils_iter* iter, const char** piece, size_t* len);
+
 #endif /* __STRUTILS_H_INCLUDED__ */
 
@@ -19,16 +19,25 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
 
 #include "common.h"
+#include "hugemem.h"
 #include "threadpool.h"
+#include "trace.h"
+
+/* Keyed jobs waiting for a busy worker before an idle one steals them */
+#define THPOOL_STEAL_BACKLOG 2
 
 static volatile int threads_keepalive;
 static volatile int threads_on_hold;
+static __thread struct thpool_* thread_pool_self;   /* pool of a worker thread */
+static __thread struct thread*  thread_self;        /* the worker itself       */
 
 
 /* ========================== STRUCTURES ============================ */
@@ -51,17 +60,67 @@ typedef struct job
 	void*  arg;                                /* function's argument       */
 	int    index;
 	int    sockfd;
+	uint64_t trace;                            /* request traced, or 0      */
+	uint64_t queued_ns;                        /* time pushed               */
+	thpool_shed_fn shed;                       /* set on pull if shed       */
+	void*  shed_arg;
+	int    ring;                               /* copy out of the ring      */
 } job;
 
 
+/* Slot of the ring, on cache lines of its own */
+typedef struct ring_slot
+{
+	uint64_t seq;                              /* turn, see ring_push       */
+	job      job;                              /* stored inline             */
+} __attribute__((aligned(64))) ring_slot;
+
+
+/* Bounded lock-free job queue, THPOOL_QUEUE_RING */
+typedef struct ring
+{
+	uint64_t  mask;                                     /* slots minus one   */
+	size_t    mapped;                                   /* hugemem, or 0     */
+	uint64_t  head __attribute__((aligned(64)));        /* next turn to fill */
+	uint64_t  tail __attribute__((aligned(64)));        /* next turn to take */
+	ring_slot slots[];
+} ring;
+
+
+/* Jobs keyed to one worker, under the job queue rwmutex
+ *
+ * Every worker sleeps on its own semaphore, so a keyed job wakes its
+ * home worker and not whichever thread the kernel picks.
+ */
+typedef struct jobqueue_local
+{
+	job  *front;                         /* pointer to front of queue */
+	job  *rear;                          /* pointer to rear  of queue */
+	int   len;                           /* number of jobs in queue   */
+	int   idle;                          /* asleep and not yet posted */
+	int   turn;                          /* ring mode, list or ring   */
+	bsem  has_jobs;                      /* wakes this worker only    */
+	job   popped;                        /* last job taken from ring  */
+} __attribute__((aligned(64))) jobqueue_local;
+
+
 /* Job queue */
 typedef struct jobqueue
 {
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
 	job  *front;                         /* pointer to front of queue */
 	job  *rear;                          /* pointer to rear  of queue */
-	bsem *has_jobs;                      /* flag as binary semaphore  */
-	int   len;                           /* number of jobs in queue   */
+	int   len;                           /* jobs in all queues        */
+	jobqueue_local* local;               /* one queue per worker      */
+	int   nlocal;                        /* number of workers         */
+	int   wake_next;                     /* next worker to wake first */
+	ring* ring;                          /* shared queue, or the list */
+	hugemem_pool slab;                   /* list jobs, or base NULL   */
+	job   drained;                       /* ring job taken by clear   */
+	pthread_cond_t   has_room;           /* signal to blocked pushers */
+	thpool_admission admission;          /* bounded queue mode        */
+	uint64_t         last_empty;         /* ns, queue last seen empty */
+	thpool_stats     stats;              /* counters, under rwmutex   */
 } jobqueue;
 
 
@@ -71,9 +130,20 @@ typedef struct thread
 	int       id;                        /* friendly id               */
 	pthread_t pthread;                   /* pointer to actual thread  */
 	struct thpool_* thpool_p;            /* access to thpool          */
+	uint32_t  locals_ready;              /* bit per slot, init done   */
+	void*     locals[THPOOL_LOCAL_MAX];  /* context per slot          */
 } thread;
 
 
+/* Worker context slot */
+typedef struct thpool_local_slot
+{
+	thpool_local_init_fn init;
+	thpool_local_free_fn fini;
+	void* arg;
+} thpool_local_slot;
+
+
 /* Threadpool */
 typedef struct thpool_
 {
@@ -83,9 +153,41 @@ typedef struct thpool_
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
 	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
 	jobqueue  jobqueue;                  /* job queue                 */
+	int       num_locals;                /* slots added, written once */
+	thpool_local_slot locals[THPOOL_LOCAL_MAX];
 } thpool_;
 
 
+/* Piece of a parallel range */
+typedef struct prange
+{
+	size_t begin;
+	size_t end;
+} prange;
+
+
+/* Shared state of a parallel for/reduce call */
+typedef struct pfor
+{
+	pthread_mutex_t lock;                /* used for all fields below */
+	pthread_cond_t  done;                /* signal to the caller      */
+	prange* stack;                       /* pieces not yet claimed    */
+	int     top;                         /* number of pieces in stack */
+	int     cap;                         /* capacity of stack         */
+	size_t  grain;                       /* largest piece to run      */
+	size_t  pending;                     /* elements not yet run      */
+	int     active;                      /* threads inside pfor_run   */
+	int     refs;                        /* caller + queued helpers   */
+	void  (*body)(size_t begin, size_t end, void* acc, void* arg, int index);
+	void  (*join)(void* acc, const void* part, void* arg);
+	void  (*for_body)(size_t begin, size_t end, void* arg, int index);
+	void*   arg;
+	void*   result;                      /* reduced value or NULL     */
+	void*   identity;                    /* seed of every accumulator */
+	size_t  result_size;
+} pfor;
+
+
 
 
 
@@ -95,14 +197,41 @@ typedef struct thpool_
 static int  thread_init(thpool_* thpool_p, struct thread** thread_p, int id);
 static void* thread_do(struct thread* thread_p);
 static void  thread_hold(int sig_id);
+static void  thread_locals_free(struct thread* thread_p);
 static void  thread_destroy(struct thread* thread_p);
 
-static int   jobqueue_init(jobqueue* jobqueue_p);
+static int   pfor_start(thpool_* thpool_p, pfor* pfor_p, size_t begin, size_t end);
+static int   pfor_push(pfor* pfor_p, size_t begin, size_t end);
+static void  pfor_run(pfor* pfor_p, int index, void* acc);
+static void* pfor_helper(void* arg, int index);
+static void  pfor_release(pfor* pfor_p);
+
+static int   thpool_submit(thpool_* thpool_p, void* (*function_p)(void* arg, int index),
+                           void* arg, int sockfd, int home);
+
+static int   jobqueue_init(jobqueue* jobqueue_p, int num_threads, const thpool_options* options);
 static void  jobqueue_clear(jobqueue* jobqueue_p);
-static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
-static struct job* jobqueue_pull(jobqueue* jobqueue_p);
+static int   jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p, int may_block, int home);
+static int   jobqueue_push_ring(jobqueue* jobqueue_p, struct job* newjob_p, int may_block);
+static struct job* jobqueue_pull(jobqueue* jobqueue_p, int id);
+static struct job* jobqueue_pull_list(jobqueue* jobqueue_p, jobqueue_local* local, int idle);
+static struct job* jobqueue_take(job** front, job** rear);
+static void  jobqueue_enqueued(jobqueue* jobqueue_p, struct job* job_p);
+static void  jobqueue_dequeued(jobqueue* jobqueue_p, struct job* job_p, int locked);
+static int   jobqueue_len(jobqueue* jobqueue_p);
+static struct job* jobqueue_alloc(jobqueue* jobqueue_p);
+static void  jobqueue_free(jobqueue* jobqueue_p, struct job* job_p);
+static void  jobqueue_wake_idle(jobqueue* jobqueue_p);
+static void  jobqueue_wake_all(jobqueue* jobqueue_p);
+static uint64_t jobqueue_now(void);
 static void  jobqueue_destroy(jobqueue* jobqueue_p);
 
+static ring* ring_init(uint32_t size, int flags);
+static void  ring_destroy(ring* ring_p);
+static int   ring_push(ring* ring_p, const struct job* job_p);
+static int   ring_pull(ring* ring_p, struct job* job_p);
+static int   ring_full(ring* ring_p);
+
 static void  bsem_init(struct bsem *bsem_p, int value);
 static void  bsem_reset(struct bsem *bsem_p);
 static void  bsem_post(struct bsem *bsem_p);
@@ -119,6 +248,18 @@ static void  bsem_wait(struct bsem *bsem_p);
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads)
 {
+	return thpool_init_ex(num_threads, NULL);
+}
+
+
+/* Initialise thread pool with options */
+struct thpool_* thpool_init_ex(int num_threads, const thpool_options* options)
+{
+	if(options && options->queue != THPOOL_QUEUE_LIST && options->queue != THPOOL_QUEUE_RING)
+	{
+		Log(("thpool_init: Unknown queue type %d", options->queue));
+		return NULL;
+	}
 
 	threads_on_hold   = 0;
 	threads_keepalive = 1;
@@ -140,9 +281,10 @@ struct thpool_* thpool_init(int num_threads)
 
 	thpool_p->num_threads_alive   = 0;
 	thpool_p->num_threads_working = 0;
+	thpool_p->num_locals          = 0;
 
 	/* Initialise the job queue */
-	if(jobqueue_init(&thpool_p->jobqueue) == -1)
+	if(jobqueue_init(&thpool_p->jobqueue, num_threads, options) == -1)
 	{
 		Log(("thpool_init: Could not allocate memory for job queue"));
 		free(thpool_p);
@@ -185,14 +327,48 @@ struct thpool_* thpool_init(int num_threads)
 int thpool_add_work(thpool_* thpool_p, void* (*function_p)(void* arg, int index),
                     void *arg, int sockfd)
 {
-	job* newjob;
+	return thpool_submit(thpool_p, function_p, arg, sockfd, -1);
+}
 
-	newjob = (struct job*)malloc(sizeof(struct job));
 
-	if(newjob == NULL)
+/* Add work that prefers the worker its key hashes to */
+int thpool_add_work_keyed(thpool_* thpool_p, uint64_t key,
+                          void* (*function_p)(void* arg, int index), void *arg, int sockfd)
+{
+	int nlocal = thpool_p->jobqueue.nlocal;
+
+	if(nlocal == 0)
 	{
-		Log(("thpool_add_work: Could not allocate memory for new job"));
-		return -1;
+		return thpool_submit(thpool_p, function_p, arg, sockfd, -1);
+	}
+
+	/* Fibonacci hashing, consecutive descriptors land on different workers */
+	key *= 0x9e3779b97f4a7c15ull;
+	return thpool_submit(thpool_p, function_p, arg, sockfd, (int)((key >> 32) % (uint64_t)nlocal));
+}
+
+
+/* Queue a job, on the shared queue or on the queue of worker home
+ *
+ * @return 0 on success, THPOOL_SHED if admission control refused
+ *         the job, -1 otherwise.
+ */
+static int thpool_submit(thpool_* thpool_p, void* (*function_p)(void* arg, int index),
+                         void* arg, int sockfd, int home)
+{
+	job  inline_job;
+	job* newjob = &inline_job;
+
+	/* The ring copies plain jobs into its slots, lists link allocated ones */
+	if(thpool_p->jobqueue.ring == NULL || home >= 0)
+	{
+		newjob = jobqueue_alloc(&thpool_p->jobqueue);
+
+		if(newjob == NULL)
+		{
+			Log(("thpool_add_work: Could not allocate memory for new job"));
+			return -1;
+		}
 	}
 
 	/* add function and argument */
@@ -201,13 +377,149 @@ int thpool_add_work(thpool_* thpool_p, void* (*function_p)(void* arg, int index)
 	newjob->index = -1;
 	newjob->sockfd = sockfd;
 
-	/* add job to queue */
-	jobqueue_push(&thpool_p->jobqueue, newjob);
+	/* the job works for the request the caller works for */
+	newjob->trace = trace_current();
+	trace_point(newjob->trace, TRACE_ENQUEUE);
+
+	/* add job to queue, a worker never blocks on its own pool */
+	if(jobqueue_push(&thpool_p->jobqueue, newjob, thread_pool_self != thpool_p, home) != 0)
+	{
+		if(newjob != &inline_job)
+		{
+			jobqueue_free(&thpool_p->jobqueue, newjob);
+		}
+
+		return THPOOL_SHED;
+	}
+
+	return 0;
+}
+
+
+/* Bound the job queue */
+int thpool_set_admission(thpool_* thpool_p, const thpool_admission* admission)
+{
+	jobqueue* jobqueue_p;
+
+	if(thpool_p == NULL || admission == NULL ||
+	   admission->policy < THPOOL_UNBOUNDED || admission->policy > THPOOL_BLOCK ||
+	   (admission->policy != THPOOL_UNBOUNDED && admission->max_queued <= 0))
+	{
+		return -1;
+	}
+
+	jobqueue_p = &thpool_p->jobqueue;
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	jobqueue_p->admission = *admission;
+
+	if(jobqueue_p->admission.target_us == 0)
+	{
+		jobqueue_p->admission.target_us = 5000;
+	}
+
+	if(jobqueue_p->admission.interval_us == 0)
+	{
+		jobqueue_p->admission.interval_us = 100000;
+	}
+
+	/* A looser bound may let blocked callers in */
+	pthread_cond_broadcast(&jobqueue_p->has_room);
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
 
 	return 0;
 }
 
 
+/* Answer 503 and close */
+void thpool_shed_503(void* (*function_p)(void* arg, int index), void* arg,
+                     int sockfd, void* shed_arg)
+{
+	static const char response[] =
+		"HTTP/1.1 503 Service Unavailable\r\n"
+		"Retry-After: 1\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+
+	(void)function_p;
+	(void)arg;
+	(void)shed_arg;
+
+	if(sockfd >= 0)
+	{
+		send(sockfd, response, sizeof(response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(sockfd);
+	}
+}
+
+
+/* Read the queue counters */
+void thpool_get_stats(thpool_* thpool_p, thpool_stats* stats)
+{
+	pthread_mutex_lock(&thpool_p->jobqueue.rwmutex);
+	*stats = thpool_p->jobqueue.stats;
+	stats->queue_len = thpool_p->jobqueue.len;
+	pthread_mutex_unlock(&thpool_p->jobqueue.rwmutex);
+}
+
+
+/* Add a per-worker context slot */
+int thpool_local_add(thpool_* thpool_p, thpool_local_init_fn init, thpool_local_free_fn fini, void* arg)
+{
+	int slot = -1;
+
+	if(thpool_p == NULL || init == NULL)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+
+	if(thpool_p->num_locals < THPOOL_LOCAL_MAX)
+	{
+		slot = thpool_p->num_locals;
+		thpool_p->locals[slot].init = init;
+		thpool_p->locals[slot].fini = fini;
+		thpool_p->locals[slot].arg  = arg;
+
+		/* Workers read the slot without the lock once they see the count */
+		__atomic_store_n(&thpool_p->num_locals, slot + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	return slot;
+}
+
+
+/* Context of the calling worker for a slot */
+void* thpool_local(thpool_* thpool_p, int slot)
+{
+	thread* thread_p = thread_self;
+	thpool_local_slot* slot_p;
+
+	if(thread_p == NULL || thread_p->thpool_p != thpool_p || slot < 0 ||
+	   slot >= __atomic_load_n(&thpool_p->num_locals, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+
+	if(!(thread_p->locals_ready & (1u << slot)))
+	{
+		slot_p = &thpool_p->locals[slot];
+		thread_p->locals[slot] = slot_p->init(slot_p->arg, thread_p->id);
+
+		if(thread_p->locals[slot] == NULL)
+		{
+			return NULL;
+		}
+
+		thread_p->locals_ready |= 1u << slot;
+	}
+
+	return thread_p->locals[slot];
+}
+
+
 /* Wait until all jobs have finished */
 void thpool_wait(thpool_* thpool_p)
 {
@@ -233,6 +545,11 @@ void thpool_destroy(thpool_* thpool_p)
 	/* End each thread 's infinite loop */
 	threads_keepalive = 0;
 
+	/* Callers blocked on a full queue give up */
+	pthread_mutex_lock(&thpool_p->jobqueue.rwmutex);
+	pthread_cond_broadcast(&thpool_p->jobqueue.has_room);
+	pthread_mutex_unlock(&thpool_p->jobqueue.rwmutex);
+
 	/* Give one second to kill idle threads */
 	double TIMEOUT = 1.0;
 	time_t start, end;
@@ -241,7 +558,7 @@ void thpool_destroy(thpool_* thpool_p)
 
 	while(tpassed < TIMEOUT && thpool_p->num_threads_alive)
 	{
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		jobqueue_wake_all(&thpool_p->jobqueue);
 		time(&end);
 		tpassed = difftime(end, start);
 	}
@@ -249,7 +566,7 @@ void thpool_destroy(thpool_* thpool_p)
 	/* Poll remaining threads */
 	while(thpool_p->num_threads_alive)
 	{
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		jobqueue_wake_all(&thpool_p->jobqueue);
 		sleep(1);
 	}
 
@@ -301,256 +618,1235 @@ int thpool_num_threads_working(thpool_* thpool_p)
 
 
 
-/* ============================ THREAD ============================== */
+/* ============================ PARALLEL ============================ */
 
 
-/* Initialize a thread in the thread pool
- *
- * @param thread        address to the pointer of the thread to be created
- * @param id            id to be given to the thread
- * @return 0 on success, -1 otherwise.
- */
-static int thread_init(thpool_* thpool_p, struct thread** thread_p, int id)
+/* Run a function over a range using all threads */
+int thpool_parallel_for(thpool_* thpool_p, size_t begin, size_t end, size_t grain,
+                        void (*body)(size_t begin, size_t end, void* arg, int index),
+                        void* arg)
 {
+	pfor* pfor_p;
 
-	*thread_p = (struct thread*)malloc(sizeof(struct thread));
+	if(thpool_p == NULL || body == NULL || end < begin)
+	{
+		return -1;
+	}
 
-	if(thread_p == NULL)
+	if(begin == end)
 	{
-		Log(("thread_init: Could not allocate memory for thread"));
+		return 0;
+	}
+
+	pfor_p = (struct pfor*)calloc(1, sizeof(struct pfor));
+
+	if(pfor_p == NULL)
+	{
+		Log(("thpool_parallel_for: Could not allocate memory for range"));
 		return -1;
 	}
 
-	(*thread_p)->thpool_p = thpool_p;
-	(*thread_p)->id       = id;
+	pfor_p->for_body = body;
+	pfor_p->arg      = arg;
+	pfor_p->grain    = grain;
 
-	pthread_create(&(*thread_p)->pthread, NULL, (void *)thread_do, (*thread_p));
-	pthread_detach((*thread_p)->pthread);
-	return 0;
+	return pfor_start(thpool_p, pfor_p, begin, end);
 }
 
 
-/* Sets the calling thread on hold */
-static void thread_hold(int sig_id)
+/* Reduce a range using all threads */
+int thpool_parallel_reduce(thpool_* thpool_p, size_t begin, size_t end, size_t grain,
+                           void (*body)(size_t begin, size_t end, void* acc,
+                                        void* arg, int index),
+                           void (*join)(void* acc, const void* part, void* arg),
+                           void* result, size_t result_size, void* arg)
 {
-	(void)sig_id;
-	threads_on_hold = 1;
+	pfor* pfor_p;
 
-	while(threads_on_hold)
+	if(thpool_p == NULL || body == NULL || join == NULL || result == NULL ||
+	   result_size == 0 || end < begin)
 	{
-		sleep(1);
+		return -1;
 	}
-}
 
+	if(begin == end)
+	{
+		return 0;
+	}
 
-/* What each thread is doing
-*
-* In principle this is an endless loop. The only time this loop gets interuppted is once
-* thpool_destroy() is invoked or the program exits.
-*
-* @param  thread        thread that will run this function
-* @return nothing
-*/
-static void* thread_do(struct thread* thread_p)
-{
+	pfor_p = (struct pfor*)calloc(1, sizeof(struct pfor));
 
-	/* Set thread name for profiling and debuging */
-	char thread_name[128] = {0};
-	sprintf(thread_name, "thread-pool-%d", thread_p->id);
+	if(pfor_p == NULL)
+	{
+		Log(("thpool_parallel_reduce: Could not allocate memory for range"));
+		return -1;
+	}
 
-	/* Use prctl instead to prevent using _GNU_SOURCE flag and implicit declaration */
-	prctl(PR_SET_NAME, thread_name);
+	pfor_p->body        = body;
+	pfor_p->join        = join;
+	pfor_p->arg         = arg;
+	pfor_p->grain       = grain;
+	pfor_p->result      = result;
+	pfor_p->result_size = result_size;
 
-	/* Assure all threads have been created before starting serving */
-	thpool_* thpool_p = thread_p->thpool_p;
+	return pfor_start(thpool_p, pfor_p, begin, end);
+}
 
-	/* Register signal handler */
-	struct sigaction act;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = 0;
-	act.sa_handler = thread_hold;
 
-	if(sigaction(SIGUSR1, &act, NULL) == -1)
+/* Hand out helper jobs, take part in the work and wait for the rest
+ *
+ * The pfor is shared with the helper jobs, the last one to drop its
+ * reference frees it. Helpers that start after all work is done leave
+ * immediately.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int pfor_start(thpool_* thpool_p, pfor* pfor_p, size_t begin, size_t end)
+{
+	size_t n = end - begin;
+	size_t pieces;
+	void*  acc = NULL;
+	int    helpers;
+	int    threads = thpool_p->num_threads_alive;
+
+	/* Aim for a few pieces per thread so that uneven pieces even out */
+	if(pfor_p->grain == 0)
 	{
-		Log(("thread_do: cannot handle SIGUSR1"));
-	}
+		pfor_p->grain = n / (8 * (size_t)(threads + 1));
 
-	/* Mark thread as alive (initialized) */
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	thpool_p->num_threads_alive += 1;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
+		if(pfor_p->grain == 0)
+		{
+			pfor_p->grain = 1;
+		}
+	}
 
-	while(threads_keepalive)
+	if(pfor_p->result)
 	{
+		pfor_p->identity = malloc(pfor_p->result_size);
+		acc = malloc(pfor_p->result_size);
 
-		bsem_wait(thpool_p->jobqueue.has_jobs);
-
-		if(threads_keepalive)
+		if(pfor_p->identity == NULL || acc == NULL)
 		{
+			free(pfor_p->identity);
+			free(acc);
+			free(pfor_p);
+			return -1;
+		}
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+		memcpy(pfor_p->identity, pfor_p->result, pfor_p->result_size);
+		memcpy(acc, pfor_p->result, pfor_p->result_size);
+	}
 
-			/* Read job from queue and execute it */
-			void* (*func_buff)(void*, int);
-			void*  arg_buff;
-			int index;
-			job* job_p = jobqueue_pull(&thpool_p->jobqueue);
+	pthread_mutex_init(&pfor_p->lock, NULL);
+	pthread_cond_init(&pfor_p->done, NULL);
+	pfor_p->pending = n;
+	pfor_p->refs    = 1;
 
-			if(job_p)
-			{
-				func_buff = job_p->function;
-				arg_buff  = job_p->arg;
-				index = thread_p->id;
-				func_buff(arg_buff, index);
-				free(job_p);
-			}
+	if(pfor_push(pfor_p, begin, end) != 0)
+	{
+		pfor_release(pfor_p);
+		free(acc);
+		return -1;
+	}
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
+	/* No point in waking more threads than there are pieces */
+	pieces  = (n + pfor_p->grain - 1) / pfor_p->grain;
+	helpers = threads;
 
-			if(!thpool_p->num_threads_working)
-			{
-				pthread_cond_signal(&thpool_p->threads_all_idle);
-			}
+	if(pieces - 1 < (size_t)helpers)
+	{
+		helpers = (int)(pieces - 1);
+	}
 
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+	while(helpers-- > 0)
+	{
+		pthread_mutex_lock(&pfor_p->lock);
+		pfor_p->refs++;
+		pthread_mutex_unlock(&pfor_p->lock);
 
+		if(thpool_add_work(thpool_p, pfor_helper, pfor_p, -1) != 0)
+		{
+			pthread_mutex_lock(&pfor_p->lock);
+			pfor_p->refs--;
+			pthread_mutex_unlock(&pfor_p->lock);
+			break;
 		}
 	}
 
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	thpool_p->num_threads_alive --;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	/* Calling thread works too, which keeps nested calls from deadlocking */
+	pfor_run(pfor_p, -1, acc);
 
-	return NULL;
-}
+	pthread_mutex_lock(&pfor_p->lock);
 
+	while(pfor_p->pending || pfor_p->active)
+	{
+		pthread_cond_wait(&pfor_p->done, &pfor_p->lock);
+	}
 
-/* Frees a thread  */
-static void thread_destroy(thread* thread_p)
-{
-	free(thread_p);
+	pthread_mutex_unlock(&pfor_p->lock);
+
+	free(acc);
+	pfor_release(pfor_p);
+	return 0;
 }
 
 
+/* Add a piece to the stack
+ *
+ * Notice: Caller MUST hold pfor lock
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int pfor_push(pfor* pfor_p, size_t begin, size_t end)
+{
+	if(pfor_p->top == pfor_p->cap)
+	{
+		int cap = pfor_p->cap ? pfor_p->cap * 2 : 32;
+		prange* stack = (struct prange*)realloc(pfor_p->stack, cap * sizeof(struct prange));
 
+		if(stack == NULL)
+		{
+			return -1;
+		}
 
+		pfor_p->stack = stack;
+		pfor_p->cap   = cap;
+	}
 
-/* ============================ JOB QUEUE =========================== */
+	pfor_p->stack[pfor_p->top].begin = begin;
+	pfor_p->stack[pfor_p->top].end   = end;
+	pfor_p->top++;
+	return 0;
+}
 
 
-/* Initialize queue */
-static int jobqueue_init(jobqueue* jobqueue_p)
-{
+/* Claim pieces until none are left
+ *
+ * Every claimed piece is halved until it fits the grain, the right
+ * halves go back to the stack for other threads to claim. When acc is
+ * not NULL it is merged into the result before leaving.
+ */
+static void pfor_run(pfor* pfor_p, int index, void* acc)
+{
+	prange r;
+	int    worked = 0;
+
+	pthread_mutex_lock(&pfor_p->lock);
+	pfor_p->active++;
+
+	while(pfor_p->top > 0)
+	{
+		r = pfor_p->stack[--pfor_p->top];
+
+		while(r.end - r.begin > pfor_p->grain)
+		{
+			size_t mid = r.begin + (r.end - r.begin) / 2;
+
+			/* Out of memory: run the whole piece here */
+			if(pfor_push(pfor_p, mid, r.end) != 0)
+			{
+				break;
+			}
+
+			r.end = mid;
+		}
+
+		pthread_mutex_unlock(&pfor_p->lock);
+
+		if(pfor_p->result)
+		{
+			pfor_p->body(r.begin, r.end, acc, pfor_p->arg, index);
+		}
+		else
+		{
+			pfor_p->for_body(r.begin, r.end, pfor_p->arg, index);
+		}
+
+		worked = 1;
+
+		pthread_mutex_lock(&pfor_p->lock);
+		pfor_p->pending -= r.end - r.begin;
+	}
+
+	if(worked && pfor_p->result)
+	{
+		pfor_p->join(pfor_p->result, acc, pfor_p->arg);
+	}
+
+	pfor_p->active--;
+
+	if(!pfor_p->pending && !pfor_p->active)
+	{
+		pthread_cond_broadcast(&pfor_p->done);
+	}
+
+	pthread_mutex_unlock(&pfor_p->lock);
+}
+
+
+/* Helper job queued on the threadpool */
+static void* pfor_helper(void* arg, int index)
+{
+	pfor* pfor_p = (struct pfor*)arg;
+	void* acc = NULL;
+
+	if(pfor_p->result)
+	{
+		acc = malloc(pfor_p->result_size);
+	}
+
+	/* Without an accumulator the other threads do the work */
+	if(pfor_p->result == NULL || acc != NULL)
+	{
+		if(acc)
+		{
+			memcpy(acc, pfor_p->identity, pfor_p->result_size);
+		}
+
+		pfor_run(pfor_p, index, acc);
+	}
+
+	free(acc);
+	pfor_release(pfor_p);
+	return NULL;
+}
+
+
+/* Drop a reference to the pfor, freeing it on the last one */
+static void pfor_release(pfor* pfor_p)
+{
+	int refs;
+
+	pthread_mutex_lock(&pfor_p->lock);
+	refs = --pfor_p->refs;
+	pthread_mutex_unlock(&pfor_p->lock);
+
+	if(refs == 0)
+	{
+		pthread_mutex_destroy(&pfor_p->lock);
+		pthread_cond_destroy(&pfor_p->done);
+		free(pfor_p->identity);
+		free(pfor_p->stack);
+		free(pfor_p);
+	}
+}
+
+
+
+
+
+/* ============================ THREAD ============================== */
+
+
+/* Initialize a thread in the thread pool
+ *
+ * @param thread        address to the pointer of the thread to be created
+ * @param id            id to be given to the thread
+ * @return 0 on success, -1 otherwise.
+ */
+static int thread_init(thpool_* thpool_p, struct thread** thread_p, int id)
+{
+
+	*thread_p = (struct thread*)malloc(sizeof(struct thread));
+
+	if(thread_p == NULL)
+	{
+		Log(("thread_init: Could not allocate memory for thread"));
+		return -1;
+	}
+
+	(*thread_p)->thpool_p = thpool_p;
+	(*thread_p)->id       = id;
+	(*thread_p)->locals_ready = 0;
+
+	pthread_create(&(*thread_p)->pthread, NULL, (void *)thread_do, (*thread_p));
+	pthread_detach((*thread_p)->pthread);
+	return 0;
+}
+
+
+/* Sets the calling thread on hold */
+static void thread_hold(int sig_id)
+{
+	(void)sig_id;
+	threads_on_hold = 1;
+
+	while(threads_on_hold)
+	{
+		sleep(1);
+	}
+}
+
+
+/* What each thread is doing
+*
+* In principle this is an endless loop. The only time this loop gets interuppted is once
+* thpool_destroy() is invoked or the program exits.
+*
+* @param  thread        thread that will run this function
+* @return nothing
+*/
+static void* thread_do(struct thread* thread_p)
+{
+
+	/* Set thread name for profiling and debuging */
+	char thread_name[128] = {0};
+	sprintf(thread_name, "thread-pool-%d", thread_p->id);
+
+	/* Use prctl instead to prevent using _GNU_SOURCE flag and implicit declaration */
+	prctl(PR_SET_NAME, thread_name);
+
+	/* Assure all threads have been created before starting serving */
+	thpool_* thpool_p = thread_p->thpool_p;
+	thread_pool_self = thpool_p;
+	thread_self      = thread_p;
+
+	/* Register signal handler */
+	struct sigaction act;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	act.sa_handler = thread_hold;
+
+	if(sigaction(SIGUSR1, &act, NULL) == -1)
+	{
+		Log(("thread_do: cannot handle SIGUSR1"));
+	}
+
+	/* Mark thread as alive (initialized) */
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	thpool_p->num_threads_alive += 1;
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	jobqueue_local* local = &thpool_p->jobqueue.local[thread_p->id];
+
+	while(threads_keepalive)
+	{
+
+		bsem_wait(&local->has_jobs);
+		uint64_t woken = trace_tsc();
+
+		if(threads_keepalive)
+		{
+
+			pthread_mutex_lock(&thpool_p->thcount_lock);
+			thpool_p->num_threads_working++;
+			pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+			/* Read jobs from queue and execute them, until none is left
+			 * for this worker; only then is it marked idle again */
+			void* (*func_buff)(void*, int);
+			void*  arg_buff;
+			int index;
+			job* job_p;
+
+			while(threads_keepalive && (job_p = jobqueue_pull(&thpool_p->jobqueue, thread_p->id)) != NULL)
+			{
+				/* Requests that waited too long go to the shed handler */
+				if(job_p->shed)
+				{
+					job_p->shed(job_p->function, job_p->arg, job_p->sockfd, job_p->shed_arg);
+					jobqueue_free(&thpool_p->jobqueue, job_p);
+					continue;
+				}
+
+				func_buff = job_p->function;
+				arg_buff  = job_p->arg;
+				index = thread_p->id;
+
+				if(job_p->trace)
+				{
+					trace_record(job_p->trace, TRACE_WAKE, woken);
+					trace_point(job_p->trace, TRACE_DEQUEUE);
+				}
+
+				trace_set_current(job_p->trace);
+				func_buff(arg_buff, index);
+				trace_set_current(0);
+				jobqueue_free(&thpool_p->jobqueue, job_p);
+
+				/* The next job did not wait for a wake up */
+				woken = trace_tsc();
+			}
+
+			pthread_mutex_lock(&thpool_p->thcount_lock);
+			thpool_p->num_threads_working--;
+
+			if(!thpool_p->num_threads_working)
+			{
+				pthread_cond_signal(&thpool_p->threads_all_idle);
+			}
+
+			pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+		}
+	}
+
+	/* Contexts go before the thread counts as gone, thpool_destroy waits */
+	thread_locals_free(thread_p);
+
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	thpool_p->num_threads_alive --;
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	return NULL;
+}
+
+
+/* Free the contexts a worker made, on the worker */
+static void thread_locals_free(thread* thread_p)
+{
+	thpool_* thpool_p = thread_p->thpool_p;
+	thpool_local_slot* slot_p;
+	int slot;
+
+	for(slot = 0; slot < THPOOL_LOCAL_MAX; slot++)
+	{
+		if(thread_p->locals_ready & (1u << slot))
+		{
+			slot_p = &thpool_p->locals[slot];
+
+			if(slot_p->fini)
+			{
+				slot_p->fini(thread_p->locals[slot], slot_p->arg, thread_p->id);
+			}
+		}
+	}
+
+	thread_p->locals_ready = 0;
+}
+
+
+/* Frees a thread  */
+static void thread_destroy(thread* thread_p)
+{
+	free(thread_p);
+}
+
+
+
+
+
+/* ============================ JOB QUEUE =========================== */
+
+
+/* Initialize queue */
+static int jobqueue_init(jobqueue* jobqueue_p, int num_threads, const thpool_options* options)
+{
+	int n;
+
 	jobqueue_p->len = 0;
 	jobqueue_p->front = NULL;
 	jobqueue_p->rear  = NULL;
+	jobqueue_p->nlocal = num_threads;
+	jobqueue_p->wake_next = 0;
+	jobqueue_p->ring = NULL;
+	memset(&jobqueue_p->slab, 0, sizeof(jobqueue_p->slab));
+
+	if(options && options->queue == THPOOL_QUEUE_RING &&
+	   (jobqueue_p->ring = ring_init(options->ring_size, options->flags)) == NULL)
+	{
+		return -1;
+	}
+
+	/* Lists link allocated jobs, keyed ones in ring mode too; a slab that
+	 * cannot be mapped only costs the malloc it would have saved */
+	if(options && (options->flags & THPOOL_HUGEPAGES) &&
+	   hugemem_pool_init(&jobqueue_p->slab, sizeof(struct job),
+	                     options->job_slab ? options->job_slab : 65536, HUGEMEM_DEFAULT) != 0)
+	{
+		Log(("jobqueue_init: Could not map job slab, jobs come from malloc"));
+	}
+
+	/* Cache line aligned, workers do not share the lines of their semaphores */
+	jobqueue_p->local = (struct jobqueue_local*)aligned_alloc(sizeof(struct jobqueue_local),
+	                        (num_threads ? num_threads : 1) * sizeof(struct jobqueue_local));
+
+	if(jobqueue_p->local == NULL)
+	{
+		ring_destroy(jobqueue_p->ring);
+		hugemem_pool_destroy(&jobqueue_p->slab);
+		return -1;
+	}
+
+	for(n = 0; n < num_threads; n++)
+	{
+		jobqueue_p->local[n].front = NULL;
+		jobqueue_p->local[n].rear  = NULL;
+		jobqueue_p->local[n].len   = 0;
+		jobqueue_p->local[n].idle  = 1;
+		jobqueue_p->local[n].turn  = 0;
+		bsem_init(&jobqueue_p->local[n].has_jobs, 0);
+	}
+
+	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
+	pthread_cond_init(&jobqueue_p->has_room, NULL);
+
+	memset(&jobqueue_p->admission, 0, sizeof(jobqueue_p->admission));
+	memset(&jobqueue_p->stats, 0, sizeof(jobqueue_p->stats));
+	jobqueue_p->last_empty = jobqueue_now();
+
+	return 0;
+}
+
+
+/* Clear the queue */
+static void jobqueue_clear(jobqueue* jobqueue_p)
+{
+
+	int n;
+
+	while(jobqueue_p->len)
+	{
+		jobqueue_free(jobqueue_p, jobqueue_pull(jobqueue_p, -1));
+	}
+
+	jobqueue_p->front = NULL;
+	jobqueue_p->rear  = NULL;
+	jobqueue_p->len = 0;
+
+	for(n = 0; n < jobqueue_p->nlocal; n++)
+	{
+		bsem_reset(&jobqueue_p->local[n].has_jobs);
+	}
+
+}
+
+
+/* Add a job to queue
+ *
+ * Plain jobs go to the shared queue: copied into the ring, or linked
+ * into the list, which needs newjob allocated. A job with a home goes,
+ * allocated, to the list of that worker and wakes it. If the home worker
+ * is busy with a backlog an idle worker is woken as well, to steal.
+ * Admission limits count the jobs of all queues.
+ *
+ * @return 0 on success, -1 if admission control refused the job
+ */
+static int jobqueue_push(jobqueue* jobqueue_p, struct job* newjob, int may_block, int home)
+{
+	thpool_admission* adm = &jobqueue_p->admission;
+	jobqueue_local* local;
+
+	newjob->prev = NULL;
+	newjob->shed = NULL;
+	newjob->ring = 0;
+
+	if(jobqueue_p->ring && home < 0)
+	{
+		return jobqueue_push_ring(jobqueue_p, newjob, may_block);
+	}
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+
+	if(adm->policy == THPOOL_BLOCK && may_block && jobqueue_len(jobqueue_p) >= adm->max_queued)
+	{
+		__atomic_add_fetch(&jobqueue_p->stats.blocked, 1, __ATOMIC_RELAXED);
+
+		while(adm->policy == THPOOL_BLOCK && jobqueue_len(jobqueue_p) >= adm->max_queued && threads_keepalive)
+		{
+			pthread_cond_wait(&jobqueue_p->has_room, &jobqueue_p->rwmutex);
+		}
+	}
+	else if((adm->policy == THPOOL_REJECT || adm->policy == THPOOL_CODEL) &&
+	        jobqueue_len(jobqueue_p) >= adm->max_queued)
+	{
+		__atomic_add_fetch(&jobqueue_p->stats.rejected, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+		return -1;
+	}
+
+	jobqueue_enqueued(jobqueue_p, newjob);
+
+	if(home < 0)
+	{
+		if(jobqueue_p->rear)
+		{
+			jobqueue_p->rear->prev = newjob;
+		}
+		else
+		{
+			jobqueue_p->front = newjob;
+		}
+
+		jobqueue_p->rear = newjob;
+		jobqueue_wake_idle(jobqueue_p);
+	}
+	else
+	{
+		local = &jobqueue_p->local[home];
+
+		if(local->rear)
+		{
+			local->rear->prev = newjob;
+		}
+		else
+		{
+			local->front = newjob;
+		}
 
-	jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
+		local->rear = newjob;
+		__atomic_add_fetch(&local->len, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&jobqueue_p->stats.keyed, 1, __ATOMIC_RELAXED);
 
-	if(jobqueue_p->has_jobs == NULL)
-	{
-		return -1;
+		if(__atomic_exchange_n(&local->idle, 0, __ATOMIC_SEQ_CST))
+		{
+			bsem_post(&local->has_jobs);
+		}
+		else if(local->len == THPOOL_STEAL_BACKLOG)
+		{
+			jobqueue_wake_idle(jobqueue_p);
+		}
 	}
 
-	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
-	bsem_init(jobqueue_p->has_jobs, 0);
-
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
 	return 0;
 }
 
 
-/* Clear the queue */
-static void jobqueue_clear(jobqueue* jobqueue_p)
+/* Add a plain job to the ring, without the lock
+ *
+ * The ring is bounded: when it is full the job is refused like one over
+ * max_queued, or with THPOOL_BLOCK the caller waits for room. Workers
+ * never wait, they are refused.
+ *
+ * @return 0 on success, -1 if the job was refused
+ */
+static int jobqueue_push_ring(jobqueue* jobqueue_p, struct job* newjob, int may_block)
 {
+	thpool_admission* adm = &jobqueue_p->admission;
+	int blocked = 0;
 
-	while(jobqueue_p->len)
+	for(;;)
+	{
+		if((adm->policy == THPOOL_REJECT || adm->policy == THPOOL_CODEL) &&
+		   jobqueue_len(jobqueue_p) >= adm->max_queued)
+		{
+			break;
+		}
+
+		if(adm->policy != THPOOL_BLOCK || !may_block || !threads_keepalive ||
+		   jobqueue_len(jobqueue_p) < adm->max_queued)
+		{
+			/* Counted first: a worker may run the job before ring_push returns */
+			jobqueue_enqueued(jobqueue_p, newjob);
+
+			if(ring_push(jobqueue_p->ring, newjob) == 0)
+			{
+				jobqueue_wake_idle(jobqueue_p);
+				return 0;
+			}
+
+			__atomic_sub_fetch(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&jobqueue_p->stats.queued, 1, __ATOMIC_RELAXED);
+
+			if(adm->policy != THPOOL_BLOCK || !may_block || !threads_keepalive)
+			{
+				break;
+			}
+		}
+
+		/* Full: wait for a worker to make room, see jobqueue_dequeued */
+		pthread_mutex_lock(&jobqueue_p->rwmutex);
+
+		if(!blocked++)
+		{
+			__atomic_add_fetch(&jobqueue_p->stats.blocked, 1, __ATOMIC_RELAXED);
+		}
+
+		while(adm->policy == THPOOL_BLOCK && threads_keepalive &&
+		      (jobqueue_len(jobqueue_p) >= adm->max_queued || ring_full(jobqueue_p->ring)))
+		{
+			pthread_cond_wait(&jobqueue_p->has_room, &jobqueue_p->rwmutex);
+		}
+
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	}
+
+	__atomic_add_fetch(&jobqueue_p->stats.rejected, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+
+/* Get the next job for worker id, -1 for any job
+ *
+ * With the ring, the worker's own keyed jobs and the ring take turns and
+ * the ring is polled without the lock; the lock is taken only for keyed
+ * jobs, to steal and to go idle. A worker marked idle looks at the ring
+ * once more: a push that read the idle flags before they were set had
+ * published its job already, so it is not missed.
+ */
+static struct job* jobqueue_pull(jobqueue* jobqueue_p, int id)
+{
+	jobqueue_local* local = id >= 0 ? &jobqueue_p->local[id] : NULL;
+	job* out = local ? &local->popped : &jobqueue_p->drained;
+	job* job_p = NULL;
+
+	if(jobqueue_p->ring == NULL)
 	{
-		free(jobqueue_pull(jobqueue_p));
+		return jobqueue_pull_list(jobqueue_p, local, 1);
 	}
 
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
-	bsem_reset(jobqueue_p->has_jobs);
-	jobqueue_p->len = 0;
+	if(local && __atomic_load_n(&local->len, __ATOMIC_RELAXED) && (local->turn ^= 1))
+	{
+		job_p = jobqueue_pull_list(jobqueue_p, local, 0);
+	}
+
+	if(job_p == NULL && ring_pull(jobqueue_p->ring, out) == 0)
+	{
+		job_p = out;
+	}
+	else if(job_p == NULL)
+	{
+		job_p = jobqueue_pull_list(jobqueue_p, local, 1);
+
+		if(job_p == NULL && local)
+		{
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+			if(ring_pull(jobqueue_p->ring, out) == 0)
+			{
+				/* Already posted meanwhile: the next wake up finds nothing */
+				__atomic_store_n(&local->idle, 0, __ATOMIC_SEQ_CST);
+				job_p = out;
+			}
+		}
+	}
+
+	if(job_p == out)
+	{
+		out->ring = 1;
+		jobqueue_dequeued(jobqueue_p, out, 0);
+	}
 
+	return job_p;
 }
 
 
-/* Add (allocated) job to queue
+/* Get the next job from the lists
+ *
+ * A worker takes the older of the fronts of its own list and of the
+ * shared list. It steals from another worker only when that one has a
+ * backlog of THPOOL_STEAL_BACKLOG keyed jobs, so keyed jobs stay where
+ * their state is warm unless the imbalance costs more than the cache
+ * misses. Without a local every list is drained. If idle is set, a
+ * worker that finds nothing is marked idle.
  */
-static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob)
+static struct job* jobqueue_pull_list(jobqueue* jobqueue_p, jobqueue_local* local, int idle)
 {
+	jobqueue_local* victim = NULL;
+	job* job_p = NULL;
+	int n, most;
 
 	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	newjob->prev = NULL;
 
-	switch(jobqueue_p->len)
+	/* Oldest first between the two, a busy key does not starve the rest */
+	if(local && local->front &&
+	   (jobqueue_p->front == NULL || local->front->queued_ns <= jobqueue_p->front->queued_ns))
+	{
+		victim = local;
+	}
+	else if(jobqueue_p->front)
+	{
+		job_p = jobqueue_take(&jobqueue_p->front, &jobqueue_p->rear);
+	}
+	else if(jobqueue_len(jobqueue_p))
 	{
+		most = local ? THPOOL_STEAL_BACKLOG - 1 : 0;
 
-	case 0:  /* if no jobs in queue */
-		jobqueue_p->front = newjob;
-		jobqueue_p->rear  = newjob;
-		break;
+		for(n = 0; n < jobqueue_p->nlocal; n++)
+		{
+			if(jobqueue_p->local[n].len > most)
+			{
+				victim = &jobqueue_p->local[n];
+				most   = victim->len;
+			}
+		}
 
-	default: /* if jobs in queue */
-		jobqueue_p->rear->prev = newjob;
-		jobqueue_p->rear = newjob;
+		if(victim)
+		{
+			__atomic_add_fetch(&jobqueue_p->stats.stolen, 1, __ATOMIC_RELAXED);
+		}
+	}
 
+	if(victim)
+	{
+		job_p = jobqueue_take(&victim->front, &victim->rear);
+		__atomic_sub_fetch(&victim->len, 1, __ATOMIC_RELAXED);
 	}
 
-	jobqueue_p->len++;
+	if(job_p)
+	{
+		jobqueue_dequeued(jobqueue_p, job_p, 1);
+	}
+	else if(local && idle)
+	{
+		__atomic_store_n(&local->idle, 1, __ATOMIC_SEQ_CST);
+	}
 
-	bsem_post(jobqueue_p->has_jobs);
 	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	return job_p;
+}
+
+
+/* Count a job in, before any worker can see it */
+static void jobqueue_enqueued(jobqueue* jobqueue_p, struct job* job_p)
+{
+	job_p->queued_ns = jobqueue_now();
+
+	if(__atomic_fetch_add(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST) == 0)
+	{
+		__atomic_store_n(&jobqueue_p->last_empty, job_p->queued_ns, __ATOMIC_RELAXED);
+	}
+
+	__atomic_add_fetch(&jobqueue_p->stats.queued, 1, __ATOMIC_RELAXED);
 }
 
 
-/* Get first job from queue(removes it from queue)
-<<<<<<< HEAD
+/* Count a job out: statistics, CoDel and room for blocked callers
  *
- * Notice: Caller MUST hold a mutex
-=======
->>>>>>> da2c0fe45e43ce0937f272c8cd2704bdc0afb490
+ * Counters are atomic since ring jobs are counted without the lock.
  */
-static struct job* jobqueue_pull(jobqueue* jobqueue_p)
+static void jobqueue_dequeued(jobqueue* jobqueue_p, struct job* job_p, int locked)
 {
+	thpool_admission* adm = &jobqueue_p->admission;
+	uint64_t now, sojourn, limit, max;
+	int len;
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	job* job_p = jobqueue_p->front;
+	len = __atomic_sub_fetch(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST);
+	now = jobqueue_now();
+	sojourn = now - job_p->queued_ns;
 
-	switch(jobqueue_p->len)
+	__atomic_add_fetch(&jobqueue_p->stats.dequeued, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&jobqueue_p->stats.sojourn_total_us, sojourn / 1000, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&jobqueue_p->stats.sojourn_max_us, __ATOMIC_RELAXED);
+
+	while(sojourn / 1000 > max &&
+	      !__atomic_compare_exchange_n(&jobqueue_p->stats.sojourn_max_us, &max, sojourn / 1000,
+	                                   0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	}
+
+	/* CoDel: a queue that has not drained for an interval is a standing
+	 * queue, then the short target applies, else the interval */
+	if(adm->policy == THPOOL_CODEL && adm->shed && job_p->sockfd >= 0)
+	{
+		limit = now - __atomic_load_n(&jobqueue_p->last_empty, __ATOMIC_RELAXED) >
+		        (uint64_t)adm->interval_us * 1000 ? adm->target_us : adm->interval_us;
+
+		if(sojourn > limit * 1000)
+		{
+			job_p->shed     = adm->shed;
+			job_p->shed_arg = adm->shed_arg;
+			__atomic_add_fetch(&jobqueue_p->stats.shed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	if(len == 0)
+	{
+		__atomic_store_n(&jobqueue_p->last_empty, now, __ATOMIC_RELAXED);
+	}
+
+	/* Signalled under the lock, a caller about to wait can not miss it */
+	if(adm->policy == THPOOL_BLOCK && len < adm->max_queued)
 	{
+		if(!locked)
+		{
+			pthread_mutex_lock(&jobqueue_p->rwmutex);
+		}
 
-	case 0:  /* if no jobs in queue */
-		break;
+		pthread_cond_signal(&jobqueue_p->has_room);
 
-	case 1:  /* if one job in queue */
-		jobqueue_p->front = NULL;
-		jobqueue_p->rear  = NULL;
-		jobqueue_p->len = 0;
-		break;
+		if(!locked)
+		{
+			pthread_mutex_unlock(&jobqueue_p->rwmutex);
+		}
+	}
+}
+
+
+/* Jobs in all queues */
+static int jobqueue_len(jobqueue* jobqueue_p)
+{
+	return __atomic_load_n(&jobqueue_p->len, __ATOMIC_SEQ_CST);
+}
 
-	default: /* if >1 jobs in queue */
-		jobqueue_p->front = job_p->prev;
-		jobqueue_p->len--;
-		/* more than one job in queue -> post it */
-		bsem_post(jobqueue_p->has_jobs);
 
+/* Allocate a list job, from the slab when there is one */
+static struct job* jobqueue_alloc(jobqueue* jobqueue_p)
+{
+	if(jobqueue_p->slab.base != NULL)
+	{
+		return (struct job*)hugemem_pool_get(&jobqueue_p->slab);
+	}
+
+	return (struct job*)malloc(sizeof(struct job));
+}
+
+
+/* Free a job once it has run, ring jobs are copies in the worker */
+static void jobqueue_free(jobqueue* jobqueue_p, struct job* job_p)
+{
+	if(job_p == NULL || job_p->ring)
+	{
+		return;
+	}
+
+	if(jobqueue_p->slab.base != NULL)
+	{
+		hugemem_pool_put(&jobqueue_p->slab, job_p);
+	}
+	else
+	{
+		free(job_p);
+	}
+}
+
+
+/* Unlink the front job of a list, which is not empty */
+static struct job* jobqueue_take(job** front, job** rear)
+{
+	job* job_p = *front;
+
+	*front = job_p->prev;
+
+	if(*front == NULL)
+	{
+		*rear = NULL;
 	}
 
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
 	return job_p;
 }
 
 
+/* Wake one idle worker, if any
+ *
+ * Called once the job can be seen. Without the lock for ring jobs, so
+ * the flags are atomic; the fence pairs with the one in jobqueue_pull.
+ */
+static void jobqueue_wake_idle(jobqueue* jobqueue_p)
+{
+	jobqueue_local* local;
+	int n, i, start;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	start = __atomic_load_n(&jobqueue_p->wake_next, __ATOMIC_RELAXED);
+
+	for(n = 0; n < jobqueue_p->nlocal; n++)
+	{
+		i = (start + n) % jobqueue_p->nlocal;
+		local = &jobqueue_p->local[i];
+
+		if(__atomic_load_n(&local->idle, __ATOMIC_RELAXED) &&
+		   __atomic_exchange_n(&local->idle, 0, __ATOMIC_SEQ_CST))
+		{
+			__atomic_store_n(&jobqueue_p->wake_next, i + 1, __ATOMIC_RELAXED);
+			bsem_post(&local->has_jobs);
+			return;
+		}
+	}
+}
+
+
+/* Wake every worker, to see threads_keepalive */
+static void jobqueue_wake_all(jobqueue* jobqueue_p)
+{
+	int n;
+
+	for(n = 0; n < jobqueue_p->nlocal; n++)
+	{
+		bsem_post_all(&jobqueue_p->local[n].has_jobs);
+	}
+}
+
+
+/* Monotonic time in ns, for sojourn times */
+static uint64_t jobqueue_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
 /* Free all queue resources back to the system */
 static void jobqueue_destroy(jobqueue* jobqueue_p)
 {
 	jobqueue_clear(jobqueue_p);
-	free(jobqueue_p->has_jobs);
+	free(jobqueue_p->local);
+	ring_destroy(jobqueue_p->ring);
+	hugemem_pool_destroy(&jobqueue_p->slab);
+	pthread_cond_destroy(&jobqueue_p->has_room);
+}
+
+
+
+
+
+/* ============================== RING ============================== */
+
+
+/* Make a ring of size slots, rounded up to a power of two
+ *
+ * D. Vyukov's bounded MPMC queue. The slot of turn t is slots[t & mask];
+ * its seq is t while free for the producer of turn t, t + 1 once that
+ * producer wrote it, t + size once its consumer read it, which frees it
+ * for the producer of the next lap. Producers and consumers claim turns
+ * with a CAS on head and tail, which sit on lines of their own.
+ */
+static ring* ring_init(uint32_t size, int flags)
+{
+	ring* ring_p = NULL;
+	uint64_t n = 2, t;
+	size_t bytes, mapped = 0;
+
+	if(size == 0)
+	{
+		size = 4096;
+	}
+
+	while(n < size && n < (1u << 24))
+	{
+		n <<= 1;
+	}
+
+	bytes = sizeof(struct ring) + n * sizeof(struct ring_slot);
+
+	if(flags & THPOOL_HUGEPAGES)
+	{
+		ring_p = (struct ring*)hugemem_map(bytes, HUGEMEM_DEFAULT, &mapped, NULL);
+	}
+
+	if(ring_p == NULL)
+	{
+		mapped = 0;
+		ring_p = (struct ring*)aligned_alloc(64, bytes);
+	}
+
+	if(ring_p == NULL)
+	{
+		Log(("ring_init: Could not allocate memory for ring"));
+		return NULL;
+	}
+
+	ring_p->mask = n - 1;
+	ring_p->mapped = mapped;
+	ring_p->head = 0;
+	ring_p->tail = 0;
+
+	for(t = 0; t < n; t++)
+	{
+		ring_p->slots[t].seq = t;
+	}
+
+	return ring_p;
+}
+
+
+/* Free a ring of ring_init */
+static void ring_destroy(ring* ring_p)
+{
+	if(ring_p == NULL)
+	{
+		return;
+	}
+
+	if(ring_p->mapped)
+	{
+		hugemem_unmap(ring_p, ring_p->mapped);
+	}
+	else
+	{
+		free(ring_p);
+	}
+}
+
+
+/* Copy a job into the ring
+ *
+ * @return 0 on success, -1 if the ring is full
+ */
+static int ring_push(ring* ring_p, const struct job* job_p)
+{
+	ring_slot* slot;
+	uint64_t pos = __atomic_load_n(&ring_p->head, __ATOMIC_RELAXED), seq;
+	int64_t dif;
+
+	for(;;)
+	{
+		slot = &ring_p->slots[pos & ring_p->mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif  = (int64_t)(seq - pos);
+
+		if(dif == 0)
+		{
+			if(__atomic_compare_exchange_n(&ring_p->head, &pos, pos + 1, 1,
+			                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if(dif < 0)
+		{
+			return -1;                   /* the slot of the last lap is still full */
+		}
+		else
+		{
+			pos = __atomic_load_n(&ring_p->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->job = *job_p;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/* Copy the oldest job out of the ring
+ *
+ * @return 0 on success, -1 if the ring is empty
+ */
+static int ring_pull(ring* ring_p, struct job* job_p)
+{
+	ring_slot* slot;
+	uint64_t pos = __atomic_load_n(&ring_p->tail, __ATOMIC_RELAXED), seq;
+	int64_t dif;
+
+	for(;;)
+	{
+		slot = &ring_p->slots[pos & ring_p->mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif  = (int64_t)(seq - (pos + 1));
+
+		if(dif == 0)
+		{
+			if(__atomic_compare_exchange_n(&ring_p->tail, &pos, pos + 1, 1,
+			                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if(dif < 0)
+		{
+			return -1;                   /* not written yet */
+		}
+		else
+		{
+			pos = __atomic_load_n(&ring_p->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	*job_p = slot->job;
+	__atomic_store_n(&slot->seq, pos + ring_p->mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/* Whether every slot is taken, a hint for blocked callers */
+static int ring_full(ring* ring_p)
+{
+	return __atomic_load_n(&ring_p->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&ring_p->tail, __ATOMIC_ACQUIRE) > ring_p->mask;
 }
 
 
@@ -18,6 +18,79 @@
 #ifndef THREAD_POOL_H_
 #define THREAD_POOL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Admission policies, see thpool_set_admission */
+#define THPOOL_UNBOUNDED     0                 /* queue everything          */
+#define THPOOL_REJECT        1                 /* refuse beyond max_queued  */
+#define THPOOL_CODEL         2                 /* also shed late requests   */
+#define THPOOL_BLOCK         3                 /* wait for room             */
+
+/* thpool_add_work refused the job, the caller still owns it */
+#define THPOOL_SHED          (-2)
+
+/* Job queues, see thpool_init_ex */
+#define THPOOL_QUEUE_LIST    0                 /* mutex and linked list     */
+#define THPOOL_QUEUE_RING    1                 /* lock-free bounded ring    */
+
+/* Flags of thpool_options */
+#define THPOOL_HUGEPAGES     0x01              /* jobs on huge pages        */
+
+/* Worker context slots per pool, see thpool_local_add */
+#define THPOOL_LOCAL_MAX     16
+
+
+/* Called on a worker with a request shed from the queue, it owns arg and sockfd */
+typedef void (*thpool_shed_fn)(void* (*function_p)(void* arg, int index), void* arg,
+                               int sockfd, void* shed_arg);
+
+
+/* Makes a worker's context for a slot, on the worker, NULL on failure */
+typedef void* (*thpool_local_init_fn)(void* arg, int index);
+
+/* Frees a worker's context when the worker exits */
+typedef void  (*thpool_local_free_fn)(void* local, void* arg, int index);
+
+
+/* Options of thpool_init_ex */
+typedef struct thpool_options
+{
+	int      queue;                            /* THPOOL_QUEUE_LIST..       */
+	uint32_t ring_size;                        /* ring slots, 0 for 4096    */
+	int      flags;                            /* THPOOL_HUGEPAGES          */
+	uint32_t job_slab;                         /* jobs mapped, 0 for 65536  */
+} thpool_options;
+
+
+/* Bounded queue mode */
+typedef struct thpool_admission
+{
+	int            policy;                     /* THPOOL_UNBOUNDED..        */
+	int            max_queued;                 /* jobs waiting, at most     */
+	uint32_t       target_us;                  /* CoDel, 0 for 5 ms         */
+	uint32_t       interval_us;                /* CoDel, 0 for 100 ms       */
+	thpool_shed_fn shed;                       /* CoDel, NULL sheds nothing */
+	void*          shed_arg;
+} thpool_admission;
+
+
+/* Queue counters since thpool_init */
+typedef struct thpool_stats
+{
+	uint64_t queued;                           /* jobs accepted             */
+	uint64_t rejected;                         /* refused, queue full       */
+	uint64_t shed;                             /* dropped by CoDel          */
+	uint64_t blocked;                          /* callers that had to wait  */
+	uint64_t dequeued;
+	uint64_t sojourn_total_us;                 /* time spent in the queue   */
+	uint64_t sojourn_max_us;
+	uint64_t keyed;                            /* accepted with a key       */
+	uint64_t stolen;                           /* keyed, run off their home */
+	int      queue_len;                        /* waiting now               */
+} thpool_stats;
+
 
 /* =================================== API ======================================= */
 
@@ -45,6 +118,37 @@ typedef struct thpool_* threadpool;
 threadpool thpool_init(int num_threads);
 
 
+/**
+ * @brief  Initialize threadpool with a choice of job queue
+ *
+ * THPOOL_QUEUE_LIST is the queue of thpool_init: a linked list under a
+ * mutex, unbounded unless admission control bounds it.
+ *
+ * THPOOL_QUEUE_RING keeps plain jobs in a bounded lock-free ring, copied
+ * into cache line sized slots, so queuing allocates nothing and producers
+ * and workers do not serialize on one mutex. ring_size is rounded up to
+ * a power of two. A full ring refuses jobs with THPOOL_SHED, as a full
+ * THPOOL_REJECT queue does; with THPOOL_BLOCK callers wait for room.
+ * Keyed jobs still go to the lists of their workers.
+ *
+ * THPOOL_HUGEPAGES maps the ring, and job_slab list jobs, on 2 MB pages
+ * (see hugemem.h) and faults them in here, so a burst of jobs takes no
+ * page faults and few TLB misses. Jobs beyond job_slab come from malloc.
+ * Without huge pages on the system the memory is still pre-faulted.
+ *
+ * @example
+ *
+ *    thpool_options opt = { THPOOL_QUEUE_RING, 16384, THPOOL_HUGEPAGES, 0 };
+ *    threadpool thpool = thpool_init_ex(8, &opt);
+ *
+ * @param  num_threads   number of threads to be created in the threadpool
+ * @param  options       queue choice, NULL for thpool_init's defaults
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_ex(int num_threads, const thpool_options* options);
+
+
 /**
  * @brief Add work to the job queue
  *
@@ -70,13 +174,226 @@ threadpool thpool_init(int num_threads);
  * @param  threadpool    threadpool to which the work will be added
  * @param  function_p    pointer to function to add as work
  * @param  arg_p         pointer to an argument
- * @return 0 on successs, -1 otherwise.
+ * @param  sockfd        client socket the job answers, -1 if none
+ * @return 0 on successs, THPOOL_SHED if admission control refused
+ *         the job, -1 otherwise.
  */
 int thpool_add_work(threadpool, void* (*function_p)(void* arg, int index),
                     void *arg, int sockfd);
 /*int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);*/
 
 
+/**
+ * @brief Add work that should run on the worker of a key
+ *
+ * The key (a socket, a session id..) is hashed to a home worker and the
+ * job goes to that worker's own queue, so consecutive jobs of a
+ * connection find its state in the same caches and handlers may keep
+ * per-worker caches without locking. The home worker wakes for it even
+ * when others are idle.
+ *
+ * Affinity is a preference, not a guarantee: when the home worker is busy
+ * and a backlog builds up behind it, idle workers steal from its queue.
+ * Two jobs with the same key may thus still run at the same time. The
+ * admission policy counts keyed and plain jobs alike.
+ *
+ * A single job behind its home worker is not stolen. Do not key a job by
+ * something the home worker may be blocked on, such as a connection
+ * whose reader runs in the pool, or one the caller waits for.
+ *
+ * @example
+ *
+ *    thpool_add_work_keyed(thpool, (uint64_t)fd, serve_next, conn, fd);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  key           affinity key
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  sockfd        client socket the job answers, -1 if none
+ * @return 0 on successs, THPOOL_SHED if admission control refused
+ *         the job, -1 otherwise.
+ */
+int thpool_add_work_keyed(threadpool, uint64_t key, void* (*function_p)(void* arg, int index),
+                          void *arg, int sockfd);
+
+
+/**
+ * @brief Bound the job queue
+ *
+ * Unbounded, an overloaded server queues every request until all of
+ * them time out. Bounded, some are refused early and the rest succeed.
+ *
+ * THPOOL_REJECT   thpool_add_work returns THPOOL_SHED while max_queued
+ *                 jobs wait; the acceptor answers 503 and closes.
+ *
+ * THPOOL_CODEL    as THPOOL_REJECT, and requests are shed when they
+ *                 leave the queue late: a queue that has not been empty
+ *                 for interval_us is a standing queue, and then a
+ *                 request that waited more than target_us goes to the
+ *                 shed handler instead of its job. Otherwise the limit
+ *                 is interval_us. Only jobs with a socket are shed.
+ *
+ * THPOOL_BLOCK    thpool_add_work waits while max_queued jobs wait, so
+ *                 the acceptor stops accepting and the kernel backlog
+ *                 fills up. Workers queueing jobs never wait, which
+ *                 keeps nested jobs from deadlocking.
+ *
+ * @example
+ *
+ *    thpool_admission adm = { THPOOL_CODEL, 1024, 5000, 100000, thpool_shed_503, NULL };
+ *    thpool_set_admission(thpool, &adm);
+ *    ..
+ *    if(thpool_add_work(thpool, serve, (void*)(intptr_t)fd, fd) != 0){
+ *       thpool_shed_503(serve, NULL, fd, NULL);
+ *    }
+ *
+ * @param  threadpool    threadpool to configure
+ * @param  admission     policy and limits, copied
+ * @return 0 on success, -1 on bad arguments
+ */
+int thpool_set_admission(threadpool, const thpool_admission* admission);
+
+
+/**
+ * @brief Shed handler answering 503 and closing the socket
+ *
+ * For jobs whose argument needs no cleanup.
+ *
+ * @return nothing
+ */
+void thpool_shed_503(void* (*function_p)(void* arg, int index), void* arg,
+                     int sockfd, void* shed_arg);
+
+
+/**
+ * @brief Read the queue counters
+ *
+ * @param  threadpool    threadpool of interest
+ * @param  stats         receives the counters
+ * @return nothing
+ */
+void thpool_get_stats(threadpool, thpool_stats* stats);
+
+
+/**
+ * @brief Run a function over a range using all threads of the pool
+ *
+ * Splits [begin, end) recursively in halves until pieces are no larger
+ * than grain and runs body on every piece. The calling thread takes part
+ * in the work, so it is safe to call this from inside a job. Returns once
+ * every piece has been processed.
+ *
+ * If grain is 0 a grain size is chosen from the range length and the
+ * number of threads in the pool.
+ *
+ * @example
+ *
+ *    void scale(size_t begin, size_t end, void* arg, int index){
+ *       float* v = arg;
+ *       for(; begin < end; begin++) v[begin] *= 2.0f;
+ *    }
+ *
+ *    thpool_parallel_for(thpool, 0, n, 0, scale, values);
+ *
+ * @param  threadpool    threadpool which will run the pieces
+ * @param  begin         first index of the range
+ * @param  end           one past the last index of the range
+ * @param  grain         largest piece handed to body, 0 for automatic
+ * @param  body          function run on every piece, index is the worker
+ *                       id or -1 when run by the calling thread
+ * @param  arg           argument passed to body
+ * @return 0 on successs, -1 otherwise.
+ */
+int thpool_parallel_for(threadpool, size_t begin, size_t end, size_t grain,
+                        void (*body)(size_t begin, size_t end, void* arg, int index),
+                        void* arg);
+
+
+/**
+ * @brief Reduce a range using all threads of the pool
+ *
+ * Works like thpool_parallel_for() but every participating thread
+ * accumulates into a private copy of result. The private copies are
+ * merged into result with join once a thread runs out of pieces.
+ *
+ * On entry result must hold the identity value of the reduction
+ * (e.g. 0 for a sum), since it is used to seed every private copy.
+ *
+ * @example
+ *
+ *    void sum(size_t begin, size_t end, void* acc, void* arg, int index){
+ *       const uint8_t* p = arg;
+ *       for(; begin < end; begin++) *(uint64_t*)acc += p[begin];
+ *    }
+ *    void add(void* acc, const void* part, void* arg){
+ *       *(uint64_t*)acc += *(const uint64_t*)part;
+ *    }
+ *
+ *    uint64_t total = 0;
+ *    thpool_parallel_reduce(thpool, 0, len, 0, sum, add,
+ *                           &total, sizeof(total), buffer);
+ *
+ * @param  threadpool    threadpool which will run the pieces
+ * @param  begin         first index of the range
+ * @param  end           one past the last index of the range
+ * @param  grain         largest piece handed to body, 0 for automatic
+ * @param  body          function accumulating a piece into acc
+ * @param  join          function merging part into acc
+ * @param  result        identity value on entry, reduced value on return
+ * @param  result_size   size of the value pointed by result
+ * @param  arg           argument passed to body and join
+ * @return 0 on successs, -1 otherwise.
+ */
+int thpool_parallel_reduce(threadpool, size_t begin, size_t end, size_t grain,
+                           void (*body)(size_t begin, size_t end, void* acc,
+                                        void* arg, int index),
+                           void (*join)(void* acc, const void* part, void* arg),
+                           void* result, size_t result_size, void* arg);
+
+
+/**
+ * @brief Add a per-worker context slot
+ *
+ * Every worker of the pool gets its own context for the slot: reusable
+ * parse buffers, compressor state, a cache of upstream connections..
+ * Only the worker touches it, so it needs no lock.
+ *
+ * init runs on the worker itself, the first time one of its jobs asks
+ * for the slot, so workers that never need it pay nothing. If init fails
+ * it is tried again on the next call. fini, if not NULL, runs on the
+ * worker when it exits in thpool_destroy.
+ *
+ * @example
+ *
+ *    void* scratch_new(void* arg, int index){ return malloc(65536); }
+ *    void  scratch_free(void* p, void* arg, int index){ free(p); }
+ *
+ *    int scratch = thpool_local_add(thpool, scratch_new, scratch_free, NULL);
+ *    ..
+ *    // in a job
+ *    char* buf = thpool_local(thpool, scratch);
+ *
+ * @param  threadpool    threadpool whose workers get the slot
+ * @param  init          makes the context of a worker
+ * @param  fini          frees it, or NULL
+ * @param  arg           passed to init and fini
+ * @return slot number on success, -1 if all THPOOL_LOCAL_MAX are taken
+ */
+int thpool_local_add(threadpool, thpool_local_init_fn init, thpool_local_free_fn fini, void* arg);
+
+
+/**
+ * @brief Context of the calling worker for a slot
+ *
+ * @param  threadpool    threadpool the slot was added to
+ * @param  slot          result of thpool_local_add
+ * @return the context, NULL if init failed, on a bad slot or when the
+ *         caller is not a worker of the pool (e.g. the calling thread of
+ *         thpool_parallel_for, whose index is -1)
+ */
+void* thpool_local(threadpool, int slot);
+
+
 /**
  * @brief Wait for all queued jobs to finish
  *
@@ -0,0 +1,241 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  timerwheel.c
+ *
+ *    Description:  分层时间轮 (connection timeouts)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define TW_MASK     (TW_SLOTS - 1)
+#define TW_MAX      ((1ull << (TW_LEVELS * TW_BITS)) - 1)
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static void tw_place(timerwheel* tw, tw_timer* timer);
+static void tw_cascade(timerwheel* tw, int level);
+static void tw_unlink(tw_timer* timer);
+
+
+
+
+/* ========================== TIMER WHEEL =========================== */
+
+
+/* Initialise wheel */
+int tw_init(timerwheel* tw, uint64_t now_ms, uint32_t tick_ms)
+{
+	if(tw == NULL || tick_ms == 0)
+	{
+		return -1;
+	}
+
+	memset(tw, 0, sizeof(timerwheel));
+	tw->origin_ms = now_ms;
+	tw->tick_ms   = tick_ms;
+	return 0;
+}
+
+
+/* Initialise timer */
+void tw_timer_init(tw_timer* timer, int sockfd,
+                   void (*expire)(tw_timer* timer, void* arg), void* arg)
+{
+	memset(timer, 0, sizeof(tw_timer));
+	timer->sockfd = sockfd;
+	timer->expire = expire;
+	timer->arg    = arg;
+}
+
+
+/* Arm or re-arm timer */
+void tw_arm(timerwheel* tw, tw_timer* timer, int kind, uint64_t timeout_ms)
+{
+	uint64_t ticks = (timeout_ms + tw->tick_ms - 1) / tw->tick_ms;
+
+	tw_cancel(timer);
+
+	/* Never due on the current tick, it has already been run */
+	if(ticks == 0)
+	{
+		ticks = 1;
+	}
+
+	if(ticks > TW_MAX)
+	{
+		ticks = TW_MAX;
+	}
+
+	timer->wheel   = tw;
+	timer->kind    = kind;
+	timer->expires = tw->now + ticks;
+	tw_place(tw, timer);
+	tw->count++;
+}
+
+
+/* Cancel timer */
+void tw_cancel(tw_timer* timer)
+{
+	if(timer->pprev == NULL)
+	{
+		return ;
+	}
+
+	tw_unlink(timer);
+	timer->wheel->count--;
+}
+
+
+/* Run due timers */
+int tw_advance(timerwheel* tw, uint64_t now_ms)
+{
+	uint64_t target;
+	tw_timer* timer;
+	int expired = 0;
+	int level;
+
+	if(now_ms < tw->origin_ms)
+	{
+		return 0;
+	}
+
+	target = (now_ms - tw->origin_ms) / tw->tick_ms;
+
+	while(tw->now < target)
+	{
+		/* Nothing armed: jump straight to the target */
+		if(tw->count == 0)
+		{
+			tw->now = target;
+			break;
+		}
+
+		tw->now++;
+
+		/* Level n wraps every 64^n ticks, pull its next slot down */
+		for(level = 1; level < TW_LEVELS; level++)
+		{
+			if(tw->now & ((1ull << (level * TW_BITS)) - 1))
+			{
+				break;
+			}
+		}
+
+		while(--level > 0)
+		{
+			tw_cascade(tw, level);
+		}
+
+		while((timer = tw->slots[0][tw->now & TW_MASK]))
+		{
+			tw_unlink(timer);
+			tw->count--;
+			timer->expire(timer, timer->arg);
+			expired++;
+		}
+	}
+
+	return expired;
+}
+
+
+/* Milliseconds until the next tick that has work */
+int tw_next_timeout(timerwheel* tw)
+{
+	uint64_t t;
+
+	if(tw->count == 0)
+	{
+		return -1;
+	}
+
+	/* Next level 0 timer, or the next cascade, whichever comes first */
+	for(t = tw->now + 1; ; t++)
+	{
+		if(tw->slots[0][t & TW_MASK] || (t & TW_MASK) == 0)
+		{
+			break;
+		}
+	}
+
+	return (int)((t - tw->now) * tw->tick_ms);
+}
+
+
+
+
+/* ============================ SLOTS =============================== */
+
+
+/* Put timer in the slot matching its distance from now */
+static void tw_place(timerwheel* tw, tw_timer* timer)
+{
+	uint64_t delta = timer->expires - tw->now;
+	tw_timer** slot;
+	int level = 0;
+
+	while(level < TW_LEVELS - 1 && delta >= (1ull << ((level + 1) * TW_BITS)))
+	{
+		level++;
+	}
+
+	slot = &tw->slots[level][(timer->expires >> (level * TW_BITS)) & TW_MASK];
+
+	timer->next  = *slot;
+	timer->pprev = slot;
+
+	if(*slot)
+	{
+		(*slot)->pprev = &timer->next;
+	}
+
+	*slot = timer;
+}
+
+
+/* Re-place every timer of the current slot of level */
+static void tw_cascade(timerwheel* tw, int level)
+{
+	tw_timer** slot = &tw->slots[level][(tw->now >> (level * TW_BITS)) & TW_MASK];
+	tw_timer*  timer = *slot;
+	tw_timer*  next;
+
+	*slot = NULL;
+
+	for(; timer; timer = next)
+	{
+		next = timer->next;
+		tw_place(tw, timer);
+	}
+}
+
+
+/* Remove timer from its slot */
+static void tw_unlink(tw_timer* timer)
+{
+	*timer->pprev = timer->next;
+
+	if(timer->next)
+	{
+		timer->next->pprev = timer->pprev;
+	}
+
+	timer->next  = NULL;
+	timer->pprev = NULL;
+}
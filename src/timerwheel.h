@@ -0,0 +1,156 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  timerwheel.h
+ *
+ *    Description:  分层时间轮 (connection timeouts)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+
+#define TW_LEVELS   5                          /* 64^5 ticks of range       */
+#define TW_BITS     6
+#define TW_SLOTS    (1 << TW_BITS)
+
+
+/* Kind of timeout a timer is armed for */
+enum tw_kind
+{
+	TW_IDLE,                                   /* keep-alive, no request    */
+	TW_READ_HEADER,                            /* request header not done   */
+	TW_WRITE                                   /* response not drained      */
+};
+
+
+/* Timer, embedded in the connection it belongs to */
+typedef struct tw_timer
+{
+	struct tw_timer*  next;                    /* next timer in slot        */
+	struct tw_timer** pprev;                   /* link to us, NULL unarmed  */
+	struct timerwheel* wheel;                  /* wheel last armed on       */
+	uint64_t expires;                          /* tick to expire at         */
+	void   (*expire)(struct tw_timer* timer, void* arg);
+	void*    arg;
+	int      sockfd;                           /* connection socket         */
+	int      kind;                             /* enum tw_kind              */
+} tw_timer;
+
+
+/* Hierarchical timing wheel, owned by one thread */
+typedef struct timerwheel
+{
+	tw_timer* slots[TW_LEVELS][TW_SLOTS];
+	uint64_t  now;                             /* current tick              */
+	uint64_t  origin_ms;                       /* time of tick 0            */
+	uint32_t  tick_ms;                         /* resolution                */
+	uint32_t  count;                           /* armed timers              */
+} timerwheel;
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief  Initialize a timer wheel
+ *
+ * A wheel is not thread safe. Each reactor or worker thread owns one and
+ * is the only one to arm, cancel and advance timers on it.
+ *
+ * @example
+ *
+ *    ..
+ *    timerwheel tw;
+ *    tw_init(&tw, now_ms(), 10);            //10 ms resolution
+ *    ..
+ *    for(;;) {
+ *       n = epoll_wait(epfd, ev, 64, tw_next_timeout(&tw));
+ *       ..
+ *       tw_advance(&tw, now_ms());          //once per loop tick
+ *    }
+ *
+ * @param  tw        wheel to initialize
+ * @param  now_ms    current time in milliseconds, any monotonic clock
+ * @param  tick_ms   resolution of the wheel in milliseconds
+ * @return 0 on success, -1 otherwise.
+ */
+int tw_init(timerwheel* tw, uint64_t now_ms, uint32_t tick_ms);
+
+
+/**
+ * @brief Initialize a connection timer
+ *
+ * @param  timer     timer to initialize, usually part of the connection
+ *                   passed as arg to thpool_add_work()
+ * @param  sockfd    connection socket, given back to expire through timer
+ * @param  expire    function called when the timer expires
+ * @param  arg       argument passed to expire
+ * @return nothing
+ */
+void tw_timer_init(tw_timer* timer, int sockfd,
+                   void (*expire)(tw_timer* timer, void* arg), void* arg);
+
+
+/**
+ * @brief Arm a timer, or re-arm it if it is already armed
+ *
+ * O(1). Moving a connection from one phase to the next (e.g. from
+ * TW_READ_HEADER to TW_WRITE) is a single call.
+ *
+ * @param  tw          wheel that will own the timer
+ * @param  timer       timer to arm
+ * @param  kind        enum tw_kind, for the expire function to look at
+ * @param  timeout_ms  time until it expires, rounded up to a tick
+ * @return nothing
+ */
+void tw_arm(timerwheel* tw, tw_timer* timer, int kind, uint64_t timeout_ms);
+
+
+/**
+ * @brief Cancel a timer
+ *
+ * O(1). Does nothing if the timer is not armed.
+ *
+ * @param  timer     timer to cancel
+ * @return nothing
+ */
+void tw_cancel(tw_timer* timer);
+
+
+/**
+ * @brief Run the timers that are due
+ *
+ * Call once per event loop tick. Expire functions may arm and cancel
+ * timers, including the one being run.
+ *
+ * @param  tw        wheel to advance
+ * @param  now_ms    current time in milliseconds
+ * @return number of timers that expired
+ */
+int tw_advance(timerwheel* tw, uint64_t now_ms);
+
+
+/**
+ * @brief Time until the wheel needs to be advanced again
+ *
+ * Suitable as epoll_wait() timeout. May be earlier than the next expiry
+ * when far timers must be moved down a level.
+ *
+ * @param  tw        wheel of interest
+ * @return milliseconds, -1 if no timer is armed
+ */
+int tw_next_timeout(timerwheel* tw);
+
+#endif /* TIMER_WHEEL_H_ */
@@ -0,0 +1,585 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  tls.c
+ *
+ *    Description:  TLS 终止 (OpenSSL, session resumption, kernel TLS)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "common.h"
+#include "tls.h"
+
+#define TLS_SESSION_ID_CONTEXT    "SimpleHttpServer"
+#define TLS_SESSION_CACHE_SIZE    20480
+#define TLS_TICKETS               2            /* per full handshake        */
+#define TLS_FILE_CHUNK            16384
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Server context */
+struct tls_ctx
+{
+	SSL_CTX* ssl_ctx;
+	int      flags;
+	int      refs;                             /* owner and connections     */
+};
+
+
+/* Connection */
+struct tls_conn
+{
+	SSL*     ssl;
+	tls_ctx* ctx;
+	int      sockfd;
+	int      ktls;                             /* 1 send, 2 receive         */
+};
+
+
+/* Handshake job */
+typedef struct tls_job
+{
+	tls_ctx*      ctx;
+	int           sockfd;
+	tls_accept_fn done;
+	void*         arg;
+} tls_job;
+
+
+static tls_stats tls_totals;
+
+
+
+
+/* ========================== PROTOTYPES ============================ */
+
+
+static void* tls_accept_job(void* arg, int index);
+static tls_conn* tls_handshake(tls_ctx* ctx, int sockfd, int timeout_ms);
+static uint64_t tls_now_ms(void);
+static void  tls_ctx_release(tls_ctx* ctx);
+static int   tls_io_error(tls_conn* conn, int ret);
+static void  tls_log_error(const char* where);
+
+
+
+
+/* ============================ CONTEXT ============================= */
+
+
+/* Server context */
+tls_ctx* tls_ctx_init(const char* cert_file, const char* key_file, int flags)
+{
+	tls_ctx* ctx;
+	SSL_CTX* ssl_ctx;
+
+	if(cert_file == NULL || key_file == NULL)
+	{
+		return NULL;
+	}
+
+	if((ssl_ctx = SSL_CTX_new(TLS_server_method())) == NULL)
+	{
+		tls_log_error("tls_ctx_init");
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+
+	if(SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_file) != 1 ||
+	   SSL_CTX_use_PrivateKey_file(ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+	   SSL_CTX_check_private_key(ssl_ctx) != 1)
+	{
+		tls_log_error("tls_ctx_init");
+		SSL_CTX_free(ssl_ctx);
+		return NULL;
+	}
+
+	/* Resumption: tickets for both versions, the cache for TLS 1.2 ids */
+	SSL_CTX_set_session_id_context(ssl_ctx, (const unsigned char*)TLS_SESSION_ID_CONTEXT,
+	                               sizeof(TLS_SESSION_ID_CONTEXT) - 1);
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ssl_ctx, TLS_SESSION_CACHE_SIZE);
+
+	if(flags & TLS_NO_TICKETS)
+	{
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+		SSL_CTX_set_num_tickets(ssl_ctx, 0);
+	}
+	else
+	{
+		SSL_CTX_set_num_tickets(ssl_ctx, TLS_TICKETS);
+	}
+
+	/* Writes may be retried with another buffer after EAGAIN */
+	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	if(flags & TLS_KTLS)
+	{
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#else
+		Log(("tls_ctx_init: OpenSSL was built without kernel TLS"));
+#endif
+	}
+
+	ctx = (tls_ctx*)calloc(1, sizeof(tls_ctx));
+
+	if(ctx == NULL)
+	{
+		Log(("tls_ctx_init: Could not allocate memory for context"));
+		SSL_CTX_free(ssl_ctx);
+		return NULL;
+	}
+
+	ctx->ssl_ctx = ssl_ctx;
+	ctx->flags   = flags;
+	ctx->refs    = 1;
+	return ctx;
+}
+
+
+/* Drop the owner's reference */
+void tls_ctx_destroy(tls_ctx* ctx)
+{
+	if(ctx != NULL)
+	{
+		tls_ctx_release(ctx);
+	}
+}
+
+
+/* Drop a reference */
+static void tls_ctx_release(tls_ctx* ctx)
+{
+	if(__atomic_sub_fetch(&ctx->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		SSL_CTX_free(ctx->ssl_ctx);
+		free(ctx);
+	}
+}
+
+
+
+
+/* =========================== HANDSHAKE ============================ */
+
+
+/* Queue a handshake */
+int tls_accept_async(threadpool pool, tls_ctx* ctx, int sockfd, tls_accept_fn done, void* arg)
+{
+	tls_job* job;
+
+	if(pool == NULL || ctx == NULL || done == NULL)
+	{
+		return -1;
+	}
+
+	job = (tls_job*)malloc(sizeof(tls_job));
+
+	if(job == NULL)
+	{
+		Log(("tls_accept_async: Could not allocate memory for handshake"));
+		return -1;
+	}
+
+	job->ctx    = ctx;
+	job->sockfd = sockfd;
+	job->done   = done;
+	job->arg    = arg;
+
+	__atomic_add_fetch(&ctx->refs, 1, __ATOMIC_RELAXED);
+
+	/* No socket: a shed 503 would go out in plaintext and leak the job */
+	if(thpool_add_work(pool, tls_accept_job, job, -1) != 0)
+	{
+		tls_ctx_release(ctx);
+		free(job);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Job: handshake with a deadline */
+static void* tls_accept_job(void* arg, int index)
+{
+	tls_job*  job = (tls_job*)arg;
+	tls_conn* conn;
+	int fl;
+
+	(void)index;
+
+	/* Non-blocking, so the deadline holds for the whole handshake and not
+	 * for each read or write of it */
+	fl = fcntl(job->sockfd, F_GETFL);
+
+	if(fl != -1 && !(fl & O_NONBLOCK))
+	{
+		fcntl(job->sockfd, F_SETFL, fl | O_NONBLOCK);
+	}
+
+	conn = tls_handshake(job->ctx, job->sockfd, TLS_HANDSHAKE_TIMEOUT_MS);
+
+	/* Hand the socket back as it came */
+	if(fl != -1 && !(fl & O_NONBLOCK))
+	{
+		fcntl(job->sockfd, F_SETFL, fl);
+	}
+
+	job->done(conn, job->sockfd, job->arg);
+
+	tls_ctx_release(job->ctx);
+	free(job);
+	return NULL;
+}
+
+
+/* Handshake in this thread */
+tls_conn* tls_accept(tls_ctx* ctx, int sockfd)
+{
+	return tls_handshake(ctx, sockfd, -1);
+}
+
+
+/* SSL_accept, polling a non-blocking socket until timeout_ms, or blocking if -1 */
+static tls_conn* tls_handshake(tls_ctx* ctx, int sockfd, int timeout_ms)
+{
+	struct pollfd pfd;
+	tls_conn* conn;
+	SSL*      ssl;
+	uint64_t  deadline = 0, now;
+	int ret, err;
+
+	if(ctx == NULL || (ssl = SSL_new(ctx->ssl_ctx)) == NULL)
+	{
+		return NULL;
+	}
+
+	if(timeout_ms >= 0)
+	{
+		deadline = tls_now_ms() + (uint64_t)timeout_ms;
+	}
+
+	if(SSL_set_fd(ssl, sockfd) != 1)
+	{
+		goto fail;
+	}
+
+	while((ret = SSL_accept(ssl)) != 1)
+	{
+		err = SSL_get_error(ssl, ret);
+
+		if(timeout_ms < 0 || (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE))
+		{
+			goto fail;
+		}
+
+		pfd.fd      = sockfd;
+		pfd.events  = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+		pfd.revents = 0;
+
+		/* One deadline for all round trips; a slow client gets no more */
+		do
+		{
+			if((now = tls_now_ms()) >= deadline)
+			{
+				goto fail;
+			}
+
+			ret = poll(&pfd, 1, (int)(deadline - now));
+		} while(ret < 0 && errno == EINTR);
+
+		if(ret <= 0)
+		{
+			goto fail;
+		}
+	}
+
+	conn = (tls_conn*)calloc(1, sizeof(tls_conn));
+
+	if(conn == NULL)
+	{
+		Log(("tls_accept: Could not allocate memory for connection"));
+		SSL_free(ssl);
+		return NULL;
+	}
+
+	conn->ssl    = ssl;
+	conn->ctx    = ctx;
+	conn->sockfd = sockfd;
+	__atomic_add_fetch(&ctx->refs, 1, __ATOMIC_RELAXED);
+
+#ifdef BIO_get_ktls_send
+	if(BIO_get_ktls_send(SSL_get_wbio(ssl)))
+	{
+		conn->ktls |= 1;
+		__atomic_add_fetch(&tls_totals.ktls_send, 1, __ATOMIC_RELAXED);
+	}
+
+	if(BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+	{
+		conn->ktls |= 2;
+		__atomic_add_fetch(&tls_totals.ktls_recv, 1, __ATOMIC_RELAXED);
+	}
+#endif
+
+	__atomic_add_fetch(&tls_totals.handshakes, 1, __ATOMIC_RELAXED);
+
+	if(SSL_session_reused(ssl))
+	{
+		__atomic_add_fetch(&tls_totals.resumed, 1, __ATOMIC_RELAXED);
+	}
+
+	return conn;
+
+fail:
+	__atomic_add_fetch(&tls_totals.failures, 1, __ATOMIC_RELAXED);
+	ERR_clear_error();
+	SSL_free(ssl);
+	return NULL;
+}
+
+
+/* Monotonic milliseconds */
+static uint64_t tls_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+
+
+
+/* ============================== I/O =============================== */
+
+
+/* Read */
+ssize_t tls_read(tls_conn* conn, void* buf, size_t len)
+{
+	int ret;
+
+	if(conn == NULL)
+	{
+		return -1;
+	}
+
+	if(len > 0x7fffffff)
+	{
+		len = 0x7fffffff;
+	}
+
+	errno = 0;
+	ret = SSL_read(conn->ssl, buf, (int)len);
+
+	if(ret > 0)
+	{
+		return ret;
+	}
+
+	return tls_io_error(conn, ret);
+}
+
+
+/* Write */
+ssize_t tls_write(tls_conn* conn, const void* buf, size_t len)
+{
+	int ret;
+
+	if(conn == NULL)
+	{
+		return -1;
+	}
+
+	if(len > 0x7fffffff)
+	{
+		len = 0x7fffffff;
+	}
+
+	errno = 0;
+	ret = SSL_write(conn->ssl, buf, (int)len);
+
+	if(ret > 0)
+	{
+		return ret;
+	}
+
+	return tls_io_error(conn, ret);
+}
+
+
+/* File, through the kernel when it can */
+ssize_t tls_sendfile(tls_conn* conn, int fd, off_t offset, size_t size)
+{
+	char    buf[TLS_FILE_CHUNK];
+	size_t  sent = 0;
+	ssize_t n, w;
+
+	if(conn == NULL)
+	{
+		return -1;
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if(conn->ktls & 1)
+	{
+		while(sent < size)
+		{
+			n = SSL_sendfile(conn->ssl, fd, offset + (off_t)sent, size - sent, 0);
+
+			if(n <= 0)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+
+				ERR_clear_error();
+				return sent > 0 ? (ssize_t)sent : -1;
+			}
+
+			sent += (size_t)n;
+		}
+
+		__atomic_add_fetch(&tls_totals.sendfile_bytes, sent, __ATOMIC_RELAXED);
+		return (ssize_t)sent;
+	}
+#endif
+
+	while(sent < size)
+	{
+		n = pread(fd, buf, size - sent < sizeof(buf) ? size - sent : sizeof(buf), offset + (off_t)sent);
+
+		if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(n <= 0)
+		{
+			break;
+		}
+
+		/* Blocking sockets only; SSL_write writes it all or fails */
+		if((w = tls_write(conn, buf, (size_t)n)) != n)
+		{
+			return sent > 0 ? (ssize_t)sent : -1;
+		}
+
+		sent += (size_t)n;
+	}
+
+	return (ssize_t)sent;
+}
+
+
+/* SSL_read/SSL_write failure to -1 and errno, or 0 at close
+ */
+static int tls_io_error(tls_conn* conn, int ret)
+{
+	switch(SSL_get_error(conn->ssl, ret))
+	{
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+
+		case SSL_ERROR_SYSCALL:
+			/* EOF without close_notify, seen as a close */
+			ERR_clear_error();
+			return errno == 0 ? 0 : -1;
+
+		default:
+			ERR_clear_error();
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+
+/* Resumed */
+int tls_resumed(const tls_conn* conn)
+{
+	return conn != NULL && SSL_session_reused(conn->ssl);
+}
+
+
+/* Kernel TLS */
+int tls_ktls(const tls_conn* conn)
+{
+	return conn != NULL ? conn->ktls : 0;
+}
+
+
+/* Close */
+void tls_close(tls_conn* conn)
+{
+	if(conn == NULL)
+	{
+		return;
+	}
+
+	/* No wait for the peer's close_notify */
+	if(SSL_is_init_finished(conn->ssl))
+	{
+		SSL_shutdown(conn->ssl);
+	}
+
+	ERR_clear_error();
+	SSL_free(conn->ssl);
+	tls_ctx_release(conn->ctx);
+	free(conn);
+}
+
+
+/* Read totals */
+void tls_get_stats(tls_stats* stats)
+{
+	stats->handshakes     = __atomic_load_n(&tls_totals.handshakes, __ATOMIC_RELAXED);
+	stats->failures       = __atomic_load_n(&tls_totals.failures, __ATOMIC_RELAXED);
+	stats->resumed        = __atomic_load_n(&tls_totals.resumed, __ATOMIC_RELAXED);
+	stats->ktls_send      = __atomic_load_n(&tls_totals.ktls_send, __ATOMIC_RELAXED);
+	stats->ktls_recv      = __atomic_load_n(&tls_totals.ktls_recv, __ATOMIC_RELAXED);
+	stats->sendfile_bytes = __atomic_load_n(&tls_totals.sendfile_bytes, __ATOMIC_RELAXED);
+}
+
+
+/* Log the OpenSSL error queue */
+static void tls_log_error(const char* where)
+{
+	char msg[256];
+	unsigned long e;
+
+	while((e = ERR_get_error()) != 0)
+	{
+		ERR_error_string_n(e, msg, sizeof(msg));
+		Log(("%s: %s", where, msg));
+	}
+}
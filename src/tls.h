@@ -0,0 +1,204 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  tls.h
+ *
+ *    Description:  TLS 终止 (OpenSSL, session resumption, kernel TLS)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "threadpool.h"
+
+
+/* Handshakes taking longer than this fail, so a silent client can not pin a worker */
+#define TLS_HANDSHAKE_TIMEOUT_MS   10000
+
+/* Flags of tls_ctx_init */
+#define TLS_KTLS                   0x01        /* ask for kernel TLS        */
+#define TLS_NO_TICKETS             0x02        /* session ids only          */
+
+
+typedef struct tls_ctx  tls_ctx;
+typedef struct tls_conn tls_conn;
+
+
+/* Called on the pool thread that ran the handshake, conn is NULL on failure */
+typedef void (*tls_accept_fn)(tls_conn* conn, int sockfd, void* arg);
+
+
+/* Totals over all connections */
+typedef struct tls_stats
+{
+	uint64_t handshakes;
+	uint64_t failures;
+	uint64_t resumed;                          /* abbreviated handshakes    */
+	uint64_t ktls_send;                        /* kTLS on the send side     */
+	uint64_t ktls_recv;                        /* kTLS on the receive side  */
+	uint64_t sendfile_bytes;                   /* sent without a user copy  */
+} tls_stats;
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Create a server context
+ *
+ * TLS 1.2 and 1.3, resumption through stateless session tickets (TLS 1.3
+ * and 1.2) and a server session cache (TLS 1.2 ids). The ticket keys
+ * live in the context, so every worker can resume any session.
+ *
+ * With TLS_KTLS the record layer moves into the kernel once the
+ * handshake is done, when both OpenSSL (SSL_OP_ENABLE_KTLS) and the
+ * kernel ("modprobe tls") support the negotiated cipher.
+ *
+ * For local testing a self-signed certificate will do:
+ *
+ *    openssl req -x509 -newkey rsa:2048 -nodes -days 30 \
+ *            -keyout key.pem -out cert.pem -subj /CN=localhost
+ *    curl -k https://localhost:8443/
+ *
+ * @param  cert_file     PEM certificate chain
+ * @param  key_file      PEM private key
+ * @param  flags         TLS_KTLS, TLS_NO_TICKETS
+ * @return context on success, NULL on error
+ */
+tls_ctx* tls_ctx_init(const char* cert_file, const char* key_file, int flags);
+
+
+/**
+ * @brief Free a context
+ *
+ * Connections made from it keep it alive until they are closed.
+ *
+ * @param  ctx       context
+ * @return nothing
+ */
+void tls_ctx_destroy(tls_ctx* ctx);
+
+
+/**
+ * @brief Run the server handshake on a pool thread
+ *
+ * Returns at once, so the caller (an accept loop or a coroutine
+ * scheduler) never waits on a handshake. The socket is made non-blocking
+ * for the handshake, which must finish within TLS_HANDSHAKE_TIMEOUT_MS
+ * however many round trips it takes, and its flags are restored before
+ * done is called.
+ *
+ * @example
+ *
+ *    void on_tls(tls_conn* conn, int sockfd, void* arg){
+ *        if(conn == NULL){ close(sockfd); return; }
+ *        ..
+ *        tls_close(conn);
+ *        close(sockfd);
+ *    }
+ *
+ *    tls_accept_async(thpool, ctx, sockfd, on_tls, NULL);
+ *
+ * @param  pool      threadpool running the handshake
+ * @param  ctx       context
+ * @param  sockfd    accepted socket
+ * @param  done      called with the result
+ * @param  arg       argument of done
+ * @return 0 on success, -1 if the job could not be queued
+ */
+int tls_accept_async(threadpool pool, tls_ctx* ctx, int sockfd, tls_accept_fn done, void* arg);
+
+
+/**
+ * @brief Run the server handshake in the calling thread
+ *
+ * @param  ctx       context
+ * @param  sockfd    accepted socket, blocking
+ * @return connection on success, NULL on error
+ */
+tls_conn* tls_accept(tls_ctx* ctx, int sockfd);
+
+
+/**
+ * @brief Read decrypted bytes
+ *
+ * @return bytes read, 0 at close_notify or EOF, -1 on error with errno
+ *         EAGAIN when a non-blocking socket has nothing yet
+ */
+ssize_t tls_read(tls_conn* conn, void* buf, size_t len);
+
+
+/**
+ * @brief Write bytes
+ *
+ * @return bytes written, -1 on error with errno EAGAIN when a
+ *         non-blocking socket is full
+ */
+ssize_t tls_write(tls_conn* conn, const void* buf, size_t len);
+
+
+/**
+ * @brief Send part of a file
+ *
+ * With kTLS on the send side this is SSL_sendfile: the kernel encrypts
+ * straight from the page cache. Otherwise the file is read in pieces and
+ * written through SSL_write.
+ *
+ * @param  conn      connection
+ * @param  fd        file to send
+ * @param  offset    start in the file
+ * @param  size      bytes to send
+ * @return bytes sent, -1 on error
+ */
+ssize_t tls_sendfile(tls_conn* conn, int fd, off_t offset, size_t size);
+
+
+/**
+ * @brief Tell if the session was resumed
+ *
+ * @return 1 if resumed, 0 if a full handshake was made
+ */
+int tls_resumed(const tls_conn* conn);
+
+
+/**
+ * @brief Tell if the kernel does the record layer
+ *
+ * @return bit 0 for the send side, bit 1 for the receive side
+ */
+int tls_ktls(const tls_conn* conn);
+
+
+/**
+ * @brief Send close_notify and free a connection
+ *
+ * The socket is left open.
+ *
+ * @param  conn      connection
+ * @return nothing
+ */
+void tls_close(tls_conn* conn);
+
+
+/**
+ * @brief Read the totals over all connections
+ *
+ * @param  stats     receives the totals
+ * @return nothing
+ */
+void tls_get_stats(tls_stats* stats);
+
+#endif /* TLS_H_ */
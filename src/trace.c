@@ -0,0 +1,362 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  trace.c
+ *
+ *    Description:  请求追踪 (sampled TSC trace points in per-thread rings)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "trace.h"
+
+#define TRACE_MASK           (TRACE_RING_EVENTS - 1)
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* One trace point, id is written last so a reader can tell a torn slot */
+typedef struct trace_event
+{
+	uint64_t id;
+	uint64_t tsc;
+	uint32_t point;
+} trace_event;
+
+
+/* Ring of one thread, only that thread writes it */
+typedef struct trace_ring
+{
+	struct trace_ring* next;                   /* registry link             */
+	int         dead;                          /* thread exited, reusable   */
+	int         tid;
+	uint64_t    head;
+	trace_event events[TRACE_RING_EVENTS];
+} trace_ring;
+
+
+/* Event copied out for the dump */
+typedef struct trace_copy
+{
+	uint64_t id;
+	uint64_t tsc;
+	int      point;
+	int      tid;
+} trace_copy;
+
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;  /* registry */
+static pthread_once_t  trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   trace_key;
+static trace_ring*     trace_rings;
+
+static volatile unsigned int trace_rate;
+static uint64_t        trace_next_id = 1;
+static uint64_t        trace_base_tsc;
+static uint64_t        trace_base_ns;
+
+static __thread trace_ring*  trace_mine;
+static __thread uint64_t     trace_cur;
+static __thread unsigned int trace_count;
+
+/* Slice between a point and the one before it is named after the later one */
+static const char* const trace_slices[TRACE_POINTS] =
+{
+	"accept", "parse", "dispatch", "queue", "pull", "handler", "write"
+};
+
+
+
+
+/* ============================ RINGS =============================== */
+
+
+static void trace_thread_exit(void* arg)
+{
+	__atomic_store_n(&((trace_ring*)arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+
+static void trace_key_init(void)
+{
+	pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+
+/* Ring of the calling thread, a ring of an exited thread is reused */
+static trace_ring* trace_ring_get(void)
+{
+	trace_ring* ring;
+	int i;
+
+	pthread_once(&trace_once, trace_key_init);
+	pthread_mutex_lock(&trace_lock);
+
+	for(ring = trace_rings; ring && !__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE); ring = ring->next);
+
+	if(ring != NULL)
+	{
+		for(i = 0; i < TRACE_RING_EVENTS; i++)
+		{
+			__atomic_store_n(&ring->events[i].id, 0, __ATOMIC_RELAXED);
+		}
+	}
+	else if((ring = (trace_ring*)calloc(1, sizeof(trace_ring))) != NULL)
+	{
+		ring->next  = trace_rings;
+		trace_rings = ring;
+	}
+	else
+	{
+		pthread_mutex_unlock(&trace_lock);
+		Log(("trace_ring_get: Could not allocate memory for ring"));
+		return NULL;
+	}
+
+	ring->tid  = (int)syscall(SYS_gettid);
+	ring->dead = 0;
+	pthread_mutex_unlock(&trace_lock);
+
+	pthread_setspecific(trace_key, ring);
+	return ring;
+}
+
+
+void trace_record(uint64_t id, int point, uint64_t tsc)
+{
+	trace_ring*  ring = trace_mine;
+	trace_event* ev;
+
+	if(ring == NULL && (ring = trace_mine = trace_ring_get()) == NULL)
+	{
+		return;
+	}
+
+	ev = &ring->events[ring->head++ & TRACE_MASK];
+
+	/* Clear id first, a dump reading this slot meanwhile skips it */
+	__atomic_store_n(&ev->id, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&ev->tsc, tsc, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->point, (uint32_t)point, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->id, id, __ATOMIC_RELEASE);
+}
+
+
+
+
+/* ============================= API ================================ */
+
+
+void trace_enable(unsigned int rate)
+{
+	pthread_mutex_lock(&trace_lock);
+
+	if(trace_base_tsc == 0)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		trace_base_tsc = trace_tsc();
+		trace_base_ns  = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+	}
+
+	trace_rate = rate;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+
+uint64_t trace_begin(void)
+{
+	unsigned int rate = trace_rate;
+	uint64_t id;
+
+	/* Counted per thread, so sampling costs no shared cache line */
+	if(rate == 0 || ++trace_count < rate)
+	{
+		return 0;
+	}
+
+	trace_count = 0;
+	id = __atomic_fetch_add(&trace_next_id, 1, __ATOMIC_RELAXED);
+	trace_record(id, TRACE_ACCEPT, trace_tsc());
+	return id;
+}
+
+
+uint64_t trace_current(void)
+{
+	return trace_cur;
+}
+
+
+uint64_t trace_set_current(uint64_t id)
+{
+	uint64_t prev = trace_cur;
+	trace_cur = id;
+	return prev;
+}
+
+
+
+
+/* ============================= DUMP =============================== */
+
+
+static int trace_copy_cmp(const void* a, const void* b)
+{
+	const trace_copy* x = (const trace_copy*)a;
+	const trace_copy* y = (const trace_copy*)b;
+
+	if(x->id != y->id)
+	{
+		return x->id < y->id ? -1 : 1;
+	}
+
+	return x->tsc < y->tsc ? -1 : x->tsc > y->tsc;
+}
+
+
+/* Ticks per microsecond, measured over the time since trace_enable */
+static double trace_ticks_per_us(void)
+{
+	struct timespec ts;
+	uint64_t tsc, ns;
+
+	for(;;)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		tsc = trace_tsc();
+		ns  = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+
+		if(ns - trace_base_ns >= 10000000)
+		{
+			return (double)(tsc - trace_base_tsc) * 1000.0 / (double)(ns - trace_base_ns);
+		}
+
+		usleep(10000);
+	}
+}
+
+
+static void trace_write_event(FILE* f, const char* name, char ph, const trace_copy* ev,
+                              double ts, int* first)
+{
+	fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%c\",\"id\":\"0x%llx\","
+	           "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+	        *first ? "" : ",", name, ph, (unsigned long long)ev->id, ts, (int)getpid(), ev->tid);
+	*first = 0;
+}
+
+
+int trace_dump(const char* path)
+{
+	trace_copy* all;
+	trace_ring* ring;
+	trace_event* ev;
+	size_t count = 0, rings = 0, i, j, k;
+	double per_us;
+	uint64_t id;
+	FILE* f;
+	int first = 1;
+
+	if(trace_base_tsc == 0)
+	{
+		return -1;
+	}
+
+	per_us = trace_ticks_per_us();
+
+	pthread_mutex_lock(&trace_lock);
+
+	for(ring = trace_rings; ring; ring = ring->next)
+	{
+		rings++;
+	}
+
+	if((all = (trace_copy*)malloc((rings ? rings : 1) * TRACE_RING_EVENTS * sizeof(trace_copy))) == NULL)
+	{
+		pthread_mutex_unlock(&trace_lock);
+		Log(("trace_dump: Could not allocate memory for events"));
+		return -1;
+	}
+
+	/* Seqlock style: keep a slot only if its id did not change while read */
+	for(ring = trace_rings; ring; ring = ring->next)
+	{
+		for(i = 0; i < TRACE_RING_EVENTS; i++)
+		{
+			ev = &ring->events[i];
+
+			if((id = __atomic_load_n(&ev->id, __ATOMIC_ACQUIRE)) == 0)
+			{
+				continue;
+			}
+
+			all[count].id    = id;
+			all[count].tsc   = __atomic_load_n(&ev->tsc, __ATOMIC_RELAXED);
+			all[count].point = (int)__atomic_load_n(&ev->point, __ATOMIC_RELAXED);
+			all[count].tid   = ring->tid;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			if(__atomic_load_n(&ev->id, __ATOMIC_RELAXED) == id && all[count].point < TRACE_POINTS)
+			{
+				count++;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	if((f = fopen(path, "w")) == NULL)
+	{
+		Log(("trace_dump: Could not open %s", path));
+		free(all);
+		return -1;
+	}
+
+	qsort(all, count, sizeof(trace_copy), trace_copy_cmp);
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	/* One async track per request: an outer slice and one per step */
+	for(i = 0; i < count; i = k)
+	{
+		for(k = i + 1; k < count && all[k].id == all[i].id; k++);
+
+		trace_write_event(f, "request", 'b', &all[i],
+		                  (double)(int64_t)(all[i].tsc - trace_base_tsc) / per_us, &first);
+
+		for(j = i + 1; j < k; j++)
+		{
+			trace_write_event(f, trace_slices[all[j].point], 'b', &all[j - 1],
+			                  (double)(int64_t)(all[j - 1].tsc - trace_base_tsc) / per_us, &first);
+			trace_write_event(f, trace_slices[all[j].point], 'e', &all[j],
+			                  (double)(int64_t)(all[j].tsc - trace_base_tsc) / per_us, &first);
+		}
+
+		trace_write_event(f, "request", 'e', &all[k - 1],
+		                  (double)(int64_t)(all[k - 1].tsc - trace_base_tsc) / per_us, &first);
+	}
+
+	fprintf(f, "\n]}\n");
+	free(all);
+
+	return fclose(f) == 0 ? 0 : -1;
+}
@@ -0,0 +1,141 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  trace.h
+ *
+ *    Description:  请求追踪 (sampled TSC trace points in per-thread rings)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+/* Events kept per thread, older ones are overwritten */
+#define TRACE_RING_EVENTS    8192
+
+
+/* Trace points of a request, in the order they usually happen */
+enum trace_point_id
+{
+	TRACE_ACCEPT,                              /* connection or stream open */
+	TRACE_PARSE_DONE,                          /* request read and parsed   */
+	TRACE_ENQUEUE,                             /* thpool_add_work           */
+	TRACE_WAKE,                                /* worker left bsem_wait     */
+	TRACE_DEQUEUE,                             /* worker took the job       */
+	TRACE_HANDLER_DONE,                        /* handler returned          */
+	TRACE_LAST_BYTE,                           /* response fully written    */
+	TRACE_POINTS
+};
+
+
+/* Timestamp: the TSC where there is one (assumed invariant and synchronised
+ * across cores, as on any x86 of the last decade), nanoseconds otherwise
+ */
+static inline uint64_t trace_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+void trace_record(uint64_t id, int point, uint64_t tsc);
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Set the sampling rate
+ *
+ * One request in rate is traced, 0 turns tracing off. Requests that are
+ * not sampled get id 0, and every trace point with id 0 is one compare,
+ * so tracing can stay on in production with a rate of 100 or more.
+ *
+ * @param  rate      1 traces every request, 0 none
+ * @return nothing
+ */
+void trace_enable(unsigned int rate);
+
+
+/**
+ * @brief Start tracing a request, if it is sampled
+ *
+ * Records TRACE_ACCEPT.
+ *
+ * @return trace id, 0 when the request is not traced
+ */
+uint64_t trace_begin(void);
+
+
+/**
+ * @brief Record a trace point of a request
+ *
+ * @param  id        from trace_begin, 0 does nothing
+ * @param  point     TRACE_*
+ * @return nothing
+ */
+static inline void trace_point(uint64_t id, int point)
+{
+	if(id != 0)
+	{
+		trace_record(id, point, trace_tsc());
+	}
+}
+
+
+/**
+ * @brief Request the calling thread works for
+ *
+ * Jobs queued with thpool_add_work take the current id of the queuing
+ * thread, and a worker makes it current while it runs the job. So the
+ * enqueue and dequeue points of a request need no help from the caller.
+ *
+ * @return trace id, 0 if none
+ */
+uint64_t trace_current(void);
+
+
+/**
+ * @brief Set the request the calling thread works for
+ *
+ * @param  id        trace id, 0 for none
+ * @return the previous id
+ */
+uint64_t trace_set_current(uint64_t id);
+
+
+/**
+ * @brief Write the rings as Chrome trace JSON
+ *
+ * Each traced request becomes one async track, with a slice between any
+ * two of its points named after what happens in between: parse, dispatch,
+ * queue, pull, handler, write. Opens in chrome://tracing and in Perfetto.
+ * The rings are not cleared and tracing goes on meanwhile.
+ *
+ * @param  path      output file
+ * @return 0 on success, -1 otherwise.
+ */
+int trace_dump(const char* path);
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,1287 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  upstream.c
+ *
+ *    Description:  反向代理 (pooled keep-alive backends, least outstanding, splice)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "bodyparser.h"
+#include "strutils.h"
+#include "timerwheel.h"
+#include "upstream.h"
+
+#define UP_PIPE_CHUNK        65536
+#define UP_TICK_MS           10                /* connect timeout resolution */
+
+/* Result of an exchange */
+#define UP_OK                0
+#define UP_RETRY             1                 /* pooled connection was dead */
+#define UP_FAIL              2
+
+
+/* ========================== STRUCTURES ============================ */
+
+
+/* Backend, under upstream lock */
+typedef struct up_backend
+{
+	char            text[108];
+	struct sockaddr_storage addr;
+	socklen_t       addr_len;
+
+	int             idle[UPSTREAM_IDLE_MAX];   /* pooled connections, LIFO  */
+	int             idle_count;
+	int             outstanding;
+	int             fails;                     /* failures in a row         */
+	uint64_t        down_until;                /* ms, 0 when up             */
+
+	uint64_t        requests;
+	uint64_t        failures;
+	uint64_t        connects;
+	uint64_t        reused;
+	uint64_t        spliced;
+} up_backend;
+
+
+struct upstream
+{
+	threadpool      pool;
+	pthread_mutex_t lock;
+	up_backend      backends[UPSTREAM_BACKENDS_MAX];
+	int             count;
+	unsigned int    next;                      /* rotates ties              */
+
+	/* Connects in progress wait here, not on a worker */
+	pthread_t       connector;
+	int             epfd;
+	int             wakefd;                    /* eventfd for the inbox     */
+	struct up_req*  inbox;                     /* under lock                */
+	int             stopping;                  /* under lock                */
+	timerwheel      wheel;                     /* connector thread only     */
+};
+
+
+/* One proxied request, owned by its job */
+typedef struct up_req
+{
+	upstream*        up;
+	up_backend*      be;
+	int              client_fd;
+	int              fd;                       /* backend connection        */
+	int              connecting;
+	int              reused;                   /* fd came from the pool     */
+	int              retried;
+	int              is_head;                  /* response has no body      */
+	uint64_t         connect_start;
+	uint64_t         body_left;
+	uint64_t         spliced;
+	char*            head;
+	size_t           head_len;
+	int              status;                   /* for done                  */
+	int              keep_alive;
+	int              backend_keep;
+	int              backend_failed;           /* counts against health     */
+	upstream_done_fn done;
+	void*            arg;
+	int              connect_err;              /* errno of a parked connect */
+	tw_timer         timer;                    /* connect timeout           */
+	struct up_req*   next;                     /* inbox link                */
+} up_req;
+
+
+static pthread_once_t   up_once = PTHREAD_ONCE_INIT;
+static pthread_key_t    up_pipe_key;
+static __thread int     up_pipe[2] = { -1, -1 };
+
+
+static void* up_job(void* arg, int index);
+static void  up_connect_park(up_req* req);
+static void* up_connector(void* arg);
+static void  up_connect_expire(tw_timer* timer, void* arg);
+static void  up_connect_resume(up_req* req);
+
+
+
+
+/* ============================ HELPERS ============================= */
+
+
+static uint64_t up_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+
+/* Wait until fd is ready, -1 with errno ETIMEDOUT after UPSTREAM_IO_MS */
+static int up_wait(int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	int n;
+
+	while((n = poll(&pfd, 1, UPSTREAM_IO_MS)) < 0 && errno == EINTR);
+
+	if(n == 0)
+	{
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return n < 0 ? -1 : 0;
+}
+
+
+static int up_send_all(int fd, const char* buf, size_t len)
+{
+	ssize_t n;
+
+	while(len > 0)
+	{
+		if((n = send(fd, buf, len, MSG_NOSIGNAL)) > 0)
+		{
+			buf += n;
+			len -= (size_t)n;
+		}
+		else if(n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if(n < 0 && errno == EAGAIN)
+		{
+			if(up_wait(fd, POLLOUT) != 0)
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Receive what is there, waiting for at least one byte */
+static ssize_t up_recv(int fd, char* buf, size_t len)
+{
+	ssize_t n;
+
+	for(;;)
+	{
+		if((n = recv(fd, buf, len, 0)) >= 0)
+		{
+			return n;
+		}
+
+		if(errno == EINTR)
+		{
+			continue;
+		}
+
+		if(errno != EAGAIN || up_wait(fd, POLLIN) != 0)
+		{
+			return -1;
+		}
+	}
+}
+
+
+static void up_pipe_close(void* arg)
+{
+	(void)arg;
+
+	if(up_pipe[0] >= 0)
+	{
+		close(up_pipe[0]);
+		close(up_pipe[1]);
+		up_pipe[0] = up_pipe[1] = -1;
+	}
+}
+
+
+static void up_key_init(void)
+{
+	pthread_key_create(&up_pipe_key, up_pipe_close);
+}
+
+
+/* Pipe of the calling thread, for splice */
+static int up_pipe_get(void)
+{
+	if(up_pipe[0] >= 0)
+	{
+		return 0;
+	}
+
+	pthread_once(&up_once, up_key_init);
+
+	if(pipe2(up_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		up_pipe[0] = up_pipe[1] = -1;
+		return -1;
+	}
+
+	/* Any non-NULL value, so the destructor runs */
+	pthread_setspecific(up_pipe_key, up_pipe);
+	return 0;
+}
+
+
+/* Copy through a buffer, when splice is not possible */
+static int up_copy(int from, int to, uint64_t len, int to_eof)
+{
+	char buf[16384];
+	ssize_t n;
+
+	while(to_eof || len > 0)
+	{
+		n = up_recv(from, buf, !to_eof && len < sizeof(buf) ? (size_t)len : sizeof(buf));
+
+		if(n <= 0)
+		{
+			return to_eof && n == 0 ? 0 : -1;
+		}
+
+		if(up_send_all(to, buf, (size_t)n) != 0)
+		{
+			return -2;
+		}
+
+		len -= to_eof ? 0 : (uint64_t)n;
+	}
+
+	return 0;
+}
+
+
+/* Move len bytes, or all until EOF, from one socket to another
+ *
+ * Through the thread's pipe with splice(2), so the bytes stay in the
+ * kernel. A pipe left with bytes in it after an error is closed.
+ *
+ * @return 0 on success, -1 if reading failed, -2 if writing failed
+ */
+static int up_splice(int from, int to, uint64_t len, int to_eof, uint64_t* spliced)
+{
+	ssize_t n, k;
+	size_t want;
+	int moved = 0;
+
+	if(up_pipe_get() != 0)
+	{
+		return up_copy(from, to, len, to_eof);
+	}
+
+	while(to_eof || len > 0)
+	{
+		want = !to_eof && len < UP_PIPE_CHUNK ? (size_t)len : UP_PIPE_CHUNK;
+		n = splice(from, NULL, up_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if(n == 0)
+		{
+			return to_eof ? 0 : -1;
+		}
+
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			if(errno == EAGAIN)
+			{
+				if(up_wait(from, POLLIN) != 0)
+				{
+					return -1;
+				}
+
+				continue;
+			}
+
+			/* Not a socket splice can read, the pipe is still empty */
+			if(errno == EINVAL && !moved)
+			{
+				return up_copy(from, to, len, to_eof);
+			}
+
+			return -1;
+		}
+
+		for(k = 0; k < n; )
+		{
+			ssize_t w = splice(up_pipe[0], NULL, to, NULL, (size_t)(n - k),
+			                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+			                   (to_eof || len > (uint64_t)n ? SPLICE_F_MORE : 0));
+
+			if(w > 0)
+			{
+				k += w;
+			}
+			else if(w < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			else if(w < 0 && errno == EAGAIN && up_wait(to, POLLOUT) == 0)
+			{
+				continue;
+			}
+			else
+			{
+				up_pipe_close(NULL);
+				return -2;
+			}
+		}
+
+		*spliced += (uint64_t)n;
+		len -= to_eof ? 0 : (uint64_t)n;
+		moved = 1;
+	}
+
+	return 0;
+}
+
+
+static int up_parse_addr(up_backend* be, const char* text)
+{
+	struct sockaddr_un* sun = (struct sockaddr_un*)&be->addr;
+	struct sockaddr_in* sin = (struct sockaddr_in*)&be->addr;
+	const char* colon;
+	char host[64];
+
+	memset(&be->addr, 0, sizeof(be->addr));
+
+	if(strncmp(text, "unix:", 5) == 0)
+	{
+		if(strlen(text + 5) >= sizeof(sun->sun_path) || text[5] == 0)
+		{
+			return -1;
+		}
+
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, text + 5);
+		be->addr_len = sizeof(*sun);
+		return 0;
+	}
+
+	if((colon = strrchr(text, ':')) == NULL || (size_t)(colon - text) >= sizeof(host))
+	{
+		return -1;
+	}
+
+	memcpy(host, text, (size_t)(colon - text));
+	host[colon - text] = 0;
+
+	sin->sin_family = AF_INET;
+	sin->sin_port   = htons((uint16_t)atoi(colon + 1));
+
+	if(inet_pton(AF_INET, host, &sin->sin_addr) != 1 || sin->sin_port == 0)
+	{
+		return -1;
+	}
+
+	be->addr_len = sizeof(*sin);
+	return 0;
+}
+
+
+
+
+/* ============================ BACKENDS ============================ */
+
+
+/* Healthy backend with the fewest requests in flight, NULL if all are down */
+static up_backend* up_pick(upstream* up)
+{
+	up_backend* best = NULL;
+	up_backend* be;
+	uint64_t now = up_now_ms();
+	int i;
+
+	pthread_mutex_lock(&up->lock);
+
+	for(i = 0; i < up->count; i++)
+	{
+		be = &up->backends[(up->next + (unsigned int)i) % (unsigned int)up->count];
+
+		if(be->down_until > now)
+		{
+			continue;
+		}
+
+		if(best == NULL || be->outstanding < best->outstanding)
+		{
+			best = be;
+		}
+	}
+
+	if(best != NULL)
+	{
+		/* A backend back from down gets one request until it answers */
+		if(best->down_until != 0)
+		{
+			best->down_until = now + UPSTREAM_DOWN_MS;
+		}
+
+		best->outstanding++;
+		best->requests++;
+		up->next++;
+	}
+
+	pthread_mutex_unlock(&up->lock);
+	return best;
+}
+
+
+/* Pooled connection, -1 if none */
+static int up_take_idle(upstream* up, up_backend* be)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&up->lock);
+
+	if(be->idle_count > 0)
+	{
+		fd = be->idle[--be->idle_count];
+		be->reused++;
+	}
+
+	pthread_mutex_unlock(&up->lock);
+	return fd;
+}
+
+
+/* End of a request on a backend: pool or close the connection, update health */
+static void up_release(up_req* req)
+{
+	upstream*   up = req->up;
+	up_backend* be = req->be;
+	int fd = req->fd;
+
+	pthread_mutex_lock(&up->lock);
+
+	be->outstanding--;
+	be->spliced += req->spliced;
+
+	if(req->backend_failed)
+	{
+		be->failures++;
+
+		if(++be->fails >= UPSTREAM_MAX_FAILS)
+		{
+			be->down_until = up_now_ms() + UPSTREAM_DOWN_MS;
+		}
+	}
+	else if(req->status > 0)
+	{
+		be->fails = 0;
+		be->down_until = 0;
+	}
+
+	if(fd >= 0 && req->backend_keep && !req->connecting && be->idle_count < UPSTREAM_IDLE_MAX)
+	{
+		be->idle[be->idle_count++] = fd;
+		fd = -1;
+	}
+
+	pthread_mutex_unlock(&up->lock);
+
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+
+	req->fd = -1;
+}
+
+
+/* Start a connection: 0 connected, 1 in progress, -1 failed */
+static int up_connect(up_req* req)
+{
+	up_backend* be = req->be;
+	int one = 1;
+
+	if(!req->retried && (req->fd = up_take_idle(req->up, be)) >= 0)
+	{
+		req->reused = 1;
+		return 0;
+	}
+
+	req->reused = 0;
+
+	if((req->fd = socket(be->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+	{
+		Log(("up_connect: Could not create socket"));
+		return -1;
+	}
+
+	if(be->addr.ss_family == AF_INET)
+	{
+		setsockopt(req->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	pthread_mutex_lock(&req->up->lock);
+	be->connects++;
+	pthread_mutex_unlock(&req->up->lock);
+
+	if(connect(req->fd, (struct sockaddr*)&be->addr, be->addr_len) == 0)
+	{
+		return 0;
+	}
+
+	if(errno == EINPROGRESS || errno == EAGAIN)
+	{
+		req->connecting    = 1;
+		req->connect_start = up_now_ms();
+		return 1;
+	}
+
+	return -1;
+}
+
+
+
+
+
+/* ============================ EXCHANGE ============================ */
+
+
+/* Framing of a response head, buf NUL terminated */
+static int up_parse_head(char* buf, int* status, int64_t* length, int* chunked, int* close_conn)
+{
+	st_strutils_iter list;
+	char *line, *next, *value;
+	const char* tok;
+	size_t tlen;
+	int minor;
+
+	if(sscanf(buf, "HTTP/1.%d %d", &minor, status) != 2)
+	{
+		return -1;
+	}
+
+	*length     = -1;
+	*chunked    = 0;
+	*close_conn = minor == 0;
+
+	for(line = strstr(buf, "\r\n"); line != NULL && line[2] != 0; line = next)
+	{
+		line += 2;
+		next  = strstr(line, "\r\n");
+
+		if((value = memchr(line, ':', (size_t)(next ? next - line : (ssize_t)strlen(line)))) == NULL)
+		{
+			continue;
+		}
+
+		for(value++; *value == ' ' || *value == '\t'; value++);
+
+		if(strncasecmp(line, "Content-Length:", 15) == 0)
+		{
+			*length = strtoll(value, NULL, 10);
+		}
+		else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+		{
+			/* A list; chunked is the last coding when present */
+			strutils_split_init(&list, value, next ? (size_t)(next - value) : strlen(value), ',',
+			                    STRUTILS_SPLIT_TRIM);
+
+			while(strutils_split_next(&list, &tok, &tlen))
+			{
+				*chunked = tlen == 7 && strncasecmp(tok, "chunked", 7) == 0;
+			}
+		}
+		else if(strncasecmp(line, "Connection:", 11) == 0)
+		{
+			strutils_split_init(&list, value, next ? (size_t)(next - value) : strlen(value), ',',
+			                    STRUTILS_SPLIT_TRIM);
+
+			while(strutils_split_next(&list, &tok, &tlen))
+			{
+				if(tlen == 5 && strncasecmp(tok, "close", 5) == 0)
+				{
+					*close_conn = 1;
+					break;
+				}
+
+				if(tlen == 10 && strncasecmp(tok, "keep-alive", 10) == 0)
+				{
+					*close_conn = 0;
+				}
+			}
+		}
+
+		if(next == NULL)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Relay a chunked body through buf, the first have bytes are at data
+ *
+ * @return 0 on success, -1 if the backend failed, -2 if the client did
+ */
+static int up_relay_chunked(up_req* req, char* buf, const char* data, size_t have)
+{
+	st_chunked chunked;
+	ssize_t used;
+
+	chunked_init(&chunked);
+
+	for(;;)
+	{
+		if((used = chunked_feed(&chunked, data, have, NULL, NULL)) < 0)
+		{
+			return -1;
+		}
+
+		/* Bytes after the last chunk are not ours to forward */
+		if((size_t)used < have)
+		{
+			req->backend_keep = 0;
+		}
+
+		if(used > 0 && up_send_all(req->client_fd, data, (size_t)used) != 0)
+		{
+			return -2;
+		}
+
+		if(chunked_done(&chunked))
+		{
+			return 0;
+		}
+
+		if((used = up_recv(req->fd, buf, UPSTREAM_HEAD_MAX)) <= 0)
+		{
+			return -1;
+		}
+
+		data = buf;
+		have = (size_t)used;
+	}
+}
+
+
+/* Send the request and relay the response
+ *
+ * @return UP_OK, UP_RETRY or UP_FAIL with req->status set
+ */
+static int up_exchange(up_req* req)
+{
+	char     buf[UPSTREAM_HEAD_MAX + 1];
+	char*    end = NULL;
+	size_t   have = 0, head_len, extra;
+	int64_t  length;
+	int      chunked, close_conn, result, replayable = req->body_left == 0;
+	ssize_t  n;
+
+	req->backend_keep = 0;
+
+	if(up_send_all(req->fd, req->head, req->head_len) != 0)
+	{
+		goto backend_error;
+	}
+
+	if(req->body_left > 0)
+	{
+		result = up_splice(req->client_fd, req->fd, req->body_left, 0, &req->spliced);
+		req->body_left = 0;
+
+		if(result == -1)
+		{
+			req->status = -1;                  /* client went away          */
+			return UP_FAIL;
+		}
+
+		if(result == -2)
+		{
+			goto backend_error;
+		}
+	}
+
+	for(;;)
+	{
+		/* Response head, 1xx heads are passed on and skipped */
+		while(end == NULL)
+		{
+			if(have == UPSTREAM_HEAD_MAX)
+			{
+				req->backend_failed = 1;
+				req->status = 502;
+				return UP_FAIL;
+			}
+
+			if((n = up_recv(req->fd, buf + have, UPSTREAM_HEAD_MAX - have)) <= 0)
+			{
+				errno = n == 0 ? ECONNRESET : errno;
+				goto backend_error;
+			}
+
+			have += (size_t)n;
+			buf[have] = 0;
+			end = strstr(buf, "\r\n\r\n");
+		}
+
+		head_len = (size_t)(end + 4 - buf);
+		extra    = have - head_len;
+		*end     = 0;
+
+		if(up_parse_head(buf, &req->status, &length, &chunked, &close_conn) != 0)
+		{
+			req->backend_failed = 1;
+			req->status = 502;
+			return UP_FAIL;
+		}
+
+		*end = '\r';
+
+		/* No tunnels, an upgrade is not passed on */
+		if(req->status == 101)
+		{
+			req->backend_failed = 1;
+			req->status = 502;
+			return UP_FAIL;
+		}
+
+		if(req->status >= 100 && req->status < 200)
+		{
+			if(up_send_all(req->client_fd, buf, head_len) != 0)
+			{
+				req->status = -1;
+				return UP_FAIL;
+			}
+
+			memmove(buf, buf + head_len, extra + 1);
+			have = extra;
+			end  = strstr(buf, "\r\n\r\n");
+			continue;
+		}
+
+		break;
+	}
+
+	req->keep_alive   = !close_conn;
+	req->backend_keep = !close_conn;
+
+	/* Send the head and whatever of the body came with it */
+	if(req->is_head || req->status == 204 || req->status == 304)
+	{
+		req->backend_keep &= extra == 0;
+		have = head_len;
+	}
+	else if(chunked)
+	{
+		have = head_len;
+	}
+	else if(length >= 0)
+	{
+		req->backend_keep &= (uint64_t)length >= extra;
+		have = head_len + ((uint64_t)length < extra ? (size_t)length : extra);
+	}
+	else
+	{
+		/* Delimited by close, on both sides */
+		req->keep_alive   = 0;
+		req->backend_keep = 0;
+	}
+
+	if(up_send_all(req->client_fd, buf, have) != 0)
+	{
+		req->status = -1;
+		req->backend_keep = 0;
+		return UP_OK;
+	}
+
+	if(req->is_head || req->status == 204 || req->status == 304)
+	{
+		result = 0;
+	}
+	else if(chunked)
+	{
+		result = up_relay_chunked(req, buf, buf + head_len, extra);
+	}
+	else if(length >= 0)
+	{
+		result = (uint64_t)length <= extra ? 0 :
+		         up_splice(req->fd, req->client_fd, (uint64_t)length - extra, 0, &req->spliced);
+	}
+	else
+	{
+		result = up_splice(req->fd, req->client_fd, 0, 1, &req->spliced);
+	}
+
+	if(result != 0)
+	{
+		req->backend_failed = result == -1;
+		req->status         = -1;
+		req->keep_alive     = 0;
+		req->backend_keep   = 0;
+	}
+
+	return UP_OK;
+
+backend_error:
+	/* A pooled connection the backend closed meanwhile, try a new one */
+	if(req->reused && !req->retried && replayable && have == 0)
+	{
+		return UP_RETRY;
+	}
+
+	req->backend_failed = 1;
+	req->status = errno == ETIMEDOUT ? 504 : 502;
+	return UP_FAIL;
+}
+
+
+/* Answer in place of the backend, when nothing was sent yet */
+static void up_send_error(up_req* req)
+{
+	char response[160];
+	const char* reason = req->status == 503 ? "Service Unavailable" :
+	                     req->status == 504 ? "Gateway Timeout" : "Bad Gateway";
+	int n;
+
+	/* Body bytes left in the socket would be read as the next request */
+	req->keep_alive = req->body_left == 0;
+
+	n = snprintf(response, sizeof(response),
+	             "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n%s\r\n",
+	             req->status, reason, req->keep_alive ? "" : "Connection: close\r\n");
+
+	if(up_send_all(req->client_fd, response, (size_t)n) != 0)
+	{
+		req->status = -1;
+		req->keep_alive = 0;
+	}
+}
+
+
+static void up_finish(up_req* req)
+{
+	if(req->be != NULL)
+	{
+		up_release(req);
+	}
+
+	if(req->done != NULL)
+	{
+		req->done(req->client_fd, req->status, req->status > 0 && req->keep_alive, req->arg);
+	}
+
+	free(req->head);
+	free(req);
+}
+
+
+
+
+/* ============================== JOB =============================== */
+
+
+/* Job: connect, then run the exchange. A connect in progress is parked on
+ * the connector thread, which queues the job again once it is done */
+static void* up_job(void* arg, int index)
+{
+	up_req* req = (up_req*)arg;
+	int r;
+
+	(void)index;
+
+	for(;;)
+	{
+		if(req->be == NULL && (req->be = up_pick(req->up)) == NULL)
+		{
+			req->status = 503;
+			up_send_error(req);
+			up_finish(req);
+			return NULL;
+		}
+
+		if(req->connect_err != 0)
+		{
+			errno = req->connect_err;
+			req->connect_err = 0;
+			r = -1;
+		}
+		else
+		{
+			r = req->fd < 0 ? up_connect(req) : 0;
+		}
+
+		if(r == 1)
+		{
+			up_connect_park(req);
+			return NULL;
+		}
+
+		if(r != 0)
+		{
+			req->backend_failed = r < 0;
+			req->status = r < 0 && errno == ETIMEDOUT ? 504 : r < 0 ? 502 : 503;
+			up_send_error(req);
+			up_finish(req);
+			return NULL;
+		}
+
+		if((r = up_exchange(req)) != UP_RETRY)
+		{
+			break;
+		}
+
+		/* Same backend, new connection, no health penalty */
+		close(req->fd);
+		req->fd = -1;
+		req->retried = 1;
+	}
+
+	if(r == UP_FAIL && req->status > 0)
+	{
+		up_send_error(req);
+	}
+
+	up_finish(req);
+	return NULL;
+}
+
+
+
+
+/* =========================== CONNECTOR ============================ */
+
+
+/* Hand a connect in progress to the connector thread */
+static void up_connect_park(up_req* req)
+{
+	upstream* up = req->up;
+	uint64_t  one = 1;
+
+	pthread_mutex_lock(&up->lock);
+	req->next = up->inbox;
+	up->inbox = req;
+	pthread_mutex_unlock(&up->lock);
+
+	if(write(up->wakefd, &one, sizeof(one)) < 0) {}
+}
+
+
+/* Thread: wait for parked connects to finish or time out */
+static void* up_connector(void* arg)
+{
+	upstream* up = (upstream*)arg;
+	struct epoll_event ev[64];
+	struct epoll_event add;
+	socklen_t len;
+	uint64_t  v, now;
+	up_req*   req, *next;
+	int       n, i, err, stop = 0;
+
+	tw_init(&up->wheel, up_now_ms(), UP_TICK_MS);
+
+	while(!stop)
+	{
+		n = epoll_wait(up->epfd, ev, 64, tw_next_timeout(&up->wheel));
+
+		for(i = 0; i < n; i++)
+		{
+			/* data.ptr == NULL marks the inbox */
+			if(ev[i].data.ptr == NULL)
+			{
+				if(read(up->wakefd, &v, sizeof(v)) < 0) {}
+
+				pthread_mutex_lock(&up->lock);
+				req  = up->inbox;
+				up->inbox = NULL;
+				stop = up->stopping;
+				pthread_mutex_unlock(&up->lock);
+
+				for(now = up_now_ms(); req != NULL; req = next)
+				{
+					next = req->next;
+
+					add.events   = EPOLLOUT;
+					add.data.ptr = req;
+
+					if(epoll_ctl(up->epfd, EPOLL_CTL_ADD, req->fd, &add) != 0)
+					{
+						req->connect_err = errno;
+						up_connect_resume(req);
+						continue;
+					}
+
+					/* The timeout runs from the start of the connect */
+					tw_timer_init(&req->timer, req->fd, up_connect_expire, req);
+					tw_arm(&up->wheel, &req->timer, TW_WRITE,
+					       now - req->connect_start < UPSTREAM_CONNECT_MS ?
+					       UPSTREAM_CONNECT_MS - (now - req->connect_start) : 0);
+				}
+
+				continue;
+			}
+
+			req = (up_req*)ev[i].data.ptr;
+			tw_cancel(&req->timer);
+			epoll_ctl(up->epfd, EPOLL_CTL_DEL, req->fd, NULL);
+
+			err = 0;
+			len = sizeof(err);
+
+			if(getsockopt(req->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+			{
+				err = errno;
+			}
+
+			if(err == 0)
+			{
+				req->connecting = 0;
+			}
+
+			req->connect_err = err;
+			up_connect_resume(req);
+		}
+
+		tw_advance(&up->wheel, up_now_ms());
+	}
+
+	return NULL;
+}
+
+
+/* Connect timed out */
+static void up_connect_expire(tw_timer* timer, void* arg)
+{
+	up_req* req = (up_req*)arg;
+
+	epoll_ctl(req->up->epfd, EPOLL_CTL_DEL, timer->sockfd, NULL);
+	req->connect_err = ETIMEDOUT;
+	up_connect_resume(req);
+}
+
+
+/* Queue the job again; if the pool refuses, answer from here */
+static void up_connect_resume(up_req* req)
+{
+	if(thpool_add_work(req->up->pool, up_job, req, -1) != 0)
+	{
+		req->status = 503;
+		up_send_error(req);
+		up_finish(req);
+	}
+}
+
+
+
+
+/* ============================== API =============================== */
+
+
+upstream* upstream_create(threadpool pool)
+{
+	struct epoll_event ev;
+	upstream* up;
+
+	if(pool == NULL)
+	{
+		return NULL;
+	}
+
+	if((up = (upstream*)calloc(1, sizeof(upstream))) == NULL)
+	{
+		Log(("upstream_create: Could not allocate memory for upstream"));
+		return NULL;
+	}
+
+	up->pool   = pool;
+	up->epfd   = epoll_create1(EPOLL_CLOEXEC);
+	up->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_init(&up->lock, NULL);
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if(up->epfd < 0 || up->wakefd < 0 ||
+	   epoll_ctl(up->epfd, EPOLL_CTL_ADD, up->wakefd, &ev) != 0 ||
+	   pthread_create(&up->connector, NULL, up_connector, up) != 0)
+	{
+		Log(("upstream_create: Could not start the connector thread"));
+		if(up->epfd >= 0) close(up->epfd);
+		if(up->wakefd >= 0) close(up->wakefd);
+		pthread_mutex_destroy(&up->lock);
+		free(up);
+		return NULL;
+	}
+
+	return up;
+}
+
+
+int upstream_add_backend(upstream* up, const char* addr)
+{
+	up_backend* be;
+
+	if(up == NULL || addr == NULL || strlen(addr) >= sizeof(be->text))
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&up->lock);
+
+	if(up->count == UPSTREAM_BACKENDS_MAX)
+	{
+		pthread_mutex_unlock(&up->lock);
+		return -1;
+	}
+
+	be = &up->backends[up->count];
+	memset(be, 0, sizeof(*be));
+
+	if(up_parse_addr(be, addr) != 0)
+	{
+		pthread_mutex_unlock(&up->lock);
+		Log(("upstream_add_backend: Could not parse %s", addr));
+		return -1;
+	}
+
+	strcpy(be->text, addr);
+	up->count++;
+	pthread_mutex_unlock(&up->lock);
+	return 0;
+}
+
+
+void upstream_destroy(upstream* up)
+{
+	uint64_t one = 1;
+	int i, k;
+
+	if(up == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&up->lock);
+	up->stopping = 1;
+	pthread_mutex_unlock(&up->lock);
+
+	if(write(up->wakefd, &one, sizeof(one)) < 0) {}
+
+	pthread_join(up->connector, NULL);
+	close(up->epfd);
+	close(up->wakefd);
+
+	for(i = 0; i < up->count; i++)
+	{
+		for(k = 0; k < up->backends[i].idle_count; k++)
+		{
+			close(up->backends[i].idle[k]);
+		}
+	}
+
+	pthread_mutex_destroy(&up->lock);
+	free(up);
+}
+
+
+int upstream_forward(upstream* up, int client_fd, const char* head, size_t head_len,
+                     uint64_t body_left, upstream_done_fn done, void* arg)
+{
+	up_req* req;
+	int result;
+
+	if(up == NULL || head == NULL || head_len == 0 || client_fd < 0)
+	{
+		return -1;
+	}
+
+	if((req = (up_req*)calloc(1, sizeof(up_req))) == NULL ||
+	   (req->head = (char*)malloc(head_len)) == NULL)
+	{
+		Log(("upstream_forward: Could not allocate memory for request"));
+		free(req);
+		return -1;
+	}
+
+	memcpy(req->head, head, head_len);
+	req->up        = up;
+	req->fd        = -1;
+	req->client_fd = client_fd;
+	req->head_len  = head_len;
+	req->body_left = body_left;
+	req->is_head   = head_len > 5 && memcmp(head, "HEAD ", 5) == 0;
+	req->done      = done;
+	req->arg       = arg;
+
+	/* No socket: the shed handler of the pool could not free req. Not
+	 * keyed: the caller serving client_fd may hold the home worker */
+	if((result = thpool_add_work(up->pool, up_job, req, -1)) != 0)
+	{
+		free(req->head);
+		free(req);
+	}
+
+	return result;
+}
+
+
+int upstream_get_stats(upstream* up, upstream_stats* stats, int max)
+{
+	uint64_t now = up_now_ms();
+	up_backend* be;
+	int i;
+
+	pthread_mutex_lock(&up->lock);
+
+	for(i = 0; i < up->count && i < max; i++)
+	{
+		be = &up->backends[i];
+		memcpy(stats[i].addr, be->text, sizeof(stats[i].addr));
+		stats[i].up          = be->down_until <= now;
+		stats[i].outstanding = be->outstanding;
+		stats[i].idle        = be->idle_count;
+		stats[i].requests    = be->requests;
+		stats[i].failures    = be->failures;
+		stats[i].connects    = be->connects;
+		stats[i].reused      = be->reused;
+		stats[i].spliced     = be->spliced;
+	}
+
+	i = up->count;
+	pthread_mutex_unlock(&up->lock);
+	return i;
+}
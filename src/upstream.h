@@ -0,0 +1,159 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  upstream.h
+ *
+ *    Description:  反向代理 (pooled keep-alive backends, least outstanding, splice)
+ *
+ *        Version:  1.0
+ *        Created:  2026年10月19日
+ *       Compiler:  gcc
+ *
+ *         Author:
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+
+#ifndef UPSTREAM_H_
+#define UPSTREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+
+/* Most backends of one upstream */
+#define UPSTREAM_BACKENDS_MAX      32
+
+/* Idle keep-alive connections kept per backend */
+#define UPSTREAM_IDLE_MAX          64
+
+/* Connect and I/O limits */
+#define UPSTREAM_CONNECT_MS        1000
+#define UPSTREAM_IO_MS             30000
+
+/* Passive health checks: this many failures in a row take a backend out
+ * for UPSTREAM_DOWN_MS, then one request tries it again */
+#define UPSTREAM_MAX_FAILS         3
+#define UPSTREAM_DOWN_MS           5000
+
+/* Longest response head read from a backend */
+#define UPSTREAM_HEAD_MAX          16384
+
+
+typedef struct upstream upstream;
+
+
+/* Called on a pool thread when the exchange is over
+ *
+ * status is the backend status, or the 502/503/504 sent in its place,
+ * or -1 if the response broke off and the client must be closed.
+ * keep_alive tells if the client connection may take another request.
+ */
+typedef void (*upstream_done_fn)(int client_fd, int status, int keep_alive, void* arg);
+
+
+/* Counters of one backend */
+typedef struct upstream_stats
+{
+	char     addr[108];
+	int      up;                               /* 0 while taken out         */
+	int      outstanding;                      /* requests in flight        */
+	int      idle;                             /* pooled connections        */
+	uint64_t requests;
+	uint64_t failures;
+	uint64_t connects;                         /* new connections           */
+	uint64_t reused;                           /* requests on pooled ones   */
+	uint64_t spliced;                          /* bytes moved by splice     */
+} upstream_stats;
+
+
+/* =================================== API ======================================= */
+
+
+/**
+ * @brief Create an upstream running its requests on a threadpool
+ *
+ * Starts the thread that waits for connects in progress.
+ *
+ * @param  pool      threadpool of the request jobs
+ * @return upstream on success, NULL on error
+ */
+upstream* upstream_create(threadpool pool);
+
+
+/**
+ * @brief Add a backend
+ *
+ * @param  up        upstream
+ * @param  addr      "unix:/run/app.sock" or "127.0.0.1:8081"
+ * @return 0 on success, -1 on a bad address or too many backends
+ */
+int upstream_add_backend(upstream* up, const char* addr);
+
+
+/**
+ * @brief Close the pooled connections and free an upstream
+ *
+ * No request may be in flight.
+ *
+ * @param  up        upstream
+ * @return nothing
+ */
+void upstream_destroy(upstream* up);
+
+
+/**
+ * @brief Forward a request to the backend with the fewest outstanding requests
+ *
+ * Runs as a job on the pool. A pooled connection is used when there is
+ * one. A new one that is still connecting does not hold a worker: the
+ * upstream's connector thread waits for it, up to UPSTREAM_CONNECT_MS,
+ * then queues the job again. A pooled connection that turns out closed
+ * is replaced once, if nothing of the body was consumed yet.
+ *
+ * head is sent as is, so it should be an HTTP/1.1 request without
+ * hop-by-hop fields other than Connection. body_left bytes of the body
+ * are still in client_fd: they go to the backend with splice(2), as
+ * does a Content-Length or close-delimited response body on the way
+ * back. A chunked response is relayed through a buffer, to find its end.
+ *
+ * If the backend can not be reached or fails before anything was sent
+ * to the client, a 502 (504 on timeouts, 503 with every backend down) is
+ * sent in its place.
+ *
+ * @example
+ *
+ *    void on_done(int fd, int status, int keep_alive, void* arg){
+ *        if(!keep_alive) close(fd);
+ *        else            wait_for_next_request(fd);
+ *    }
+ *
+ *    upstream_forward(up, fd, head, head_len, content_length - body_read, on_done, NULL);
+ *
+ * @param  up        upstream
+ * @param  client_fd client socket
+ * @param  head      request head, and any body bytes already read, copied
+ * @param  head_len  length of head
+ * @param  body_left body bytes still to be read from client_fd
+ * @param  done      called at the end
+ * @param  arg       argument of done
+ * @return 0 on success, THPOOL_SHED or -1 if the job could not be queued
+ */
+int upstream_forward(upstream* up, int client_fd, const char* head, size_t head_len,
+                     uint64_t body_left, upstream_done_fn done, void* arg);
+
+
+/**
+ * @brief Read the counters of the backends
+ *
+ * @param  up        upstream
+ * @param  stats     receives up to max entries
+ * @param  max       size of stats
+ * @return number of backends
+ */
+int upstream_get_stats(upstream* up, upstream_stats* stats, int max);
+
+#endif /* UPSTREAM_H_ */
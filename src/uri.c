@@ -26,15 +26,19 @@ uri_decode (const char *src) {
 
   // alloc
   dec = (char *) malloc(len + 1);
+  if (!dec)
+      return NULL;
 
 #define push(c) (dec[size++] = c)
 
-  // decode
-  while (len--) {
+  // decode, an escape takes three of the len bytes
+  while ((size_t) i < len) {
     ch = src[i++];
 
-    // if prefix `%' then read byte and decode
-    if ('%' == ch) {
+    // if prefix `%' and two hex digits then read byte and decode,
+    // a cut or bad escape is kept as is
+    if ('%' == ch && (size_t) i + 2 <= len &&
+        isxdigit((unsigned char) src[i]) && isxdigit((unsigned char) src[i + 1])) {
       tmp[0] = src[i++];
       tmp[1] = src[i++];
       tmp[2] = '\0';
@@ -0,0 +1,153 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  test_bundle.c
+ *
+ *    Description:  bundle_find on escaped paths, uri_decode bounds
+ *
+ *          Build:  gcc -g -fsanitize=address,undefined -Isrc test/test_bundle.c \
+ *                      src/bundle.c src/compress.c src/rcu.c src/strutils.c src/uri.c \
+ *                      -o bin/test_bundle -lz -lpthread -lm
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "uri.h"
+
+
+static int failures;
+
+#define CHECK(cond) \
+	do { if(!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while(0)
+
+
+/* In-memory bundle of one identity asset: header, seed, entry, path, head, etag, body */
+typedef struct one_bundle
+{
+	bundle_header header;
+	uint32_t      seeds[2];
+	bundle_entry  entry;
+	char          path[BUNDLE_PATH_MAX];
+	char          head[32];
+	char          etag[8];
+	char          body[8];
+} one_bundle;
+
+
+static void make_bundle(one_bundle* img, bundle* b, const char* path, size_t path_len)
+{
+	bundle_variant* v = &img->entry.variant[COMPRESS_IDENTITY];
+
+	memset(img, 0, sizeof(*img));
+	memcpy(img->header.magic, BUNDLE_MAGIC, sizeof(img->header.magic));
+	img->header.version = BUNDLE_VERSION;
+	img->header.count   = 1;
+	img->header.buckets = 1;
+	img->header.seeds   = offsetof(one_bundle, seeds);
+	img->header.entries = offsetof(one_bundle, entry);
+	img->header.size    = sizeof(*img);
+
+	memcpy(img->path, path, path_len);
+	strcpy(img->head, "Content-Length: 2\r\n");
+	strcpy(img->etag, "\"e1\"");
+	strcpy(img->body, "ok");
+
+	img->entry.hash      = bundle_hash(path, path_len);
+	img->entry.path      = offsetof(one_bundle, path);
+	img->entry.path_len  = (uint32_t)path_len;
+	img->entry.available = 1u << COMPRESS_IDENTITY;
+	v->head     = offsetof(one_bundle, head);
+	v->head_len = (uint32_t)strlen(img->head);
+	v->etag     = offsetof(one_bundle, etag);
+	v->etag_len = (uint32_t)strlen(img->etag);
+	v->body     = offsetof(one_bundle, body);
+	v->body_len = 2;
+
+	memset(b, 0, sizeof(*b));
+	b->base    = (const char*)img;
+	b->size    = sizeof(*img);
+	b->header  = &img->header;
+	b->seeds   = img->seeds;
+	b->entries = &img->entry;
+}
+
+
+/* Escapes use three bytes; the decoder must not read past the NUL */
+static void test_uri_decode(void)
+{
+	char* src = malloc(8);
+	char* dec;
+
+	memcpy(src, "/%41%42", 8);
+	dec = uri_decode(src);
+	CHECK(dec != NULL && strcmp(dec, "/AB") == 0);
+	free(dec);
+
+	/* Cut and bad escapes are kept */
+	memcpy(src, "/a%4", 5);
+	dec = uri_decode(src);
+	CHECK(dec != NULL && strcmp(dec, "/a%4") == 0);
+	free(dec);
+
+	memcpy(src, "/%zz%", 6);
+	dec = uri_decode(src);
+	CHECK(dec != NULL && strcmp(dec, "/%zz%") == 0);
+	free(dec);
+
+	free(src);
+}
+
+
+/* Longest request path, every byte after the slash escaped */
+static void test_find_max_escaped(void)
+{
+	static one_bundle img;
+	char  request[BUNDLE_PATH_MAX + 32];
+	char  decoded[BUNDLE_PATH_MAX];
+	size_t n = 0, d = 0;
+	bundle b;
+	bundle_file f;
+
+	request[n++] = decoded[d++] = '/';
+
+	while(n + 3 <= BUNDLE_PATH_MAX)
+	{
+		memcpy(request + n, "%41", 3);
+		n += 3;
+		decoded[d++] = 'A';
+	}
+
+	request[n] = 0;
+	make_bundle(&img, &b, decoded, d);
+
+	CHECK(bundle_find(&b, request, NULL, &f) == 0);
+	CHECK(f.path_len == d && f.body_len == 2);
+
+	/* Query string ignored, a stray '%' after it never reached */
+	memcpy(request + n, "?q=%", 5);
+	CHECK(bundle_find(&b, request, NULL, &f) == 0);
+
+	/* One byte too long */
+	memset(request, 'A', BUNDLE_PATH_MAX + 1);
+	request[0] = '/';
+	request[BUNDLE_PATH_MAX + 1] = 0;
+	CHECK(bundle_find(&b, request, NULL, &f) == -1);
+
+	/* Cut escape at the end */
+	CHECK(bundle_find(&b, "/%4", NULL, &f) == -1);
+}
+
+
+int main(void)
+{
+	test_uri_decode();
+	test_find_max_escaped();
+
+	printf("test_bundle: %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  test_strkvm.c
+ *
+ *    Description:  strkvm_image / strkvm_load round trip and malformed images
+ *
+ *          Build:  gcc -g -fsanitize=address,undefined -Isrc test/test_strkvm.c \
+ *                      src/strkvm.c src/strutils.c src/atom.c -o bin/test_strkvm -lm
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strkvm.h"
+#include "atom.h"
+
+
+static int failures;
+
+#define CHECK(cond) \
+	do { if(!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while(0)
+
+
+/* Nodes of an image, right after its head */
+static st_strkv* image_vars(void* data)
+{
+	return (st_strkv*)((st_strkvm_head*)data + 1);
+}
+
+
+/* Copy of the image of three variables, one removed so the blob has dead bytes */
+static void* make_image(size_t* size)
+{
+	st_strkvm kv;
+	const void* data;
+	void* copy;
+
+	strkvm_init(&kv);
+	strkvm_add_string(&kv, "host", "example.org");
+	strkvm_add_string(&kv, "gone", "soon");
+	strkvm_add_string(&kv, "port", "8080");
+	strkvm_add_string(&kv, "path", "/index.html");
+	strkvm_remove(&kv, "gone");
+
+	strkvm_image(&kv, &data, size);
+	copy = malloc(*size);
+	memcpy(copy, data, *size);
+	strkvm_free(&kv);
+	return copy;
+}
+
+
+static void test_round_trip(void)
+{
+	st_strkvm kv;
+	st_strkv* var;
+	size_t size;
+	void* data = make_image(&size);
+	char* value;
+	int n = 0;
+
+	CHECK(strkvm_load(&kv, data, size) == 0);
+	free(data);
+
+	CHECK(strkvm_get_string(&kv, "port", &value) == 0 && strcmp(value, "8080") == 0);
+	free(value);
+
+	/* Pointers are rebuilt and follow the nodes */
+	for(var = strkvm_get_next(&kv, NULL); var; var = var->next, n++)
+	{
+		CHECK(var->name == strkvm_name(&kv, var));
+		CHECK(var->value == strkvm_value(&kv, var));
+	}
+	CHECK(n == 3);
+
+	/* Adding past the room left compacts over the dead bytes and grows */
+	CHECK(strkvm_add_string(&kv, "user", "admin") == 0);
+	CHECK(strkvm_add_string(&kv, "host", "example.com") == 0);
+	CHECK(strkvm_get_string(&kv, "host", &value) == 0 && strcmp(value, "example.com") == 0);
+	free(value);
+
+	for(var = strkvm_get_next(&kv, NULL); var; var = var->next)
+	{
+		CHECK(var->name == strkvm_name(&kv, var));
+	}
+
+	strkvm_free(&kv);
+}
+
+
+static void test_atom(void)
+{
+	st_strkvm kv;
+	uint32_t atom;
+
+	strkvm_init(&kv);
+	strkvm_add_string(&kv, "accept", "*/*");
+
+	/* Interned after the node was added: found by bytes, then by atom */
+	atom = atom_intern("accept", 6);
+	CHECK(atom != 0);
+	CHECK(strkvm_get_atom(&kv, atom) != NULL);
+	strkvm_add_string(&kv, "accept", "text/html");
+	CHECK(strkvm_get_atom(&kv, atom) == strkvm_get_next(&kv, strkvm_get_next(&kv, NULL)));
+	CHECK(strcmp(strkvm_get_atom(&kv, atom)->value, "text/html") == 0);
+
+	strkvm_free(&kv);
+}
+
+
+static void test_malformed(void)
+{
+	st_strkvm kv;
+	st_strkv* vars;
+	st_strkvm_head* head;
+	uint32_t t;
+	size_t size;
+	void* data;
+
+	strkvm_init(&kv);
+
+	/* Nodes out of order: compact would move a string up over the next */
+	data = make_image(&size);
+	vars = image_vars(data);
+	t = vars[0].name_off; vars[0].name_off = vars[2].name_off; vars[2].name_off = t;
+	t = vars[0].name_len; vars[0].name_len = vars[2].name_len; vars[2].name_len = t;
+	CHECK(strkvm_load(&kv, data, size) == -1);
+	free(data);
+
+	/* Two nodes on the same string */
+	data = make_image(&size);
+	vars = image_vars(data);
+	vars[1].name_off = vars[0].name_off;
+	vars[1].name_len = vars[0].name_len;
+	CHECK(strkvm_load(&kv, data, size) == -1);
+	free(data);
+
+	/* Value before its name */
+	data = make_image(&size);
+	vars = image_vars(data);
+	vars[0].val_off = vars[0].name_off;
+	vars[0].val_len = vars[0].name_len;
+	CHECK(strkvm_load(&kv, data, size) == -1);
+	free(data);
+
+	/* String past the end of the blob */
+	data = make_image(&size);
+	vars = image_vars(data);
+	vars[2].val_len = 1u << 20;
+	CHECK(strkvm_load(&kv, data, size) == -1);
+	free(data);
+
+	/* Dead bytes that do not add up */
+	data = make_image(&size);
+	head = (st_strkvm_head*)data;
+	head->blob_dead = 0;
+	CHECK(strkvm_load(&kv, data, size) == -1);
+	free(data);
+
+	/* More nodes than room */
+	data = make_image(&size);
+	head = (st_strkvm_head*)data;
+	head->count = head->capacity + 1;
+	CHECK(strkvm_load(&kv, data, size) == -1);
+	free(data);
+
+	/* Cut short */
+	data = make_image(&size);
+	CHECK(strkvm_load(&kv, data, size - 1) == -1);
+	CHECK(strkvm_load(&kv, data, sizeof(st_strkvm_head) - 1) == -1);
+	free(data);
+
+	CHECK(kv.block == NULL);
+}
+
+
+int main(void)
+{
+	test_round_trip();
+	test_atom();
+	test_malformed();
+
+	printf("test_strkvm: %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
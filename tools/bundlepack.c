@@ -0,0 +1,850 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bundlepack.c
+ *
+ *    Description:  pack a directory of static assets into one bundle file for
+ *                  bundle_open: perfect-hash index of the paths, header lines and
+ *                  ETags computed once, .gz/.br siblings (or -z) as variants
+ *
+ *          Build:  gcc -O2 -Isrc -Iinclude tools/bundlepack.c src/compress.c src/strutils.c \
+ *                      -o bin/bundlepack -lz -lm
+ *
+ *          Usage:  bin/bundlepack [-z] [-o site.bundle] root
+ *
+ * =====================================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+#include "compress.h"
+
+#define PACK_SEED_MAX      (1u << 20)          /* tries per bucket          */
+#define PACK_PAGE          4096                /* bodies start on a page    */
+
+
+/* A file read whole, or a body compressed here */
+typedef struct pack_body
+{
+	char*    data;
+	size_t   len;
+	uint64_t offset;                           /* in the bundle             */
+	char*    head;                             /* header lines              */
+	size_t   head_len;
+	size_t   etag_at;                          /* of the tag in head        */
+	size_t   etag_len;
+} pack_body;
+
+
+/* One file, with its variants */
+typedef struct pack_asset
+{
+	char*       path;                          /* "/css/site.css"           */
+	time_t      mtime;
+	unsigned    available;                     /* 1 << coding               */
+	pack_body   var[BUNDLE_VARIANTS];
+	uint64_t    path_at;                       /* offsets in the bundle     */
+	uint64_t    head_at[BUNDLE_VARIANTS];
+} pack_asset;
+
+
+/* One index key, an asset or an alias of one */
+typedef struct pack_key
+{
+	const char* path;
+	size_t      len;
+	uint64_t    hash;
+	int         alias;                         /* of a path before it       */
+	pack_asset* asset;
+} pack_key;
+
+
+/* Growable array */
+typedef struct pack_vec
+{
+	void*  items;
+	size_t count;
+	size_t cap;
+	size_t size;                               /* of an item                */
+} pack_vec;
+
+
+static const char* pack_root;
+static size_t      pack_root_len;
+static pack_vec    pack_files = { NULL, 0, 0, sizeof(pack_asset) };
+
+
+/* Content types by extension */
+static const char* pack_types[][2] =
+{
+	{ "html", "text/html; charset=utf-8" },    { "htm",  "text/html; charset=utf-8" },
+	{ "css",  "text/css; charset=utf-8" },     { "js",   "text/javascript; charset=utf-8" },
+	{ "mjs",  "text/javascript; charset=utf-8" }, { "json", "application/json" },
+	{ "map",  "application/json" },            { "txt",  "text/plain; charset=utf-8" },
+	{ "xml",  "application/xml" },             { "svg",  "image/svg+xml" },
+	{ "png",  "image/png" },                   { "jpg",  "image/jpeg" },
+	{ "jpeg", "image/jpeg" },                  { "gif",  "image/gif" },
+	{ "webp", "image/webp" },                  { "avif", "image/avif" },
+	{ "ico",  "image/x-icon" },                { "wasm", "application/wasm" },
+	{ "woff", "font/woff" },                   { "woff2", "font/woff2" },
+	{ "ttf",  "font/ttf" },                    { "otf",  "font/otf" },
+	{ "pdf",  "application/pdf" },             { "mp4",  "video/mp4" },
+	{ "webm", "video/webm" },                  { "mp3",  "audio/mpeg" },
+	{ NULL, NULL }
+};
+
+
+static void* pack_push(pack_vec* vec);
+static int   pack_walk(const char* fpath, const struct stat* st, int flag, struct FTW* ftw);
+static int   pack_read(const char* path, pack_body* body);
+static const char* pack_type(const char* path);
+static int   pack_cmp_path(const void* a, const void* b);
+static pack_asset* pack_lookup(const char* path, size_t len);
+static int   pack_sink(void* arg, const char* data, size_t len);
+static int   pack_gzip(pack_asset* asset, const char* type);
+static int   pack_head(pack_asset* asset, int enc, const char* type);
+static int   pack_index(pack_key* keys, uint32_t count, uint32_t* buckets, uint32_t** seeds,
+                        uint32_t** slots);
+static int   pack_write(const char* out, pack_key* keys, uint32_t count);
+
+
+
+
+
+/* ============================== MAIN ============================== */
+
+
+int main(int argc, char** argv)
+{
+	const char* out = "site.bundle";
+	pack_vec    keys = { NULL, 0, 0, sizeof(pack_key) };
+	pack_asset* assets, *a, *base;
+	pack_key*   k;
+	const char* type;
+	size_t      i, len;
+	int         gzip = 0, opt, enc;
+
+	while((opt = getopt(argc, argv, "zo:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'z':
+			gzip = 1;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-z] [-o site.bundle] root\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(optind >= argc)
+	{
+		fprintf(stderr, "usage: %s [-z] [-o site.bundle] root\n", argv[0]);
+		return 1;
+	}
+
+	pack_root     = argv[optind];
+	pack_root_len = strlen(pack_root);
+
+	while(pack_root_len > 1 && pack_root[pack_root_len - 1] == '/')
+	{
+		pack_root_len--;
+	}
+
+	if(nftw(pack_root, pack_walk, 32, FTW_PHYS) != 0)
+	{
+		fprintf(stderr, "bundlepack: could not read %s: %s\n", pack_root, strerror(errno));
+		return 1;
+	}
+
+	assets = (pack_asset*)pack_files.items;
+	qsort(assets, pack_files.count, sizeof(pack_asset), pack_cmp_path);
+
+	/* "x.gz" and "x.br" not older than "x" are variants of it, as in compress_static_path */
+	for(i = 0; i < pack_files.count; i++)
+	{
+		a   = &assets[i];
+		len = strlen(a->path);
+		enc = len > 3 && strcmp(a->path + len - 3, ".gz") == 0 ? COMPRESS_GZIP :
+		      len > 3 && strcmp(a->path + len - 3, ".br") == 0 ? COMPRESS_BR : -1;
+
+		if(enc < 0 || (base = pack_lookup(a->path, len - 3)) == NULL ||
+		   a->mtime < base->mtime || (base->available & (1u << enc)))
+		{
+			continue;
+		}
+
+		base->var[enc] = a->var[COMPRESS_IDENTITY];
+		base->available |= 1u << enc;
+		a->available = 0;
+	}
+
+	for(i = 0; i < pack_files.count; i++)
+	{
+		a = &assets[i];
+
+		if(a->available == 0)
+		{
+			continue;
+		}
+
+		type = pack_type(a->path);
+
+		if(gzip && !(a->available & (1u << COMPRESS_GZIP)) && pack_gzip(a, type) != 0)
+		{
+			return 1;
+		}
+
+		for(enc = 0; enc < BUNDLE_VARIANTS; enc++)
+		{
+			if((a->available & (1u << enc)) && pack_head(a, enc, type) != 0)
+			{
+				fprintf(stderr, "bundlepack: out of memory\n");
+				return 1;
+			}
+		}
+
+		if((k = (pack_key*)pack_push(&keys)) == NULL)
+		{
+			fprintf(stderr, "bundlepack: out of memory\n");
+			return 1;
+		}
+
+		k->path  = a->path;
+		k->len   = strlen(a->path);
+		k->asset = a;
+
+		/* "/dir/index.html" also answers "/dir/" */
+		len = k->len;
+		if(len >= 11 && strcmp(a->path + len - 11, "/index.html") == 0)
+		{
+			if((k = (pack_key*)pack_push(&keys)) == NULL)
+			{
+				fprintf(stderr, "bundlepack: out of memory\n");
+				return 1;
+			}
+
+			k->path  = a->path;
+			k->len   = len - 10;
+			k->alias = 1;
+			k->asset = a;
+		}
+	}
+
+	if(keys.count >= UINT32_MAX / 2)
+	{
+		fprintf(stderr, "bundlepack: too many files\n");
+		return 1;
+	}
+
+	return pack_write(out, (pack_key*)keys.items, (uint32_t)keys.count) == 0 ? 0 : 1;
+}
+
+
+
+
+
+/* ============================= INPUT ============================== */
+
+
+/* Room for one more item, zeroed */
+static void* pack_push(pack_vec* vec)
+{
+	void* items;
+
+	if(vec->count == vec->cap)
+	{
+		vec->cap = vec->cap ? vec->cap * 2 : 256;
+
+		if((items = realloc(vec->items, vec->cap * vec->size)) == NULL)
+		{
+			return NULL;
+		}
+
+		vec->items = items;
+	}
+
+	return memset((char*)vec->items + vec->size * vec->count++, 0, vec->size);
+}
+
+
+/* nftw callback: read every regular file under the root */
+static int pack_walk(const char* fpath, const struct stat* st, int flag, struct FTW* ftw)
+{
+	pack_asset* a;
+
+	(void)ftw;
+
+	if(flag != FTW_F || !S_ISREG(st->st_mode))
+	{
+		return 0;
+	}
+
+	if(strlen(fpath) - pack_root_len >= BUNDLE_PATH_MAX)
+	{
+		fprintf(stderr, "bundlepack: skipping %s, path too long\n", fpath);
+		return 0;
+	}
+
+	if((a = (pack_asset*)pack_push(&pack_files)) == NULL)
+	{
+		return -1;
+	}
+
+	/* Names on disk are the decoded paths, requests are decoded to match */
+	if((a->path = strdup(fpath + pack_root_len)) == NULL ||
+	   pack_read(fpath, &a->var[COMPRESS_IDENTITY]) != 0)
+	{
+		fprintf(stderr, "bundlepack: could not read %s\n", fpath);
+		return -1;
+	}
+
+	a->mtime     = st->st_mtime;
+	a->available = 1u << COMPRESS_IDENTITY;
+	return 0;
+}
+
+
+/* Read a file whole */
+static int pack_read(const char* path, pack_body* body)
+{
+	FILE* f;
+	long  size;
+
+	if((f = fopen(path, "rb")) == NULL)
+	{
+		return -1;
+	}
+
+	if(fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0 ||
+	   (body->data = (char*)malloc((size_t)size + 1)) == NULL ||
+	   fread(body->data, 1, (size_t)size, f) != (size_t)size)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	body->len = (size_t)size;
+	fclose(f);
+	return 0;
+}
+
+
+/* Content type from the extension */
+static const char* pack_type(const char* path)
+{
+	const char* dot = strrchr(path, '.');
+	int n;
+
+	if(dot != NULL && strchr(dot, '/') == NULL)
+	{
+		for(n = 0; pack_types[n][0] != NULL; n++)
+		{
+			if(strcasecmp(dot + 1, pack_types[n][0]) == 0)
+			{
+				return pack_types[n][1];
+			}
+		}
+	}
+
+	return "application/octet-stream";
+}
+
+
+static int pack_cmp_path(const void* a, const void* b)
+{
+	return strcmp(((const pack_asset*)a)->path, ((const pack_asset*)b)->path);
+}
+
+
+/* Asset of path[0..len), files sorted */
+static pack_asset* pack_lookup(const char* path, size_t len)
+{
+	pack_asset* assets = (pack_asset*)pack_files.items;
+	size_t lo = 0, hi = pack_files.count, mid;
+	int cmp;
+
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		cmp = strncmp(assets[mid].path, path, len);
+
+		if(cmp == 0)
+		{
+			cmp = assets[mid].path[len] != 0;
+		}
+
+		if(cmp == 0)
+		{
+			return assets[mid].available ? &assets[mid] : NULL;
+		}
+
+		if(cmp < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Append compressed output to a body */
+static int pack_sink(void* arg, const char* data, size_t len)
+{
+	pack_body* body = (pack_body*)arg;
+	char* grown;
+
+	if((grown = (char*)realloc(body->data, body->len + len)) == NULL)
+	{
+		return -1;
+	}
+
+	memcpy(grown + body->len, data, len);
+	body->data = grown;
+	body->len += len;
+	return 0;
+}
+
+
+/* gzip variant, kept only if worth it and smaller */
+static int pack_gzip(pack_asset* asset, const char* type)
+{
+	pack_body* plain = &asset->var[COMPRESS_IDENTITY];
+	pack_body  gz;
+	compress_stream stream;
+	int result;
+
+	if(!compress_worth(type, plain->len, plain->data, plain->len < 4096 ? plain->len : 4096))
+	{
+		return 0;
+	}
+
+	memset(&gz, 0, sizeof(gz));
+
+	if(compress_begin(&stream, COMPRESS_GZIP, pack_sink, &gz) != 0)
+	{
+		fprintf(stderr, "bundlepack: could not start gzip\n");
+		return -1;
+	}
+
+	result = compress_write(&stream, plain->data, plain->len);
+
+	if(compress_end(&stream) != 0 || result != 0)
+	{
+		fprintf(stderr, "bundlepack: could not gzip %s\n", asset->path);
+		free(gz.data);
+		return -1;
+	}
+
+	if(gz.len >= plain->len)
+	{
+		free(gz.data);
+		return 0;
+	}
+
+	asset->var[COMPRESS_GZIP] = gz;
+	asset->available |= 1u << COMPRESS_GZIP;
+	return 0;
+}
+
+
+/* Header lines of one variant */
+static int pack_head(pack_asset* asset, int enc, const char* type)
+{
+	static const char* codings[] = { NULL, "gzip", "deflate", "br" };
+	pack_body* body = &asset->var[enc];
+	char  date[64], etag[24];
+	char* head;
+	struct tm tm;
+	int   n;
+
+	gmtime_r(&asset->mtime, &tm);
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	/* Strong tag of the bytes sent, so each coding has its own */
+	snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)bundle_hash(body->data, body->len));
+
+	n = asprintf(&head, "Content-Type: %s\r\nContent-Length: %zu\r\nLast-Modified: %s\r\n"
+	             "ETag: %s\r\n%s%s%s%s",
+	             type, body->len, date, etag,
+	             codings[enc] ? "Content-Encoding: " : "", codings[enc] ? codings[enc] : "",
+	             codings[enc] ? "\r\n" : "",
+	             asset->available != (1u << COMPRESS_IDENTITY) ? "Vary: Accept-Encoding\r\n" : "");
+
+	if(n < 0)
+	{
+		return -1;
+	}
+
+	body->head     = head;
+	body->head_len = (size_t)n;
+	body->etag_at  = (size_t)(strstr(head, "ETag: ") - head) + 6;
+	body->etag_len = strlen(etag);
+	return 0;
+}
+
+
+
+
+
+/* ============================= INDEX ============================== */
+
+
+/* Hash and displace: sort buckets by size, give each the first seed that
+ * sends all its keys to free slots. Buckets of one or two keys are easy
+ * even when the table is nearly full, so the large ones go first.
+ */
+static int pack_index(pack_key* keys, uint32_t count, uint32_t* buckets, uint32_t** seeds,
+                      uint32_t** slots)
+{
+	uint32_t *order, *start, *members, *taken, *slot, *try;
+	uint32_t nb, b, i, j, k, n, seed, s, tmp;
+	int failed;
+
+	if(count == 0)
+	{
+		*buckets = 0;
+		*seeds = *slots = NULL;
+		return 0;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		keys[i].hash = bundle_hash(keys[i].path, keys[i].len);
+	}
+
+	for(nb = count / 4 + 1;; nb *= 2)
+	{
+		order   = (uint32_t*)calloc(nb, sizeof(uint32_t));
+		start   = (uint32_t*)calloc(nb + 1, sizeof(uint32_t));
+		members = (uint32_t*)malloc(count * sizeof(uint32_t));
+		taken   = (uint32_t*)calloc(count, sizeof(uint32_t));
+		slot    = (uint32_t*)malloc(count * sizeof(uint32_t));
+		try     = (uint32_t*)malloc(count * sizeof(uint32_t));
+		*seeds  = (uint32_t*)calloc(nb, sizeof(uint32_t));
+
+		if(!order || !start || !members || !taken || !slot || !try || !*seeds)
+		{
+			fprintf(stderr, "bundlepack: out of memory\n");
+			return -1;
+		}
+
+		/* Keys grouped by bucket, counting sort */
+		for(i = 0; i < count; i++)
+		{
+			start[(keys[i].hash >> 32) % nb + 1]++;
+		}
+
+		for(b = 0; b < nb; b++)
+		{
+			start[b + 1] += start[b];
+			order[b] = b;
+		}
+
+		memcpy(try, start, nb * sizeof(uint32_t));
+
+		for(i = 0; i < count; i++)
+		{
+			members[try[(keys[i].hash >> 32) % nb]++] = i;
+		}
+
+		/* Largest first, insertion sort is fine on mostly tiny buckets */
+		for(b = 1; b < nb; b++)
+		{
+			for(tmp = order[b], k = b; k > 0 &&
+			    start[order[k - 1] + 1] - start[order[k - 1]] < start[tmp + 1] - start[tmp]; k--)
+			{
+				order[k] = order[k - 1];
+			}
+
+			order[k] = tmp;
+		}
+
+		for(failed = 0, b = 0; b < nb && !failed; b++)
+		{
+			n = start[order[b] + 1] - start[order[b]];
+
+			if(n == 0)
+			{
+				break;
+			}
+
+			for(seed = 0; seed < PACK_SEED_MAX; seed++)
+			{
+				for(j = 0; j < n; j++)
+				{
+					s = (uint32_t)(bundle_slot(keys[members[start[order[b]] + j]].hash, seed) % count);
+
+					/* Taken for good, or twice by this try */
+					if(taken[s] == UINT32_MAX || taken[s] == seed + 1)
+					{
+						break;
+					}
+
+					taken[s] = seed + 1;
+					try[j]   = s;
+				}
+
+				if(j == n)
+				{
+					break;
+				}
+
+				/* Undo this try's claims */
+				while(j--)
+				{
+					taken[try[j]] = 0;
+				}
+			}
+
+			if(seed == PACK_SEED_MAX)
+			{
+				failed = 1;
+				break;
+			}
+
+			(*seeds)[order[b]] = seed;
+
+			for(j = 0; j < n; j++)
+			{
+				taken[try[j]] = UINT32_MAX;
+				slot[members[start[order[b]] + j]] = try[j];
+			}
+		}
+
+		free(order);
+		free(start);
+		free(members);
+		free(taken);
+		free(try);
+
+		if(!failed)
+		{
+			*buckets = nb;
+			*slots   = slot;
+			return 0;
+		}
+
+		free(slot);
+		free(*seeds);
+
+		if(nb >= count)
+		{
+			/* Equal hashes: two paths no seed can split */
+			fprintf(stderr, "bundlepack: could not build the index\n");
+			return -1;
+		}
+	}
+}
+
+
+/* Lay out and write the bundle, to a temporary name then renamed */
+static int pack_write(const char* out, pack_key* keys, uint32_t count)
+{
+	bundle_header  hd;
+	bundle_entry*  entries;
+	bundle_variant* v;
+	pack_asset*    a;
+	pack_body*     body;
+	uint32_t       buckets, *seeds, *slots, i;
+	uint64_t       at, strings;
+	char           tmp[BUNDLE_PATH_MAX + 8];
+	static const char zero[PACK_PAGE];
+	FILE*          f;
+	size_t         n, w, total = 0;
+	int            enc;
+
+	if(pack_index(keys, count, &buckets, &seeds, &slots) != 0)
+	{
+		return -1;
+	}
+
+	memset(&hd, 0, sizeof(hd));
+	memcpy(hd.magic, BUNDLE_MAGIC, sizeof(hd.magic));
+	hd.version = BUNDLE_VERSION;
+	hd.count   = count;
+	hd.buckets = buckets;
+	hd.seeds   = sizeof(hd);
+	hd.entries = (hd.seeds + buckets * sizeof(uint32_t) + 7) & ~7ull;
+	hd.created = (uint64_t)time(NULL);
+	strings    = hd.entries + (uint64_t)count * sizeof(bundle_entry);
+
+	/* Strings: each asset's path and header blocks once, aliases share them */
+	at = strings;
+	for(i = 0; i < count; i++)
+	{
+		a = keys[i].asset;
+
+		if(!keys[i].alias)
+		{
+			a->path_at = at;
+			at += keys[i].len;
+
+			for(enc = 0; enc < BUNDLE_VARIANTS; enc++)
+			{
+				if(a->available & (1u << enc))
+				{
+					a->head_at[enc] = at;
+					at += a->var[enc].head_len;
+				}
+			}
+		}
+	}
+
+	/* Bodies */
+	at = (at + PACK_PAGE - 1) & ~(uint64_t)(PACK_PAGE - 1);
+	for(i = 0; i < count; i++)
+	{
+		a = keys[i].asset;
+
+		if(!keys[i].alias)
+		{
+			for(enc = 0; enc < BUNDLE_VARIANTS; enc++)
+			{
+				if(a->available & (1u << enc))
+				{
+					a->var[enc].offset = at;
+					at = (at + a->var[enc].len + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+				}
+			}
+		}
+	}
+	hd.size = at;
+
+	if((entries = (bundle_entry*)calloc(count ? count : 1, sizeof(bundle_entry))) == NULL)
+	{
+		fprintf(stderr, "bundlepack: out of memory\n");
+		return -1;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		bundle_entry* e = &entries[slots[i]];
+		a = keys[i].asset;
+
+		e->hash      = keys[i].hash;
+		e->path      = a->path_at;
+		e->path_len  = (uint32_t)keys[i].len;
+		e->available = a->available;
+
+		for(enc = 0; enc < BUNDLE_VARIANTS; enc++)
+		{
+			if(a->available & (1u << enc))
+			{
+				v = &e->variant[enc];
+				v->body     = a->var[enc].offset;
+				v->body_len = a->var[enc].len;
+				v->head     = a->head_at[enc];
+				v->head_len = (uint32_t)a->var[enc].head_len;
+				v->etag     = a->head_at[enc] + a->var[enc].etag_at;
+				v->etag_len = (uint32_t)a->var[enc].etag_len;
+			}
+		}
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+
+	if((f = fopen(tmp, "wb")) == NULL)
+	{
+		fprintf(stderr, "bundlepack: could not create %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	fwrite(&hd, sizeof(hd), 1, f);
+	fwrite(seeds, sizeof(uint32_t), buckets, f);
+	fwrite(zero, 1, hd.entries - hd.seeds - buckets * sizeof(uint32_t), f);
+	fwrite(entries, sizeof(bundle_entry), count, f);
+
+	for(i = 0; i < count; i++)
+	{
+		a = keys[i].asset;
+
+		if(!keys[i].alias)
+		{
+			fwrite(a->path, 1, keys[i].len, f);
+
+			for(enc = 0; enc < BUNDLE_VARIANTS; enc++)
+			{
+				if(a->available & (1u << enc))
+				{
+					fwrite(a->var[enc].head, 1, a->var[enc].head_len, f);
+				}
+			}
+		}
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		a = keys[i].asset;
+
+		if(!keys[i].alias)
+		{
+			total++;
+
+			for(enc = 0; enc < BUNDLE_VARIANTS; enc++)
+			{
+				if(a->available & (1u << enc))
+				{
+					body = &a->var[enc];
+
+					/* Pad up to the body's offset, a full disk writes nothing */
+					for(n = (size_t)(body->offset - (uint64_t)ftell(f)); n > 0; n -= w)
+					{
+						if((w = fwrite(zero, 1, n < PACK_PAGE ? n : PACK_PAGE, f)) == 0)
+						{
+							goto write_end;
+						}
+					}
+
+					fwrite(body->data, 1, body->len, f);
+				}
+			}
+		}
+	}
+
+	/* Pad the last body too, the size is checked on open */
+	for(n = (size_t)(hd.size - (uint64_t)ftell(f)); n > 0; n -= w)
+	{
+		if((w = fwrite(zero, 1, n < PACK_PAGE ? n : PACK_PAGE, f)) == 0)
+		{
+			break;
+		}
+	}
+
+write_end:
+	if(ferror(f) | fclose(f) || n > 0 || rename(tmp, out) != 0)
+	{
+		fprintf(stderr, "bundlepack: could not write %s: %s\n", out, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	fprintf(stderr, "bundlepack: %s, %zu files, %u paths, %u buckets, %llu bytes, index %llu bytes\n",
+	        out, total, count, buckets, (unsigned long long)hd.size,
+	        (unsigned long long)(strings - hd.seeds));
+
+	free(entries);
+	free(seeds);
+	free(slots);
+	return 0;
+}